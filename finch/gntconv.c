@@ -813,6 +813,8 @@ finch_create_conversation(PurpleConversation *conv)
 	gnt_widget_set_name(ggc->tv, "conversation-window-textview");
 	gnt_widget_set_size(ggc->tv, purple_prefs_get_int(PREF_ROOT "/size/width"),
 			purple_prefs_get_int(PREF_ROOT "/size/height"));
+	gnt_text_view_set_max_lines(GNT_TEXT_VIEW(ggc->tv),
+			purple_prefs_get_int(PREF_ROOT "/scrollback"));
 
 	if (type == PURPLE_CONV_TYPE_CHAT) {
 		GntWidget *hbox, *tree;
@@ -1406,6 +1408,7 @@ void finch_conversation_init()
 	purple_prefs_add_none(PREF_ROOT "/position");
 	purple_prefs_add_int(PREF_ROOT "/position/x", 0);
 	purple_prefs_add_int(PREF_ROOT "/position/y", 0);
+	purple_prefs_add_int(PREF_ROOT "/scrollback", 5000);
 	purple_prefs_add_none(PREF_CHAT);
 	purple_prefs_add_bool(PREF_USERLIST, FALSE);
 
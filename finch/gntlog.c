@@ -38,6 +38,7 @@
 #include "account.h"
 #include "debug.h"
 #include "log.h"
+#include "logsearch.h"
 #include "notify.h"
 #include "request.h"
 #include "util.h"
@@ -109,12 +110,29 @@ static const char *log_get_date(PurpleLog *log)
 		return purple_date_format_full(localtime(&log->time));
 }
 
+static void search_done_cb(GList *results, guint total, gpointer data)
+{
+	FinchLogViewer *lv = data;
+	GList *l;
+
+	for (l = results; l != NULL; l = l->next) {
+		PurpleLog *log = ((PurpleLogSearchResult *)l->data)->log;
+
+		gnt_tree_add_row_last(GNT_TREE(lv->tree),
+								log,
+								gnt_tree_create_row(GNT_TREE(lv->tree), log_get_date(log)),
+								NULL);
+	}
+	purple_log_search_results_free(results);
+}
+
 static void search_cb(GntWidget *button, FinchLogViewer *lv)
 {
 	const char *search_term = gnt_entry_get_text(GNT_ENTRY(lv->entry));
-	GList *logs;
 
 	if (!(*search_term)) {
+		purple_log_search_cancel_with_handle(lv);
+
 		/* reset the tree */
 		gnt_tree_remove_all(GNT_TREE(lv->tree));
 		g_free(lv->search);
@@ -127,25 +145,15 @@ static void search_cb(GntWidget *button, FinchLogViewer *lv)
 		return;
 	}
 
+	purple_log_search_cancel_with_handle(lv);
+
 	g_free(lv->search);
 	lv->search = g_strdup(search_term);
 
 	gnt_tree_remove_all(GNT_TREE(lv->tree));
 	gnt_text_view_clear(GNT_TEXT_VIEW(lv->text));
 
-	for (logs = lv->logs; logs != NULL; logs = logs->next) {
-		char *read = purple_log_read((PurpleLog*)logs->data, NULL);
-		if (read && *read && purple_strcasestr(read, search_term)) {
-			PurpleLog *log = logs->data;
-
-			gnt_tree_add_row_last(GNT_TREE(lv->tree),
-									log,
-									gnt_tree_create_row(GNT_TREE(lv->tree), log_get_date(log)),
-									NULL);
-		}
-		g_free(read);
-	}
-
+	purple_log_search_async(lv, lv->logs, search_term, 0, 0, search_done_cb, lv);
 }
 
 static void destroy_cb(GntWidget *w, struct log_viewer_hash_t *ht)
@@ -162,6 +170,7 @@ static void destroy_cb(GntWidget *w, struct log_viewer_hash_t *ht)
 		syslog_viewer = NULL;
 
 	purple_request_close_with_handle(lv);
+	purple_log_search_cancel_with_handle(lv);
 
 	g_list_foreach(lv->logs, (GFunc)purple_log_free, NULL);
 	g_list_free(lv->logs);
@@ -394,6 +394,7 @@ read_general_style(GKeyFile *kfile)
 	              {"mouse", GNT_STYLE_MOUSE},
 	              {"wm", GNT_STYLE_WM},
 	              {"remember_position", GNT_STYLE_REMPOS},
+	              {"frame_rate", GNT_STYLE_FRAME_RATE},
 	              {NULL, 0}};
 
 	if (prgname && *prgname)
@@ -34,6 +34,7 @@ typedef enum
 	GNT_STYLE_MOUSE = 2,
 	GNT_STYLE_WM = 3,
 	GNT_STYLE_REMPOS = 4,
+	GNT_STYLE_FRAME_RATE = 5,
 	GNT_STYLES
 } GntStyle;
 
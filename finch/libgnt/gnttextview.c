@@ -59,6 +59,21 @@ typedef struct
 	int end;
 } GntTextTag;
 
+struct _GntTextViewPriv
+{
+	int max_lines;           /* The most lines to keep, or 0 to keep them all */
+	int lines;               /* The number of lines in the view */
+	GList *oldest;           /* The last link in the list of lines */
+	GList *stale;            /* The newest line not flowed for the current width yet */
+	int dropped;             /* The text before this offset belongs to dropped lines */
+};
+
+#define GNT_TEXT_VIEW_GET_PRIVATE(o)   (G_TYPE_INSTANCE_GET_PRIVATE ((o), GNT_TYPE_TEXT_VIEW, GntTextViewPriv))
+
+/* Text from dropped lines is cut from the string once there is at least this
+ * much of it, and it makes up half of the string. */
+#define DROPPED_CHUNK  4096
+
 static GntWidgetClass *parent_class = NULL;
 
 static gchar *select_start;
@@ -66,6 +81,7 @@ static gchar *select_end;
 static gboolean double_click;
 
 static void reset_text_view(GntTextView *view);
+static void flow_stale_lines(GntTextView *view, int count);
 
 static gboolean
 text_view_contains(GntTextView *view, const char *str)
@@ -77,7 +93,8 @@ static void
 gnt_text_view_draw(GntWidget *widget)
 {
 	GntTextView *view = GNT_TEXT_VIEW(widget);
-	int n;
+	GntTextViewPriv *priv = GNT_TEXT_VIEW_GET_PRIVATE(view);
+	int n, below;
 	int i = 0;
 	GList *lines;
 	int rows, scrcol;
@@ -87,7 +104,10 @@ gnt_text_view_draw(GntWidget *widget)
 	wbkgd(widget->window, gnt_color_pair(GNT_COLOR_NORMAL));
 	werase(widget->window);
 
-	n = g_list_length(view->list);
+	flow_stale_lines(view, widget->priv.height);
+
+	below = gnt_text_view_get_lines_below(view);
+	n = priv->lines - below;
 	if ((view->flags & GNT_TEXT_VIEW_TOP_ALIGN) &&
 			n < widget->priv.height) {
 		GList *now = view->list;
@@ -95,8 +115,10 @@ gnt_text_view_draw(GntWidget *widget)
 		view->list = g_list_nth_prev(view->list, comp);
 		if (!view->list) {
 			view->list = g_list_first(now);
-			comp = widget->priv.height - g_list_length(view->list);
+			below = 0;
+			comp = widget->priv.height - priv->lines;
 		} else {
+			below -= comp;
 			comp = 0;
 		}
 	}
@@ -150,14 +172,14 @@ gnt_text_view_draw(GntWidget *widget)
 	rows = widget->priv.height - 2;
 	if (has_scroll && rows > 0)
 	{
-		int total = g_list_length(g_list_first(view->list));
+		int total = priv->lines;
 		int showing, position, up, down;
 
 		showing = rows * rows / total + 1;
 		showing = MIN(rows, showing);
 
 		total -= rows;
-		up = g_list_length(lines);
+		up = priv->lines - below - i;
 		down = total - up;
 
 		position = (rows - showing) * up / MAX(1, up + down);
@@ -257,7 +279,7 @@ gnt_text_view_get_p(GntTextView *view, int x, int y)
 	GntTextSegment *seg;
 	gchar *pos;
 
-	n = g_list_length(view->list);
+	n = GNT_TEXT_VIEW_GET_PRIVATE(view)->lines - gnt_text_view_get_lines_below(view);
 	y = wid->priv.height - y;
 	if (n < y) {
 		x = 0;
@@ -365,65 +387,296 @@ gnt_text_view_clicked(GntWidget *widget, GntMouseEvent event, int x, int y)
 	return TRUE;
 }
 
+static GntTextLine *
+add_line(GntTextView *view, GList **lines, gboolean soft)
+{
+	GntTextLine *line = g_new0(GntTextLine, 1);
+	line->soft = soft;
+	*lines = g_list_prepend(*lines, line);
+	GNT_TEXT_VIEW_GET_PRIVATE(view)->lines++;
+	return line;
+}
+
+/* Lays out some text from view->string after the line at the head of 'lines',
+ * adding new lines to the head as the text wraps or breaks. */
 static void
-gnt_text_view_reflow(GntTextView *view)
+flow_text(GntTextView *view, GList **lines, const char *text,
+		GntTextFormatFlags flags, chtype fl)
 {
-	/* This is pretty ugly, and inefficient. Someone do something about it. */
+	GntWidget *widget = GNT_WIDGET(view);
+	const char *start, *end;
 	GntTextLine *line;
-	GList *back, *iter, *list;
-	GString *string;
-	int pos = 0;    /* no. of 'real' lines */
+	int len;
+	gboolean has_scroll = !(view->flags & GNT_TEXT_VIEW_NO_SCROLL);
+	gboolean wrap_word = !(view->flags & GNT_TEXT_VIEW_WRAP_CHAR);
 
-	list = view->list;
-	while (list->prev) {
-		line = list->data;
-		if (!line->soft)
-			pos++;
-		list = list->prev;
-	}
+	start = end = text;
 
-	back = g_list_last(view->list);
-	view->list = NULL;
+	while (*start) {
+		GntTextLine *oldl;
+		GntTextSegment *seg = NULL;
 
-	string = view->string;
-	view->string = NULL;
-	reset_text_view(view);
+		if (*end == '\n' || *end == '\r') {
+			if (!strncmp(end, "\r\n", 2))
+				end++;
+			end++;
+			start = end;
+			add_line(view, lines, FALSE);
+			continue;
+		}
+
+		line = (*lines)->data;
+		if (line->length == widget->priv.width - has_scroll) {
+			/* The last added line was exactly the same width as the widget */
+			line = add_line(view, lines, TRUE);
+		}
+
+		if ((end = strchr(start, '\r')) != NULL ||
+			(end = strchr(start, '\n')) != NULL) {
+			len = gnt_util_onscreen_width(start, end - has_scroll);
+			if (widget->priv.width > 0 &&
+					len >= widget->priv.width - line->length - has_scroll) {
+				end = NULL;
+			}
+		}
 
-	view->string = g_string_set_size(view->string, string->len);
-	view->string->len = 0;
-	GNT_WIDGET_SET_FLAGS(GNT_WIDGET(view), GNT_WIDGET_DRAWING);
+		if (end == NULL)
+			end = gnt_util_onscreen_width_to_pointer(start,
+					widget->priv.width - line->length - has_scroll, &len);
 
-	for (; back; back = back->prev) {
-		line = back->data;
-		if (back->next && !line->soft) {
-			gnt_text_view_append_text_with_flags(view, "\n", GNT_TEXT_FLAG_NORMAL);
+		/* Try to append to the previous segment if possible */
+		if (line->segments) {
+			seg = g_list_last(line->segments)->data;
+			if (seg->flags != fl)
+				seg = NULL;
 		}
 
-		for (iter = line->segments; iter; iter = iter->next) {
-			GntTextSegment *seg = iter->data;
-			char *start = string->str + seg->start;
-			char *end = string->str + seg->end;
+		if (seg == NULL) {
+			seg = g_new0(GntTextSegment, 1);
+			seg->start = start - view->string->str;
+			seg->tvflag = flags;
+			seg->flags = fl;
+			line->segments = g_list_append(line->segments, seg);
+		}
+
+		oldl = line;
+		if (wrap_word && *end && *end != '\n' && *end != '\r') {
+			const char *tmp = end;
+			while (end && *end != '\n' && *end != '\r' && !g_ascii_isspace(*end)) {
+				end = g_utf8_find_prev_char(seg->start + view->string->str, end);
+			}
+			if (!end || !g_ascii_isspace(*end))
+				end = tmp;
+			else
+				end++; /* Remove the space */
+
+			add_line(view, lines, TRUE);
+		}
+		seg->end = end - view->string->str;
+		oldl->length += len;
+		start = end;
+	}
+}
+
+/* Cuts the text of the dropped lines from the front of the string. */
+static void
+cut_dropped_text(GntTextView *view)
+{
+	GntTextViewPriv *priv = GNT_TEXT_VIEW_GET_PRIVATE(view);
+	GList *iter, *next;
+	int cut = priv->dropped;
+
+	while (cut < view->string->len &&
+			(view->string->str[cut] == '\r' || view->string->str[cut] == '\n'))
+		cut++;
+
+	if (text_view_contains(view, select_start) || text_view_contains(view, select_end))
+		select_start = select_end = NULL;
+
+	g_string_erase(view->string, 0, cut);
+	priv->dropped = 0;
+
+	for (iter = g_list_first(view->list); iter; iter = iter->next) {
+		GntTextLine *line = iter->data;
+		GList *segs;
+		for (segs = line->segments; segs; segs = segs->next) {
+			GntTextSegment *seg = segs->data;
+			seg->start -= cut;
+			seg->end -= cut;
+		}
+	}
+
+	for (iter = view->tags; iter; iter = next) {
+		GntTextTag *tag = iter->data;
+		next = iter->next;
+		if (tag->end <= cut) {
+			view->tags = g_list_delete_link(view->tags, iter);
+			free_tag(tag, NULL);
+			continue;
+		}
+		tag->start = MAX(0, tag->start - cut);
+		tag->end -= cut;
+	}
+}
+
+static void
+drop_oldest_line(GntTextView *view)
+{
+	GntTextViewPriv *priv = GNT_TEXT_VIEW_GET_PRIVATE(view);
+	GList *oldest = priv->oldest;
+	GntTextLine *line = oldest->data;
+	GList *segs;
+
+	for (segs = line->segments; segs; segs = segs->next) {
+		GntTextSegment *seg = segs->data;
+		priv->dropped = MAX(priv->dropped, seg->end);
+	}
+
+	if (view->list == oldest)
+		view->list = oldest->prev;
+	if (priv->stale == oldest)
+		priv->stale = NULL;
+	priv->oldest = oldest->prev;
+	priv->oldest->next = NULL;
+	priv->lines--;
+
+	free_text_line(line, NULL);
+	g_list_free_1(oldest);
+}
+
+/* Drops the oldest lines while there are more lines than the view keeps. */
+static void
+drop_old_lines(GntTextView *view)
+{
+	GntTextViewPriv *priv = GNT_TEXT_VIEW_GET_PRIVATE(view);
+
+	if (priv->max_lines <= 0)
+		return;
+
+	while (priv->lines > priv->max_lines && priv->oldest->prev) {
+		drop_oldest_line(view);
+		/* Do not leave the rest of a wrapped line behind */
+		while (priv->oldest->prev && ((GntTextLine *)priv->oldest->data)->soft)
+			drop_oldest_line(view);
+	}
+
+	if (priv->dropped >= DROPPED_CHUNK && priv->dropped >= view->string->len / 2)
+		cut_dropped_text(view);
+}
+
+/* Flows the line which ends at 'link' again for the current width, and
+ * returns the link for the line before it. 'count' is increased by the
+ * number of lines it takes now. */
+static GList *
+reflow_line(GntTextView *view, GList *link, int *count)
+{
+	GntTextViewPriv *priv = GNT_TEXT_VIEW_GET_PRIVATE(view);
+	GList *first = link, *last = link, *lines = NULL, *newest, *iter, *next;
+	gboolean in_view = (view->list == link);
+	int old = 1, added;
+
+	while (((GntTextLine *)last->data)->soft && last->next) {
+		last = last->next;
+		if (view->list == last)
+			in_view = TRUE;
+		old++;
+	}
+	next = last->next;
+
+	add_line(view, &lines, FALSE);
+	for (iter = last; ; iter = iter->prev) {
+		GntTextLine *line = iter->data;
+		GList *segs;
+
+		for (segs = line->segments; segs; segs = segs->next) {
+			GntTextSegment *seg = segs->data;
+			char *end = view->string->str + seg->end;
 			char back = *end;
 			*end = '\0';
-			gnt_text_view_append_text_with_flags(view, start, seg->tvflag);
+			flow_text(view, &lines, view->string->str + seg->start, seg->tvflag, seg->flags);
 			*end = back;
 		}
-		free_text_line(line, NULL);
+		if (iter == first)
+			break;
 	}
-	g_list_free(list);
 
-	list = view->list = g_list_first(view->list);
-	/* Go back to the line that was in view before resizing started */
+	/* Put the new lines in place of the old ones */
+	newest = lines;
+	added = g_list_length(lines);
+	lines = g_list_last(lines);
+	newest->prev = first->prev;
+	if (newest->prev)
+		newest->prev->next = newest;
+	lines->next = next;
+	if (next)
+		next->prev = lines;
+	if (priv->oldest == last)
+		priv->oldest = lines;
+	if (in_view)
+		view->list = newest;
+
+	first->prev = NULL;
+	last->next = NULL;
+	g_list_foreach(first, free_text_line, NULL);
+	g_list_free(first);
+	priv->lines -= old;
+
+	*count += added;
+	return next;
+}
+
+/* Flows the lines that were left for later after a resize, until the 'count'
+ * lines from the one in view are all fresh. */
+static void
+flow_stale_lines(GntTextView *view, int count)
+{
+	GntTextViewPriv *priv = GNT_TEXT_VIEW_GET_PRIVATE(view);
+	GList *iter;
+	int i;
+
+	for (i = 0, iter = view->list; iter != priv->stale; i++, iter = iter->next) {
+		if (iter == NULL || i >= count)
+			return;
+	}
+
+	while (priv->stale && i < count)
+		priv->stale = reflow_line(view, priv->stale, &i);
+}
+
+static void
+gnt_text_view_reflow(GntTextView *view)
+{
+	GntTextViewPriv *priv = GNT_TEXT_VIEW_GET_PRIVATE(view);
+	GntTextLine *line;
+	GList *list;
+	int pos = 0;    /* no. of 'real' lines */
+	int n;
+
+	list = view->list;
+	while (list->prev) {
+		line = list->data;
+		if (!line->soft)
+			pos++;
+		list = list->prev;
+	}
+
+	/* Flow the lines up to the one that was in view before resizing started.
+	 * The older lines are flowed when they are scrolled into view. */
+	view->list = priv->stale = list;
+	for (n = 0; n <= pos && priv->stale; n++) {
+		int count = 0;
+		priv->stale = reflow_line(view, priv->stale, &count);
+	}
+
+	list = view->list;
 	while (pos--) {
 		while (((GntTextLine*)list->data)->soft)
 			list = list->next;
 		list = list->next;
 	}
 	view->list = list;
-	GNT_WIDGET_UNSET_FLAGS(GNT_WIDGET(view), GNT_WIDGET_DRAWING);
 	if (GNT_WIDGET(view)->window)
 		gnt_widget_draw(GNT_WIDGET(view));
-	g_string_free(string, TRUE);
 }
 
 static void
@@ -446,6 +699,8 @@ gnt_text_view_class_init(GntTextViewClass *klass)
 	parent_class->clicked = gnt_text_view_clicked;
 	parent_class->size_changed = gnt_text_view_size_changed;
 
+	g_type_class_add_private(klass, sizeof(GntTextViewPriv));
+
 	GNTDEBUG;
 }
 
@@ -454,6 +709,7 @@ gnt_text_view_init(GTypeInstance *instance, gpointer class)
 {
 	GntWidget *widget = GNT_WIDGET(instance);
 	GntTextView *view = GNT_TEXT_VIEW(widget);
+	GntTextViewPriv *priv = GNT_TEXT_VIEW_GET_PRIVATE(view);
 	GntTextLine *line = g_new0(GntTextLine, 1);
 
 	GNT_WIDGET_SET_FLAGS(widget, GNT_WIDGET_NO_BORDER | GNT_WIDGET_NO_SHADOW |
@@ -463,6 +719,9 @@ gnt_text_view_init(GTypeInstance *instance, gpointer class)
 	view->string = g_string_new(NULL);
 	view->list = g_list_append(view->list, line);
 
+	priv->lines = 1;
+	priv->oldest = view->list;
+
 	GNTDEBUG;
 }
 
@@ -512,20 +771,12 @@ void gnt_text_view_append_text_with_flags(GntTextView *view, const char *text, G
 void gnt_text_view_append_text_with_tag(GntTextView *view, const char *text,
 			GntTextFormatFlags flags, const char *tagname)
 {
-	GntWidget *widget = GNT_WIDGET(view);
-	chtype fl = 0;
-	const char *start, *end;
-	GList *list = view->list;
-	GntTextLine *line;
+	GList *lines;
 	int len;
-	gboolean has_scroll = !(view->flags & GNT_TEXT_VIEW_NO_SCROLL);
-	gboolean wrap_word = !(view->flags & GNT_TEXT_VIEW_WRAP_CHAR);
 
 	if (text == NULL || *text == '\0')
 		return;
 
-	fl = gnt_text_format_flag_to_chtype(flags);
-
 	len = view->string->len;
 	view->string = g_string_append(view->string, text);
 
@@ -537,83 +788,12 @@ void gnt_text_view_append_text_with_tag(GntTextView *view, const char *text,
 		view->tags = g_list_append(view->tags, tag);
 	}
 
-	view->list = g_list_first(view->list);
-
-	start = end = view->string->str + len;
-
-	while (*start) {
-		GntTextLine *oldl;
-		GntTextSegment *seg = NULL;
-
-		if (*end == '\n' || *end == '\r') {
-			if (!strncmp(end, "\r\n", 2))
-				end++;
-			end++;
-			start = end;
-			gnt_text_view_next_line(view);
-			view->list = g_list_first(view->list);
-			continue;
-		}
-
-		line = view->list->data;
-		if (line->length == widget->priv.width - has_scroll) {
-			/* The last added line was exactly the same width as the widget */
-			line = g_new0(GntTextLine, 1);
-			line->soft = TRUE;
-			view->list = g_list_prepend(view->list, line);
-		}
-
-		if ((end = strchr(start, '\r')) != NULL ||
-			(end = strchr(start, '\n')) != NULL) {
-			len = gnt_util_onscreen_width(start, end - has_scroll);
-			if (widget->priv.width > 0 &&
-					len >= widget->priv.width - line->length - has_scroll) {
-				end = NULL;
-			}
-		}
-
-		if (end == NULL)
-			end = gnt_util_onscreen_width_to_pointer(start,
-					widget->priv.width - line->length - has_scroll, &len);
-
-		/* Try to append to the previous segment if possible */
-		if (line->segments) {
-			seg = g_list_last(line->segments)->data;
-			if (seg->flags != fl)
-				seg = NULL;
-		}
-
-		if (seg == NULL) {
-			seg = g_new0(GntTextSegment, 1);
-			seg->start = start - view->string->str;
-			seg->tvflag = flags;
-			seg->flags = fl;
-			line->segments = g_list_append(line->segments, seg);
-		}
-
-		oldl = line;
-		if (wrap_word && *end && *end != '\n' && *end != '\r') {
-			const char *tmp = end;
-			while (end && *end != '\n' && *end != '\r' && !g_ascii_isspace(*end)) {
-				end = g_utf8_find_prev_char(seg->start + view->string->str, end);
-			}
-			if (!end || !g_ascii_isspace(*end))
-				end = tmp;
-			else
-				end++; /* Remove the space */
-
-			line = g_new0(GntTextLine, 1);
-			line->soft = TRUE;
-			view->list = g_list_prepend(view->list, line);
-		}
-		seg->end = end - view->string->str;
-		oldl->length += len;
-		start = end;
-	}
-
-	view->list = list;
+	lines = g_list_first(view->list);
+	flow_text(view, &lines, view->string->str + len, flags,
+			gnt_text_format_flag_to_chtype(flags));
+	drop_old_lines(view);
 
-	gnt_widget_draw(widget);
+	gnt_widget_draw(GNT_WIDGET(view));
 }
 
 void gnt_text_view_scroll(GntTextView *view, int scroll)
@@ -631,9 +811,11 @@ void gnt_text_view_scroll(GntTextView *view, int scroll)
 	}
 	else if (scroll < 0)
 	{
-		GList *list = g_list_nth(view->list, -scroll);
+		GList *list;
+		flow_stale_lines(view, GNT_WIDGET(view)->priv.height - scroll);
+		list = g_list_nth(view->list, -scroll);
 		if (list == NULL)
-			list = g_list_last(view->list);
+			list = GNT_TEXT_VIEW_GET_PRIVATE(view)->oldest;
 		view->list = list;
 	}
 
@@ -642,11 +824,10 @@ void gnt_text_view_scroll(GntTextView *view, int scroll)
 
 void gnt_text_view_next_line(GntTextView *view)
 {
-	GntTextLine *line = g_new0(GntTextLine, 1);
-	GList *list = view->list;
+	GList *lines = g_list_first(view->list);
 
-	view->list = g_list_prepend(g_list_first(view->list), line);
-	view->list = list;
+	add_line(view, &lines, FALSE);
+	drop_old_lines(view);
 	gnt_widget_draw(GNT_WIDGET(view));
 }
 
@@ -675,8 +856,10 @@ chtype gnt_text_format_flag_to_chtype(GntTextFormatFlags flags)
 
 static void reset_text_view(GntTextView *view)
 {
+	GntTextViewPriv *priv = GNT_TEXT_VIEW_GET_PRIVATE(view);
 	GntTextLine *line;
 
+	view->list = g_list_first(view->list);
 	g_list_foreach(view->list, free_text_line, NULL);
 	g_list_free(view->list);
 	view->list = NULL;
@@ -686,6 +869,11 @@ static void reset_text_view(GntTextView *view)
 	if (view->string)
 		g_string_free(view->string, TRUE);
 	view->string = g_string_new(NULL);
+
+	priv->lines = 1;
+	priv->oldest = view->list;
+	priv->stale = NULL;
+	priv->dropped = 0;
 }
 
 void gnt_text_view_clear(GntTextView *view)
@@ -725,6 +913,7 @@ int gnt_text_view_get_lines_above(GntTextView *view)
  */
 int gnt_text_view_tag_change(GntTextView *view, const char *name, const char *text, gboolean all)
 {
+	GntTextViewPriv *priv = GNT_TEXT_VIEW_GET_PRIVATE(view);
 	GList *alllines = g_list_first(view->list);
 	GList *list, *next, *iter, *inext;
 	const int text_length = text ? strlen(text) : 0;
@@ -791,6 +980,11 @@ int gnt_text_view_tag_change(GntTextView *view, const char *name, const char *te
 									else
 										view->list = iter->prev;
 								}
+								if (priv->stale == iter)
+									priv->stale = inext;
+								if (priv->oldest == iter)
+									priv->oldest = iter->prev;
+								priv->lines--;
 								alllines = g_list_delete_link(alllines, iter);
 							}
 						} else {
@@ -849,6 +1043,19 @@ void gnt_text_view_set_flag(GntTextView *view, GntTextViewFlag flag)
 	view->flags |= flag;
 }
 
+void gnt_text_view_set_max_lines(GntTextView *view, int lines)
+{
+	GNT_TEXT_VIEW_GET_PRIVATE(view)->max_lines = MAX(0, lines);
+	drop_old_lines(view);
+	if (GNT_WIDGET(view)->window)
+		gnt_widget_draw(GNT_WIDGET(view));
+}
+
+int gnt_text_view_get_max_lines(GntTextView *view)
+{
+	return GNT_TEXT_VIEW_GET_PRIVATE(view)->max_lines;
+}
+
 /* Pager and editor setups */
 struct
 {
@@ -237,6 +237,28 @@ void gnt_text_view_attach_editor_widget(GntTextView *view, GntWidget *widget);
  */
 void gnt_text_view_set_flag(GntTextView *view, GntTextViewFlag flag);
 
+/**
+ * Limit the number of lines a textview keeps. When there are more lines than
+ * that, the oldest lines are dropped.
+ *
+ * @param view   The textview widget
+ * @param lines  The most lines to keep, or @c 0 to keep all of them (the default)
+ *
+ * @since 2.11.0
+ */
+void gnt_text_view_set_max_lines(GntTextView *view, int lines);
+
+/**
+ * Get the most lines a textview keeps.
+ *
+ * @param view  The textview widget
+ *
+ * @return  The most lines the textview keeps, or @c 0 if it keeps all of them.
+ *
+ * @since 2.11.0
+ */
+int gnt_text_view_get_max_lines(GntTextView *view);
+
 G_END_DECLS
 
 #endif /* GNT_TEXT_VIEW_H */
@@ -62,6 +62,8 @@ struct _GntTreePriv
 	GCompareFunc compare;
 	int lastvisible;
 	int expander_level;
+
+	GntTreeRow *rows;       /* Root of the treap of the top-level rows */
 };
 
 #define	TAB_SIZE 3
@@ -87,6 +89,17 @@ struct _GntTreeRow
 
 	GList *columns;
 	GntTree *tree;
+
+	/* The siblings also form a treap, in the same order as the list of
+	 * siblings, so that rows can be found by their position quickly. */
+	GntTreeRow *up;
+	GntTreeRow *left;
+	GntTreeRow *right;
+	GntTreeRow *children;   /* Root of the treap of the child rows */
+	guint32 priority;
+	int span;               /* Number of rows shown for this part of the treap */
+
+	GList *link;            /* The link for this row in tree->list */
 };
 
 struct _GntTreeCol
@@ -135,18 +148,6 @@ readjust_columns(GntTree *tree)
 	}
 }
 
-/* Move the item at position old to position new */
-static GList *
-g_list_reposition_child(GList *list, int old, int new)
-{
-	gpointer item = g_list_nth_data(list, old);
-	list = g_list_remove(list, item);
-	if (old < new)
-		new--;   /* because the positions would have shifted after removing the item */
-	list = g_list_insert(list, item, new);
-	return list;
-}
-
 static GntTreeRow *
 _get_next(GntTreeRow *row, gboolean godeep)
 {
@@ -191,10 +192,176 @@ get_next(GntTreeRow *row)
 	return row;
 }
 
+#define SPAN(row)   ((row) ? (row)->span : 0)
+#define SHOWN(row)  (1 + ((row)->collapsed ? 0 : SPAN((row)->children)))
+
+static GntTreeRow **
+sibling_root(GntTree *tree, GntTreeRow *row)
+{
+	return row->parent ? &row->parent->children : &tree->priv->rows;
+}
+
+static void
+update_span(GntTreeRow *row)
+{
+	row->span = SPAN(row->left) + SPAN(row->right) + SHOWN(row);
+}
+
+/* Updates the spans after the number of rows shown for 'row' has changed */
+static void
+update_spans(GntTreeRow *row)
+{
+	while (row) {
+		GntTreeRow *r;
+		for (r = row; r; r = r->up)
+			update_span(r);
+		row = row->parent;
+	}
+}
+
+/* Moves 'row' above its parent in the treap */
+static void
+rotate_up(GntTree *tree, GntTreeRow *row)
+{
+	GntTreeRow *p = row->up;
+	GntTreeRow *g = p->up;
+
+	if (p->left == row) {
+		p->left = row->right;
+		if (p->left)
+			p->left->up = p;
+		row->right = p;
+	} else {
+		p->right = row->left;
+		if (p->right)
+			p->right->up = p;
+		row->left = p;
+	}
+	p->up = row;
+	row->up = g;
+
+	if (g == NULL)
+		*sibling_root(tree, row) = row;
+	else if (g->left == p)
+		g->left = row;
+	else
+		g->right = row;
+
+	update_span(p);
+	update_span(row);
+}
+
+/* Adds 'row' to the treap of its siblings, right after 'after', or before
+ * all the siblings if 'after' is NULL. row->parent must be set already. */
+static void
+treap_insert(GntTree *tree, GntTreeRow *row, GntTreeRow *after)
+{
+	GntTreeRow **root = sibling_root(tree, row);
+	GntTreeRow *r;
+
+	row->up = row->left = row->right = NULL;
+	row->priority = g_random_int();
+
+	if (*root == NULL) {
+		*root = row;
+	} else if (after && after->right == NULL) {
+		after->right = row;
+		row->up = after;
+	} else {
+		for (r = after ? after->right : *root; r->left; r = r->left)
+			;
+		r->left = row;
+		row->up = r;
+	}
+	update_span(row);
+
+	while (row->up && row->up->priority < row->priority)
+		rotate_up(tree, row);
+	update_spans(row);
+}
+
+static void
+treap_remove(GntTree *tree, GntTreeRow *row)
+{
+	GntTreeRow *up;
+
+	while (row->left || row->right) {
+		if (row->left == NULL)
+			rotate_up(tree, row->right);
+		else if (row->right == NULL)
+			rotate_up(tree, row->left);
+		else if (row->left->priority > row->right->priority)
+			rotate_up(tree, row->left);
+		else
+			rotate_up(tree, row->right);
+	}
+
+	up = row->up;
+	if (up == NULL)
+		*sibling_root(tree, row) = NULL;
+	else if (up->left == row)
+		up->left = NULL;
+	else
+		up->right = NULL;
+	row->up = NULL;
+
+	update_spans(up ? up : row->parent);
+}
+
+/* Returns the number of rows shown before 'row' */
+static int
+get_position(GntTreeRow *row)
+{
+	int pos = 0;
+
+	while (row) {
+		GntTreeRow *r;
+		pos += SPAN(row->left);
+		for (r = row; r->up; r = r->up) {
+			if (r->up->right == r)
+				pos += SPAN(r->up->left) + SHOWN(r->up);
+		}
+		row = row->parent;
+		if (row)
+			pos++;
+	}
+	return pos;
+}
+
+/* Returns the row shown at position n, or NULL if there is no such row */
+static GntTreeRow *
+get_nth_row(GntTree *tree, int n)
+{
+	GntTreeRow *row = tree->priv->rows;
+
+	if (n < 0)
+		return NULL;
+
+	while (row) {
+		if (n < SPAN(row->left)) {
+			row = row->left;
+			continue;
+		}
+		n -= SPAN(row->left);
+		if (n == 0)
+			return row;
+		n--;
+		if (n < SHOWN(row) - 1) {
+			row = row->children;
+			continue;
+		}
+		n -= SHOWN(row) - 1;
+		row = row->right;
+	}
+	return NULL;
+}
+
 /* Returns the n-th next row. If it doesn't exist, returns NULL */
 static GntTreeRow *
 get_next_n(GntTreeRow *row, int n)
 {
+	if (row && !SEARCHING(row->tree))
+		return get_nth_row(row->tree, get_position(row) + n);
 	while (row && n--)
 		row = get_next(row);
 	return row;
@@ -210,6 +377,14 @@ get_next_n_opt(GntTreeRow *row, int n, int *pos)
 	if (row == NULL)
 		return NULL;
 
+	if (!SEARCHING(row->tree)) {
+		int p = get_position(row);
+		r = MAX(0, MIN(n, SPAN(row->tree->priv->rows) - 1 - p));
+		if (pos)
+			*pos = r;
+		return r ? get_nth_row(row->tree, p + r) : row;
+	}
+
 	while (row && n--)
 	{
 		row = get_next(row);
@@ -260,18 +435,22 @@ get_prev(GntTreeRow *row)
 static GntTreeRow *
 get_prev_n(GntTreeRow *row, int n)
 {
+	if (row && !SEARCHING(row->tree))
+		return get_nth_row(row->tree, get_position(row) - n);
 	while (row && n--)
 		row = get_prev(row);
 	return row;
 }
 
 /* Distance of row from the root */
-/* XXX: This is uber-inefficient */
 static int
 get_root_distance(GntTreeRow *row)
 {
 	if (row == NULL)
 		return -1;
+	if (!SEARCHING(row->tree))
+		return get_position(row);
+	/* XXX: This is uber-inefficient */
 	return get_root_distance(get_prev(row)) + 1;
 }
 
@@ -575,7 +754,7 @@ redraw_tree(GntTree *tree)
 		int total = 0;
 		int showing, position;
 
-		get_next_n_opt(tree->root, g_list_length(tree->list), &total);
+		get_next_n_opt(tree->root, g_hash_table_size(tree->hash), &total);
 		showing = rows * rows / MAX(total, 1) + 1;
 		showing = MIN(rows, showing);
 
@@ -837,6 +1016,7 @@ gnt_tree_key_pressed(GntWidget *widget, const char *text)
 		if (row && row->child)
 		{
 			row->collapsed = !row->collapsed;
+			update_spans(row);
 			redraw_tree(tree);
 			g_signal_emit(tree, signals[SIG_COLLAPSED], 0, row->key, row->collapsed);
 		}
@@ -980,11 +1160,9 @@ move_last_action(GntBindable *bind, GList *null)
 {
 	GntTree *tree = GNT_TREE(bind);
 	GntTreeRow *old = tree->current;
-	GntTreeRow *row = tree->bottom;
-	GntTreeRow *next;
+	GntTreeRow *row;
 
-	while ((next = get_next(row)))
-		row = next;
+	row = get_next_n_opt(tree->bottom, g_hash_table_size(tree->hash), NULL);
 
 	if (row) {
 		tree->current = row;
@@ -1242,6 +1420,58 @@ void gnt_tree_scroll(GntTree *tree, int count)
 	g_signal_emit(tree, signals[SIG_SCROLLED], 0, count);
 }
 
+/* Returns the last row in a treap of siblings */
+static GntTreeRow *
+get_last_sibling(GntTreeRow *row)
+{
+	if (row == NULL)
+		return NULL;
+	while (row->right)
+		row = row->right;
+	return row;
+}
+
+/* Puts the key for 'row' in tree->list right after the link 'after', or at
+ * the start of the list if 'after' is NULL. */
+static void
+list_insert_row(GntTree *tree, GntTreeRow *row, GList *after)
+{
+	GList *link;
+
+	if (after == NULL) {
+		tree->list = g_list_prepend(tree->list, row->key);
+		row->link = tree->list;
+		return;
+	}
+
+	link = g_list_alloc();
+	link->data = row->key;
+	link->prev = after;
+	link->next = after->next;
+	if (after->next)
+		after->next->prev = link;
+	after->next = link;
+	row->link = link;
+}
+
+/* Returns the sibling the row for 'key' should go after in the sorted tree */
+static GntTreeRow *
+find_sorted_position(GntTree *tree, gpointer key, GntTreeRow *row)
+{
+	GntTreeRow *bigbro = NULL;
+
+	while (row)
+	{
+		if (tree->priv->compare(key, row->key) < 0)
+			row = row->left;
+		else {
+			bigbro = row;
+			row = row->right;
+		}
+	}
+	return bigbro;
+}
+
 static gpointer
 find_position(GntTree *tree, gpointer key, gpointer parent)
 {
@@ -1251,32 +1481,21 @@ find_position(GntTree *tree, gpointer key, gpointer parent)
 		return NULL;
 
 	if (parent == NULL)
-		row = tree->root;
-	else
+		row = tree->priv->rows;
+	else {
 		row = g_hash_table_lookup(tree->hash, parent);
-
-	if (!row)
-		return NULL;
-
-	if (parent)
-		row = row->child;
-
-	while (row)
-	{
-		if (tree->priv->compare(key, row->key) < 0)
-			return (row->prev ? row->prev->key : NULL);
-		if (row->next)
-			row = row->next;
-		else
-			return row->key;
+		if (!row)
+			return NULL;
+		row = row->children;
 	}
-	return NULL;
+
+	row = find_sorted_position(tree, key, row);
+	return row ? row->key : NULL;
 }
 
 void gnt_tree_sort_row(GntTree *tree, gpointer key)
 {
 	GntTreeRow *row, *q, *s;
-	int current, newp;
 
 	if (!tree->priv->compare)
 		return;
@@ -1284,60 +1503,46 @@ void gnt_tree_sort_row(GntTree *tree, gpointer key)
 	row = g_hash_table_lookup(tree->hash, key);
 	g_return_if_fail(row != NULL);
 
-	current = g_list_index(tree->list, key);
+	treap_remove(tree, row);
+	q = find_sorted_position(tree, row->key, *sibling_root(tree, row));
+	treap_insert(tree, row, q);
 
-	if (row->parent)
+	if (q)
+		s = q->next;
+	else if (row->parent)
 		s = row->parent->child;
 	else
 		s = tree->root;
 
-	q = NULL;
-	while (s) {
-		if (tree->priv->compare(row->key, s->key) < 0)
-			break;
-		q = s;
-		s = s->next;
-	}
-
 	/* Move row between q and s */
-	if (row == q || row == s)
+	if (row == q || row == s || (q && q == row->prev))
 		return;
 
-	if (q == NULL) {
-		/* row becomes the first child of its parent */
-		row->prev->next = row->next;  /* row->prev cannot be NULL at this point */
-		if (row->next)
-			row->next->prev = row->prev;
+	if (row->prev) {
+		row->prev->next = row->next;
+	} else {
+		/* row was the first child of its parent */
 		if (row->parent)
-			row->parent->child = row;
+			row->parent->child = row->next;
 		else
-			tree->root = row;
-		row->next = s;
-		s->prev = row;  /* s cannot be NULL */
-		row->prev = NULL;
-		newp = g_list_index(tree->list, s) - 1;
-	} else {
-		if (row->prev) {
-			row->prev->next = row->next;
-		} else {
-			/* row was the first child of its parent */
-			if (row->parent)
-				row->parent->child = row->next;
-			else
-				tree->top = row->next;
-		}
-
-		if (row->next)
-			row->next->prev = row->prev;
+			tree->root = row->next;
+	}
+	if (row->next)
+		row->next->prev = row->prev;
 
+	row->prev = q;
+	row->next = s;
+	if (q)
 		q->next = row;
-		row->prev = q;
-		if (s)
-			s->prev = row;
-		row->next = s;
-		newp = g_list_index(tree->list, q) + 1;
-	}
-	tree->list = g_list_reposition_child(tree->list, current, newp);
+	else if (row->parent)
+		row->parent->child = row;
+	else
+		tree->root = row;
+	if (s)
+		s->prev = row;
+
+	tree->list = g_list_delete_link(tree->list, row->link);
+	list_insert_row(tree, row, q ? q->link : (s ? s->link->prev : NULL));
 
 	redraw_tree(tree);
 }
@@ -1363,12 +1568,11 @@ GntTreeRow *gnt_tree_add_row_after(GntTree *tree, void *key, GntTreeRow *row, vo
 	if (tree->root == NULL)
 	{
 		tree->root = row;
-		tree->list = g_list_prepend(tree->list, key);
+		treap_insert(tree, row, NULL);
+		list_insert_row(tree, row, NULL);
 	}
 	else
 	{
-		int position = 0;
-
 		if (bigbro)
 		{
 			pr = g_hash_table_lookup(tree->hash, bigbro);
@@ -1380,7 +1584,7 @@ GntTreeRow *gnt_tree_add_row_after(GntTree *tree, void *key, GntTreeRow *row, vo
 				pr->next = row;
 				row->parent = pr->parent;
 
-				position = g_list_index(tree->list, bigbro);
+				treap_insert(tree, row, pr);
 			}
 		}
 
@@ -1394,7 +1598,7 @@ GntTreeRow *gnt_tree_add_row_after(GntTree *tree, void *key, GntTreeRow *row, vo
 				pr->child = row;
 				row->parent = pr;
 
-				position = g_list_index(tree->list, parent);
+				treap_insert(tree, row, NULL);
 			}
 		}
 
@@ -1406,11 +1610,12 @@ GntTreeRow *gnt_tree_add_row_after(GntTree *tree, void *key, GntTreeRow *row, vo
 			if (tree->current == tree->root)
 				tree->current = row;
 			tree->root = row;
-			tree->list = g_list_prepend(tree->list, key);
+			treap_insert(tree, row, NULL);
+			list_insert_row(tree, row, NULL);
 		}
 		else
 		{
-			tree->list = g_list_insert(tree->list, key, position + 1);
+			list_insert_row(tree, row, pr->link);
 		}
 	}
 	redraw_tree(tree);
@@ -1426,15 +1631,9 @@ GntTreeRow *gnt_tree_add_row_last(GntTree *tree, void *key, GntTreeRow *row, voi
 		pr = g_hash_table_lookup(tree->hash, parent);
 
 	if (pr)
-		br = pr->child;
+		br = get_last_sibling(pr->children);
 	else
-		br = tree->root;
-
-	if (br)
-	{
-		while (br->next)
-			br = br->next;
-	}
+		br = get_last_sibling(tree->priv->rows);
 
 	return gnt_tree_add_row_after(tree, key, row, parent, br ? br->key : NULL);
 }
@@ -1519,6 +1718,8 @@ void gnt_tree_remove(GntTree *tree, gpointer key)
 			tree->bottom = get_prev(row);
 		}
 
+		treap_remove(tree, row);
+
 		/* Fix the links */
 		if (row->next)
 			row->next->prev = row->prev;
@@ -1527,8 +1728,8 @@ void gnt_tree_remove(GntTree *tree, gpointer key)
 		if (row->prev)
 			row->prev->next = row->next;
 
+		tree->list = g_list_delete_link(tree->list, row->link);
 		g_hash_table_remove(tree->hash, key);
-		tree->list = g_list_remove(tree->list, key);
 
 		if (redraw && depth == 0)
 		{
@@ -1546,6 +1747,7 @@ return_true(gpointer key, gpointer data, gpointer null)
 void gnt_tree_remove_all(GntTree *tree)
 {
 	tree->root = NULL;
+	tree->priv->rows = NULL;
 	g_hash_table_foreach_remove(tree->hash, (GHRFunc)return_true, tree);
 	g_list_free(tree->list);
 	tree->list = NULL;
@@ -1593,15 +1795,9 @@ GntTreeRow *gnt_tree_add_choice(GntTree *tree, void *key, GntTreeRow *row, void
 			bigbro = find_position(tree, key, parent);
 		else {
 			r = g_hash_table_lookup(tree->hash, parent);
-			if (!r)
-				r = tree->root;
-			else
-				r = r->child;
-			if (r) {
-				while (r->next)
-					r = r->next;
+			r = get_last_sibling(r ? r->children : tree->priv->rows);
+			if (r)
 				bigbro = r->key;
-			}
 		}
 	}
 	row = gnt_tree_add_row_after(tree, key, row, parent, bigbro);
@@ -1688,6 +1884,7 @@ static void _gnt_tree_init_internals(GntTree *tree, int col)
 		tree->columns[col].width = 15;
 	}
 	tree->list = NULL;
+	tree->priv->rows = NULL;
 	tree->show_title = FALSE;
 	g_object_notify(G_OBJECT(tree), "columns");
 }
@@ -1791,6 +1988,7 @@ void gnt_tree_set_expanded(GntTree *tree, void *key, gboolean expanded)
 	GntTreeRow *row = g_hash_table_lookup(tree->hash, key);
 	if (row) {
 		row->collapsed = !expanded;
+		update_spans(row);
 		if (GNT_WIDGET(tree)->window)
 			gnt_widget_draw(GNT_WIDGET(tree));
 		g_signal_emit(tree, signals[SIG_COLLAPSED], 0, key, row->collapsed);
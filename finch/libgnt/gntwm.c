@@ -71,6 +71,7 @@
 #include "gntwindow.h"
 
 #define IDLE_CHECK_INTERVAL 5 /* 5 seconds */
+#define DEFAULT_FRAME_RATE 30 /* redraws per second */
 
 enum
 {
@@ -108,6 +109,12 @@ static gboolean write_already(gpointer data);
 static int write_timeout;
 static time_t last_active_time;
 static gboolean idle_update;
+static guint render_source;     /* Pending redraw of the screen */
+static GList *damaged;          /* Windows to copy to their panels in it */
+static gboolean taskbar_damaged;
+static gboolean taskbar_reposition;
+static GTimeVal last_render;
+static int frame_interval;      /* Milliseconds between redraws */
 static GList *act = NULL; /* list of WS with unseen activitiy */
 static gboolean ignore_keys = FALSE;
 #ifdef USE_PYTHON
@@ -260,6 +267,69 @@ update_screen(GntWM *wm)
 	return TRUE;
 }
 
+static gboolean
+render_frame(gpointer data)
+{
+	GntWM *wm = data;
+
+	render_source = 0;
+
+	while (damaged) {
+		GntNode *node = g_hash_table_lookup(wm->nodes, damaged->data);
+		if (node)
+			gnt_wm_copy_win(node->me, node);
+		damaged = g_list_delete_link(damaged, damaged);
+	}
+
+	if (taskbar_damaged) {
+		gnt_ws_draw_taskbar(wm->cws, taskbar_reposition);
+		taskbar_damaged = taskbar_reposition = FALSE;
+	}
+
+	update_screen(wm);
+	g_get_current_time(&last_render);
+	return FALSE;
+}
+
+/**
+ * Schedules a redraw of the screen. However many windows change in the
+ * meantime, the terminal is written to at most once per frame.
+ */
+static void
+queue_render(GntWM *wm)
+{
+	GTimeVal now;
+	glong elapsed;
+
+	if (render_source)
+		return;
+
+	g_get_current_time(&now);
+	elapsed = (now.tv_sec - last_render.tv_sec) * 1000 +
+		(now.tv_usec - last_render.tv_usec) / 1000;
+
+	if (elapsed < 0 || elapsed >= frame_interval)
+		render_source = g_idle_add(render_frame, wm);
+	else
+		render_source = g_timeout_add(frame_interval - elapsed, render_frame, wm);
+}
+
+static void
+queue_window(GntWM *wm, GntWidget *widget)
+{
+	if (!g_list_find(damaged, widget))
+		damaged = g_list_prepend(damaged, widget);
+	queue_render(wm);
+}
+
+static void
+queue_taskbar(GntWM *wm, gboolean reposition)
+{
+	taskbar_damaged = TRUE;
+	taskbar_reposition |= reposition;
+	queue_render(wm);
+}
+
 static gboolean
 sanitize_position(GntWidget *widget, int *x, int *y, gboolean m)
 {
@@ -395,6 +465,7 @@ static void
 gnt_wm_init(GTypeInstance *instance, gpointer class)
 {
 	GntWM *wm = GNT_WM(instance);
+	const char *frame_rate;
 	wm->workspaces = NULL;
 	wm->name_places = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 	wm->title_places = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
@@ -415,6 +486,8 @@ gnt_wm_init(GTypeInstance *instance, gpointer class)
 		read_window_positions(wm);
 	g_timeout_add_seconds(IDLE_CHECK_INTERVAL, check_idle, NULL);
 	time(&last_active_time);
+	frame_rate = gnt_style_get(GNT_STYLE_FRAME_RATE);
+	frame_interval = 1000 / (frame_rate && atoi(frame_rate) > 0 ? atoi(frame_rate) : DEFAULT_FRAME_RATE);
 	gnt_wm_switch_workspace(wm, 0);
 }
 
@@ -509,8 +582,7 @@ window_scroll_up(GntBindable *bindable, GList *null)
 
 	if (node->scroll) {
 		node->scroll--;
-		gnt_wm_copy_win(window, node);
-		update_screen(wm);
+		queue_window(wm, window);
 	}
 	return TRUE;
 }
@@ -534,8 +606,7 @@ window_scroll_down(GntBindable *bindable, GList *null)
 	gnt_widget_get_size(window, &w, &h);
 	if (h - node->scroll > getmaxy(node->window)) {
 		node->scroll++;
-		gnt_wm_copy_win(window, node);
-		update_screen(wm);
+		queue_window(wm, window);
 	}
 	return TRUE;
 }
@@ -563,7 +634,7 @@ destroy__list(GntWidget *widget, GntWM *wm)
 	wm->_list.tree = NULL;
 	wm->windows = NULL;
 	wm->actions = NULL;
-	update_screen(wm);
+	queue_render(wm);
 }
 
 static void
@@ -899,13 +970,11 @@ shift_window(GntWM *wm, GntWidget *widget, int dir)
 	all = g_list_insert(all, widget, pos);
 	all = g_list_delete_link(all, list);
 	wm->cws->list = all;
-	gnt_ws_draw_taskbar(wm->cws, FALSE);
+	queue_taskbar(wm, FALSE);
 	if (wm->cws->ordered) {
 		GntWidget *w = wm->cws->ordered->data;
 		GntNode *node = g_hash_table_lookup(wm->nodes, w);
 		top_panel(node->panel);
-		update_panels();
-		doupdate();
 	}
 }
 
@@ -1060,8 +1129,7 @@ window_reverse(GntWidget *win, gboolean set, GntWM *wm)
 	for (i = 0; i < h; i += reverse_char(d, i, 0, set));
 	for (i = 0; i < h; i += reverse_char(d, i, w-1, set));
 
-	gnt_wm_copy_win(win, g_hash_table_lookup(wm->nodes, win));
-	update_screen(wm);
+	queue_window(wm, win);
 }
 
 static void
@@ -1391,6 +1459,14 @@ gnt_wm_destroy(GObject *obj)
 	g_hash_table_destroy(wm->nodes);
 	wm->nodes = NULL;
 
+	if (render_source) {
+		g_source_remove(render_source);
+		render_source = 0;
+	}
+	g_list_free(damaged);
+	damaged = NULL;
+	taskbar_damaged = taskbar_reposition = FALSE;
+
 	while (wm->workspaces) {
 		g_object_unref(wm->workspaces->data);
 		wm->workspaces = g_list_delete_link(wm->workspaces, wm->workspaces);
@@ -1660,8 +1736,7 @@ gnt_wm_switch_workspace(GntWM *wm, gint n)
 	wm->cws = s;
 	gnt_ws_show(wm->cws, wm->nodes);
 
-	gnt_ws_draw_taskbar(wm->cws, TRUE);
-	update_screen(wm);
+	queue_taskbar(wm, TRUE);
 	if (wm->cws->ordered) {
 		gnt_wm_raise_window(wm, wm->cws->ordered->data);
 	}
@@ -1901,7 +1976,7 @@ void gnt_wm_new_window(GntWM *wm, GntWidget *widget)
 
 	if (GNT_WIDGET_IS_FLAG_SET(widget, GNT_WIDGET_INVISIBLE) ||
 			g_hash_table_lookup(wm->nodes, widget)) {
-		update_screen(wm);
+		queue_render(wm);
 		return;
 	}
 
@@ -1928,8 +2003,7 @@ void gnt_wm_new_window(GntWM *wm, GntWidget *widget)
 		}
 	}
 
-	gnt_ws_draw_taskbar(wm->cws, FALSE);
-	update_screen(wm);
+	queue_taskbar(wm, FALSE);
 }
 
 void gnt_wm_window_decorate(GntWM *wm, GntWidget *widget)
@@ -1969,8 +2043,7 @@ void gnt_wm_window_close(GntWM *wm, GntWidget *widget)
 		gnt_wm_update_window(wm, wm->cws->ordered->data);
 	}
 
-	gnt_ws_draw_taskbar(wm->cws, FALSE);
-	update_screen(wm);
+	queue_taskbar(wm, FALSE);
 }
 
 time_t gnt_wm_get_idle_time()
@@ -2138,7 +2211,7 @@ void gnt_wm_resize_window(GntWM *wm, GntWidget *widget, int width, int height)
 	g_signal_emit(wm, signals[SIG_RESIZED], 0, node);
 
 	show_panel(node->panel);
-	update_screen(wm);
+	queue_render(wm);
 }
 
 static void
@@ -2213,7 +2286,7 @@ void gnt_wm_move_window(GntWM *wm, GntWidget *widget, int x, int y)
 		}
 	}
 
-	update_screen(wm);
+	queue_render(wm);
 }
 
 static void
@@ -2240,8 +2313,7 @@ gnt_wm_give_focus(GntWM *wm, GntWidget *widget)
 		GntNode *nd = g_hash_table_lookup(wm->nodes, wm->_list.window);
 		top_panel(nd->panel);
 	}
-	gnt_ws_draw_taskbar(wm->cws, FALSE);
-	update_screen(wm);
+	queue_taskbar(wm, FALSE);
 }
 
 void gnt_wm_update_window(GntWM *wm, GntWidget *widget)
@@ -2265,9 +2337,8 @@ void gnt_wm_update_window(GntWM *wm, GntWidget *widget)
 		g_signal_emit(wm, signals[SIG_UPDATE_WIN], 0, node);
 
 	if (ws == wm->cws || GNT_WIDGET_IS_FLAG_SET(widget, GNT_WIDGET_TRANSIENT)) {
-		gnt_wm_copy_win(widget, node);
-		gnt_ws_draw_taskbar(wm->cws, FALSE);
-		update_screen(wm);
+		queue_window(wm, widget);
+		queue_taskbar(wm, FALSE);
 	} else if (ws && ws != wm->cws && GNT_WIDGET_IS_FLAG_SET(widget, GNT_WIDGET_URGENT)) {
 		if (!act || (act && !g_list_find(act, ws)))
 			act = g_list_prepend(act, ws);
@@ -35,6 +35,9 @@
 
 #define SEND_TYPED_TIMEOUT_SECONDS 5
 
+/* How long occupant changes are held back so the UI gets them in one go. */
+#define CHAT_USERS_FLUSH_DELAY 100
+
 static GList *conversations = NULL;
 static GList *ims = NULL;
 static GList *chats = NULL;
@@ -46,6 +49,18 @@ static PurpleConversationUiOps *default_ops = NULL;
  */
 static GHashTable *conversation_cache = NULL;
 
+/**
+ * A hash table used for finding chats by their ID.
+ * struct _purple_hchat => PurpleConversation*
+ */
+static GHashTable *chat_id_cache = NULL;
+
+/* IDs of the signals emitted for every message written. */
+static gulong writing_im_msg_signal = 0;
+static gulong wrote_im_msg_signal = 0;
+static gulong writing_chat_msg_signal = 0;
+static gulong wrote_chat_msg_signal = 0;
+
 struct _purple_hconv {
 	PurpleConversationType type;
 	char *name;
@@ -70,6 +85,46 @@ static void _purple_conversations_hconv_free_key(struct _purple_hconv *hc)
 	g_free(hc);
 }
 
+struct _purple_hchat {
+	const PurpleAccount *account;
+	int id;
+};
+
+static guint _purple_conversations_hchat_hash(struct _purple_hchat *hc)
+{
+	return g_direct_hash(hc->account) ^ (guint)hc->id;
+}
+
+static gboolean _purple_conversations_hchat_equal(struct _purple_hchat *hc1, struct _purple_hchat *hc2)
+{
+	return (hc1->account == hc2->account && hc1->id == hc2->id);
+}
+
+static void
+chat_id_cache_add(PurpleConversation *conv)
+{
+	struct _purple_hchat *hc;
+
+	hc = g_new(struct _purple_hchat, 1);
+	hc->account = conv->account;
+	hc->id = conv->u.chat->id;
+
+	g_hash_table_replace(chat_id_cache, hc, conv);
+}
+
+static void
+chat_id_cache_remove(PurpleConversation *conv)
+{
+	struct _purple_hchat hc;
+
+	hc.account = conv->account;
+	hc.id = conv->u.chat->id;
+
+	/* Another chat may have been given the same ID since. */
+	if (g_hash_table_lookup(chat_id_cache, &hc) == conv)
+		g_hash_table_remove(chat_id_cache, &hc);
+}
+
 static guint _purple_conversation_user_hash(gconstpointer data)
 {
 	const gchar *name = data;
@@ -87,6 +142,119 @@ static gboolean _purple_conversation_user_equal(gconstpointer a, gconstpointer b
 	return !g_utf8_collate(a, b);
 }
 
+static int purple_conv_chat_cb_compare(PurpleConvChatBuddy *a, PurpleConvChatBuddy *b);
+
+/*
+ * Occupant changes waiting to be passed on to the UI.  Joins and parts
+ * tend to come in bursts (a netsplit, or a room filling up after we
+ * join it), and the UI would rather redraw its list once per burst than
+ * once per user.
+ */
+struct _PurpleConvChatPending
+{
+	GHashTable *added;   /* Buddies the UI hasn't been told about yet. */
+	GList *removed;      /* Names the UI still has to remove, newest first. */
+	guint timer;
+};
+
+static void
+chat_users_pending_free(struct _PurpleConvChatPending *pending)
+{
+	if (pending->timer)
+		purple_timeout_remove(pending->timer);
+	g_hash_table_destroy(pending->added);
+	g_list_foreach(pending->removed, (GFunc)g_free, NULL);
+	g_list_free(pending->removed);
+	g_free(pending);
+}
+
+static void
+chat_users_discard(PurpleConvChat *chat)
+{
+	if (chat->pending == NULL)
+		return;
+
+	chat_users_pending_free(chat->pending);
+	chat->pending = NULL;
+}
+
+static void
+chat_users_flush(PurpleConvChat *chat)
+{
+	struct _PurpleConvChatPending *pending = chat->pending;
+	PurpleConversation *conv = chat->conv;
+	PurpleConversationUiOps *ops;
+
+	if (pending == NULL)
+		return;
+
+	/* The UI may well call back into us; start a new batch if it does. */
+	chat->pending = NULL;
+	ops = purple_conversation_get_ui_ops(conv);
+
+	/* Parts go first, so someone who left and came back stays listed. */
+	if (pending->removed != NULL && ops != NULL && ops->chat_remove_users != NULL) {
+		pending->removed = g_list_reverse(pending->removed);
+		ops->chat_remove_users(conv, pending->removed);
+	}
+
+	if (g_hash_table_size(pending->added) > 0 &&
+			ops != NULL && ops->chat_add_users != NULL) {
+		GList *cbuddies = g_hash_table_get_values(pending->added);
+
+		cbuddies = g_list_sort(cbuddies, (GCompareFunc)purple_conv_chat_cb_compare);
+		ops->chat_add_users(conv, cbuddies, TRUE);
+		g_list_free(cbuddies);
+	}
+
+	chat_users_pending_free(pending);
+}
+
+static gboolean
+chat_users_flush_cb(gpointer data)
+{
+	PurpleConvChat *chat = data;
+
+	chat->pending->timer = 0;
+	chat_users_flush(chat);
+
+	return FALSE;
+}
+
+static struct _PurpleConvChatPending *
+chat_users_pending(PurpleConvChat *chat)
+{
+	if (chat->pending == NULL) {
+		chat->pending = g_new0(struct _PurpleConvChatPending, 1);
+		chat->pending->added = g_hash_table_new(g_direct_hash, g_direct_equal);
+		chat->pending->timer = purple_timeout_add(CHAT_USERS_FLUSH_DELAY,
+				chat_users_flush_cb, chat);
+	}
+
+	return chat->pending;
+}
+
+static void
+chat_users_insert(PurpleConvChat *chat, PurpleConvChatBuddy *cb)
+{
+	chat->in_room = g_list_prepend(chat->in_room, cb);
+	cb->link = chat->in_room;
+	g_hash_table_replace(chat->users, g_strdup(cb->name), cb);
+}
+
+static void
+chat_users_unlink(PurpleConvChat *chat, PurpleConvChatBuddy *cb)
+{
+	if (cb->link != NULL) {
+		chat->in_room = g_list_delete_link(chat->in_room, cb->link);
+		cb->link = NULL;
+	}
+
+	/* A rename which only changes case replaces the old buddy in the table. */
+	if (g_hash_table_lookup(chat->users, cb->name) == cb)
+		g_hash_table_remove(chat->users, cb->name);
+}
+
 void
 purple_conversations_set_ui_ops(PurpleConversationUiOps *ops)
 {
@@ -248,12 +416,130 @@ open_log(PurpleConversation *conv)
 
 /* Functions that deal with PurpleConvMessage */
 
+/* The text of the messages in a history is packed into blocks of this size */
+#define HISTORY_BLOCK_SIZE 8192
+
+#define HISTORY_MIN_SIZE 16
+
+typedef struct _PurpleConvHistory      PurpleConvHistory;
+typedef struct _PurpleConvHistoryBlock PurpleConvHistoryBlock;
+
+struct _PurpleConvHistoryBlock
+{
+	PurpleConvHistoryBlock *next;
+	gsize size;
+	gsize used;
+	guint messages;  /* How many messages still have their text here */
+	char text[1];
+};
+
+typedef struct
+{
+	PurpleConvMessage msg;  /* Must be first */
+	PurpleConvHistoryBlock *block;
+} PurpleConvHistoryEntry;
+
+/*
+ * A ring of messages, oldest at head.  Messages are numbered in the
+ * order they were added, so iterators can tell where they are even as
+ * old messages are dropped.  Since messages are dropped oldest first,
+ * so are the blocks holding their text.
+ */
+struct _PurpleConvHistory
+{
+	PurpleConvHistoryEntry **ring;
+	guint size;
+	guint head;
+	guint count;
+	guint added;  /* The number of the next message */
+	guint max;
+
+	PurpleConvHistoryBlock *first;
+	PurpleConvHistoryBlock *last;
+};
+
+static PurpleConvHistory *
+get_history(PurpleConversation *conv)
+{
+	if (conv->history == NULL) {
+		conv->history = g_new0(PurpleConvHistory, 1);
+		conv->history->max = purple_prefs_get_int("/purple/conversations/max_history");
+	}
+
+	return conv->history;
+}
+
+static void
+history_invalidate_list(PurpleConversation *conv)
+{
+	g_list_free(conv->message_history);
+	conv->message_history = NULL;
+}
+
+static void
+history_resize(PurpleConvHistory *history, guint size)
+{
+	PurpleConvHistoryEntry **ring = g_new(PurpleConvHistoryEntry *, size);
+	guint i;
+
+	for (i = 0; i < history->count; i++)
+		ring[i] = history->ring[(history->head + i) % history->size];
+
+	g_free(history->ring);
+	history->ring = ring;
+	history->size = size;
+	history->head = 0;
+}
+
+static char *
+history_copy_text(char **dest, const char *text)
+{
+	gsize len;
+
+	if (text == NULL)
+		return NULL;
+
+	len = strlen(text) + 1;
+	memcpy(*dest, text, len);
+	*dest += len;
+
+	return *dest - len;
+}
+
+static void
+history_drop_oldest(PurpleConvHistory *history)
+{
+	PurpleConvHistoryEntry *entry = history->ring[history->head];
+	PurpleConvHistoryBlock *block;
+
+	history->head = (history->head + 1) % history->size;
+	history->count--;
+
+	PURPLE_DBUS_UNREGISTER_POINTER(&entry->msg);
+	entry->block->messages--;
+	g_slice_free(PurpleConvHistoryEntry, entry);
+
+	while ((block = history->first) != NULL && block->messages == 0) {
+		if (block == history->last) {
+			block->used = 0;
+			break;
+		}
+		history->first = block->next;
+		g_free(block);
+	}
+}
+
 static void
 add_message_to_history(PurpleConversation *conv, const char *who, const char *alias,
 		const char *message, PurpleMessageFlags flags, time_t when)
 {
+	PurpleConvHistory *history = get_history(conv);
+	PurpleConvHistoryEntry *entry;
+	PurpleConvHistoryBlock *block;
 	PurpleConvMessage *msg;
 	PurpleConnection *gc;
+	gsize len;
+	char *text;
 
 	gc = purple_account_get_connection(conv->account);
 
@@ -266,33 +552,75 @@ add_message_to_history(PurpleConversation *conv, const char *who, const char *al
 		who = me;
 	}
 
-	msg = g_new0(PurpleConvMessage, 1);
+	history_invalidate_list(conv);
+
+	while (history->max && history->count >= history->max)
+		history_drop_oldest(history);
+
+	if (history->count == history->size) {
+		guint size = MAX(history->size * 2, HISTORY_MIN_SIZE);
+		if (history->max)
+			size = MIN(size, history->max);
+		history_resize(history, size);
+	}
+
+	len = (who ? strlen(who) + 1 : 0) + (alias ? strlen(alias) + 1 : 0) +
+			(message ? strlen(message) + 1 : 0);
+
+	block = history->last;
+	if (block == NULL || block->size - block->used < len) {
+		gsize size = MAX(len, HISTORY_BLOCK_SIZE);
+		block = g_malloc(G_STRUCT_OFFSET(PurpleConvHistoryBlock, text) + size);
+		block->next = NULL;
+		block->size = size;
+		block->used = 0;
+		block->messages = 0;
+		if (history->last)
+			history->last->next = block;
+		else
+			history->first = block;
+		history->last = block;
+	}
+
+	text = block->text + block->used;
+	block->used += len;
+	block->messages++;
+
+	entry = g_slice_new(PurpleConvHistoryEntry);
+	entry->block = block;
+	msg = &entry->msg;
 	PURPLE_DBUS_REGISTER_POINTER(msg, PurpleConvMessage);
-	msg->who = g_strdup(who);
-	msg->alias = g_strdup(alias);
+	msg->who = history_copy_text(&text, who);
+	msg->alias = history_copy_text(&text, alias);
 	msg->flags = flags;
-	msg->what = g_strdup(message);
+	msg->what = history_copy_text(&text, message);
 	msg->when = when;
 	msg->conv = conv;
 
-	conv->message_history = g_list_prepend(conv->message_history, msg);
+	history->ring[(history->head + history->count) % history->size] = entry;
+	history->count++;
+	history->added++;
 }
 
 static void
-free_conv_message(PurpleConvMessage *msg)
+message_history_free(PurpleConversation *conv)
 {
-	g_free(msg->who);
-	g_free(msg->alias);
-	g_free(msg->what);
-	PURPLE_DBUS_UNREGISTER_POINTER(msg);
-	g_free(msg);
-}
+	PurpleConvHistory *history = conv->history;
 
-static void
-message_history_free(GList *list)
-{
-	g_list_foreach(list, (GFunc)free_conv_message, NULL);
-	g_list_free(list);
+	history_invalidate_list(conv);
+
+	if (history == NULL)
+		return;
+
+	while (history->count > 0)
+		history_drop_oldest(history);
+
+	g_free(history->first);
+	history->first = history->last = NULL;
+	g_free(history->ring);
+	history->ring = NULL;
+	history->size = 0;
+	history->head = 0;
 }
 
 /**************************************************************************
@@ -415,6 +743,7 @@ purple_conversation_new(PurpleConversationType type, PurpleAccount *account,
 		PURPLE_DBUS_REGISTER_POINTER(conv->u.chat, PurpleConvChat);
 
 		chats = g_list_prepend(chats, conv);
+		chat_id_cache_add(conv);
 
 		if ((disp = purple_connection_get_display_name(account->gc)))
 			purple_conv_chat_set_nick(conv->u.chat, disp);
@@ -566,6 +895,9 @@ purple_conversation_destroy(PurpleConversation *conv)
 		conv->u.im = NULL;
 	}
 	else if (conv->type == PURPLE_CONV_TYPE_CHAT) {
+		chat_users_discard(conv->u.chat);
+		chat_id_cache_remove(conv);
+
 		g_hash_table_destroy(conv->u.chat->users);
 		conv->u.chat->users = NULL;
 
@@ -601,6 +933,8 @@ purple_conversation_destroy(PurpleConversation *conv)
 	purple_conversation_close_logs(conv);
 
 	purple_conversation_clear_message_history(conv);
+	g_free(conv->history);
+	conv->history = NULL;
 
 	PURPLE_DBUS_UNREGISTER_POINTER(conv);
 	g_free(conv);
@@ -659,6 +993,10 @@ purple_conversation_set_ui_ops(PurpleConversation *conv,
 	if (conv->ui_ops != NULL && conv->ui_ops->destroy_conversation != NULL)
 		conv->ui_ops->destroy_conversation(conv);
 
+	/* The new UI will pick up the whole list of users. */
+	if (conv->type == PURPLE_CONV_TYPE_CHAT)
+		chat_users_discard(conv->u.chat);
+
 	conv->ui_data = NULL;
 
 	conv->ui_ops = ops;
@@ -680,7 +1018,12 @@ purple_conversation_set_account(PurpleConversation *conv, PurpleAccount *account
 	if (account == purple_conversation_get_account(conv))
 		return;
 
-	conv->account = account;
+	if (conv->type == PURPLE_CONV_TYPE_CHAT) {
+		chat_id_cache_remove(conv);
+		conv->account = account;
+		chat_id_cache_add(conv);
+	} else
+		conv->account = account;
 
 	purple_conversation_update(conv, PURPLE_CONV_UPDATE_ACCOUNT);
 }
@@ -966,9 +1309,8 @@ purple_conversation_write(PurpleConversation *conv, const char *who,
 	alias = who;
 
 	plugin_return =
-		GPOINTER_TO_INT(purple_signal_emit_return_1(
-			purple_conversations_get_handle(),
-			(type == PURPLE_CONV_TYPE_IM ? "writing-im-msg" : "writing-chat-msg"),
+		GPOINTER_TO_INT(purple_signal_emit_by_id_return_1(
+			(type == PURPLE_CONV_TYPE_IM ? writing_im_msg_signal : writing_chat_msg_signal),
 			account, who, &displayed, conv, flags));
 
 	if (displayed == NULL)
@@ -1026,8 +1368,8 @@ purple_conversation_write(PurpleConversation *conv, const char *who,
 
 	add_message_to_history(conv, who, alias, message, flags, mtime);
 
-	purple_signal_emit(purple_conversations_get_handle(),
-		(type == PURPLE_CONV_TYPE_IM ? "wrote-im-msg" : "wrote-chat-msg"),
+	purple_signal_emit_by_id(
+		(type == PURPLE_CONV_TYPE_IM ? wrote_im_msg_signal : wrote_chat_msg_signal),
 		account, who, displayed, conv, flags);
 
 	g_free(displayed);
@@ -1381,10 +1723,16 @@ purple_conv_chat_get_conversation(const PurpleConvChat *chat)
 GList *
 purple_conv_chat_set_users(PurpleConvChat *chat, GList *users)
 {
+	GList *l;
+
 	g_return_val_if_fail(chat != NULL, NULL);
 
+	chat_users_discard(chat);
 	chat->in_room = users;
 
+	for (l = users; l != NULL; l = l->next)
+		((PurpleConvChatBuddy *)l->data)->link = l;
+
 	return users;
 }
 
@@ -1520,7 +1868,9 @@ purple_conv_chat_set_id(PurpleConvChat *chat, int id)
 {
 	g_return_if_fail(chat != NULL);
 
+	chat_id_cache_remove(chat->conv);
 	chat->id = id;
+	chat_id_cache_add(chat->conv);
 }
 
 int
@@ -1661,6 +2011,7 @@ purple_conv_chat_add_users(PurpleConvChat *chat, GList *users, GList *extra_msgs
 	PurplePluginProtocolInfo *prpl_info;
 	GList *ul, *fl;
 	GList *cbuddies = NULL;
+	gboolean batch;
 
 	g_return_if_fail(chat  != NULL);
 	g_return_if_fail(users != NULL);
@@ -1668,6 +2019,11 @@ purple_conv_chat_add_users(PurpleConvChat *chat, GList *users, GList *extra_msgs
 	conv = purple_conv_chat_get_conversation(chat);
 	ops  = purple_conversation_get_ui_ops(conv);
 
+	/* People trickling in are batched up, the initial list is not. */
+	batch = new_arrivals && ops != NULL && ops->chat_add_users != NULL;
+	if (!batch)
+		chat_users_flush(chat);
+
 	gc = purple_conversation_get_gc(conv);
 	g_return_if_fail(gc != NULL);
 	prpl_info = PURPLE_PLUGIN_PROTOCOL_INFO(purple_connection_get_prpl(gc));
@@ -1707,10 +2063,12 @@ purple_conv_chat_add_users(PurpleConvChat *chat, GList *users, GList *extra_msgs
 		cbuddy = purple_conv_chat_cb_new(user, alias, flag);
 		cbuddy->buddy = purple_find_buddy(conv->account, user) != NULL;
 
-		chat->in_room = g_list_prepend(chat->in_room, cbuddy);
-		g_hash_table_replace(chat->users, g_strdup(cbuddy->name), cbuddy);
+		chat_users_insert(chat, cbuddy);
 
-		cbuddies = g_list_prepend(cbuddies, cbuddy);
+		if (batch)
+			g_hash_table_insert(chat_users_pending(chat)->added, cbuddy, cbuddy);
+		else
+			cbuddies = g_list_prepend(cbuddies, cbuddy);
 
 		if (!quiet && new_arrivals) {
 			char *alias_esc = g_markup_escape_text(alias, -1);
@@ -1740,12 +2098,14 @@ purple_conv_chat_add_users(PurpleConvChat *chat, GList *users, GList *extra_msgs
 			extra_msgs = extra_msgs->next;
 	}
 
-	cbuddies = g_list_sort(cbuddies, (GCompareFunc)purple_conv_chat_cb_compare);
+	if (cbuddies != NULL) {
+		cbuddies = g_list_sort(cbuddies, (GCompareFunc)purple_conv_chat_cb_compare);
 
-	if (ops != NULL && ops->chat_add_users != NULL)
-		ops->chat_add_users(conv, cbuddies, new_arrivals);
+		if (ops != NULL && ops->chat_add_users != NULL)
+			ops->chat_add_users(conv, cbuddies, new_arrivals);
 
-	g_list_free(cbuddies);
+		g_list_free(cbuddies);
+	}
 }
 
 void
@@ -1756,7 +2116,7 @@ purple_conv_chat_rename_user(PurpleConvChat *chat, const char *old_user,
 	PurpleConversationUiOps *ops;
 	PurpleConnection *gc;
 	PurplePluginProtocolInfo *prpl_info;
-	PurpleConvChatBuddy *cb;
+	PurpleConvChatBuddy *cb, *old_cb;
 	PurpleConvChatBuddyFlags flags;
 	const char *new_alias = new_user;
 	char tmp[BUF_LONG];
@@ -1797,22 +2157,22 @@ purple_conv_chat_rename_user(PurpleConvChat *chat, const char *old_user,
 			new_alias = purple_buddy_get_contact_alias(buddy);
 	}
 
+	/* The UI has to know about the old name before it can rename it. */
+	chat_users_flush(chat);
+
+	old_cb = purple_conv_chat_cb_find(chat, old_user);
 	flags = purple_conv_chat_user_get_flags(chat, old_user);
 	cb = purple_conv_chat_cb_new(new_user, new_alias, flags);
 	cb->buddy = purple_find_buddy(conv->account, new_user) != NULL;
 
-	chat->in_room = g_list_prepend(chat->in_room, cb);
-	g_hash_table_replace(chat->users, g_strdup(cb->name), cb);
+	chat_users_insert(chat, cb);
 
 	if (ops != NULL && ops->chat_rename_user != NULL)
 		ops->chat_rename_user(conv, old_user, new_user, new_alias);
 
-	cb = purple_conv_chat_cb_find(chat, old_user);
-
-	if (cb) {
-		chat->in_room = g_list_remove(chat->in_room, cb);
-		g_hash_table_remove(chat->users, cb->name);
-		purple_conv_chat_cb_destroy(cb);
+	if (old_cb) {
+		chat_users_unlink(chat, old_cb);
+		purple_conv_chat_cb_destroy(old_cb);
 	}
 
 	if (purple_conv_chat_is_user_ignored(chat, old_user)) {
@@ -1882,6 +2242,7 @@ purple_conv_chat_remove_users(PurpleConvChat *chat, GList *users, const char *re
 	PurpleConvChatBuddy *cb;
 	GList *l;
 	gboolean quiet;
+	gboolean batch;
 
 	g_return_if_fail(chat  != NULL);
 	g_return_if_fail(users != NULL);
@@ -1894,9 +2255,12 @@ purple_conv_chat_remove_users(PurpleConvChat *chat, GList *users, const char *re
 	g_return_if_fail(prpl_info != NULL);
 
 	ops  = purple_conversation_get_ui_ops(conv);
+	batch = ops != NULL && ops->chat_remove_users != NULL;
 
 	for (l = users; l != NULL; l = l->next) {
 		const char *user = (const char *)l->data;
+		gboolean unseen = FALSE;
+
 		quiet = GPOINTER_TO_INT(purple_signal_emit_return_1(purple_conversations_get_handle(),
 					"chat-buddy-leaving", conv, user, reason)) |
 				purple_conv_chat_is_user_ignored(chat, user);
@@ -1904,11 +2268,19 @@ purple_conv_chat_remove_users(PurpleConvChat *chat, GList *users, const char *re
 		cb = purple_conv_chat_cb_find(chat, user);
 
 		if (cb) {
-			chat->in_room = g_list_remove(chat->in_room, cb);
-			g_hash_table_remove(chat->users, cb->name);
+			/* Don't tell the UI about someone who came and went in one batch. */
+			if (chat->pending != NULL)
+				unseen = g_hash_table_remove(chat->pending->added, cb);
+
+			chat_users_unlink(chat, cb);
 			purple_conv_chat_cb_destroy(cb);
 		}
 
+		if (batch && !unseen) {
+			struct _PurpleConvChatPending *pending = chat_users_pending(chat);
+			pending->removed = g_list_prepend(pending->removed, g_strdup(user));
+		}
+
 		/* NOTE: Don't remove them from ignored in case they re-enter. */
 
 		if (!quiet) {
@@ -1944,9 +2316,6 @@ purple_conv_chat_remove_users(PurpleConvChat *chat, GList *users, const char *re
 		purple_signal_emit(purple_conversations_get_handle(), "chat-buddy-left",
 						 conv, user, reason);
 	}
-
-	if (ops != NULL && ops->chat_remove_users != NULL)
-		ops->chat_remove_users(conv, users);
 }
 
 void
@@ -1960,6 +2329,8 @@ purple_conv_chat_clear_users(PurpleConvChat *chat)
 
 	g_return_if_fail(chat != NULL);
 
+	chat_users_flush(chat);
+
 	conv  = purple_conv_chat_get_conversation(chat);
 	ops   = purple_conversation_get_ui_ops(conv);
 	users = chat->in_room;
@@ -2027,6 +2398,8 @@ purple_conv_chat_user_set_flags(PurpleConvChat *chat, const char *user,
 	conv = purple_conv_chat_get_conversation(chat);
 	ops = purple_conversation_get_ui_ops(conv);
 
+	chat_users_flush(chat);
+
 	if (ops != NULL && ops->chat_update_user != NULL)
 		ops->chat_update_user(conv, user);
 
@@ -2063,19 +2436,29 @@ const char *purple_conv_chat_get_nick(PurpleConvChat *chat) {
 	return chat->nick;
 }
 
+void
+purple_conv_chat_flush_users(PurpleConvChat *chat)
+{
+	g_return_if_fail(chat != NULL);
+
+	chat_users_flush(chat);
+}
+
 PurpleConversation *
 purple_find_chat(const PurpleConnection *gc, int id)
 {
-	GList *l;
+	struct _purple_hchat hc;
 	PurpleConversation *conv;
 
-	for (l = purple_get_chats(); l != NULL; l = l->next) {
-		conv = (PurpleConversation *)l->data;
+	g_return_val_if_fail(gc != NULL, NULL);
 
-		if (purple_conv_chat_get_id(PURPLE_CONV_CHAT(conv)) == id &&
-			purple_conversation_get_gc(conv) == gc)
-			return conv;
-	}
+	hc.account = purple_connection_get_account(gc);
+	hc.id = id;
+
+	conv = g_hash_table_lookup(chat_id_cache, &hc);
+
+	if (conv != NULL && purple_conversation_get_gc(conv) == gc)
+		return conv;
 
 	return NULL;
 }
@@ -2253,6 +2636,8 @@ purple_conv_chat_cb_set_attribute(PurpleConvChat *chat, PurpleConvChatBuddy *cb,
 	conv = purple_conv_chat_get_conversation(chat);
 	ops = purple_conversation_get_ui_ops(conv);
 	
+	chat_users_flush(chat);
+
 	if (ops != NULL && ops->chat_update_user != NULL)
 		ops->chat_update_user(conv, cb->name);
 }
@@ -2276,6 +2661,8 @@ purple_conv_chat_cb_set_attributes(PurpleConvChat *chat, PurpleConvChatBuddy *cb
 	conv = purple_conv_chat_get_conversation(chat);
 	ops = purple_conversation_get_ui_ops(conv);
 	
+	chat_users_flush(chat);
+
 	if (ops != NULL && ops->chat_update_user != NULL)
 		ops->chat_update_user(conv, cb->name);
 }
@@ -2294,9 +2681,7 @@ purple_conversation_get_extended_menu(PurpleConversation *conv)
 
 void purple_conversation_clear_message_history(PurpleConversation *conv)
 {
-	GList *list = conv->message_history;
-	message_history_free(list);
-	conv->message_history = NULL;
+	message_history_free(conv);
 
 	purple_signal_emit(purple_conversations_get_handle(),
 			"cleared-message-history", conv);
@@ -2304,9 +2689,101 @@ void purple_conversation_clear_message_history(PurpleConversation *conv)
 
 GList *purple_conversation_get_message_history(PurpleConversation *conv)
 {
+	PurpleConvMessageIter iter;
+	PurpleConvMessage *msg;
+
+	if (conv->message_history == NULL) {
+		purple_conversation_message_iter_init(&iter, conv, FALSE);
+		while ((msg = purple_conversation_message_iter_next(&iter)))
+			conv->message_history = g_list_prepend(conv->message_history, msg);
+	}
+
 	return conv->message_history;
 }
 
+guint purple_conversation_get_message_count(PurpleConversation *conv)
+{
+	g_return_val_if_fail(conv != NULL, 0);
+
+	return conv->history ? conv->history->count : 0;
+}
+
+void purple_conversation_set_max_history(PurpleConversation *conv, guint max)
+{
+	PurpleConvHistory *history;
+
+	g_return_if_fail(conv != NULL);
+
+	history = get_history(conv);
+	history->max = max;
+
+	if (max == 0 || history->count <= max)
+		return;
+
+	history_invalidate_list(conv);
+	while (history->count > max)
+		history_drop_oldest(history);
+	history_resize(history, max);
+}
+
+guint purple_conversation_get_max_history(PurpleConversation *conv)
+{
+	g_return_val_if_fail(conv != NULL, 0);
+
+	return get_history(conv)->max;
+}
+
+void purple_conversation_message_iter_init(PurpleConvMessageIter *iter,
+		PurpleConversation *conv, gboolean newest_first)
+{
+	PurpleConvHistory *history;
+
+	g_return_if_fail(iter != NULL);
+	g_return_if_fail(conv != NULL);
+
+	history = get_history(conv);
+	iter->conv = conv;
+	iter->newest_first = newest_first;
+	if (newest_first)
+		iter->next = history->added - 1;
+	else
+		iter->next = history->added - history->count;
+}
+
+PurpleConvMessage *purple_conversation_message_iter_next(PurpleConvMessageIter *iter)
+{
+	PurpleConvHistory *history;
+	guint remaining;
+
+	g_return_val_if_fail(iter != NULL, NULL);
+
+	history = iter->conv->history;
+	if (history == NULL)
+		return NULL;
+
+	/* Counting this message, how many there are from here to the newest.
+	 * The numbers may wrap around, but the difference doesn't mind. */
+	remaining = history->added - iter->next;
+
+	if (remaining > history->count) {
+		/* Dropped since the iterator got here */
+		if (iter->newest_first)
+			return NULL;
+		remaining = history->count;
+		iter->next = history->added - remaining;
+	}
+
+	if (remaining == 0)
+		return NULL;
+
+	if (iter->newest_first)
+		iter->next--;
+	else
+		iter->next++;
+
+	return &history->ring[(history->head + history->count - remaining) % history->size]->msg;
+}
+
 const char *purple_conversation_message_get_sender(PurpleConvMessage *msg)
 {
 	g_return_val_if_fail(msg, NULL);
@@ -2358,6 +2835,9 @@ purple_conversations_init(void)
 	conversation_cache = g_hash_table_new_full((GHashFunc)_purple_conversations_hconv_hash,
 						(GEqualFunc)_purple_conversations_hconv_equal,
 						(GDestroyNotify)_purple_conversations_hconv_free_key, NULL);
+	chat_id_cache = g_hash_table_new_full((GHashFunc)_purple_conversations_hchat_hash,
+						(GEqualFunc)_purple_conversations_hchat_equal,
+						g_free, NULL);
 
 	/**********************************************************************
 	 * Register preferences
@@ -2365,6 +2845,7 @@ purple_conversations_init(void)
 
 	/* Conversations */
 	purple_prefs_add_none("/purple/conversations");
+	purple_prefs_add_int("/purple/conversations/max_history", 1000);
 
 	/* Conversations -> Chat */
 	purple_prefs_add_none("/purple/conversations/chat");
@@ -2378,7 +2859,8 @@ purple_conversations_init(void)
 	/**********************************************************************
 	 * Register signals
 	 **********************************************************************/
-	purple_signal_register(handle, "writing-im-msg",
+	writing_im_msg_signal =
+		purple_signal_register(handle, "writing-im-msg",
 						 purple_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER_UINT,
 						 purple_value_new(PURPLE_TYPE_BOOLEAN), 5,
 						 purple_value_new(PURPLE_TYPE_SUBTYPE,
@@ -2389,7 +2871,8 @@ purple_conversations_init(void)
 										PURPLE_SUBTYPE_CONVERSATION),
 						 purple_value_new(PURPLE_TYPE_UINT));
 
-	purple_signal_register(handle, "wrote-im-msg",
+	wrote_im_msg_signal =
+		purple_signal_register(handle, "wrote-im-msg",
 						 purple_marshal_VOID__POINTER_POINTER_POINTER_POINTER_UINT,
 						 NULL, 5,
 						 purple_value_new(PURPLE_TYPE_SUBTYPE,
@@ -2468,7 +2951,8 @@ purple_conversations_init(void)
 						 purple_value_new(PURPLE_TYPE_UINT),
 						 purple_value_new(PURPLE_TYPE_UINT));
 
-	purple_signal_register(handle, "writing-chat-msg",
+	writing_chat_msg_signal =
+		purple_signal_register(handle, "writing-chat-msg",
 						 purple_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER_UINT,
 						 purple_value_new(PURPLE_TYPE_BOOLEAN), 5,
 						 purple_value_new(PURPLE_TYPE_SUBTYPE,
@@ -2479,7 +2963,8 @@ purple_conversations_init(void)
 										PURPLE_SUBTYPE_CONVERSATION),
 						 purple_value_new(PURPLE_TYPE_UINT));
 
-	purple_signal_register(handle, "wrote-chat-msg",
+	wrote_chat_msg_signal =
+		purple_signal_register(handle, "wrote-chat-msg",
 						 purple_marshal_VOID__POINTER_POINTER_POINTER_POINTER_UINT,
 						 NULL, 5,
 						 purple_value_new(PURPLE_TYPE_SUBTYPE,
@@ -2679,6 +3164,7 @@ purple_conversations_uninit(void)
 	while (conversations)
 		purple_conversation_destroy((PurpleConversation*)conversations->data);
 	g_hash_table_destroy(conversation_cache);
+	g_hash_table_destroy(chat_id_cache);
 	purple_signals_unregister_by_instance(purple_conversations_get_handle());
 }
 
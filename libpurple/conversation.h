@@ -44,6 +44,8 @@ typedef struct _PurpleConvChat          PurpleConvChat;
 typedef struct _PurpleConvChatBuddy     PurpleConvChatBuddy;
 /** @copydoc _PurpleConvMessage */
 typedef struct _PurpleConvMessage       PurpleConvMessage;
+/** @copydoc _PurpleConvMessageIter */
+typedef struct _PurpleConvMessageIter   PurpleConvMessageIter;
 
 /**
  * A type of conversation.
@@ -193,11 +195,13 @@ struct _PurpleConversationUiOps
 	                   PurpleMessageFlags flags,
 	                   time_t mtime);
 
-	/** Add @a cbuddies to a chat.
+	/** Add @a cbuddies to a chat.  Users who join an existing chat are
+	 *  collected for a short while and added in one call.
 	 *  @param cbuddies      A @c GList of #PurpleConvChatBuddy structs.
 	 *  @param new_arrivals  Whether join notices should be shown.
 	 *                       (Join notices are actually written to the
 	 *                       conversation by #purple_conv_chat_add_users().)
+	 *  @see purple_conv_chat_flush_users()
 	 */
 	void (*chat_add_users)(PurpleConversation *conv,
 	                       GList *cbuddies,
@@ -209,7 +213,8 @@ struct _PurpleConversationUiOps
 	 */
 	void (*chat_rename_user)(PurpleConversation *conv, const char *old_name,
 	                         const char *new_name, const char *new_alias);
-	/** Remove @a users from a chat.
+	/** Remove @a users from a chat.  Like joins, these are collected
+	 *  for a short while and removed in one call.
 	 *  @param users    A @c GList of <tt>const char *</tt>s.
 	 *  @see purple_conv_chat_rename_user()
 	 */
@@ -284,6 +289,7 @@ struct _PurpleConvChat
 	GHashTable *users;               /**< Hash table of the users in the room.
 	                                  *   @since 2.9.0
 	                                  */
+	struct _PurpleConvChatPending *pending; /**< Private. @since 2.11.0 */
 };
 
 /**
@@ -310,6 +316,11 @@ struct _PurpleConvChatBuddy
                                     *   real name, user@host, etc.
                                     */
 	gpointer ui_data;                /** < The UI can put whatever it wants here. */
+	GList *link;                     /**< This buddy's node in the chat's
+	                                  *   @c in_room list, so it can be removed
+	                                  *   without searching for it.
+	                                  *   @since 2.11.0
+	                                  */
 };
 
 /**
@@ -327,6 +338,21 @@ struct _PurpleConvMessage
 	char *alias;               /**< @since 2.3.0 */
 };
 
+/**
+ * An iterator over the message history of a conversation.  Unlike the
+ * list from purple_conversation_get_message_history(), it stays valid
+ * while messages are added to the history or dropped from it.
+ *
+ * @see purple_conversation_message_iter_init()
+ * @since 2.11.0
+ */
+struct _PurpleConvMessageIter
+{
+	PurpleConversation *conv;  /**< The conversation. */
+	guint next;                /**< Private. */
+	gboolean newest_first;     /**< Private. */
+};
+
 /**
  * A core representation of a conversation between two or more people.
  *
@@ -360,7 +386,12 @@ struct _PurpleConversation
 	GHashTable *data;                        /**< Plugin-specific data.   */
 
 	PurpleConnectionFlags features; /**< The supported features */
-	GList *message_history;         /**< Message history, as a GList of PurpleConvMessage's */
+	GList *message_history;         /**< Message history, as a GList of PurpleConvMessage's.
+	                                     Only filled in by
+	                                     purple_conversation_get_message_history().
+	                                     @deprecated Use a PurpleConvMessageIter. */
+
+	struct _PurpleConvHistory *history; /**< Private. @since 2.11.0 */
 };
 
 #ifdef __cplusplus
@@ -743,12 +774,90 @@ void purple_conversation_foreach(void (*func)(PurpleConversation *conv));
  *
  * @return  A GList of PurpleConvMessage's. The must not modify the list or the data within.
  *          The list contains the newest message at the beginning, and the oldest message at
- *          the end.
+ *          the end.  It is only valid until the next message is written to the
+ *          conversation.
  *
  * @since 2.2.0
+ * @deprecated This builds a new list each time the history has changed.  Use
+ *             purple_conversation_message_iter_init() instead.
  */
 GList *purple_conversation_get_message_history(PurpleConversation *conv);
 
+/**
+ * Returns the number of messages in the message history of a conversation.
+ *
+ * @param conv  The conversation
+ *
+ * @return The number of messages.
+ *
+ * @since 2.11.0
+ */
+guint purple_conversation_get_message_count(PurpleConversation *conv);
+
+/**
+ * Sets how many messages the message history of a conversation keeps.
+ * Once it is full, the oldest message is dropped for each new one.
+ * New conversations start out with the limit in the
+ * /purple/conversations/max_history preference.
+ *
+ * @param conv  The conversation
+ * @param max   The number of messages to keep, or @c 0 for no limit.
+ *
+ * @since 2.11.0
+ */
+void purple_conversation_set_max_history(PurpleConversation *conv, guint max);
+
+/**
+ * Returns how many messages the message history of a conversation keeps.
+ *
+ * @param conv  The conversation
+ *
+ * @return The number of messages kept, or @c 0 for no limit.
+ *
+ * @since 2.11.0
+ */
+guint purple_conversation_get_max_history(PurpleConversation *conv);
+
+/**
+ * Starts iterating over the message history of a conversation.
+ *
+ * Iterating oldest first also visits messages added along the way, and
+ * skips past any dropped from the history before the iterator reached
+ * them.  Iterating newest first stops at the oldest message still in the
+ * history.
+ *
+ * @code
+ * PurpleConvMessageIter iter;
+ * PurpleConvMessage *msg;
+ *
+ * purple_conversation_message_iter_init(&iter, conv, FALSE);
+ * while ((msg = purple_conversation_message_iter_next(&iter)))
+ *     ...
+ * @endcode
+ *
+ * @param iter          The iterator to initialize.
+ * @param conv          The conversation.
+ * @param newest_first  Whether to start from the newest message rather
+ *                      than the oldest.
+ *
+ * @since 2.11.0
+ */
+void purple_conversation_message_iter_init(PurpleConvMessageIter *iter,
+		PurpleConversation *conv, gboolean newest_first);
+
+/**
+ * Returns the next message of a history iterator.
+ *
+ * @param iter  The iterator.
+ *
+ * @return The next message, or @c NULL when there are no more.  The message
+ *         belongs to the conversation and may be freed once it is dropped
+ *         from the history, so don't hold on to it.
+ *
+ * @since 2.11.0
+ */
+PurpleConvMessage *purple_conversation_message_iter_next(PurpleConvMessageIter *iter);
+
 /**
  * Clear the message history of a conversation.
  *
@@ -1318,6 +1427,17 @@ PurpleConvChatBuddyFlags purple_conv_chat_user_get_flags(PurpleConvChat *chat,
  */
 void purple_conv_chat_clear_users(PurpleConvChat *chat);
 
+/**
+ * Passes any joins and parts which are being held back on to the UI
+ * right away.  This only needs to be called before using the chat's
+ * UI ops directly; libpurple does it itself otherwise.
+ *
+ * @param chat The chat.
+ *
+ * @since 2.11.0
+ */
+void purple_conv_chat_flush_users(PurpleConvChat *chat);
+
 /**
  * Sets your nickname (used for hilighting) for a chat.
  *
@@ -264,6 +264,7 @@ purple_core_quit(void)
 	/* Everything after util_uninit cannot try to write things to the confdir */
 	purple_util_uninit();
 	purple_log_uninit();
+	_purple_xmlnode_uninit();
 
 	purple_signals_uninit();
 
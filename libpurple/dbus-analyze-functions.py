@@ -45,6 +45,11 @@ excluded = [\
     # as pointer to a struct, instead of a pointer to an enum.  This
     # causes a compilation error. Someone should fix this script.
     "purple_log_read",
+
+    # These are excluded because the iterator lives on the caller's stack
+    # and can't be handed out as a handle.
+    "purple_conversation_message_iter_init",
+    "purple_conversation_message_iter_next",
     ]
 
 # This is a list of functions that return a GList* or GSList * whose elements
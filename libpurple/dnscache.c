@@ -0,0 +1,291 @@
+/**
+ * @file dnscache.c DNS cache shared by the DNS query and SRV/TXT APIs
+ * @ingroup core
+ */
+
+/* purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include "internal.h"
+#include "debug.h"
+#include "network.h"
+#include "signals.h"
+
+/* The answers are kept for their TTL, but never for longer than
+ * DNS_CACHE_MAX_TTL, and at most DNS_CACHE_MAX_ENTRIES of them at a time.
+ * The keys are built by the callers, who also decide what an answer is,
+ * so an A/AAAA answer is a list of addresses while an SRV answer is a
+ * list of records. */
+#define DNS_CACHE_MAX_TTL      3600   /* seconds */
+#define DNS_CACHE_MAX_ENTRIES  256
+
+typedef struct {
+	gpointer answer;
+	GDestroyNotify free_func;
+	gboolean negative;
+	time_t expires;
+} PurpleDnsCacheEntry;
+
+typedef struct {
+	gpointer query;
+	PurpleDnsCacheResumeFunc resume;
+} PurpleDnsCacheWaiter;
+
+static int dns_cache_handle;
+
+/* key -> PurpleDnsCacheEntry */
+static GHashTable *entries = NULL;
+
+/* key -> GList of PurpleDnsCacheWaiter.  The first one is resolving the
+ * query and the rest are waiting for its answer. */
+static GHashTable *in_flight = NULL;
+
+static void
+entry_free(PurpleDnsCacheEntry *entry)
+{
+	if (entry->answer != NULL && entry->free_func != NULL)
+		entry->free_func(entry->answer);
+	g_free(entry);
+}
+
+static gboolean
+entry_is_expired(gpointer key, gpointer value, gpointer now)
+{
+	PurpleDnsCacheEntry *entry = value;
+
+	return entry->expires <= *(time_t *)now;
+}
+
+/* Make room for one more entry: first drop everything that has expired,
+ * and if that isn't enough, the entry that would expire the soonest. */
+static void
+make_room(void)
+{
+	GHashTableIter iter;
+	gpointer key, value, oldest = NULL;
+	time_t now = time(NULL);
+	time_t expires = 0;
+
+	if (g_hash_table_size(entries) < DNS_CACHE_MAX_ENTRIES)
+		return;
+
+	g_hash_table_foreach_remove(entries, entry_is_expired, &now);
+	if (g_hash_table_size(entries) < DNS_CACHE_MAX_ENTRIES)
+		return;
+
+	g_hash_table_iter_init(&iter, entries);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		PurpleDnsCacheEntry *entry = value;
+		if (oldest == NULL || entry->expires < expires) {
+			oldest = key;
+			expires = entry->expires;
+		}
+	}
+
+	g_hash_table_remove(entries, oldest);
+}
+
+gboolean
+_purple_dns_cache_lookup(const char *key, gconstpointer *answer, gboolean *negative)
+{
+	PurpleDnsCacheEntry *entry;
+
+	g_return_val_if_fail(key != NULL, FALSE);
+
+	if (entries == NULL)
+		return FALSE;
+
+	entry = g_hash_table_lookup(entries, key);
+	if (entry == NULL)
+		return FALSE;
+
+	if (entry->expires <= time(NULL)) {
+		g_hash_table_remove(entries, key);
+		return FALSE;
+	}
+
+	purple_debug_info("dnscache", "Using cached %s for %s\n",
+			entry->negative ? "failure" : "answer", key);
+
+	if (answer != NULL)
+		*answer = entry->answer;
+	if (negative != NULL)
+		*negative = entry->negative;
+
+	return TRUE;
+}
+
+void
+_purple_dns_cache_store(const char *key, gpointer answer, GDestroyNotify free_func,
+		gboolean negative, guint ttl)
+{
+	PurpleDnsCacheEntry *entry;
+
+	g_return_if_fail(key != NULL);
+
+	if (entries == NULL || ttl == 0) {
+		if (answer != NULL && free_func != NULL)
+			free_func(answer);
+		return;
+	}
+
+	g_hash_table_remove(entries, key);
+	make_room();
+
+	entry = g_new0(PurpleDnsCacheEntry, 1);
+	entry->answer = answer;
+	entry->free_func = free_func;
+	entry->negative = negative;
+	entry->expires = time(NULL) + MIN(ttl, DNS_CACHE_MAX_TTL);
+
+	g_hash_table_insert(entries, g_strdup(key), entry);
+}
+
+gboolean
+_purple_dns_cache_join(const char *key, gpointer query, PurpleDnsCacheResumeFunc resume)
+{
+	PurpleDnsCacheWaiter *waiter;
+	GList *waiters;
+
+	g_return_val_if_fail(key != NULL, TRUE);
+
+	if (in_flight == NULL)
+		return TRUE;
+
+	waiter = g_new0(PurpleDnsCacheWaiter, 1);
+	waiter->query = query;
+	waiter->resume = resume;
+
+	waiters = g_hash_table_lookup(in_flight, key);
+	if (waiters == NULL) {
+		g_hash_table_insert(in_flight, g_strdup(key), g_list_prepend(NULL, waiter));
+		return TRUE;
+	}
+
+	purple_debug_info("dnscache", "Waiting for the lookup of %s that is "
+			"already in progress\n", key);
+
+	/* The first waiter stays first, so appending is fine. */
+	waiters = g_list_append(waiters, waiter);
+
+	return FALSE;
+}
+
+void
+_purple_dns_cache_leave(const char *key, gpointer query)
+{
+	PurpleDnsCacheWaiter *waiter;
+	GList *waiters, *l;
+	gpointer orig_key, value;
+	gboolean first;
+
+	g_return_if_fail(key != NULL);
+
+	if (in_flight == NULL ||
+			!g_hash_table_lookup_extended(in_flight, key, &orig_key, &value))
+		return;
+
+	waiters = value;
+	for (l = waiters; l != NULL; l = l->next) {
+		waiter = l->data;
+		if (waiter->query == query)
+			break;
+	}
+
+	if (l == NULL)
+		return;
+
+	first = (l == waiters);
+	g_free(l->data);
+	waiters = g_list_delete_link(waiters, l);
+
+	if (!first) {
+		/* The head of the list didn't change. */
+		return;
+	}
+
+	g_hash_table_steal(in_flight, key);
+	g_free(orig_key);
+
+	/*
+	 * The query everyone was waiting on is done, or was cancelled.
+	 * Either way, let the rest try again: they find its answer in the
+	 * cache, or the first of them to come back starts a new lookup.
+	 */
+	while (waiters != NULL) {
+		waiter = waiters->data;
+		waiters = g_list_delete_link(waiters, waiters);
+
+		waiter->resume(waiter->query);
+		g_free(waiter);
+	}
+}
+
+void
+_purple_dns_cache_clear(void)
+{
+	if (entries == NULL)
+		return;
+
+	purple_debug_info("dnscache", "Clearing %d cached answers\n",
+			g_hash_table_size(entries));
+	g_hash_table_remove_all(entries);
+}
+
+static void
+network_configuration_changed_cb(void *data)
+{
+	/* The addresses we have might not be reachable from the new network,
+	 * and the old failures might have been caused by the old network. */
+	_purple_dns_cache_clear();
+}
+
+static void
+waiters_free(GList *waiters)
+{
+	while (waiters != NULL) {
+		g_free(waiters->data);
+		waiters = g_list_delete_link(waiters, waiters);
+	}
+}
+
+void
+_purple_dns_cache_init(void)
+{
+	entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)entry_free);
+	in_flight = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)waiters_free);
+
+	purple_signal_connect(purple_network_get_handle(), "network-configuration-changed",
+			&dns_cache_handle, PURPLE_CALLBACK(network_configuration_changed_cb), NULL);
+}
+
+void
+_purple_dns_cache_uninit(void)
+{
+	purple_signals_disconnect_by_handle(&dns_cache_handle);
+
+	g_hash_table_destroy(entries);
+	entries = NULL;
+	g_hash_table_destroy(in_flight);
+	in_flight = NULL;
+}
@@ -0,0 +1,256 @@
+/**
+ * @file dnspool.c Resolver threads shared by the DNS query and SRV/TXT APIs
+ * @ingroup core
+ */
+
+/* purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include "internal.h"
+#include "debug.h"
+#include "eventloop.h"
+
+/*
+ * Blocking lookups (getaddrinfo(), res_query(), ...) are run by a pool of
+ * threads.  Threads are started as lookups come in, up to
+ * DNS_POOL_MAX_THREADS at a time, and glib stops them again once they
+ * have been idle for a while.  Lookups beyond that wait in the pool's
+ * queue.
+ *
+ * A finished job is handed back to the main thread through a queue.  On
+ * Unix, the worker writes a byte to a pipe that the main thread watches
+ * with purple_input_add(); on Windows, where pipes can't be watched,
+ * it adds a timeout, as the resolver threads always did there.
+ */
+#define DNS_POOL_MAX_THREADS 16
+
+struct _PurpleDnsPoolJob {
+	PurpleDnsPoolFunc resolve;
+	PurpleDnsPoolFunc done;
+	GDestroyNotify destroy;
+	gpointer data;
+	volatile gint cancelled;
+};
+
+static GThreadPool *pool = NULL;
+static GAsyncQueue *finished = NULL;
+static guint outstanding = 0;
+
+/* Set while shutting down: jobs still queued are skipped, and nothing is
+ * told about its results any more. */
+static volatile gint stopping = FALSE;
+
+#ifndef _WIN32
+static int wakeup_fds[2] = { -1, -1 };
+static guint wakeup_inpa = 0;
+#endif
+
+#if !defined(_WIN32) && !defined(__GLIBC__)
+/* The resolver keeps its state in _res, which only glibc has per thread */
+G_LOCK_DEFINE_STATIC(resolver);
+#endif
+
+static void
+dispatch_finished_jobs(void)
+{
+	PurpleDnsPoolJob *job;
+
+	/* A wakeup can still be pending after shutting down on Windows */
+	if (finished == NULL)
+		return;
+
+	while ((job = g_async_queue_try_pop(finished)) != NULL) {
+		outstanding--;
+
+		if (!g_atomic_int_get(&job->cancelled) &&
+				!g_atomic_int_get(&stopping) && job->done != NULL)
+			job->done(job->data);
+
+		if (job->destroy != NULL)
+			job->destroy(job->data);
+		g_free(job);
+	}
+}
+
+#ifndef _WIN32
+static void
+wakeup_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+	char buf[64];
+
+	/* Empty the pipe; there is at least one byte per finished job */
+	while (read(source, buf, sizeof(buf)) > 0)
+		;
+
+	dispatch_finished_jobs();
+}
+#else
+static gboolean
+wakeup_cb(gpointer data)
+{
+	dispatch_finished_jobs();
+
+	return FALSE;
+}
+#endif
+
+static void
+run_job(gpointer data, gpointer user_data)
+{
+	PurpleDnsPoolJob *job = data;
+
+	if (!g_atomic_int_get(&job->cancelled) && !g_atomic_int_get(&stopping))
+		job->resolve(job->data);
+
+	g_async_queue_push(finished, job);
+
+#ifndef _WIN32
+	/* purple_debug_*() isn't for other threads.  If the pipe is full,
+	 * the main thread has a wakeup pending anyway. */
+	if (write(wakeup_fds[1], "", 1) < 0 && errno != EAGAIN)
+		fprintf(stderr, "dnspool: Unable to wake up the main thread: %s\n",
+				strerror(errno));
+#else
+	purple_timeout_add(0, wakeup_cb, NULL);
+#endif
+}
+
+static gboolean
+dns_pool_start(void)
+{
+	GError *error = NULL;
+
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+#endif
+
+#ifndef _WIN32
+	if (pipe(wakeup_fds) != 0) {
+		purple_debug_error("dnspool", "Unable to create pipe: %s\n",
+				g_strerror(errno));
+		return FALSE;
+	}
+	_purple_network_set_common_socket_flags(wakeup_fds[0]);
+	_purple_network_set_common_socket_flags(wakeup_fds[1]);
+	wakeup_inpa = purple_input_add(wakeup_fds[0], PURPLE_INPUT_READ,
+			wakeup_cb, NULL);
+#endif
+
+	finished = g_async_queue_new();
+	g_atomic_int_set(&stopping, FALSE);
+
+	pool = g_thread_pool_new(run_job, NULL, DNS_POOL_MAX_THREADS, FALSE, &error);
+	if (pool == NULL) {
+		purple_debug_error("dnspool", "Unable to create resolver threads: %s\n",
+				error ? error->message : "");
+		if (error != NULL)
+			g_error_free(error);
+		_purple_dns_pool_uninit();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+PurpleDnsPoolJob *
+_purple_dns_pool_push(PurpleDnsPoolFunc resolve, PurpleDnsPoolFunc done,
+		GDestroyNotify destroy, gpointer data)
+{
+	PurpleDnsPoolJob *job;
+
+	g_return_val_if_fail(resolve != NULL, NULL);
+
+	if (pool == NULL && !dns_pool_start())
+		return NULL;
+
+	job = g_new0(PurpleDnsPoolJob, 1);
+	job->resolve = resolve;
+	job->done = done;
+	job->destroy = destroy;
+	job->data = data;
+
+	outstanding++;
+	g_thread_pool_push(pool, job, NULL);
+
+	return job;
+}
+
+void
+_purple_dns_pool_cancel(PurpleDnsPoolJob *job)
+{
+	g_return_if_fail(job != NULL);
+
+	/*
+	 * A lookup can't be interrupted, so the job stays with the pool.
+	 * If it hasn't started, it's skipped; either way it's freed when it
+	 * comes back to the main thread.
+	 */
+	g_atomic_int_set(&job->cancelled, TRUE);
+}
+
+void
+_purple_dns_pool_lock_resolver(void)
+{
+#if !defined(_WIN32) && !defined(__GLIBC__)
+	G_LOCK(resolver);
+#endif
+}
+
+void
+_purple_dns_pool_unlock_resolver(void)
+{
+#if !defined(_WIN32) && !defined(__GLIBC__)
+	G_UNLOCK(resolver);
+#endif
+}
+
+void
+_purple_dns_pool_uninit(void)
+{
+	if (pool != NULL) {
+		/* Lookups that haven't started are skipped, but still come back
+		 * through the queue to be freed.  The ones already running can't
+		 * be interrupted, so this waits for them. */
+		g_atomic_int_set(&stopping, TRUE);
+		g_thread_pool_free(pool, FALSE, TRUE);
+		pool = NULL;
+	}
+
+	if (finished != NULL) {
+		dispatch_finished_jobs();
+		g_async_queue_unref(finished);
+		finished = NULL;
+	}
+
+#ifndef _WIN32
+	if (wakeup_inpa > 0) {
+		purple_input_remove(wakeup_inpa);
+		wakeup_inpa = 0;
+	}
+
+	if (wakeup_fds[0] >= 0) {
+		close(wakeup_fds[0]);
+		close(wakeup_fds[1]);
+		wakeup_fds[0] = wakeup_fds[1] = -1;
+	}
+#endif
+}
@@ -38,19 +38,12 @@
 #include <resolv.h>
 #endif
 
-#define MAX_ADDR_RESPONSE_LEN 1048576
-
-#if (defined(__APPLE__) || defined (__unix__)) && !defined(__osf__)
-#define PURPLE_DNSQUERY_USE_FORK
-#endif
 /**************************************************************************
  * DNS query API
  **************************************************************************/
 
 static PurpleDnsQueryUiOps *dns_query_ui_ops = NULL;
 
-typedef struct _PurpleDnsQueryResolverProcess PurpleDnsQueryResolverProcess;
-
 struct _PurpleDnsQueryData {
 	char *hostname;
 	int port;
@@ -59,76 +52,75 @@ struct _PurpleDnsQueryData {
 	guint timeout;
 	PurpleAccount *account;
 
-#if defined(PURPLE_DNSQUERY_USE_FORK)
-	PurpleDnsQueryResolverProcess *resolver;
-#elif defined _WIN32 /* end PURPLE_DNSQUERY_USE_FORK  */
-	GThread *resolver;
-	GSList *hosts;
-	gchar *error_message;
-#endif
-};
-
-#if defined(PURPLE_DNSQUERY_USE_FORK)
-
-#define MAX_DNS_CHILDREN 4
+	/* Set while the query is known to the DNS cache, see purple_dnsquery_use_cache() */
+	gchar *cache_key;
 
-/*
- * This structure keeps a reference to a child resolver process.
- */
-struct _PurpleDnsQueryResolverProcess {
-	guint inpa;
-	int fd_in, fd_out;
-	pid_t dns_pid;
+	/* Set while a resolver thread is looking up the host name */
+	PurpleDnsPoolJob *job;
 };
 
-static GSList *free_dns_children = NULL;
-/* TODO: Make me a GQueue when we require >= glib 2.4 */
-static GSList *queued_requests = NULL;
-
-static int number_of_dns_children = 0;
-
 /*
- * This is a convenience struct used to pass data to
- * the child resolver process.
+ * This is what a resolver thread works on.  The query can be destroyed
+ * while the thread is still resolving, so the thread gets its own copy
+ * of what it needs.
  */
 typedef struct {
-	char hostname[512];
+	PurpleDnsQueryData *query_data; /* only for the main thread */
+	char *hostname;
 	int port;
-} dns_params_t;
-#endif /* end PURPLE_DNSQUERY_USE_FORK */
+	GSList *hosts;
+	int error;
+	gchar *error_message;
+} PurpleDnsQueryRequest;
+
+static GSList *
+copy_hosts(const GSList *hosts)
+{
+	GSList *copy = NULL;
+	size_t addrlen;
+
+	while (hosts != NULL)
+	{
+		addrlen = GPOINTER_TO_SIZE(hosts->data);
+		copy = g_slist_prepend(copy, hosts->data);
+		hosts = hosts->next;
+		copy = g_slist_prepend(copy, g_memdup(hosts->data, addrlen));
+		hosts = hosts->next;
+	}
+
+	return g_slist_reverse(copy);
+}
+
+static void
+free_hosts(GSList *hosts)
+{
+	while (hosts != NULL)
+	{
+		hosts = g_slist_remove(hosts, hosts->data);
+		g_free(hosts->data);
+		hosts = g_slist_remove(hosts, hosts->data);
+	}
+}
 
 static void
 purple_dnsquery_resolved(PurpleDnsQueryData *query_data, GSList *hosts)
 {
 	purple_debug_info("dnsquery", "IP resolved for %s\n", query_data->hostname);
+	/* getaddrinfo() doesn't tell us the TTLs, so use the default one */
+	if (query_data->cache_key != NULL && hosts != NULL)
+		_purple_dns_cache_store(query_data->cache_key, copy_hosts(hosts),
+				(GDestroyNotify)free_hosts, FALSE, PURPLE_DNS_CACHE_DEFAULT_TTL);
+
 	if (query_data->callback != NULL)
 		query_data->callback(hosts, query_data->data, NULL);
 	else
 	{
 		/*
-		 * Callback is a required parameter, but it can get set to
-		 * NULL if we cancel a thread-based DNS lookup.  So we need
-		 * to free hosts.
+		 * Callback is a required parameter, but a UI's resolver might
+		 * still answer after it was cleared.  So we need to free hosts.
 		 */
-		while (hosts != NULL)
-		{
-			hosts = g_slist_remove(hosts, hosts->data);
-			g_free(hosts->data);
-			hosts = g_slist_remove(hosts, hosts->data);
-		}
-	}
-
-#ifdef PURPLE_DNSQUERY_USE_FORK
-	/*
-	 * Add the resolver to the list of available resolvers, and set it
-	 * to NULL so that it doesn't get destroyed along with the query_data
-	 */
-	if (query_data->resolver)
-	{
-		free_dns_children = g_slist_prepend(free_dns_children, query_data->resolver);
-		query_data->resolver = NULL;
+		free_hosts(hosts);
 	}
-#endif /* PURPLE_DNSQUERY_USE_FORK */
 
 	purple_dnsquery_destroy(query_data);
 }
@@ -142,6 +134,69 @@ purple_dnsquery_failed(PurpleDnsQueryData *query_data, const gchar *error_messag
 	purple_dnsquery_destroy(query_data);
 }
 
+/*
+ * Like purple_dnsquery_failed(), but for when the resolver said the name
+ * doesn't resolve, so that the failure can be cached.
+ */
+static void
+purple_dnsquery_unresolvable(PurpleDnsQueryData *query_data, const gchar *error_message)
+{
+	if (query_data->cache_key != NULL)
+		_purple_dns_cache_store(query_data->cache_key, g_strdup(error_message),
+				g_free, TRUE, PURPLE_DNS_CACHE_NEGATIVE_TTL);
+
+	purple_dnsquery_failed(query_data, error_message);
+}
+
+static gboolean initiate_resolving(gpointer data);
+
+static void
+purple_dnsquery_resume(gpointer data)
+{
+	PurpleDnsQueryData *query_data = data;
+
+	g_free(query_data->cache_key);
+	query_data->cache_key = NULL;
+
+	query_data->timeout = purple_timeout_add(0, initiate_resolving, query_data);
+}
+
+/*
+ * Answers the query from the cache, or has it wait for an identical query
+ * that is already being resolved.  Returns FALSE if the query still needs
+ * to be resolved.
+ */
+static gboolean
+purple_dnsquery_use_cache(PurpleDnsQueryData *query_data)
+{
+	gchar *key, *tmp;
+	gconstpointer answer;
+	gboolean negative;
+
+	tmp = g_strdup_printf("%s:%d", query_data->hostname, query_data->port);
+	key = g_ascii_strdown(tmp, -1);
+	g_free(tmp);
+
+	if (_purple_dns_cache_lookup(key, &answer, &negative))
+	{
+		g_free(key);
+		if (negative)
+		{
+			/* The callback could clear the cache */
+			gchar *message = g_strdup(answer);
+			purple_dnsquery_failed(query_data, message);
+			g_free(message);
+		}
+		else
+			purple_dnsquery_resolved(query_data, copy_hosts(answer));
+		return TRUE;
+	}
+
+	query_data->cache_key = key;
+
+	return !_purple_dns_cache_join(key, query_data, purple_dnsquery_resume);
+}
+
 static gboolean
 purple_dnsquery_ui_resolve(PurpleDnsQueryData *query_data)
 {
@@ -211,529 +266,25 @@ dns_str_is_ascii(const char *name)
 }
 #endif
 
-#if defined(PURPLE_DNSQUERY_USE_FORK)
-
-/*
- * Unix!
- */
-
-/*
- * Begin the DNS resolver child process functions.
- */
-#ifdef HAVE_SIGNAL_H
-G_GNUC_NORETURN static void
-trap_gdb_bug(int sig)
-{
-	const char *message =
-		"Purple's DNS child got a SIGTRAP signal.\n"
-		"This can be caused by trying to run purple inside gdb.\n"
-		"There is a known gdb bug which prevents this.  Supposedly purple\n"
-		"should have detected you were using gdb and used an ugly hack,\n"
-		"check cope_with_gdb_brokenness() in dnsquery.c.\n\n"
-		"For more info about this bug, see http://sources.redhat.com/ml/gdb/2001-07/msg00349.html\n";
-	fputs("\n* * *\n",stderr);
-	fputs(message,stderr);
-	fputs("* * *\n\n",stderr);
-	execlp("xmessage","xmessage","-center", message, NULL);
-	_exit(1);
-}
-#endif
-
-static void
-write_to_parent(int fd, const void *buf, size_t count)
-{
-	ssize_t written;
-
-	written = write(fd, buf, count);
-	if (written < 0 || (gsize)written != count) {
-		if (written < 0)
-			fprintf(stderr, "dns[%d]: Error writing data to "
-					"parent: %s\n", getpid(), strerror(errno));
-		else
-			fprintf(stderr, "dns[%d]: Error: Tried to write %"
-					G_GSIZE_FORMAT " bytes to parent but instead "
-					"wrote %" G_GSIZE_FORMAT " bytes\n",
-					getpid(), count, written);
-	}
-}
-
-G_GNUC_NORETURN static void
-purple_dnsquery_resolver_run(int child_out, int child_in, gboolean show_debug)
-{
-	dns_params_t dns_params;
-	const size_t zero = 0;
-	int rc;
-#ifdef HAVE_GETADDRINFO
-	struct addrinfo hints, *res, *tmp;
-	char servname[20];
-#else
-	struct sockaddr_in sin;
-	const size_t addrlen = sizeof(sin);
-#endif
-	char *hostname;
-
-#ifdef HAVE_SIGNAL_H
-	purple_restore_default_signal_handlers();
-	signal(SIGTRAP, trap_gdb_bug);
-#endif
-
-	/*
-	 * We resolve 1 host name for each iteration of this
-	 * while loop.
-	 *
-	 * The top half of this reads in the hostname and port
-	 * number from the socket with our parent.  The bottom
-	 * half of this resolves the IP (blocking) and sends
-	 * the result back to our parent, when finished.
-	 */
-	while (1) {
-		fd_set fds;
-		struct timeval tv = { .tv_sec = 20, .tv_usec = 0 };
-		FD_ZERO(&fds);
-		FD_SET(child_in, &fds);
-		rc = select(child_in + 1, &fds, NULL, NULL, &tv);
-		if (!rc) {
-			if (show_debug)
-				printf("dns[%d]: nobody needs me... =(\n", getpid());
-			break;
-		}
-		rc = read(child_in, &dns_params, sizeof(dns_params_t));
-		if (rc < 0) {
-			fprintf(stderr, "dns[%d]: Error: Could not read dns_params: "
-					"%s\n", getpid(), strerror(errno));
-			break;
-		}
-		if (rc == 0) {
-			if (show_debug)
-				printf("dns[%d]: Oops, father has gone, wait for me, wait...!\n", getpid());
-			_exit(0);
-		}
-		if (dns_params.hostname[0] == '\0') {
-			fprintf(stderr, "dns[%d]: Error: Parent requested resolution "
-					"of an empty hostname (port = %d)!!!\n", getpid(),
-					dns_params.port);
-			_exit(1);
-		}
-
-#ifdef USE_IDN
-		if (!dns_str_is_ascii(dns_params.hostname)) {
-			rc = purple_network_convert_idn_to_ascii(dns_params.hostname, &hostname);
-			if (rc != 0) {
-				write_to_parent(child_out, &rc, sizeof(rc));
-				if (show_debug)
-					fprintf(stderr, "dns[%d] Error: IDN conversion returned "
-							"%d\n", getpid(), rc);
-				dns_params.hostname[0] = '\0';
-				break;
-			}
-		} else /* intentional to execute the g_strdup */
-#endif
-		hostname = g_strdup(dns_params.hostname);
-
-		/* We have the hostname and port, now resolve the IP */
-
-#ifdef HAVE_GETADDRINFO
-		g_snprintf(servname, sizeof(servname), "%d", dns_params.port);
-		memset(&hints, 0, sizeof(hints));
-
-		/* This is only used to convert a service
-		 * name to a port number. As we know we are
-		 * passing a number already, we know this
-		 * value will not be really used by the C
-		 * library.
-		 */
-		hints.ai_socktype = SOCK_STREAM;
-#ifdef AI_ADDRCONFIG
-		hints.ai_flags |= AI_ADDRCONFIG;
-#endif /* AI_ADDRCONFIG */
-		rc = getaddrinfo(hostname, servname, &hints, &res);
-		write_to_parent(child_out, &rc, sizeof(rc));
-		if (rc != 0) {
-			if (show_debug)
-				printf("dns[%d] Error: getaddrinfo returned %d\n",
-					getpid(), rc);
-			dns_params.hostname[0] = '\0';
-			g_free(hostname);
-			hostname = NULL;
-			break;
-		}
-		tmp = res;
-		while (res) {
-			size_t ai_addrlen = res->ai_addrlen;
-			write_to_parent(child_out, &ai_addrlen, sizeof(ai_addrlen));
-			write_to_parent(child_out, res->ai_addr, res->ai_addrlen);
-			res = res->ai_next;
-		}
-		freeaddrinfo(tmp);
-#else
-		struct hostent *hp;
-		if (!(hp = gethostbyname(hostname))) {
-			write_to_parent(child_out, &h_errno, sizeof(int));
-			close(child_out);
-			if (show_debug)
-				printf("DNS Error: %d\n", h_errno);
-			_exit(0);
-		}
-		memset(&sin, 0, sizeof(struct sockaddr_in));
-		memcpy(&sin.sin_addr.s_addr, hp->h_addr, hp->h_length);
-		sin.sin_family = hp->h_addrtype;
-
-		sin.sin_port = htons(dns_params.port);
-		rc = 0;
-		write_to_parent(child_out, &rc, sizeof(rc));
-		write_to_parent(child_out, &addrlen, sizeof(addrlen));
-		write_to_parent(child_out, &sin, addrlen);
-#endif
-		write_to_parent(child_out, &zero, sizeof(zero));
-		dns_params.hostname[0] = '\0';
-
-		g_free(hostname);
-		hostname = NULL;
-	}
-
-	close(child_out);
-	close(child_in);
-
-	_exit(0);
-}
 /*
- * End the DNS resolver child process functions.
+ * The lookups run in the resolver threads from dnspool.c.
  */
 
-/*
- * Begin the functions for dealing with the DNS child processes.
- */
 static void
-cope_with_gdb_brokenness(void)
+request_free(PurpleDnsQueryRequest *request)
 {
-#ifdef __linux__
-	static gboolean already_done = FALSE;
-	char s[256], e[512];
-	int n;
-	pid_t ppid;
-
-	if(already_done)
-		return;
-	already_done = TRUE;
-	ppid = getppid();
-	g_snprintf(s, sizeof(s), "/proc/%d/exe", ppid);
-	n = readlink(s, e, sizeof(e));
-	if(n < 0)
-		return;
-
-	e[MIN((gsize)n,sizeof(e)-1)] = '\0';
-
-	if(strstr(e,"gdb")) {
-		purple_debug_info("dns",
-				   "Debugger detected, performing useless query...\n");
-		gethostbyname("x.x.x.x.x");
-	}
-#endif
+	free_hosts(request->hosts);
+	g_free(request->error_message);
+	g_free(request->hostname);
+	g_free(request);
 }
 
+/* This runs in a resolver thread */
 static void
-purple_dnsquery_resolver_destroy(PurpleDnsQueryResolverProcess *resolver)
+resolve_host_thread(gpointer data)
 {
-	g_return_if_fail(resolver != NULL);
-
-	/* Keep this before the kill() call below. */
-	if (resolver->inpa != 0) {
-		purple_input_remove(resolver->inpa);
-		resolver->inpa = 0;
-	}
-
-	/*
-	 * We might as well attempt to kill our child process.  It really
-	 * doesn't matter if this fails, because children will expire on
-	 * their own after a few seconds.
-	 */
-	if (resolver->dns_pid > 0)
-		kill(resolver->dns_pid, SIGKILL);
-
-	close(resolver->fd_in);
-	close(resolver->fd_out);
-
-	g_free(resolver);
-
-	number_of_dns_children--;
-}
-
-static PurpleDnsQueryResolverProcess *
-purple_dnsquery_resolver_new(gboolean show_debug)
-{
-	PurpleDnsQueryResolverProcess *resolver;
-	int child_out[2], child_in[2];
-
-	/* Create pipes for communicating with the child process */
-	if (pipe(child_out) || pipe(child_in)) {
-		purple_debug_error("dns",
-				   "Could not create pipes: %s\n", g_strerror(errno));
-		return NULL;
-	}
-
-	resolver = g_new(PurpleDnsQueryResolverProcess, 1);
-	resolver->inpa = 0;
-
-	cope_with_gdb_brokenness();
-
-	/* "Go fork and multiply." --Tommy Caldwell (Emily's dad, not the climber) */
-	resolver->dns_pid = fork();
-
-	/* If we are the child process... */
-	if (resolver->dns_pid == 0) {
-		/* We should not access the parent's side of the pipes, so close them */
-		close(child_out[0]);
-		close(child_in[1]);
-
-		purple_dnsquery_resolver_run(child_out[1], child_in[0], show_debug);
-		/* The thread calls _exit() rather than returning, so we never get here */
-	}
-
-	/* We should not access the child's side of the pipes, so close them */
-	close(child_out[1]);
-	close(child_in[0]);
-	if (resolver->dns_pid == -1) {
-		purple_debug_error("dns",
-				   "Could not create child process for DNS: %s\n",
-				   g_strerror(errno));
-		purple_dnsquery_resolver_destroy(resolver);
-		return NULL;
-	}
-
-	resolver->fd_out = child_out[0];
-	resolver->fd_in = child_in[1];
-	number_of_dns_children++;
-	purple_debug_info("dns",
-			   "Created new DNS child %d, there are now %d children.\n",
-			   resolver->dns_pid, number_of_dns_children);
-
-	return resolver;
-}
-
-/**
- * @return TRUE if the request was sent succesfully.  FALSE
- *         if the request could not be sent.  This isn't
- *         necessarily an error.  If the child has expired,
- *         for example, we won't be able to send the message.
- */
-static gboolean
-send_dns_request_to_child(PurpleDnsQueryData *query_data,
-		PurpleDnsQueryResolverProcess *resolver)
-{
-	pid_t pid;
-	dns_params_t dns_params;
-	ssize_t rc;
-
-	/* This waitpid might return the child's PID if it has recently
-	 * exited, or it might return an error if it exited "long
-	 * enough" ago that it has already been reaped; in either
-	 * instance, we can't use it. */
-	pid = waitpid(resolver->dns_pid, NULL, WNOHANG);
-	if (pid > 0) {
-		purple_debug_warning("dns", "DNS child %d no longer exists\n",
-				resolver->dns_pid);
-		purple_dnsquery_resolver_destroy(resolver);
-		return FALSE;
-	} else if (pid < 0) {
-		purple_debug_warning("dns", "Wait for DNS child %d failed: %s\n",
-				resolver->dns_pid, g_strerror(errno));
-		purple_dnsquery_resolver_destroy(resolver);
-		return FALSE;
-	}
-
-	/* Copy the hostname and port into a single data structure */
-	strncpy(dns_params.hostname, query_data->hostname, sizeof(dns_params.hostname) - 1);
-	dns_params.hostname[sizeof(dns_params.hostname) - 1] = '\0';
-	dns_params.port = query_data->port;
-
-	/* Send the data structure to the child */
-	rc = write(resolver->fd_in, &dns_params, sizeof(dns_params));
-	if (rc < 0) {
-		purple_debug_error("dns", "Unable to write to DNS child %d: %s\n",
-				resolver->dns_pid, g_strerror(errno));
-		purple_dnsquery_resolver_destroy(resolver);
-		return FALSE;
-	}
-	if ((gsize)rc < sizeof(dns_params)) {
-		purple_debug_error("dns", "Tried to write %" G_GSSIZE_FORMAT
-				" bytes to child but only wrote %" G_GSSIZE_FORMAT "\n",
-				sizeof(dns_params), rc);
-		purple_dnsquery_resolver_destroy(resolver);
-		return FALSE;
-	}
-
-	purple_debug_info("dns",
-			"Successfully sent DNS request to child %d\n",
-			resolver->dns_pid);
-
-	query_data->resolver = resolver;
-
-	return TRUE;
-}
-
-static void host_resolved(gpointer data, gint source, PurpleInputCondition cond);
-
-static void
-handle_next_queued_request(void)
-{
-	PurpleDnsQueryData *query_data;
-	PurpleDnsQueryResolverProcess *resolver;
-
-	if (queued_requests == NULL)
-		/* No more DNS queries, yay! */
-		return;
-
-	query_data = queued_requests->data;
-	queued_requests = g_slist_delete_link(queued_requests, queued_requests);
-
-	/*
-	 * If we have any children, attempt to have them perform the DNS
-	 * query.  If we're able to send the query then resolver will be
-	 * set to the PurpleDnsQueryResolverProcess.  Otherwise, resolver
-	 * will be NULL and we'll need to create a new DNS request child.
-	 */
-	while (free_dns_children != NULL)
-	{
-		resolver = free_dns_children->data;
-		free_dns_children = g_slist_remove(free_dns_children, resolver);
-
-		if (send_dns_request_to_child(query_data, resolver))
-			/* We found an acceptable child, yay */
-			break;
-	}
-
-	/* We need to create a new DNS request child */
-	if (query_data->resolver == NULL)
-	{
-		if (number_of_dns_children >= MAX_DNS_CHILDREN)
-		{
-			/* Apparently all our children are busy */
-			queued_requests = g_slist_prepend(queued_requests, query_data);
-			return;
-		}
-
-		resolver = purple_dnsquery_resolver_new(purple_debug_is_enabled());
-		if (resolver == NULL)
-		{
-			purple_dnsquery_failed(query_data, _("Unable to create new resolver process\n"));
-			return;
-		}
-		if (!send_dns_request_to_child(query_data, resolver))
-		{
-			purple_dnsquery_failed(query_data, _("Unable to send request to resolver process\n"));
-			return;
-		}
-	}
-
-	query_data->resolver->inpa = purple_input_add(query_data->resolver->fd_out,
-			PURPLE_INPUT_READ, host_resolved, query_data);
-}
-
-/*
- * End the functions for dealing with the DNS child processes.
- */
-
-static void
-host_resolved(gpointer data, gint source, PurpleInputCondition cond)
-{
-	PurpleDnsQueryData *query_data;
-	int rc, err;
-	GSList *hosts = NULL;
-	struct sockaddr *addr = NULL;
-	size_t addrlen;
-	char message[1024];
-
-	query_data = data;
-
-	purple_debug_info("dns", "Got response for '%s'\n", query_data->hostname);
-	purple_input_remove(query_data->resolver->inpa);
-	query_data->resolver->inpa = 0;
-
-	rc = read(query_data->resolver->fd_out, &err, sizeof(err));
-	if ((rc == 4) && (err != 0))
-	{
+	PurpleDnsQueryRequest *request = data;
 #ifdef HAVE_GETADDRINFO
-		g_snprintf(message, sizeof(message), _("Error resolving %s:\n%s"),
-				query_data->hostname, purple_gai_strerror(err));
-#else
-		g_snprintf(message, sizeof(message), _("Error resolving %s: %d"),
-				query_data->hostname, err);
-#endif
-		/* Re-read resolv.conf and friends in case DNS servers have changed */
-		res_init();
-
-		purple_dnsquery_failed(query_data, message);
-	} else if (rc > 0) {
-		/* Success! */
-		while (rc > 0) {
-			rc = read(query_data->resolver->fd_out, &addrlen, sizeof(addrlen));
-			if (rc > 0 && addrlen > 0 && addrlen < MAX_ADDR_RESPONSE_LEN) {
-				addr = g_malloc(addrlen);
-				rc = read(query_data->resolver->fd_out, addr, addrlen);
-				hosts = g_slist_append(hosts, GINT_TO_POINTER(addrlen));
-				hosts = g_slist_append(hosts, addr);
-			} else {
-				break;
-			}
-		}
-		/*	wait4(resolver->dns_pid, NULL, WNOHANG, NULL); */
-		purple_dnsquery_resolved(query_data, hosts);
-
-	} else if (rc == -1) {
-		g_snprintf(message, sizeof(message), _("Error reading from resolver process:\n%s"), g_strerror(errno));
-		purple_dnsquery_failed(query_data, message);
-
-	} else if (rc == 0) {
-		g_snprintf(message, sizeof(message), _("Resolver process exited without answering our request"));
-		purple_dnsquery_failed(query_data, message);
-	}
-
-	handle_next_queued_request();
-}
-
-static void
-resolve_host(PurpleDnsQueryData *query_data)
-{
-	queued_requests = g_slist_append(queued_requests, query_data);
-
-	handle_next_queued_request();
-}
-
-#elif defined _WIN32 /* end PURPLE_DNSQUERY_USE_FORK  */
-
-/*
- * Windows!
- */
-
-static gboolean
-dns_main_thread_cb(gpointer data)
-{
-	PurpleDnsQueryData *query_data = data;
-
-	/* We're done, so purple_dnsquery_destroy() shouldn't think it is canceling an in-progress lookup */
-	query_data->resolver = NULL;
-
-	if (query_data->error_message != NULL)
-		purple_dnsquery_failed(query_data, query_data->error_message);
-	else
-	{
-		GSList *hosts;
-
-		/* We don't want purple_dns_query_resolved() to free(hosts) */
-		hosts = query_data->hosts;
-		query_data->hosts = NULL;
-		purple_dnsquery_resolved(query_data, hosts);
-	}
-
-	return FALSE;
-}
-
-static gpointer
-dns_thread(gpointer data)
-{
-	PurpleDnsQueryData *query_data;
-#ifdef HAVE_GETADDRINFO
-	int rc;
 	struct addrinfo hints, *res, *tmp;
 	char servname[20];
 #else
@@ -742,25 +293,21 @@ dns_thread(gpointer data)
 #endif
 	char *hostname;
 
-	query_data = data;
-
 #ifdef USE_IDN
-	if (!dns_str_is_ascii(query_data->hostname)) {
-		rc = purple_network_convert_idn_to_ascii(query_data->hostname, &hostname);
+	if (!dns_str_is_ascii(request->hostname)) {
+		int rc = purple_network_convert_idn_to_ascii(request->hostname, &hostname);
 		if (rc != 0) {
-			query_data->error_message = g_strdup_printf(_("Error converting %s "
-					"to punycode: %d"), query_data->hostname, rc);
-			/* back to main thread */
-			purple_timeout_add(0, dns_main_thread_cb, query_data);
-			return 0;
+			request->error_message = g_strdup_printf(_("Error converting %s "
+					"to punycode: %d"), request->hostname, rc);
+			return;
 		}
 	} else /* intentional fallthru */
 #endif
-	hostname = g_strdup(query_data->hostname);
+	hostname = g_strdup(request->hostname);
 
 #ifdef HAVE_GETADDRINFO
-	g_snprintf(servname, sizeof(servname), "%d", query_data->port);
-	memset(&hints,0,sizeof(hints));
+	g_snprintf(servname, sizeof(servname), "%d", request->port);
+	memset(&hints, 0, sizeof(hints));
 
 	/*
 	 * This is only used to convert a service
@@ -773,114 +320,107 @@ dns_thread(gpointer data)
 #ifdef AI_ADDRCONFIG
 	hints.ai_flags |= AI_ADDRCONFIG;
 #endif /* AI_ADDRCONFIG */
-	if ((rc = getaddrinfo(hostname, servname, &hints, &res)) == 0) {
+	request->error = getaddrinfo(hostname, servname, &hints, &res);
+	if (request->error == 0) {
+		/* Prepending the address after its length and reversing the
+		 * list at the end keeps both in order */
 		tmp = res;
-		while(res) {
-			query_data->hosts = g_slist_append(query_data->hosts,
+		while (res) {
+			request->hosts = g_slist_prepend(request->hosts,
 				GSIZE_TO_POINTER(res->ai_addrlen));
-			query_data->hosts = g_slist_append(query_data->hosts,
+			request->hosts = g_slist_prepend(request->hosts,
 				g_memdup(res->ai_addr, res->ai_addrlen));
 			res = res->ai_next;
 		}
 		freeaddrinfo(tmp);
-	} else {
-		query_data->error_message = g_strdup_printf(_("Error resolving %s:\n%s"), query_data->hostname, purple_gai_strerror(rc));
+		request->hosts = g_slist_reverse(request->hosts);
 	}
 #else
 	if ((hp = gethostbyname(hostname))) {
 		memset(&sin, 0, sizeof(struct sockaddr_in));
 		memcpy(&sin.sin_addr.s_addr, hp->h_addr, hp->h_length);
 		sin.sin_family = hp->h_addrtype;
-		sin.sin_port = htons(query_data->port);
+		sin.sin_port = htons(request->port);
 
-		query_data->hosts = g_slist_append(query_data->hosts,
+		request->hosts = g_slist_append(request->hosts,
 				GSIZE_TO_POINTER(sizeof(sin)));
-		query_data->hosts = g_slist_append(query_data->hosts,
+		request->hosts = g_slist_append(request->hosts,
 				g_memdup(&sin, sizeof(sin)));
 	} else {
-		query_data->error_message = g_strdup_printf(_("Error resolving %s: %d"), query_data->hostname, h_errno);
+		request->error = h_errno;
 	}
 #endif
 	g_free(hostname);
 
-	/* back to main thread */
-	purple_timeout_add(0, dns_main_thread_cb, query_data);
-
-	return 0;
+#ifndef _WIN32
+	/* Re-read resolv.conf and friends in case DNS servers have changed */
+	if (request->error != 0) {
+		_purple_dns_pool_lock_resolver();
+		res_init();
+		_purple_dns_pool_unlock_resolver();
+	}
+#endif
 }
 
 static void
-resolve_host(PurpleDnsQueryData *query_data)
+host_resolved(gpointer data)
 {
-	GError *err = NULL;
+	PurpleDnsQueryRequest *request = data;
+	PurpleDnsQueryData *query_data = request->query_data;
+	GSList *hosts;
+	char message[1024];
 
-	/*
-	 * Spin off a separate thread to perform the DNS lookup so
-	 * that we don't block the UI.
-	 */
-	query_data->resolver = g_thread_create(dns_thread,
-			query_data, FALSE, &err);
-	if (query_data->resolver == NULL)
+	query_data->job = NULL;
+
+	purple_debug_info("dns", "Got response for '%s'\n", query_data->hostname);
+
+	if (request->error_message != NULL)
 	{
-		char message[1024];
-		g_snprintf(message, sizeof(message), _("Thread creation failure: %s"),
-				(err && err->message) ? err->message : _("Unknown reason"));
-		g_error_free(err);
-		purple_dnsquery_failed(query_data, message);
+		purple_dnsquery_failed(query_data, request->error_message);
+	}
+	else if (request->error != 0)
+	{
+#ifdef HAVE_GETADDRINFO
+		g_snprintf(message, sizeof(message), _("Error resolving %s:\n%s"),
+				query_data->hostname, purple_gai_strerror(request->error));
+		if (request->error != EAI_AGAIN)
+#else
+		g_snprintf(message, sizeof(message), _("Error resolving %s: %d"),
+				query_data->hostname, request->error);
+		if (request->error != TRY_AGAIN)
+#endif
+			purple_dnsquery_unresolvable(query_data, message);
+		else
+			purple_dnsquery_failed(query_data, message);
+	}
+	else
+	{
+		/* We don't want request_free() to free(hosts) */
+		hosts = request->hosts;
+		request->hosts = NULL;
+		purple_dnsquery_resolved(query_data, hosts);
 	}
 }
 
-#else /* not PURPLE_DNSQUERY_USE_FORK or _WIN32 */
-
-/*
- * We weren't able to do anything fancier above, so use the
- * fail-safe name resolution code, which is blocking.
- */
-
 static void
 resolve_host(PurpleDnsQueryData *query_data)
 {
-	struct sockaddr_in sin;
-	GSList *hosts = NULL;
-	struct hostent *hp;
-	gchar *hostname;
-#ifdef USE_IDN
-	if (!dns_str_is_ascii(query_data->hostname)) {
-		int ret = purple_network_convert_idn_to_ascii(query_data->hostname,
-				&hostname);
-		if (ret != 0) {
-			char message[1024];
-			g_snprintf(message, sizeof(message), _("Error resolving %s: %d"),
-					query_data->hostname, ret);
-			purple_dnsquery_failed(query_data, message);
-			return;
-		}
-	} else /* fallthrough is intentional to the g_strdup */
-#endif
-	hostname = g_strdup(query_data->hostname);
+	PurpleDnsQueryRequest *request;
 
-	if(!(hp = gethostbyname(hostname))) {
-		char message[1024];
-		g_snprintf(message, sizeof(message), _("Error resolving %s: %d"),
-				query_data->hostname, h_errno);
-		purple_dnsquery_failed(query_data, message);
-		g_free(hostname);
-		return;
-	}
-	memset(&sin, 0, sizeof(struct sockaddr_in));
-	memcpy(&sin.sin_addr.s_addr, hp->h_addr, hp->h_length);
-	sin.sin_family = hp->h_addrtype;
-	g_free(hostname);
-	sin.sin_port = htons(query_data->port);
+	request = g_new0(PurpleDnsQueryRequest, 1);
+	request->query_data = query_data;
+	request->hostname = g_strdup(query_data->hostname);
+	request->port = query_data->port;
 
-	hosts = g_slist_append(hosts, GINT_TO_POINTER(sizeof(sin)));
-	hosts = g_slist_append(hosts, g_memdup(&sin, sizeof(sin)));
-
-	purple_dnsquery_resolved(query_data, hosts);
+	query_data->job = _purple_dns_pool_push(resolve_host_thread,
+			host_resolved, (GDestroyNotify)request_free, request);
+	if (query_data->job == NULL)
+	{
+		request_free(request);
+		purple_dnsquery_failed(query_data, _("Unable to create new resolver process\n"));
+	}
 }
 
-#endif /* not PURPLE_DNSQUERY_USE_FORK or _WIN32 */
-
 static gboolean
 initiate_resolving(gpointer data)
 {
@@ -902,6 +442,10 @@ initiate_resolving(gpointer data)
 		return FALSE;
 	}
 
+	if (purple_dnsquery_use_cache(query_data))
+		/* Answered from the cache, or waiting on another lookup */
+		return FALSE;
+
 	if (purple_dnsquery_ui_resolve(query_data))
 		/* The UI is handling the resolve; we're done */
 		return FALSE;
@@ -957,42 +501,19 @@ purple_dnsquery_destroy(PurpleDnsQueryData *query_data)
 	if (ops && ops->destroy)
 		ops->destroy(query_data);
 
-#if defined(PURPLE_DNSQUERY_USE_FORK)
-	queued_requests = g_slist_remove(queued_requests, query_data);
-
-	if (query_data->resolver != NULL)
-		/*
-		 * This is only non-NULL when we're cancelling an in-progress
-		 * query.  Ideally we would tell our resolver child to stop
-		 * resolving shit and then we would add it back to the
-		 * free_dns_children linked list.  However, it's hard to tell
-		 * children stuff, they just don't listen.  So we'll just
-		 * kill the process and allow a new child to be started if we
-		 * have more stuff to resolve.
-		 */
-		purple_dnsquery_resolver_destroy(query_data->resolver);
-#elif defined _WIN32 /* end PURPLE_DNSQUERY_USE_FORK */
-	if (query_data->resolver != NULL)
+	if (query_data->cache_key != NULL)
 	{
-		/*
-		 * It's not really possible to kill a thread.  So instead we
-		 * just set the callback to NULL and let the DNS lookup
-		 * finish.
-		 */
-		query_data->callback = NULL;
-		return;
+		_purple_dns_cache_leave(query_data->cache_key, query_data);
+		g_free(query_data->cache_key);
+		query_data->cache_key = NULL;
 	}
 
-	while (query_data->hosts != NULL)
-	{
-		/* Discard the length... */
-		query_data->hosts = g_slist_remove(query_data->hosts, query_data->hosts->data);
-		/* Free the address... */
-		g_free(query_data->hosts->data);
-		query_data->hosts = g_slist_remove(query_data->hosts, query_data->hosts->data);
-	}
-	g_free(query_data->error_message);
-#endif /* end _WIN32 */
+	if (query_data->job != NULL)
+		/*
+		 * The resolver thread can't be stopped, but the pool throws
+		 * its answer away.
+		 */
+		_purple_dns_pool_cancel(query_data->job);
 
 	if (query_data->timeout > 0)
 		purple_timeout_remove(query_data->timeout);
@@ -1035,16 +556,12 @@ purple_dnsquery_get_ui_ops(void)
 void
 purple_dnsquery_init(void)
 {
+	_purple_dns_cache_init();
 }
 
 void
 purple_dnsquery_uninit(void)
 {
-#if defined(PURPLE_DNSQUERY_USE_FORK)
-	while (free_dns_children != NULL)
-	{
-		purple_dnsquery_resolver_destroy(free_dns_children->data);
-		free_dns_children = g_slist_remove(free_dns_children, free_dns_children->data);
-	}
-#endif /* end PURPLE_DNSQUERY_USE_FORK */
+	_purple_dns_pool_uninit();
+	_purple_dns_cache_uninit();
 }
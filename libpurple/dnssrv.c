@@ -49,8 +49,6 @@
 #define T_TXT	PurpleDnsTypeTxt
 #endif
 
-#define MAX_ADDR_RESPONSE_LEN 1048576
-
 #include "debug.h"
 #include "dnssrv.h"
 #include "eventloop.h"
@@ -72,23 +70,30 @@ struct _PurpleSrvTxtQueryData {
 	} cb;
 
 	gpointer extradata;
-	guint handle;
+	guint timeout;
 	int type;
 	char *query;
-#ifdef _WIN32
-	GThread *resolver;
-	char *error_message;
-	GList *results;
-#else
-	int fd_in, fd_out;
-	pid_t pid;
-#endif
+
+	/* Set while the query is known to the DNS cache, see purple_srv_txt_query_use_cache() */
+	char *cache_key;
+
+	/* Set while a resolver thread is running the query */
+	PurpleDnsPoolJob *job;
 };
 
-typedef struct _PurpleSrvInternalQuery {
+/*
+ * This is what a resolver thread works on.  The query can be destroyed
+ * while the thread is still resolving, so the thread gets its own copy
+ * of what it needs.
+ */
+typedef struct {
+	PurpleSrvTxtQueryData *query_data; /* only for the main thread */
 	int type;
-	char query[256];
-} PurpleSrvInternalQuery;
+	char *query;
+	GList *results;
+	guint ttl;
+	char *error_message;
+} PurpleSrvTxtRequest;
 
 typedef struct _PurpleSrvResponseContainer {
 	PurpleSrvResponse *response;
@@ -96,6 +101,7 @@ typedef struct _PurpleSrvResponseContainer {
 } PurpleSrvResponseContainer;
 
 static gboolean purple_srv_txt_query_ui_resolve(PurpleSrvTxtQueryData *query_data);
+static void purple_srv_query_failed(PurpleSrvTxtQueryData *query_data, const gchar *error_message);
 
 /**
  * Sort by priority, then by weight.  Strictly numerically--no
@@ -252,10 +258,6 @@ query_data_new(int type, gchar *query, gpointer extradata)
 	query_data->type = type;
 	query_data->extradata = extradata;
 	query_data->query = query;
-#ifndef _WIN32
-	query_data->fd_in = -1;
-	query_data->fd_out = -1;
-#endif
 	return query_data;
 }
 
@@ -267,26 +269,21 @@ purple_srv_txt_query_destroy(PurpleSrvTxtQueryData *query_data)
 	if (ops && ops->destroy)
 		ops->destroy(query_data);
 
-	if (query_data->handle > 0)
-		purple_input_remove(query_data->handle);
-#ifdef _WIN32
-	if (query_data->resolver != NULL)
-	{
+	if (query_data->cache_key != NULL) {
+		_purple_dns_cache_leave(query_data->cache_key, query_data);
+		g_free(query_data->cache_key);
+		query_data->cache_key = NULL;
+	}
+
+	if (query_data->job != NULL)
 		/*
 		 * It's not really possible to kill a thread.  So instead we
-		 * just set the callback to NULL and let the DNS lookup
-		 * finish.
+		 * let the DNS lookup finish, and the pool throws the answer
+		 * away.
 		 */
-		query_data->cb.srv = NULL;
-		return;
-	}
-	g_free(query_data->error_message);
-#else
-	if (query_data->fd_out != -1)
-		close(query_data->fd_out);
-	if (query_data->fd_in != -1)
-		close(query_data->fd_in);
-#endif
+		_purple_dns_pool_cancel(query_data->job);
+	if (query_data->timeout > 0)
+		purple_timeout_remove(query_data->timeout);
 	g_free(query_data->query);
 	g_free(query_data);
 }
@@ -305,63 +302,144 @@ dns_str_is_ascii(const char *name)
 }
 #endif
 
-#ifndef _WIN32
 static void
-write_to_parent(int in, int out, gconstpointer data, gsize size)
+srv_responses_free(GList *responses)
 {
-	const guchar *buf = data;
-	gssize w;
-
-	do {
-		w = write(out, buf, size);
-		if (w > 0) {
-			buf += w;
-			size -= w;
-		} else if (w < 0 && errno == EINTR) {
-			/* Let's try some more; */
-			w = 1;
-		}
-	} while (size > 0 && w > 0);
+	while (responses != NULL) {
+		g_free(responses->data);
+		responses = g_list_delete_link(responses, responses);
+	}
+}
+
+static void
+txt_responses_free(GList *responses)
+{
+	g_list_foreach(responses, (GFunc)purple_txt_response_destroy, NULL);
+	g_list_free(responses);
+}
+
+static GList *
+copy_responses(int type, const GList *responses)
+{
+	GList *copy = NULL;
 
-	if (size != 0) {
-		/* An error occurred */
-		close(out);
-		close(in);
-		_exit(0);
+	for (; responses != NULL; responses = responses->next) {
+		if (type == T_SRV) {
+			copy = g_list_prepend(copy,
+					g_memdup(responses->data, sizeof(PurpleSrvResponse)));
+		} else {
+			PurpleTxtResponse *response = g_new0(PurpleTxtResponse, 1);
+			response->content = g_strdup(((PurpleTxtResponse *)responses->data)->content);
+			copy = g_list_prepend(copy, response);
+		}
 	}
+
+	return g_list_reverse(copy);
 }
 
-/* Read size bytes to data. Dies if an error occurs. */
+/**
+ * Caches the answer to a query, if the query is the one the cache is
+ * waiting on.
+ *
+ * @param responses The PurpleSrvResponses or PurpleTxtResponses, which are
+ *        copied, or NULL if the lookup failed.
+ * @param ttl How many seconds the answer is good for.
+ */
 static void
-read_from_parent(int in, int out, gpointer data, gsize size)
+purple_srv_txt_query_cache(PurpleSrvTxtQueryData *query_data, GList *responses, guint ttl)
 {
-	guchar *buf = data;
-	gssize r;
-
-	do {
-		r = read(in, data, size);
-		if (r > 0) {
-			buf += r;
-			size -= r;
-		} else if (r < 0 && errno == EINTR) {
-			/* Let's try some more; */
-			r = 1;
+	if (query_data->cache_key == NULL)
+		return;
+
+	_purple_dns_cache_store(query_data->cache_key,
+			copy_responses(query_data->type, responses),
+			(GDestroyNotify)(query_data->type == T_SRV ? srv_responses_free : txt_responses_free),
+			responses == NULL, ttl);
+}
+
+static gboolean initiate_query(gpointer data);
+
+static void
+purple_srv_txt_query_resume(gpointer data)
+{
+	PurpleSrvTxtQueryData *query_data = data;
+
+	g_free(query_data->cache_key);
+	query_data->cache_key = NULL;
+
+	query_data->timeout = purple_timeout_add(0, initiate_query, query_data);
+}
+
+/**
+ * Answers the query from the cache, or has it wait for an identical query
+ * that is already being resolved.  Returns FALSE if the query still needs
+ * to be resolved.
+ */
+static gboolean
+purple_srv_txt_query_use_cache(PurpleSrvTxtQueryData *query_data)
+{
+	gchar *key, *tmp;
+	gconstpointer answer;
+	gboolean negative;
+	GList *responses;
+
+	tmp = g_strdup_printf("%s %s", query_data->type == T_SRV ? "SRV" : "TXT",
+			query_data->query);
+	key = g_ascii_strdown(tmp, -1);
+	g_free(tmp);
+
+	if (!_purple_dns_cache_lookup(key, &answer, &negative)) {
+		query_data->cache_key = key;
+		return !_purple_dns_cache_join(key, query_data, purple_srv_txt_query_resume);
+	}
+
+	g_free(key);
+	responses = negative ? NULL : copy_responses(query_data->type, answer);
+
+	if (query_data->type == T_SRV) {
+		PurpleSrvResponse *records = NULL;
+		int i, size;
+
+		/* Sort the copy so the weights are honored on every lookup */
+		responses = purple_srv_sort(responses);
+		size = g_list_length(responses);
+		if (size > 0)
+			records = g_new(PurpleSrvResponse, size);
+		for (i = 0; responses != NULL; i++) {
+			records[i] = *(PurpleSrvResponse *)responses->data;
+			g_free(responses->data);
+			responses = g_list_delete_link(responses, responses);
 		}
-	} while (size > 0 && r > 0);
 
-	if (size != 0) {
-		/* An error occurred */
-		close(out);
-		close(in);
-		_exit(0);
+		query_data->cb.srv(records, size, query_data->extradata);
+	} else {
+		query_data->cb.txt(responses, query_data->extradata);
 	}
+
+	purple_srv_txt_query_destroy(query_data);
+
+	return TRUE;
+}
+
+static void
+request_free(PurpleSrvTxtRequest *request)
+{
+	if (request->type == T_SRV)
+		srv_responses_free(request->results);
+	else
+		txt_responses_free(request->results);
+	g_free(request->error_message);
+	g_free(request->query);
+	g_free(request);
 }
 
+#ifndef _WIN32
 
-G_GNUC_NORETURN static void
-resolve(int in, int out)
+/* This runs in a resolver thread */
+static void
+resolve_thread(gpointer data)
 {
-	GList *ret = NULL;
+	PurpleSrvTxtRequest *request = data;
 	PurpleSrvResponse *srvres;
 	PurpleTxtResponse *txtres;
 	queryans answer;
@@ -369,22 +447,23 @@ resolve(int in, int out)
 	guchar *end, *cp;
 	gchar name[256];
 	guint16 type, dlen, pref, weight, port;
-	PurpleSrvInternalQuery query;
-
-#ifdef HAVE_SIGNAL_H
-	purple_restore_default_signal_handlers();
-#endif
+	guint32 rttl;
 
-	read_from_parent(in, out, &query, sizeof(query));
+	request->ttl = G_MAXUINT;
 
-	size = res_query( query.query, C_IN, query.type, (u_char*)&answer, sizeof( answer));
+	_purple_dns_pool_lock_resolver();
+	size = res_query(request->query, C_IN, request->type, (u_char*)&answer, sizeof(answer));
 	if (size == -1) {
-		write_to_parent(in, out, &(query.type), sizeof(query.type));
-		write_to_parent(in, out, &size, sizeof(size));
-		close(out);
-		close(in);
-		_exit(0);
-	}
+		/* Don't cache the failure if it's likely to go away soon */
+		request->ttl = (h_errno == TRY_AGAIN) ? 0 : PURPLE_DNS_CACHE_NEGATIVE_TTL;
+		request->error_message = g_strdup_printf("res_query returned an error "
+				"for %s: %d", request->query, h_errno);
+		/* Re-read resolv.conf and friends in case DNS servers have changed */
+		res_init();
+	}
+	_purple_dns_pool_unlock_resolver();
+	if (size == -1)
+		return;
 
 	qdcount = ntohs(answer.hdr.qdcount);
 	ancount = ntohs(answer.hdr.ancount);
@@ -405,8 +484,12 @@ resolve(int in, int out)
 		cp += size;
 		GETSHORT(type,cp);
 
-		/* skip ttl and class since we already know it */
-		cp += 6;
+		/* skip class since we already know it */
+		cp += 2;
+
+		/* the answer is good for as long as its shortest-lived record */
+		GETLONG(rttl,cp);
+		request->ttl = MIN(request->ttl, rttl);
 
 		GETSHORT(dlen,cp);
 		if (type == T_SRV) {
@@ -422,21 +505,18 @@ resolve(int in, int out)
 
 			cp += size;
 
+			/* Names that don't fit the buffer are cut short */
 			srvres = g_new0(PurpleSrvResponse, 1);
-			if (strlen(name) > sizeof(srvres->hostname) - 1) {
-				purple_debug_error("dnssrv", "hostname is longer than available buffer ('%s', %zd bytes)!",
-				                   name, strlen(name));
-			}
 			g_strlcpy(srvres->hostname, name, sizeof(srvres->hostname));
 			srvres->pref = pref;
 			srvres->port = port;
 			srvres->weight = weight;
 
-			ret = g_list_prepend(ret, srvres);
+			request->results = g_list_prepend(request->results, srvres);
 		} else if (type == T_TXT) {
 			txtres = g_new0(PurpleTxtResponse, 1);
 			txtres->content = g_strndup((gchar*)(++cp), dlen-1);
-			ret = g_list_append(ret, txtres);
+			request->results = g_list_prepend(request->results, txtres);
 			cp += dlen - 1;
 		} else {
 			cp += dlen;
@@ -444,222 +524,37 @@ resolve(int in, int out)
 	}
 
 end:
-	size = g_list_length(ret);
-
-	if (query.type == T_SRV)
-		ret = purple_srv_sort(ret);
-
-	write_to_parent(in, out, &(query.type), sizeof(query.type));
-	write_to_parent(in, out, &size, sizeof(size));
-	while (ret != NULL)
-	{
-		if (query.type == T_SRV)
-			write_to_parent(in, out, ret->data, sizeof(PurpleSrvResponse));
-		if (query.type == T_TXT) {
-			PurpleTxtResponse *response = ret->data;
-			gsize l = strlen(response->content) + 1 /* null byte */;
-			write_to_parent(in, out, &l, sizeof(l));
-			write_to_parent(in, out, response->content, l);
-		}
-
-		g_free(ret->data);
-		ret = g_list_remove(ret, ret->data);
-	}
-
-	close(out);
-	close(in);
-
-	_exit(0);
-}
-
-static void
-resolved(gpointer data, gint source, PurpleInputCondition cond)
-{
-	int size;
-	int type;
-	PurpleSrvTxtQueryData *query_data = (PurpleSrvTxtQueryData*)data;
-	int i;
-	int status;
-
-	if (read(source, &type, sizeof(type)) == sizeof(type)) {
-		if (read(source, &size, sizeof(size)) == sizeof(size)) {
-			if (size < -1 || size > MAX_ADDR_RESPONSE_LEN) {
-				purple_debug_warning("dnssrv", "res_query returned invalid number\n");
-				size = 0;
-			}
-			if (size == -1 || size == 0) {
-				if (size == -1) {
-					purple_debug_warning("dnssrv", "res_query returned an error\n");
-					/* Re-read resolv.conf and friends in case DNS servers have changed */
-					res_init();
-				} else
-					purple_debug_info("dnssrv", "Found 0 entries, errno is %i\n", errno);
-
-				if (type == T_SRV) {
-					PurpleSrvCallback cb = query_data->cb.srv;
-					cb(NULL, 0, query_data->extradata);
-				} else if (type == T_TXT) {
-					PurpleTxtCallback cb = query_data->cb.txt;
-					cb(NULL, query_data->extradata);
-				} else {
-					purple_debug_error("dnssrv", "type unknown of DNS result entry; errno is %i\n", errno);
-				}
-
-			} else if (size) {
-				if (type == T_SRV) {
-					PurpleSrvResponse *res;
-					PurpleSrvResponse *tmp;
-					PurpleSrvCallback cb = query_data->cb.srv;
-					ssize_t red;
-					purple_debug_info("dnssrv","found %d SRV entries\n", size);
-					tmp = res = g_new0(PurpleSrvResponse, size);
-					for (i = 0; i < size; i++) {
-						red = read(source, tmp++, sizeof(PurpleSrvResponse));
-						if (red != sizeof(PurpleSrvResponse)) {
-							purple_debug_error("dnssrv","unable to read srv "
-									"response: %s\n", g_strerror(errno));
-							size = 0;
-							g_free(res);
-							res = NULL;
-						}
-					}
-
-					cb(res, size, query_data->extradata);
-				} else if (type == T_TXT) {
-					GList *responses = NULL;
-					PurpleTxtResponse *res;
-					PurpleTxtCallback cb = query_data->cb.txt;
-					ssize_t red;
-					purple_debug_info("dnssrv","found %d TXT entries\n", size);
-					for (i = 0; i < size; i++) {
-						gsize len;
-
-						red = read(source, &len, sizeof(len));
-						if (red != sizeof(len)) {
-							purple_debug_error("dnssrv","unable to read txt "
-									"response length: %s\n", g_strerror(errno));
-							size = 0;
-							g_list_foreach(responses, (GFunc)purple_txt_response_destroy, NULL);
-							g_list_free(responses);
-							responses = NULL;
-							break;
-						}
-						if (len > MAX_ADDR_RESPONSE_LEN) {
-							purple_debug_error("dnssrv", "we've read invalid number\n");
-							size = 0;
-							g_list_foreach(responses, (GFunc)purple_txt_response_destroy, NULL);
-							g_list_free(responses);
-							responses = NULL;
-							break;
-						}
-
-						res = g_new0(PurpleTxtResponse, 1);
-						res->content = g_new0(gchar, len);
-
-						red = read(source, res->content, len);
-						if (red < 0 || (gsize)red != len) {
-							purple_debug_error("dnssrv","unable to read txt "
-									"response: %s\n", g_strerror(errno));
-							size = 0;
-							purple_txt_response_destroy(res);
-							g_list_foreach(responses, (GFunc)purple_txt_response_destroy, NULL);
-							g_list_free(responses);
-							responses = NULL;
-							break;
-						}
-						responses = g_list_prepend(responses, res);
-					}
-
-					responses = g_list_reverse(responses);
-					cb(responses, query_data->extradata);
-				} else {
-					purple_debug_error("dnssrv", "type unknown of DNS result entry; errno is %i\n", errno);
-				}
-			}
-		}
-	}
-
-	waitpid(query_data->pid, &status, 0);
-	purple_srv_txt_query_destroy(query_data);
+	request->results = g_list_reverse(request->results);
+	if (request->results == NULL)
+		request->ttl = PURPLE_DNS_CACHE_NEGATIVE_TTL;
 }
 
 #else /* _WIN32 */
 
 /** The Jabber Server code was inspiration for parts of this. */
 
-static gboolean
-res_main_thread_cb(gpointer data)
-{
-	PurpleSrvResponse *srvres = NULL;
-	PurpleSrvTxtQueryData *query_data = data;
-	if(query_data->error_message != NULL) {
-		purple_debug_error("dnssrv", "%s", query_data->error_message);
-		if (query_data->type == DNS_TYPE_SRV) {
-			if (query_data->cb.srv)
-				query_data->cb.srv(srvres, 0, query_data->extradata);
-		} else if (query_data->type == DNS_TYPE_TXT) {
-			if (query_data->cb.txt)
-				query_data->cb.txt(NULL, query_data->extradata);
-		}
-	} else {
-		if (query_data->type == DNS_TYPE_SRV) {
-			PurpleSrvResponse *srvres_tmp = NULL;
-			GList *lst = query_data->results;
-			int size = g_list_length(lst);
-
-			if(query_data->cb.srv && size > 0)
-				srvres_tmp = srvres = g_new0(PurpleSrvResponse, size);
-			while (lst) {
-				PurpleSrvResponse *lstdata = lst->data;
-				lst = g_list_delete_link(lst, lst);
-
-				if(query_data->cb.srv)
-					memcpy(srvres_tmp++, lstdata, sizeof(PurpleSrvResponse));
-				g_free(lstdata);
-			}
-
-			query_data->results = NULL;
-
-			purple_debug_info("dnssrv", "found %d SRV entries\n", size);
-
-			if(query_data->cb.srv) query_data->cb.srv(srvres, size, query_data->extradata);
-		} else if (query_data->type == DNS_TYPE_TXT) {
-			GList *lst = query_data->results;
-
-			purple_debug_info("dnssrv", "found %d TXT entries\n", g_list_length(lst));
-
-			if (query_data->cb.txt) {
-				query_data->results = NULL;
-				query_data->cb.txt(lst, query_data->extradata);
-			}
-		} else {
-			purple_debug_error("dnssrv", "unknown query type");
-		}
-	}
-
-	query_data->resolver = NULL;
-	query_data->handle = 0;
-
-	purple_srv_txt_query_destroy(query_data);
-
-	return FALSE;
-}
-
-static gpointer
-res_thread(gpointer data)
+/* This runs in a resolver thread */
+static void
+resolve_thread(gpointer data)
 {
+	PurpleSrvTxtRequest *request = data;
 	PDNS_RECORD dr = NULL;
 	int type;
 	DNS_STATUS ds;
-	PurpleSrvTxtQueryData *query_data = data;
-	type = query_data->type;
-	ds = DnsQuery_UTF8(query_data->query, type, DNS_QUERY_STANDARD, NULL, &dr, NULL);
+	type = request->type;
+	ds = DnsQuery_UTF8(request->query, type, DNS_QUERY_STANDARD, NULL, &dr, NULL);
+	request->ttl = G_MAXUINT;
 	if (ds != ERROR_SUCCESS) {
 		gchar *msg = g_win32_error_message(ds);
+		/* Only cache the failure if the name or record doesn't exist */
+		if (ds == DNS_ERROR_RCODE_NAME_ERROR || ds == DNS_INFO_NO_RECORDS)
+			request->ttl = PURPLE_DNS_CACHE_NEGATIVE_TTL;
+		else
+			request->ttl = 0;
 		if (type == DNS_TYPE_SRV) {
-			query_data->error_message = g_strdup_printf("Couldn't look up SRV record. %s (%lu).\n", msg, ds);
+			request->error_message = g_strdup_printf("Couldn't look up SRV record. %s (%lu).\n", msg, ds);
 		} else if (type == DNS_TYPE_TXT) {
-			query_data->error_message = g_strdup_printf("Couldn't look up TXT record. %s (%lu).\n", msg, ds);
+			request->error_message = g_strdup_printf("Couldn't look up TXT record. %s (%lu).\n", msg, ds);
 		}
 		g_free(msg);
 	} else {
@@ -671,10 +566,11 @@ res_thread(gpointer data)
 
 			for (dr_tmp = dr; dr_tmp != NULL; dr_tmp = dr_tmp->pNext) {
 				/* Discard any incorrect entries. I'm not sure if this is necessary */
-				if (dr_tmp->wType != type || strcmp(dr_tmp->pName, query_data->query) != 0) {
+				if (dr_tmp->wType != type || strcmp(dr_tmp->pName, request->query) != 0) {
 					continue;
 				}
 
+				request->ttl = MIN(request->ttl, dr_tmp->dwTtl);
 				srv_data = &dr_tmp->Data.SRV;
 				srvres = g_new0(PurpleSrvResponse, 1);
 				strncpy(srvres->hostname, srv_data->pNameTarget, 255);
@@ -687,7 +583,7 @@ res_thread(gpointer data)
 			}
 
 			DnsRecordListFree(dr, DnsFreeRecordList);
-			query_data->results = purple_srv_sort(lst);
+			request->results = g_list_reverse(lst);
 		} else if (type == DNS_TYPE_TXT) {
 			PDNS_RECORD dr_tmp;
 			GList *lst = NULL;
@@ -699,10 +595,11 @@ res_thread(gpointer data)
 				int i;
 
 				/* Discard any incorrect entries. I'm not sure if this is necessary */
-				if (dr_tmp->wType != type || strcmp(dr_tmp->pName, query_data->query) != 0) {
+				if (dr_tmp->wType != type || strcmp(dr_tmp->pName, request->query) != 0) {
 					continue;
 				}
 
+				request->ttl = MIN(request->ttl, dr_tmp->dwTtl);
 				txt_data = &dr_tmp->Data.TXT;
 				txtres = g_new0(PurpleTxtResponse, 1);
 
@@ -711,26 +608,117 @@ res_thread(gpointer data)
 					s = g_string_append(s, txt_data->pStringArray[i]);
 				txtres->content = g_string_free(s, FALSE);
 
-				lst = g_list_append(lst, txtres);
+				lst = g_list_prepend(lst, txtres);
 			}
 
 			DnsRecordListFree(dr, DnsFreeRecordList);
-			query_data->results = lst;
+			request->results = g_list_reverse(lst);
 		} else {
 
 		}
 	}
 
-	/* back to main thread */
-	/* Note: this should *not* be attached to query_data->handle - it will cause leakage */
-	purple_timeout_add(0, res_main_thread_cb, query_data);
-
-	g_thread_exit(NULL);
-	return NULL;
+	if (ds == ERROR_SUCCESS && request->results == NULL)
+		request->ttl = PURPLE_DNS_CACHE_NEGATIVE_TTL;
 }
 
 #endif
 
+static void
+query_resolved(gpointer data)
+{
+	PurpleSrvTxtRequest *request = data;
+	PurpleSrvTxtQueryData *query_data = request->query_data;
+
+	query_data->job = NULL;
+
+	if (request->error_message != NULL) {
+		purple_srv_txt_query_cache(query_data, NULL, request->ttl);
+		purple_srv_query_failed(query_data, request->error_message);
+		return;
+	}
+
+	purple_srv_txt_query_cache(query_data, request->results, request->ttl);
+
+	if (query_data->type == T_SRV) {
+		PurpleSrvResponse *srvres = NULL;
+		GList *lst;
+		int i, size;
+
+		/* purple_srv_sort() picks at random, so sort the answer here rather
+		 * than in the cache */
+		lst = request->results = purple_srv_sort(request->results);
+		size = g_list_length(lst);
+
+		purple_debug_info("dnssrv", "found %d SRV entries\n", size);
+
+		if (size > 0)
+			srvres = g_new(PurpleSrvResponse, size);
+		for (i = 0; lst != NULL; lst = lst->next, i++)
+			srvres[i] = *(PurpleSrvResponse *)lst->data;
+
+		query_data->cb.srv(srvres, size, query_data->extradata);
+	} else {
+		GList *lst = request->results;
+
+		purple_debug_info("dnssrv", "found %d TXT entries\n", g_list_length(lst));
+
+		/* the callback frees the responses */
+		request->results = NULL;
+		query_data->cb.txt(lst, query_data->extradata);
+	}
+
+	purple_srv_txt_query_destroy(query_data);
+}
+
+/**
+ * Starts resolving a query in a resolver thread.
+ */
+static void
+resolve_query(PurpleSrvTxtQueryData *query_data)
+{
+	PurpleSrvTxtRequest *request;
+
+	request = g_new0(PurpleSrvTxtRequest, 1);
+	request->query_data = query_data;
+	request->type = query_data->type;
+	request->query = g_strdup(query_data->query);
+
+	query_data->job = _purple_dns_pool_push(resolve_thread, query_resolved,
+			(GDestroyNotify)request_free, request);
+	if (query_data->job == NULL) {
+		request_free(request);
+		purple_srv_query_failed(query_data, query_data->type == T_SRV ?
+				"Could not create SRV resolver thread" :
+				"Could not create TXT resolver thread");
+	}
+}
+
+/**
+ * The lookups are started from a timeout so that the callback is never
+ * called before purple_srv_resolve_account() or
+ * purple_txt_resolve_account() returns.
+ */
+static gboolean
+initiate_query(gpointer data)
+{
+	PurpleSrvTxtQueryData *query_data = data;
+
+	query_data->timeout = 0;
+
+	if (purple_srv_txt_query_use_cache(query_data))
+		/* Answered from the cache, or waiting on another lookup */
+		return FALSE;
+
+	if (purple_srv_txt_query_ui_resolve(query_data))
+		/* The UI is handling the resolve; we're done */
+		return FALSE;
+
+	resolve_query(query_data);
+
+	return FALSE;
+}
+
 PurpleSrvTxtQueryData *
 purple_srv_resolve(const char *protocol, const char *transport,
 	const char *domain, PurpleSrvCallback cb, gpointer extradata)
@@ -748,13 +736,6 @@ purple_srv_resolve_account(PurpleAccount *account, const char *protocol,
 	char *hostname;
 	PurpleSrvTxtQueryData *query_data;
 	PurpleProxyType proxy_type;
-#ifndef _WIN32
-	PurpleSrvInternalQuery internal_query;
-	int in[2], out[2];
-	int pid;
-#else
-	GError* err = NULL;
-#endif
 
 	if (!protocol || !*protocol || !transport || !*transport || !domain || !*domain) {
 		purple_debug_error("dnssrv", "Wrong arguments\n");
@@ -789,73 +770,9 @@ purple_srv_resolve_account(PurpleAccount *account, const char *protocol,
 
 	query_data = query_data_new(PurpleDnsTypeSrv, query, extradata);
 	query_data->cb.srv = cb;
-
-	if (purple_srv_txt_query_ui_resolve(query_data))
-	{
-		return query_data;
-	}
-
-#ifndef _WIN32
-	if(pipe(in) || pipe(out)) {
-		purple_debug_error("dnssrv", "Could not create pipe\n");
-		g_free(query);
-		g_free(query_data);
-		cb(NULL, 0, extradata);
-		return NULL;
-	}
-
-	pid = fork();
-	if (pid == -1) {
-		purple_debug_error("dnssrv", "Could not create process!\n");
-		g_free(query);
-		g_free(query_data);
-		cb(NULL, 0, extradata);
-		return NULL;
-	}
-
-	/* Child */
-	if (pid == 0)
-	{
-		g_free(query);
-		g_free(query_data);
-
-		close(out[0]);
-		close(in[1]);
-		resolve(in[0], out[1]);
-		/* resolve() does not return */
-	}
-
-	close(out[1]);
-	close(in[0]);
-
-	internal_query.type = T_SRV;
-	strncpy(internal_query.query, query, 255);
-	internal_query.query[255] = '\0';
-
-	if (write(in[1], &internal_query, sizeof(internal_query)) < 0)
-		purple_debug_error("dnssrv", "Could not write to SRV resolver\n");
-
-	query_data->pid = pid;
-	query_data->fd_out = out[0];
-	query_data->fd_in = in[1];
-	query_data->handle = purple_input_add(out[0], PURPLE_INPUT_READ, resolved, query_data);
+	query_data->timeout = purple_timeout_add(0, initiate_query, query_data);
 
 	return query_data;
-#else
-	query_data->resolver = g_thread_create(res_thread, query_data, FALSE, &err);
-	if (query_data->resolver == NULL) {
-		query_data->error_message = g_strdup_printf("SRV thread create failure: %s\n", (err && err->message) ? err->message : "");
-		g_error_free(err);
-	}
-
-	/* The query isn't going to happen, so finish the SRV lookup now.
-	 * Asynchronously call the callback since stuff may not expect
-	 * the callback to be called before this returns */
-	if (query_data->error_message != NULL)
-		query_data->handle = purple_timeout_add(0, res_main_thread_cb, query_data);
-
-	return query_data;
-#endif
 }
 
 PurpleSrvTxtQueryData *purple_txt_resolve(const char *owner,
@@ -872,13 +789,6 @@ PurpleSrvTxtQueryData *purple_txt_resolve_account(PurpleAccount *account,
 	char *hostname;
 	PurpleSrvTxtQueryData *query_data;
 	PurpleProxyType proxy_type;
-#ifndef _WIN32
-	PurpleSrvInternalQuery internal_query;
-	int in[2], out[2];
-	int pid;
-#else
-	GError* err = NULL;
-#endif
 
 	proxy_type = purple_proxy_info_get_type(
 		purple_proxy_get_setup(account));
@@ -907,74 +817,9 @@ PurpleSrvTxtQueryData *purple_txt_resolve_account(PurpleAccount *account,
 
 	query_data = query_data_new(PurpleDnsTypeTxt, query, extradata);
 	query_data->cb.txt = cb;
-
-	if (purple_srv_txt_query_ui_resolve(query_data)) {
-		/* query intentionally not freed
-		 */
-		return query_data;
-	}
-
-#ifndef _WIN32
-	if(pipe(in) || pipe(out)) {
-		purple_debug_error("dnssrv", "Could not create pipe\n");
-		g_free(query);
-		g_free(query_data);
-		cb(NULL, extradata);
-		return NULL;
-	}
-
-	pid = fork();
-	if (pid == -1) {
-		purple_debug_error("dnssrv", "Could not create process!\n");
-		g_free(query);
-		g_free(query_data);
-		cb(NULL, extradata);
-		return NULL;
-	}
-
-	/* Child */
-	if (pid == 0)
-	{
-		g_free(query);
-		g_free(query_data);
-
-		close(out[0]);
-		close(in[1]);
-		resolve(in[0], out[1]);
-		/* resolve() does not return */
-	}
-
-	close(out[1]);
-	close(in[0]);
-
-	internal_query.type = T_TXT;
-	strncpy(internal_query.query, query, 255);
-	internal_query.query[255] = '\0';
-
-	if (write(in[1], &internal_query, sizeof(internal_query)) < 0)
-		purple_debug_error("dnssrv", "Could not write to TXT resolver\n");
-
-	query_data->pid = pid;
-	query_data->fd_out = out[0];
-	query_data->fd_in = in[1];
-	query_data->handle = purple_input_add(out[0], PURPLE_INPUT_READ, resolved, query_data);
+	query_data->timeout = purple_timeout_add(0, initiate_query, query_data);
 
 	return query_data;
-#else
-	query_data->resolver = g_thread_create(res_thread, query_data, FALSE, &err);
-	if (query_data->resolver == NULL) {
-		query_data->error_message = g_strdup_printf("TXT thread create failure: %s\n", (err && err->message) ? err->message : "");
-		g_error_free(err);
-	}
-
-	/* The query isn't going to happen, so finish the TXT lookup now.
-	 * Asynchronously call the callback since stuff may not expect
-	 * the callback to be called before this returns */
-	if (query_data->error_message != NULL)
-		query_data->handle = purple_timeout_add(0, res_main_thread_cb, query_data);
-
-	return query_data;
-#endif
 }
 
 void
@@ -1027,6 +872,8 @@ purple_srv_query_resolved(PurpleSrvTxtQueryData *query_data, GList *records)
 		return;
 	}
 
+	purple_srv_txt_query_cache(query_data, records, PURPLE_DNS_CACHE_DEFAULT_TTL);
+
 	records = purple_srv_sort(records);
 	length = g_list_length(records);
 
@@ -1058,6 +905,8 @@ purple_txt_query_resolved(PurpleSrvTxtQueryData *query_data, GList *entries)
 
 	purple_debug_info("dnssrv", "TXT entries resolved for %s, count: %d\n", query_data->query, g_list_length(entries));
 
+	purple_srv_txt_query_cache(query_data, entries, PURPLE_DNS_CACHE_DEFAULT_TTL);
+
 	/* the callback should g_free the entries.
 	 */
 	if (query_data->cb.txt != NULL)
@@ -1077,8 +926,13 @@ purple_srv_query_failed(PurpleSrvTxtQueryData *query_data, const gchar *error_me
 {
 	purple_debug_error("dnssrv", "%s\n", error_message);
 
-	if (query_data->cb.srv != NULL)
-		query_data->cb.srv(NULL, 0, query_data->extradata);
+	if (query_data->type == T_SRV) {
+		if (query_data->cb.srv != NULL)
+			query_data->cb.srv(NULL, 0, query_data->extradata);
+	} else {
+		if (query_data->cb.txt != NULL)
+			query_data->cb.txt(NULL, query_data->extradata);
+	}
 
 	purple_srv_txt_query_destroy(query_data);
 }
@@ -34,8 +34,18 @@
 #include "util.h"
 #include "debug.h"
 
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+#include <sys/sendfile.h>
+#define PURPLE_XFER_USE_SENDFILE
+#endif
+
 #define FT_INITIAL_BUFFER_SIZE 4096
 #define FT_MAX_BUFFER_SIZE     65535
+/* When we read or write the socket ourselves instead of a prpl, there is
+ * no packet size to stay under, so let the buffer grow much larger. */
+#define FT_MAX_FD_BUFFER_SIZE  1048576
+/* Don't tell the UI about progress more often than this (in ms) */
+#define FT_PROGRESS_INTERVAL   100
 
 static PurpleXferUiOps *xfer_ui_ops = NULL;
 static GList *xfers;
@@ -61,6 +71,16 @@ typedef struct _PurpleXferPrivData {
 	/* TODO: Should really use a PurpleCircBuffer for this. */
 	GByteArray *buffer;
 
+	/* Reused for every chunk we read, instead of allocating a new one */
+	guchar *chunk;
+	gsize chunk_size;
+
+	/* sendfile() didn't work for this file and socket */
+	gboolean no_sendfile;
+
+	/* When the UI was last told about the progress, in ms */
+	gint64 last_progress;
+
 	gpointer thumbnail_data;		/**< thumbnail image */
 	gsize thumbnail_size;
 	gchar *thumbnail_mimetype;
@@ -76,6 +96,8 @@ purple_xfer_priv_data_destroy(gpointer data)
 	if (priv->buffer)
 		g_byte_array_free(priv->buffer, TRUE);
 
+	g_free(priv->chunk);
+
 	g_free(priv->thumbnail_data);
 
 	g_free(priv->thumbnail_mimetype);
@@ -1041,17 +1063,42 @@ purple_xfer_set_cancel_recv_fnc(PurpleXfer *xfer, void (*fnc)(PurpleXfer *))
 static void
 purple_xfer_increase_buffer_size(PurpleXfer *xfer)
 {
+	gboolean prpl_io;
+
+	if (xfer->type == PURPLE_XFER_RECEIVE)
+		prpl_io = (xfer->ops.read != NULL);
+	else
+		prpl_io = (xfer->ops.write != NULL);
+
 	xfer->current_buffer_size = MIN(xfer->current_buffer_size * 1.5,
-			FT_MAX_BUFFER_SIZE);
+			prpl_io ? FT_MAX_BUFFER_SIZE : FT_MAX_FD_BUFFER_SIZE);
 }
 
-gssize
-purple_xfer_read(PurpleXfer *xfer, guchar **buffer)
+/*
+ * Returns a buffer of at least size bytes that belongs to the transfer
+ * and is reused for the next chunk.
+ */
+static guchar *
+purple_xfer_get_chunk(PurpleXferPrivData *priv, gsize size)
 {
-	gssize s, r;
+	if (priv->chunk_size < size) {
+		g_free(priv->chunk);
+		priv->chunk = g_malloc(size);
+		priv->chunk_size = size;
+	}
 
-	g_return_val_if_fail(xfer   != NULL, 0);
-	g_return_val_if_fail(buffer != NULL, 0);
+	return priv->chunk;
+}
+
+/*
+ * Like purple_xfer_read(), but when reuse is TRUE and we're reading the
+ * socket ourselves, the data is read into the transfer's own buffer,
+ * which must not be freed.
+ */
+static gssize
+purple_xfer_read_chunk(PurpleXfer *xfer, guchar **buffer, gboolean reuse)
+{
+	gssize s, r;
 
 	if (purple_xfer_get_size(xfer) == 0)
 		s = xfer->current_buffer_size;
@@ -1062,7 +1109,10 @@ purple_xfer_read(PurpleXfer *xfer, guchar **buffer)
 		r = (xfer->ops.read)(buffer, xfer);
 	}
 	else {
-		*buffer = g_malloc0(s);
+		if (reuse)
+			*buffer = purple_xfer_get_chunk(g_hash_table_lookup(xfers_data, xfer), s);
+		else
+			*buffer = g_malloc0(s);
 
 		r = read(xfer->fd, *buffer, s);
 		if (r < 0 && errno == EAGAIN)
@@ -1084,6 +1134,15 @@ purple_xfer_read(PurpleXfer *xfer, guchar **buffer)
 	return r;
 }
 
+gssize
+purple_xfer_read(PurpleXfer *xfer, guchar **buffer)
+{
+	g_return_val_if_fail(xfer   != NULL, 0);
+	g_return_val_if_fail(buffer != NULL, 0);
+
+	return purple_xfer_read_chunk(xfer, buffer, FALSE);
+}
+
 gssize
 purple_xfer_write(PurpleXfer *xfer, const guchar *buffer, gsize size)
 {
@@ -1205,17 +1264,102 @@ purple_xfer_read_file(PurpleXfer *xfer, guchar *buffer, gsize size)
 	return got_len;
 }
 
+#ifdef PURPLE_XFER_USE_SENDFILE
+/*
+ * Sends the next chunk straight from the file to the socket, without
+ * copying it through our buffers.  Returns what purple_xfer_write()
+ * would, or -2 if sendfile() can't be used for this chunk, in which case
+ * the caller should read and write the data itself.
+ */
+static gssize
+purple_xfer_sendfile(PurpleXfer *xfer, PurpleXferPrivData *priv)
+{
+	size_t s = MIN(purple_xfer_get_bytes_remaining(xfer), xfer->current_buffer_size);
+	off_t offset;
+	gssize r;
+
+	/*
+	 * Only when we'd be copying from the file to the socket ourselves,
+	 * and nothing is left over from a short write.  Without priv->buffer
+	 * the UI wants to see what wasn't sent, which needs the data.
+	 */
+	if (s == 0 || xfer->ops.write != NULL || xfer->dest_fp == NULL ||
+			xfer->fd == -1 || priv->no_sendfile ||
+			priv->buffer == NULL || priv->buffer->len > 0)
+		return -2;
+
+	offset = purple_xfer_get_bytes_sent(xfer);
+	r = sendfile(xfer->fd, fileno(xfer->dest_fp), &offset, s);
+	if (r < 0) {
+		if (errno == EAGAIN)
+			return 0;
+
+		if (errno == EINVAL || errno == ENOSYS) {
+			/* Not for this kind of file or socket.  sendfile() didn't
+			 * move the file position, so put it where we are. */
+			purple_debug_info("xfer", "sendfile() is not supported for "
+					"%p, copying instead\n", xfer);
+			priv->no_sendfile = TRUE;
+			if (fseek(xfer->dest_fp, offset, SEEK_SET) != 0) {
+				purple_debug_error("xfer", "couldn't seek\n");
+				return -1;
+			}
+			return -2;
+		}
+
+		return -1;
+	}
+
+	if ((gsize)r == s)
+		/* Same as in do_transfer() */
+		purple_xfer_increase_buffer_size(xfer);
+
+	if ((purple_xfer_get_bytes_sent(xfer) + r) >= purple_xfer_get_size(xfer) &&
+		!purple_xfer_is_completed(xfer))
+		purple_xfer_set_completed(xfer, TRUE);
+
+	return r;
+}
+#endif
+
+/*
+ * Whether it's been long enough since the UI was last told about the
+ * progress.  Copying a big chunk takes no time at all on a fast network,
+ * and redrawing the progress that often is wasted effort.
+ */
+static gboolean
+purple_xfer_progress_due(PurpleXferPrivData *priv)
+{
+	GTimeVal tv;
+	gint64 now;
+
+	g_get_current_time(&tv);
+	now = (gint64)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+	/* If the clock went backwards, don't wait for it to catch up */
+	if (now >= priv->last_progress &&
+			now - priv->last_progress < FT_PROGRESS_INTERVAL)
+		return FALSE;
+
+	priv->last_progress = now;
+	return TRUE;
+}
+
 static void
 do_transfer(PurpleXfer *xfer)
 {
 	PurpleXferUiOps *ui_ops;
+	PurpleXferPrivData *priv = g_hash_table_lookup(xfers_data, xfer);
 	guchar *buffer = NULL;
+	/* Whether buffer was allocated for this chunk */
+	gboolean free_buffer = TRUE;
 	gssize r = 0;
 
 	ui_ops = purple_xfer_get_ui_ops(xfer);
 
 	if (xfer->type == PURPLE_XFER_RECEIVE) {
-		r = purple_xfer_read(xfer, &buffer);
+		r = purple_xfer_read_chunk(xfer, &buffer, TRUE);
+		free_buffer = (xfer->ops.read != NULL);
 		if (r > 0) {
 			size_t wc;
 			if (ui_ops && ui_ops->ui_write)
@@ -1226,7 +1370,8 @@ do_transfer(PurpleXfer *xfer)
 			if (wc != (gsize)r) {
 				purple_debug_error("filetransfer", "Unable to write whole buffer.\n");
 				purple_xfer_cancel_local(xfer);
-				g_free(buffer);
+				if (free_buffer)
+					g_free(buffer);
 				return;
 			}
 
@@ -1235,13 +1380,22 @@ do_transfer(PurpleXfer *xfer)
 				purple_xfer_set_completed(xfer, TRUE);
 		} else if(r < 0) {
 			purple_xfer_cancel_remote(xfer);
-			g_free(buffer);
+			if (free_buffer)
+				g_free(buffer);
 			return;
 		}
+#ifdef PURPLE_XFER_USE_SENDFILE
+	} else if (xfer->type == PURPLE_XFER_SEND &&
+			(r = purple_xfer_sendfile(xfer, priv)) != -2) {
+		/* Sent straight from the file, there is no buffer */
+		if (r == -1) {
+			purple_xfer_cancel_remote(xfer);
+			return;
+		}
+#endif
 	} else if (xfer->type == PURPLE_XFER_SEND) {
 		size_t result = 0;
 		size_t s = MIN(purple_xfer_get_bytes_remaining(xfer), xfer->current_buffer_size);
-		PurpleXferPrivData *priv = g_hash_table_lookup(xfers_data, xfer);
 		gboolean read = TRUE;
 
 		/* this is so the prpl can keep the connection open
@@ -1288,30 +1442,46 @@ do_transfer(PurpleXfer *xfer)
 				}
 
 				result = tmp;
+
+				if (priv->buffer) {
+					g_byte_array_append(priv->buffer, buffer, result);
+					g_free(buffer);
+				}
+			} else if (priv->buffer) {
+				/* Read straight into the end of the buffer we write from */
+				gsize len = priv->buffer->len;
+
+				g_byte_array_set_size(priv->buffer, len + s);
+				result = fread(priv->buffer->data + len, 1, s, xfer->dest_fp);
+				g_byte_array_set_size(priv->buffer, len + result);
+				if (result != s) {
+					purple_debug_error("filetransfer", "Unable to read whole buffer.\n");
+					purple_xfer_cancel_local(xfer);
+					return;
+				}
 			} else {
-				buffer = g_malloc(s);
+				buffer = purple_xfer_get_chunk(priv, s);
+				free_buffer = FALSE;
 				result = fread(buffer, 1, s, xfer->dest_fp);
 				if (result != s) {
 					purple_debug_error("filetransfer", "Unable to read whole buffer.\n");
 					purple_xfer_cancel_local(xfer);
-					g_free(buffer);
 					return;
 				}
 			}
 		}
 
 		if (priv->buffer) {
-			g_byte_array_append(priv->buffer, buffer, result);
-			g_free(buffer);
 			buffer = priv->buffer->data;
 			result = priv->buffer->len;
+			free_buffer = FALSE;
 		}
 
 		r = purple_xfer_write(xfer, buffer, result);
 
 		if (r == -1) {
 			purple_xfer_cancel_remote(xfer);
-			if (!priv->buffer)
+			if (free_buffer)
 				/* We don't free buffer if priv->buffer is set, because in
 				   that case buffer doesn't belong to us. */
 				g_free(buffer);
@@ -1348,9 +1518,11 @@ do_transfer(PurpleXfer *xfer)
 		if (xfer->ops.ack != NULL)
 			xfer->ops.ack(xfer, buffer, r);
 
-		g_free(buffer);
+		if (free_buffer)
+			g_free(buffer);
 
-		if (ui_ops != NULL && ui_ops->update_progress != NULL)
+		if (ui_ops != NULL && ui_ops->update_progress != NULL &&
+				(purple_xfer_is_completed(xfer) || purple_xfer_progress_due(priv)))
 			ui_ops->update_progress(xfer,
 				purple_xfer_get_progress(xfer));
 	}
@@ -262,6 +262,13 @@ void _purple_connection_new_unregister(PurpleAccount *account, const char *passw
  */
 void _purple_connection_destroy(PurpleConnection *gc);
 
+/**
+ * Frees the names shared by the nodes of xmlnode arenas.  No tree created
+ * by xmlnode_new_arena(), xmlnode_from_str() or xmlnode_copy() may be
+ * left by then.
+ */
+void _purple_xmlnode_uninit(void);
+
 /**
  * Sets most commonly used socket flags: O_NONBLOCK and FD_CLOEXEC.
  *
@@ -272,4 +279,128 @@ void _purple_connection_destroy(PurpleConnection *gc);
 gboolean
 _purple_network_set_common_socket_flags(int fd);
 
+/* The DNS cache in dnscache.c is shared by dnsquery.c and dnssrv.c.  The
+ * callers build the keys and decide what an answer looks like. */
+
+/* How many seconds to cache answers that don't come with a TTL, and
+ * failures for. */
+#define PURPLE_DNS_CACHE_DEFAULT_TTL  300
+#define PURPLE_DNS_CACHE_NEGATIVE_TTL 30
+
+/**
+ * Called when the lookup a query was waiting on (see
+ * _purple_dns_cache_join()) is over.  This shouldn't call back into the
+ * cache right away; schedule the lookup to start over instead.
+ */
+typedef void (*PurpleDnsCacheResumeFunc)(gpointer query);
+
+/**
+ * Looks up a cached answer.
+ *
+ * @param key      The key the answer was stored under.
+ * @param answer   The cached answer is returned here.  It belongs to the
+ *                 cache, so copy it.
+ * @param negative Whether the answer is a cached failure is returned here.
+ *
+ * @return TRUE if there is an answer that hasn't expired, FALSE otherwise.
+ */
+gboolean
+_purple_dns_cache_lookup(const char *key, gconstpointer *answer, gboolean *negative);
+
+/**
+ * Caches an answer, replacing any answer already stored under the key.
+ *
+ * @param key       The key to store the answer under.
+ * @param answer    The answer.  The cache takes ownership of it.
+ * @param free_func The function used to free the answer.
+ * @param negative  TRUE if this is a failure.
+ * @param ttl       How many seconds to keep the answer for.
+ */
+void
+_purple_dns_cache_store(const char *key, gpointer answer, GDestroyNotify free_func,
+		gboolean negative, guint ttl);
+
+/**
+ * Tells the cache that a query is about to be resolved.
+ *
+ * @param key    The key the answer will be stored under.
+ * @param query  The query.
+ * @param resume Called when the identical query that is already in
+ *               progress is over.
+ *
+ * @return TRUE if the caller should resolve the query.  FALSE if the same
+ *         query is already being resolved, in which case @a resume will
+ *         be called when it is over.  Either way, call
+ *         _purple_dns_cache_leave() when the query is done or cancelled.
+ */
+gboolean
+_purple_dns_cache_join(const char *key, gpointer query, PurpleDnsCacheResumeFunc resume);
+
+/**
+ * Tells the cache that a query is done or cancelled.  Any queries
+ * waiting on it are resumed.
+ *
+ * @param key   The key passed to _purple_dns_cache_join().
+ * @param query The query.
+ */
+void
+_purple_dns_cache_leave(const char *key, gpointer query);
+
+/**
+ * Forgets every cached answer.
+ */
+void
+_purple_dns_cache_clear(void);
+
+void
+_purple_dns_cache_init(void);
+
+void
+_purple_dns_cache_uninit(void);
+
+/* The resolver threads in dnspool.c are shared by dnsquery.c and
+ * dnssrv.c. */
+
+typedef struct _PurpleDnsPoolJob PurpleDnsPoolJob;
+
+typedef void (*PurpleDnsPoolFunc)(gpointer data);
+
+/**
+ * Runs a blocking lookup in one of the resolver threads.
+ *
+ * @param resolve Called in a resolver thread to do the lookup.  It must
+ *                only touch @a data.
+ * @param done    Called in the main thread after @a resolve, unless the
+ *                job was cancelled.
+ * @param destroy Called in the main thread to free @a data when the job is
+ *                over, whether it was cancelled or not.
+ * @param data    The job's data.
+ *
+ * @return The job, or NULL if the resolver threads couldn't be started.
+ */
+PurpleDnsPoolJob *
+_purple_dns_pool_push(PurpleDnsPoolFunc resolve, PurpleDnsPoolFunc done,
+		GDestroyNotify destroy, gpointer data);
+
+/**
+ * Cancels a job.  Its done function won't be called, but its data is only
+ * freed once the lookup, if it's running, is over.
+ */
+void
+_purple_dns_pool_cancel(PurpleDnsPoolJob *job);
+
+/**
+ * Resolver threads hold this around res_query(), res_init() and anything
+ * else that uses the resolver's state, which is shared by all threads
+ * outside of glibc.
+ */
+void
+_purple_dns_pool_lock_resolver(void);
+
+void
+_purple_dns_pool_unlock_resolver(void);
+
+void
+_purple_dns_pool_uninit(void);
+
 #endif /* _PURPLE_INTERNAL_H_ */
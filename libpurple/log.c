@@ -30,6 +30,7 @@
 #include "debug.h"
 #include "internal.h"
 #include "log.h"
+#include "logsearch.h"
 #include "prefs.h"
 #include "util.h"
 #include "stringref.h"
@@ -41,6 +42,7 @@ static GSList *loggers = NULL;
 static PurpleLogLogger *html_logger;
 static PurpleLogLogger *txt_logger;
 static PurpleLogLogger *old_logger;
+static PurpleLogLogger *bin_logger;
 
 struct _purple_logsize_user {
 	char *name;
@@ -49,6 +51,20 @@ struct _purple_logsize_user {
 static GHashTable *logsize_users = NULL;
 static GHashTable *logsize_users_decayed = NULL;
 
+/* Per-directory indexes of the binary logger, keyed by log directory. */
+static GHashTable *bin_logger_indexes = NULL;
+
+/* Log files are written through a large stdio buffer and flushed in batches,
+ * either after LOG_FLUSH_INTERVAL seconds or once LOG_FLUSH_THRESHOLD bytes
+ * are pending, rather than after every message. */
+#define LOG_BUFFER_SIZE      (64 * 1024)
+#define LOG_FLUSH_THRESHOLD  (64 * 1024)
+#define LOG_FLUSH_INTERVAL   1
+
+static GHashTable *unflushed_files = NULL;
+static gsize unflushed_bytes = 0;
+static guint flush_timer = 0;
+
 static void log_get_log_sets_common(GHashTable *sets);
 
 static gsize html_logger_write(PurpleLog *log, PurpleMessageFlags type,
@@ -75,6 +91,18 @@ static GList *txt_logger_list_syslog(PurpleAccount *account);
 static char *txt_logger_read(PurpleLog *log, PurpleLogReadFlags *flags);
 static int txt_logger_total_size(PurpleLogType type, const char *name, PurpleAccount *account);
 
+static gsize bin_logger_write(PurpleLog *log,
+							 PurpleMessageFlags type,
+							 const char *from, time_t time, const char *message);
+static void bin_logger_finalize(PurpleLog *log);
+static GList *bin_logger_list(PurpleLogType type, const char *sn, PurpleAccount *account);
+static GList *bin_logger_list_syslog(PurpleAccount *account);
+static char *bin_logger_read(PurpleLog *log, PurpleLogReadFlags *flags);
+static int bin_logger_size(PurpleLog *log);
+static int bin_logger_total_size(PurpleLogType type, const char *name, PurpleAccount *account);
+static int bin_logger_activity_score(PurpleLogType type, const char *name, PurpleAccount *account);
+static void bin_logger_index_free(gpointer data);
+
 /**************************************************************************
  * PUBLIC LOGGING FUNCTIONS ***********************************************
  **************************************************************************/
@@ -127,6 +155,7 @@ PurpleLog *purple_log_new(PurpleLogType type, const char *name, PurpleAccount *a
 void purple_log_free(PurpleLog *log)
 {
 	g_return_if_fail(log);
+	purple_log_search_forget(log);
 	if (log->logger && log->logger->finalize)
 		log->logger->finalize(log);
 	g_free(log->name);
@@ -144,52 +173,107 @@ void purple_log_free(PurpleLog *log)
 	g_slice_free(PurpleLog, log);
 }
 
+/* Adds to a cached size, if there is one, without allocating a new key. */
+static void logsize_user_add(GHashTable *table, struct _purple_logsize_user *lu, gsize written)
+{
+	gpointer key, ptrsize;
+
+	if(g_hash_table_lookup_extended(table, lu, &key, &ptrsize)) {
+		gsize total = GPOINTER_TO_INT(ptrsize);
+
+		total += written;
+		/* Reinsert the existing key, which the table still owns. */
+		g_hash_table_steal(table, key);
+		g_hash_table_insert(table, key, GINT_TO_POINTER(total));
+	}
+}
+
 void purple_log_write(PurpleLog *log, PurpleMessageFlags type,
 		    const char *from, time_t time, const char *message)
 {
-	struct _purple_logsize_user *lu;
-	gsize written, total = 0;
-	gpointer ptrsize;
+	struct _purple_logsize_user lu;
+	gsize written;
 
 	g_return_if_fail(log);
 	g_return_if_fail(log->logger);
 	g_return_if_fail(log->logger->write);
 
 	written = (log->logger->write)(log, type, from, time, message);
+	purple_log_search_index_message(log, type, from, message, written);
 
-	lu = g_new(struct _purple_logsize_user, 1);
+	lu.name = (char *)purple_normalize(log->account, log->name);
+	lu.account = log->account;
 
-	lu->name = g_strdup(purple_normalize(log->account, log->name));
-	lu->account = log->account;
+	logsize_user_add(logsize_users, &lu, written);
+	logsize_user_add(logsize_users_decayed, &lu, written);
+}
 
-	if(g_hash_table_lookup_extended(logsize_users, lu, NULL, &ptrsize)) {
-		char *tmp = lu->name;
+/****************************************************************************
+ * BUFFERED WRITING *********************************************************
+ ****************************************************************************/
 
-		total = GPOINTER_TO_INT(ptrsize);
-		total += written;
-		g_hash_table_replace(logsize_users, lu, GINT_TO_POINTER(total));
+static void log_flush_all(void)
+{
+	GHashTableIter iter;
+	gpointer file;
 
-		/* The hash table takes ownership of lu, so create a new one
-		 * for the logsize_users_decayed check below. */
-		lu = g_new(struct _purple_logsize_user, 1);
-		lu->name = g_strdup(tmp);
-		lu->account = log->account;
+	if (flush_timer) {
+		purple_timeout_remove(flush_timer);
+		flush_timer = 0;
 	}
 
-	if(g_hash_table_lookup_extended(logsize_users_decayed, lu, NULL, &ptrsize)) {
-		total = GPOINTER_TO_INT(ptrsize);
-		total += written;
-		g_hash_table_replace(logsize_users_decayed, lu, GINT_TO_POINTER(total));
-	} else {
-		g_free(lu->name);
-		g_free(lu);
+	if (unflushed_files == NULL)
+		return;
+
+	g_hash_table_iter_init(&iter, unflushed_files);
+	while (g_hash_table_iter_next(&iter, &file, NULL))
+		fflush(file);
+
+	g_hash_table_remove_all(unflushed_files);
+	unflushed_bytes = 0;
+}
+
+static gboolean log_flush_cb(gpointer data)
+{
+	flush_timer = 0;
+	log_flush_all();
+	return FALSE;
+}
+
+/* Called instead of fflush() after writing a message to a log file. */
+static void log_file_written(FILE *file, gsize written)
+{
+	/* Logs written while shutting down have nothing to batch with. */
+	if (unflushed_files == NULL) {
+		fflush(file);
+		return;
 	}
+
+	g_hash_table_replace(unflushed_files, file, file);
+	unflushed_bytes += written;
+
+	if (unflushed_bytes >= LOG_FLUSH_THRESHOLD)
+		log_flush_all();
+	else if (flush_timer == 0)
+		flush_timer = purple_timeout_add_seconds(LOG_FLUSH_INTERVAL, log_flush_cb, NULL);
+}
+
+/* Must be called before closing a file passed to log_file_written(). */
+static void log_file_closing(FILE *file)
+{
+	if (unflushed_files != NULL)
+		g_hash_table_remove(unflushed_files, file);
 }
 
 char *purple_log_read(PurpleLog *log, PurpleLogReadFlags *flags)
 {
 	PurpleLogReadFlags mflags;
 	g_return_val_if_fail(log && log->logger, NULL);
+
+	/* The log being read may still be being written. */
+	if (flush_timer)
+		log_flush_all();
+
 	if (log->logger->read) {
 		char *ret = (log->logger->read)(log, flags ? flags : &mflags);
 		purple_str_strip_char(ret, '\r');
@@ -202,6 +286,9 @@ int purple_log_get_size(PurpleLog *log)
 {
 	g_return_val_if_fail(log && log->logger, 0);
 
+	if (flush_timer)
+		log_flush_all();
+
 	if (log->logger->size)
 		return log->logger->size(log);
 	return 0;
@@ -287,7 +374,9 @@ gint purple_log_get_activity_score(PurpleLogType type, const char *name, PurpleA
 		for (n = loggers; n; n = n->next) {
 			PurpleLogLogger *logger = n->data;
 
-			if(logger->list) {
+			if(logger->activity_score) {
+				score_double += (logger->activity_score)(type, name, account);
+			} else if(logger->list) {
 				GList *logs = (logger->list)(type, name, account);
 
 				while (logs) {
@@ -405,7 +494,8 @@ PurpleLogLogger *purple_log_logger_new(const char *id, const char *name, int fun
 				GList*(*list_syslog)(PurpleAccount *account),
 				void(*get_log_sets)(PurpleLogSetCallback cb, GHashTable *sets),
 				gboolean(*remove)(PurpleLog *log),
-				gboolean(*is_deletable)(PurpleLog *log))
+				gboolean(*is_deletable)(PurpleLog *log),
+				int(*activity_score)(PurpleLogType type, const char *name, PurpleAccount *account))
 #endif
 	PurpleLogLogger *logger;
 	va_list args;
@@ -442,8 +532,10 @@ PurpleLogLogger *purple_log_logger_new(const char *id, const char *name, int fun
 		logger->remove = va_arg(args, void *);
 	if (functions >= 11)
 		logger->is_deletable = va_arg(args, void *);
-
 	if (functions >= 12)
+		logger->activity_score = va_arg(args, void *);
+
+	if (functions >= 13)
 		purple_debug_info("log", "Dropping new functions for logger: %s (%s)\n", name, id);
 
 	va_end(args);
@@ -692,6 +784,21 @@ void purple_log_init(void)
 									 old_logger_get_log_sets);
 	purple_log_logger_add(old_logger);
 
+	bin_logger = purple_log_logger_new("bin", _("Indexed binary"), 12,
+									 NULL,
+									 bin_logger_write,
+									 bin_logger_finalize,
+									 bin_logger_list,
+									 bin_logger_read,
+									 bin_logger_size,
+									 bin_logger_total_size,
+									 bin_logger_list_syslog,
+									 NULL,
+									 NULL,
+									 NULL,
+									 bin_logger_activity_score);
+	purple_log_logger_add(bin_logger);
+
 	purple_signal_register(handle, "log-timestamp",
 #if SIZEOF_TIME_T == 4
 	                     purple_marshal_POINTER__POINTER_INT_BOOLEAN,
@@ -722,6 +829,11 @@ void purple_log_init(void)
 	logsize_users_decayed = g_hash_table_new_full((GHashFunc)_purple_logsize_user_hash,
 				(GEqualFunc)_purple_logsize_user_equal,
 				(GDestroyNotify)_purple_logsize_user_free_key, NULL);
+	bin_logger_indexes = g_hash_table_new_full(g_str_hash, g_str_equal,
+				NULL, bin_logger_index_free);
+	unflushed_files = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	purple_log_search_init();
 }
 
 void
@@ -729,6 +841,12 @@ purple_log_uninit(void)
 {
 	purple_signals_unregister_by_instance(purple_log_get_handle());
 
+	purple_log_search_uninit();
+
+	log_flush_all();
+	g_hash_table_destroy(unflushed_files);
+	unflushed_files = NULL;
+
 	purple_log_logger_remove(html_logger);
 	purple_log_logger_free(html_logger);
 	html_logger = NULL;
@@ -741,8 +859,14 @@ purple_log_uninit(void)
 	purple_log_logger_free(old_logger);
 	old_logger = NULL;
 
+	purple_log_logger_remove(bin_logger);
+	purple_log_logger_free(bin_logger);
+	bin_logger = NULL;
+
 	g_hash_table_destroy(logsize_users);
 	g_hash_table_destroy(logsize_users_decayed);
+	g_hash_table_destroy(bin_logger_indexes);
+	bin_logger_indexes = NULL;
 }
 
 /****************************************************************************
@@ -917,6 +1041,7 @@ void purple_log_common_writer(PurpleLog *log, const char *ext)
 			g_free(path);
 			return;
 		}
+		setvbuf(data->file, NULL, _IOFBF, LOG_BUFFER_SIZE);
 		g_free(path);
 	}
 }
@@ -1467,7 +1592,7 @@ static gsize html_logger_write(PurpleLog *log, PurpleMessageFlags type,
 	g_free(date);
 	g_free(msg_fixed);
 	g_free(escaped_from);
-	fflush(data->file);
+	log_file_written(data->file, written);
 
 	return written;
 }
@@ -1477,6 +1602,7 @@ static void html_logger_finalize(PurpleLog *log)
 	PurpleLogCommonLoggerData *data = log->logger_data;
 	if (data) {
 		if(data->file) {
+			log_file_closing(data->file);
 			fprintf(data->file, "</body></html>\n");
 			fclose(data->file);
 		}
@@ -1602,7 +1728,7 @@ static gsize txt_logger_write(PurpleLog *log,
 	}
 	g_free(date);
 	g_free(stripped);
-	fflush(data->file);
+	log_file_written(data->file, written);
 
 	return written;
 }
@@ -1611,8 +1737,10 @@ static void txt_logger_finalize(PurpleLog *log)
 {
 	PurpleLogCommonLoggerData *data = log->logger_data;
 	if (data) {
-		if(data->file)
+		if(data->file) {
+			log_file_closing(data->file);
 			fclose(data->file);
+		}
 		g_free(data->path);
 
 		g_slice_free(PurpleLogCommonLoggerData, data);
@@ -1653,6 +1781,708 @@ static int txt_logger_total_size(PurpleLogType type, const char *name, PurpleAcc
 }
 
 
+/****************************
+ ** INDEXED BINARY LOGGER ***
+ ****************************/
+
+/* The binary logger appends every message for a conversation partner to a
+ * single segment file and keeps a compact index next to it.  The index has
+ * one entry per logged conversation plus the running size and decayed
+ * activity score, so listing, sizing and scoring never have to touch the
+ * segment (or stat a file per conversation, like the common loggers do).
+ *
+ * All integers are stored little endian.  A segment record is:
+ *
+ *   guint32 length of the rest of the record
+ *   guint32 conversation number (index of the entry in the index)
+ *   gint64  timestamp
+ *   guint32 PurpleMessageFlags
+ *   guint32 length of the sender
+ *   guint32 length of the message
+ *   sender and message bytes, not NUL terminated
+ *
+ * The index is a header ("PLBI", guint32 version, guint64 indexed segment
+ * size, gint64 score time, gdouble score) followed by one entry per
+ * conversation: gint64 start time, guint64 offset of its first record,
+ * guint64 span up to the end of its last record, guint64 bytes of its own
+ * records.
+ *
+ * The segment is authoritative.  The index is only written when a log is
+ * closed; records past the indexed size (e.g. after a crash) are folded back
+ * in the next time the index is loaded.
+ */
+
+#define BIN_LOGGER_SEGMENT       "purple.seg"
+#define BIN_LOGGER_INDEX         "purple.idx"
+#define BIN_LOGGER_MAGIC         "PLBI"
+#define BIN_LOGGER_VERSION       1
+#define BIN_LOGGER_RECORD_HEADER 28
+#define BIN_LOGGER_INDEX_HEADER  32
+#define BIN_LOGGER_INDEX_ENTRY   32
+/* The same half-life used by purple_log_get_activity_score(): 14 days. */
+#define BIN_LOGGER_HALF_LIFE     1209600.0
+
+struct bin_logger_entry {
+	time_t time;
+	guint64 offset;
+	guint64 span;
+	guint64 size;
+};
+
+struct bin_logger_index {
+	char *dir;
+	guint64 size;            /* Bytes of the segment covered by the index */
+	time_t score_time;
+	double score;            /* Decayed activity score as of score_time */
+	GArray *entries;         /* struct bin_logger_entry, one per conversation */
+	gboolean dirty;
+	FILE *file;              /* The segment, while any log is being written */
+	guint writers;           /* Logs writing to file */
+};
+
+struct bin_logger_data {
+	struct bin_logger_index *index;
+	guint entry;
+	FILE *file;              /* The index's file, while the log is being written */
+};
+
+static guchar *
+bin_put32(guchar *p, guint32 v)
+{
+	v = GUINT32_TO_LE(v);
+	memcpy(p, &v, 4);
+	return p + 4;
+}
+
+static guchar *
+bin_put64(guchar *p, guint64 v)
+{
+	v = GUINT64_TO_LE(v);
+	memcpy(p, &v, 8);
+	return p + 8;
+}
+
+static const guchar *
+bin_get32(const guchar *p, guint32 *v)
+{
+	memcpy(v, p, 4);
+	*v = GUINT32_FROM_LE(*v);
+	return p + 4;
+}
+
+static const guchar *
+bin_get64(const guchar *p, guint64 *v)
+{
+	memcpy(v, p, 8);
+	*v = GUINT64_FROM_LE(*v);
+	return p + 8;
+}
+
+/* fseek() takes a long, which can't reach past 2GB on 32-bit builds. */
+static int
+bin_logger_seek(FILE *file, guint64 offset)
+{
+#ifdef _WIN32
+	return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+	return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+static void
+bin_logger_index_reset(struct bin_logger_index *idx)
+{
+	idx->size = 0;
+	idx->score_time = 0;
+	idx->score = 0.0;
+	g_array_set_size(idx->entries, 0);
+	idx->dirty = TRUE;
+}
+
+/* Accounts a record of @bytes bytes at @offset to conversation @entry. */
+static void
+bin_logger_index_add(struct bin_logger_index *idx, guint entry, time_t when,
+                     guint64 offset, guint64 bytes)
+{
+	struct bin_logger_entry *e;
+
+	if (entry >= idx->entries->len)
+		g_array_set_size(idx->entries, entry + 1);
+
+	e = &g_array_index(idx->entries, struct bin_logger_entry, entry);
+	if (e->size == 0) {
+		e->offset = offset;
+		if (e->time == 0)
+			e->time = when;
+	}
+	e->span = offset + bytes - e->offset;
+	e->size += bytes;
+
+	if (offset + bytes > idx->size)
+		idx->size = offset + bytes;
+
+	if (when >= idx->score_time) {
+		idx->score *= pow(0.5, difftime(when, idx->score_time) / BIN_LOGGER_HALF_LIFE);
+		idx->score_time = when;
+		idx->score += bytes;
+	} else {
+		idx->score += bytes * pow(0.5, difftime(idx->score_time, when) / BIN_LOGGER_HALF_LIFE);
+	}
+
+	idx->dirty = TRUE;
+}
+
+/* Folds any records past the indexed size back into the index. */
+static void
+bin_logger_index_recover(struct bin_logger_index *idx)
+{
+	char *path;
+	struct stat st;
+	FILE *file;
+	guint64 offset;
+
+	path = g_build_filename(idx->dir, BIN_LOGGER_SEGMENT, NULL);
+	if (g_stat(path, &st) != 0) {
+		if (idx->size != 0 || idx->entries->len != 0) {
+			purple_debug_warning("log", "Segment %s is missing, dropping its index\n", path);
+			bin_logger_index_reset(idx);
+		}
+		g_free(path);
+		return;
+	}
+
+	if ((guint64)st.st_size == idx->size) {
+		g_free(path);
+		return;
+	}
+
+	if ((guint64)st.st_size < idx->size) {
+		purple_debug_warning("log", "Segment %s shrank, rebuilding its index\n", path);
+		bin_logger_index_reset(idx);
+	}
+
+	if ((file = g_fopen(path, "rb")) == NULL) {
+		purple_debug_error("log", "Failed to open %s for reading: %s\n",
+		                   path, g_strerror(errno));
+		g_free(path);
+		return;
+	}
+
+	purple_debug_info("log", "Indexing %s from offset %" G_GUINT64_FORMAT "\n",
+	                  path, idx->size);
+
+	offset = idx->size;
+	if (bin_logger_seek(file, offset) == 0) {
+		guchar header[BIN_LOGGER_RECORD_HEADER];
+
+		while (fread(header, BIN_LOGGER_RECORD_HEADER, 1, file) == 1) {
+			guint32 length, entry, flags, from_len, msg_len;
+			guint64 stamp;
+			const guchar *p = header;
+
+			p = bin_get32(p, &length);
+			p = bin_get32(p, &entry);
+			p = bin_get64(p, &stamp);
+			p = bin_get32(p, &flags);
+			p = bin_get32(p, &from_len);
+			p = bin_get32(p, &msg_len);
+
+			if (length != BIN_LOGGER_RECORD_HEADER - 4 + from_len + msg_len ||
+			    offset + length + 4 > (guint64)st.st_size)
+				break;
+
+			/* Conversations are numbered in the order they're started, so
+			 * a record can only belong to a known one or the next one.
+			 * Anything else is garbage, and trusting it could mean
+			 * growing the index to billions of entries. */
+			if (entry > idx->entries->len)
+				break;
+
+			if (fseek(file, from_len + msg_len, SEEK_CUR) != 0)
+				break;
+
+			bin_logger_index_add(idx, entry, (time_t)(gint64)stamp, offset, length + 4);
+			offset += length + 4;
+		}
+	}
+	fclose(file);
+
+	if (offset != (guint64)st.st_size)
+		purple_debug_warning("log", "Ignoring %" G_GUINT64_FORMAT " trailing bytes in %s\n",
+		                     (guint64)st.st_size - offset, path);
+
+	g_free(path);
+}
+
+static void
+bin_logger_index_load(struct bin_logger_index *idx)
+{
+	char *path = g_build_filename(idx->dir, BIN_LOGGER_INDEX, NULL);
+	gchar *contents;
+	gsize length;
+
+	if (g_file_get_contents(path, &contents, &length, NULL)) {
+		const guchar *p = (const guchar *)contents;
+		guint32 version = 0;
+		guint64 size, stamp, score;
+
+		if (length >= BIN_LOGGER_INDEX_HEADER && !memcmp(p, BIN_LOGGER_MAGIC, 4))
+			bin_get32(p + 4, &version);
+
+		if (version == BIN_LOGGER_VERSION &&
+		    (length - BIN_LOGGER_INDEX_HEADER) % BIN_LOGGER_INDEX_ENTRY == 0) {
+			guint i, count = (length - BIN_LOGGER_INDEX_HEADER) / BIN_LOGGER_INDEX_ENTRY;
+
+			p = bin_get64(p + 8, &size);
+			p = bin_get64(p, &stamp);
+			p = bin_get64(p, &score);
+
+			idx->size = size;
+			idx->score_time = (time_t)(gint64)stamp;
+			memcpy(&idx->score, &score, sizeof(idx->score));
+
+			g_array_set_size(idx->entries, count);
+			for (i = 0; i < count; i++) {
+				struct bin_logger_entry *e = &g_array_index(idx->entries, struct bin_logger_entry, i);
+
+				p = bin_get64(p, &stamp);
+				p = bin_get64(p, &e->offset);
+				p = bin_get64(p, &e->span);
+				p = bin_get64(p, &e->size);
+				e->time = (time_t)(gint64)stamp;
+			}
+		} else {
+			purple_debug_warning("log", "Ignoring invalid log index %s\n", path);
+		}
+
+		g_free(contents);
+	}
+	g_free(path);
+
+	bin_logger_index_recover(idx);
+}
+
+static void
+bin_logger_index_save(struct bin_logger_index *idx)
+{
+	guchar *contents, *p;
+	gsize length;
+	guint64 score;
+	char *path;
+	guint i;
+
+	if (!idx->dirty || idx->entries->len == 0)
+		return;
+
+	length = BIN_LOGGER_INDEX_HEADER + idx->entries->len * BIN_LOGGER_INDEX_ENTRY;
+	p = contents = g_malloc(length);
+
+	memcpy(p, BIN_LOGGER_MAGIC, 4);
+	p = bin_put32(p + 4, BIN_LOGGER_VERSION);
+	p = bin_put64(p, idx->size);
+	p = bin_put64(p, (guint64)(gint64)idx->score_time);
+	memcpy(&score, &idx->score, sizeof(score));
+	p = bin_put64(p, score);
+
+	for (i = 0; i < idx->entries->len; i++) {
+		struct bin_logger_entry *e = &g_array_index(idx->entries, struct bin_logger_entry, i);
+
+		p = bin_put64(p, (guint64)(gint64)e->time);
+		p = bin_put64(p, e->offset);
+		p = bin_put64(p, e->span);
+		p = bin_put64(p, e->size);
+	}
+
+	path = g_build_filename(idx->dir, BIN_LOGGER_INDEX, NULL);
+	if (purple_util_write_data_to_file_absolute(path, (const char *)contents, length))
+		idx->dirty = FALSE;
+	g_free(path);
+	g_free(contents);
+}
+
+static void
+bin_logger_index_free(gpointer data)
+{
+	struct bin_logger_index *idx = data;
+
+	bin_logger_index_save(idx);
+	g_array_free(idx->entries, TRUE);
+	g_free(idx->dir);
+	g_slice_free(struct bin_logger_index, idx);
+}
+
+static struct bin_logger_index *
+bin_logger_get_index(PurpleLogType type, const char *name, PurpleAccount *account)
+{
+	struct bin_logger_index *idx;
+	char *dir;
+
+	if (account == NULL || bin_logger_indexes == NULL)
+		return NULL;
+
+	dir = purple_log_get_log_dir(type, name, account);
+	if (dir == NULL)
+		return NULL;
+
+	idx = g_hash_table_lookup(bin_logger_indexes, dir);
+	if (idx != NULL) {
+		g_free(dir);
+		return idx;
+	}
+
+	idx = g_slice_new0(struct bin_logger_index);
+	idx->dir = dir;
+	idx->entries = g_array_new(FALSE, TRUE, sizeof(struct bin_logger_entry));
+	bin_logger_index_load(idx);
+
+	g_hash_table_insert(bin_logger_indexes, idx->dir, idx);
+
+	return idx;
+}
+
+/*
+ * Like bin_logger_get_index(), but doesn't try to read an index from disk
+ * unless there is a segment there.  The size and score are asked for every
+ * buddy in the buddy list, most of whom have no binary logs.
+ */
+static struct bin_logger_index *
+bin_logger_peek_index(PurpleLogType type, const char *name, PurpleAccount *account)
+{
+	struct bin_logger_index *idx;
+	char *dir, *path;
+	gboolean exists;
+
+	if (account == NULL || bin_logger_indexes == NULL)
+		return NULL;
+
+	dir = purple_log_get_log_dir(type, name, account);
+	if (dir == NULL)
+		return NULL;
+
+	idx = g_hash_table_lookup(bin_logger_indexes, dir);
+	if (idx != NULL) {
+		g_free(dir);
+		return idx;
+	}
+
+	path = g_build_filename(dir, BIN_LOGGER_SEGMENT, NULL);
+	exists = g_file_test(path, G_FILE_TEST_EXISTS);
+	g_free(path);
+	g_free(dir);
+
+	return exists ? bin_logger_get_index(type, name, account) : NULL;
+}
+
+static FILE *
+bin_logger_open_segment(struct bin_logger_index *idx)
+{
+	char *path;
+	FILE *file;
+	struct stat st;
+
+	purple_build_dir(idx->dir, S_IRUSR | S_IWUSR | S_IXUSR);
+
+	path = g_build_filename(idx->dir, BIN_LOGGER_SEGMENT, NULL);
+	file = g_fopen(path, "ab");
+	if (file == NULL) {
+		purple_debug_error("log", "Could not create log file %s\n", path);
+		g_free(path);
+		return NULL;
+	}
+
+	/* Drop a partially written record so new records stay reachable. */
+	if (fstat(fileno(file), &st) == 0 && (guint64)st.st_size > idx->size) {
+		purple_debug_warning("log", "Truncating %s to %" G_GUINT64_FORMAT " bytes\n",
+		                     path, idx->size);
+#ifdef _WIN32
+		_chsize(fileno(file), (long)idx->size);
+#else
+		if (ftruncate(fileno(file), (off_t)idx->size) != 0)
+			purple_debug_error("log", "Failed to truncate %s: %s\n",
+			                   path, g_strerror(errno));
+#endif
+	}
+
+	g_free(path);
+	return file;
+}
+
+static gsize bin_logger_write(PurpleLog *log,
+							 PurpleMessageFlags type,
+							 const char *from, time_t time, const char *message)
+{
+	struct bin_logger_data *data = log->logger_data;
+	struct bin_logger_index *idx;
+	char *image_corrected_msg;
+	guchar header[BIN_LOGGER_RECORD_HEADER], *p;
+	gsize from_len, msg_len, length;
+	guint64 offset;
+
+	if (data == NULL) {
+		struct bin_logger_entry entry;
+
+		idx = bin_logger_get_index(log->type, log->name, log->account);
+		if (idx == NULL)
+			return 0;
+
+		log->logger_data = data = g_slice_new0(struct bin_logger_data);
+		data->index = idx;
+		data->entry = idx->entries->len;
+
+		/* Every log in the directory appends to the same segment, and the
+		 * offsets in the index are only right if the writes stay in order,
+		 * so they share one buffered file. */
+		if (idx->file == NULL)
+			idx->file = bin_logger_open_segment(idx);
+		data->file = idx->file;
+		if (data->file == NULL) {
+			if (log->conv != NULL)
+				purple_conversation_write(log->conv, NULL, _("Logging of this conversation failed."),
+										PURPLE_MESSAGE_ERROR, time);
+			return 0;
+		}
+
+		idx->writers++;
+
+		memset(&entry, 0, sizeof(entry));
+		entry.time = log->time;
+		g_array_append_val(idx->entries, entry);
+		idx->dirty = TRUE;
+	}
+
+	/* if we can't write to the file, give up before we hurt ourselves */
+	if (data->file == NULL)
+		return 0;
+
+	idx = data->index;
+
+	image_corrected_msg = convert_image_tags(log, message);
+
+	from_len = from ? strlen(from) : 0;
+	msg_len = image_corrected_msg ? strlen(image_corrected_msg) : 0;
+	length = BIN_LOGGER_RECORD_HEADER + from_len + msg_len;
+
+	p = bin_put32(header, length - 4);
+	p = bin_put32(p, data->entry);
+	p = bin_put64(p, (guint64)(gint64)time);
+	p = bin_put32(p, type);
+	p = bin_put32(p, from_len);
+	p = bin_put32(p, msg_len);
+
+	offset = idx->size;
+	if (fwrite(header, BIN_LOGGER_RECORD_HEADER, 1, data->file) != 1 ||
+	    (from_len && fwrite(from, from_len, 1, data->file) != 1) ||
+	    (msg_len && fwrite(image_corrected_msg, msg_len, 1, data->file) != 1))
+	{
+		purple_debug_error("log", "Error writing to %s: %s\n",
+		                   idx->dir, g_strerror(errno));
+		length = 0;
+	}
+
+	if (image_corrected_msg != message)
+		g_free(image_corrected_msg);
+
+	if (length) {
+		bin_logger_index_add(idx, data->entry, time, offset, length);
+		log_file_written(data->file, length);
+	}
+
+	return length;
+}
+
+static void bin_logger_finalize(PurpleLog *log)
+{
+	struct bin_logger_data *data = log->logger_data;
+
+	if (data == NULL)
+		return;
+
+	if (data->file && --data->index->writers == 0) {
+		log_file_closing(data->file);
+		fclose(data->file);
+		data->index->file = NULL;
+		bin_logger_index_save(data->index);
+	}
+
+	g_slice_free(struct bin_logger_data, data);
+}
+
+static GList *bin_logger_list(PurpleLogType type, const char *sn, PurpleAccount *account)
+{
+	struct bin_logger_index *idx = bin_logger_get_index(type, sn, account);
+	GList *list = NULL;
+	guint i;
+
+	if (idx == NULL)
+		return NULL;
+
+	for (i = 0; i < idx->entries->len; i++) {
+		struct bin_logger_entry *e = &g_array_index(idx->entries, struct bin_logger_entry, i);
+		struct bin_logger_data *data;
+		PurpleLog *log;
+
+		if (e->size == 0)
+			continue;
+
+		log = purple_log_new(type, sn, account, NULL, e->time, NULL);
+		log->logger = bin_logger;
+		log->logger_data = data = g_slice_new0(struct bin_logger_data);
+		data->index = idx;
+		data->entry = i;
+
+		list = g_list_prepend(list, log);
+	}
+
+	return list;
+}
+
+static GList *bin_logger_list_syslog(PurpleAccount *account)
+{
+	return bin_logger_list(PURPLE_LOG_SYSTEM, ".system", account);
+}
+
+static void
+bin_logger_format(GString *out, PurpleLog *log, PurpleMessageFlags type,
+                  const char *from, time_t when, const char *message)
+{
+	char *date = log_get_timestamp(log, when);
+	char *escaped_from = from ? g_markup_escape_text(from, -1) : NULL;
+
+	if (log->type == PURPLE_LOG_SYSTEM) {
+		g_string_append_printf(out, "---- %s @ %s ----<br/>\n", message, date);
+	} else if (type & PURPLE_MESSAGE_ERROR) {
+		g_string_append_printf(out, "<font color=\"#FF0000\"><font size=\"2\">(%s)</font><b> %s</b></font><br/>\n",
+				date, message);
+	} else if (escaped_from == NULL || (type & (PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_RAW))) {
+		g_string_append_printf(out, "<font size=\"2\">(%s)</font><b> %s</b><br/>\n", date, message);
+	} else {
+		const char *color = (type & PURPLE_MESSAGE_SEND) ? "#16569E" :
+		                    (type & PURPLE_MESSAGE_WHISPER) ? "#6C2585" : "#A82F2F";
+		char *msg = g_strdup(message);
+
+		if (purple_message_meify(msg, -1))
+			g_string_append_printf(out, "<font color=\"#062585\"><font size=\"2\">(%s)</font> <b>***%s</b></font> %s<br/>\n",
+					date, escaped_from, msg);
+		else if (type & PURPLE_MESSAGE_AUTO_RESP)
+			g_string_append_printf(out, _("<font color=\"%s\"><font size=\"2\">(%s)</font> <b>%s &lt;AUTO-REPLY&gt;:</b></font> %s<br/>\n"),
+					color, date, escaped_from, msg);
+		else
+			g_string_append_printf(out, "<font color=\"%s\"><font size=\"2\">(%s)</font> <b>%s:</b></font> %s<br/>\n",
+					color, date, escaped_from, msg);
+		g_free(msg);
+	}
+
+	g_free(escaped_from);
+	g_free(date);
+}
+
+static char *bin_logger_read(PurpleLog *log, PurpleLogReadFlags *flags)
+{
+	struct bin_logger_data *data = log->logger_data;
+	struct bin_logger_entry *e;
+	GString *out;
+	guchar *buf;
+	const guchar *p, *end;
+	char *path;
+	FILE *file;
+	size_t result;
+
+	*flags = PURPLE_LOG_READ_NO_NEWLINE;
+
+	if (data == NULL || data->entry >= data->index->entries->len)
+		return g_strdup(_("<font color=\"red\"><b>Unable to find log path!</b></font>"));
+
+	e = &g_array_index(data->index->entries, struct bin_logger_entry, data->entry);
+	path = g_build_filename(data->index->dir, BIN_LOGGER_SEGMENT, NULL);
+
+	if ((file = g_fopen(path, "rb")) == NULL) {
+		char *ret = g_strdup_printf(_("<font color=\"red\"><b>Could not read file: %s</b></font>"), path);
+		g_free(path);
+		return ret;
+	}
+
+	buf = g_malloc(e->span);
+	if (bin_logger_seek(file, e->offset) != 0)
+		result = 0;
+	else
+		result = fread(buf, e->span, 1, file);
+	fclose(file);
+
+	if (result != 1) {
+		purple_debug_error("log", "Unable to read from log file: %s\n", path);
+		g_free(buf);
+		g_free(path);
+		return g_strdup("");
+	}
+	g_free(path);
+
+	out = g_string_sized_new(e->span);
+	p = buf;
+	end = buf + e->span;
+
+	while (p + BIN_LOGGER_RECORD_HEADER <= end) {
+		guint32 length, entry, type, from_len, msg_len;
+		guint64 stamp;
+		const guchar *record = p;
+
+		p = bin_get32(p, &length);
+		p = bin_get32(p, &entry);
+		p = bin_get64(p, &stamp);
+		p = bin_get32(p, &type);
+		p = bin_get32(p, &from_len);
+		p = bin_get32(p, &msg_len);
+
+		if (record + 4 + length > end ||
+		    length != BIN_LOGGER_RECORD_HEADER - 4 + from_len + msg_len)
+			break;
+
+		/* Records of other conversations may be interleaved with ours. */
+		if (entry == data->entry) {
+			char *from = from_len ? g_strndup((const char *)p, from_len) : NULL;
+			char *msg = g_strndup((const char *)p + from_len, msg_len);
+
+			bin_logger_format(out, log, type, from, (time_t)(gint64)stamp, msg);
+			g_free(from);
+			g_free(msg);
+		}
+
+		p = record + 4 + length;
+	}
+
+	g_free(buf);
+	return g_string_free(out, FALSE);
+}
+
+static int bin_logger_size(PurpleLog *log)
+{
+	struct bin_logger_data *data = log->logger_data;
+
+	if (data == NULL || data->entry >= data->index->entries->len)
+		return 0;
+
+	return g_array_index(data->index->entries, struct bin_logger_entry, data->entry).size;
+}
+
+static int bin_logger_total_size(PurpleLogType type, const char *name, PurpleAccount *account)
+{
+	struct bin_logger_index *idx = bin_logger_peek_index(type, name, account);
+
+	return idx ? (int)idx->size : 0;
+}
+
+static int bin_logger_activity_score(PurpleLogType type, const char *name, PurpleAccount *account)
+{
+	struct bin_logger_index *idx = bin_logger_peek_index(type, name, account);
+	time_t now;
+
+	if (idx == NULL || idx->size == 0)
+		return 0;
+
+	time(&now);
+	return (int)ceil(idx->score * pow(0.5, difftime(now, idx->score_time) / BIN_LOGGER_HALF_LIFE));
+}
+
+
 /****************
  * OLD LOGGER ***
  ****************/
@@ -112,7 +112,11 @@ struct _PurpleLogLogger {
 	/* Tests whether a log is deletable */
 	gboolean (*is_deletable)(PurpleLog *log);
 
-	void (*_purple_reserved1)(void);
+	/** Returns the activity score of all the logs (see
+	 *  purple_log_get_activity_score()). If this is undefined a default
+	 *  implementation based on @c list and @c size is used */
+	int (*activity_score)(PurpleLogType type, const char *name, PurpleAccount *account);
+
 	void (*_purple_reserved2)(void);
 	void (*_purple_reserved3)(void);
 	void (*_purple_reserved4)(void);
@@ -492,7 +496,7 @@ gboolean purple_log_common_is_deletable(PurpleLog *log);
  *                     functions are currently available (in order): @c create,
  *                     @c write, @c finalize, @c list, @c read, @c size,
  *                     @c total_size, @c list_syslog, @c get_log_sets,
- *                     @c remove, @c is_deletable.
+ *                     @c remove, @c is_deletable, @c activity_score.
  *                     For details on these functions, see PurpleLogLogger.
  *                     Functions may not be skipped. For example, passing
  *                     @c create and @c write is acceptable (for a total of
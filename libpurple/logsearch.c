@@ -0,0 +1,1290 @@
+/**
+ * @file logsearch.c Log Search API
+ * @ingroup core
+ */
+
+/* purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include "internal.h"
+#include "account.h"
+#include "debug.h"
+#include "eventloop.h"
+#include "log.h"
+#include "logsearch.h"
+#include "prefs.h"
+#include "util.h"
+
+/* Every log directory (see purple_log_get_log_dir()) gets a search.idx
+ * file next to the logs.  It is append-only and made up of one block per
+ * indexed log:
+ *
+ *   D <tab> logger id <tab> log time
+ *   token <tab> count <tab> offset of the first occurrence
+ *   ...
+ *   E
+ *
+ * Blocks without the trailing E (e.g. after a crash) are ignored, and if
+ * a log shows up twice the last block wins.  Once most of the blocks in
+ * a file have been superseded, it's rewritten with only the current ones.
+ * Logs being written are indexed in memory as messages come in and their
+ * block is appended when the log is freed.
+ *
+ * Offsets are in the text of purple_log_read() with the markup stripped.
+ * What a logger writes doesn't have to look like what it reads back, so
+ * logs indexed as they're written store SEARCH_OFFSET_UNKNOWN instead, and
+ * the offset is looked up when such a log turns up in the results.
+ */
+
+#define SEARCH_INDEX_FILE   "search.idx"
+#define SEARCH_MIN_TOKEN    2      /* characters */
+#define SEARCH_MAX_TOKEN    64     /* bytes */
+#define SEARCH_MAX_LOADED   8      /* directories kept in memory */
+#define SEARCH_COMPACT_MIN  16     /* blocks in a file before compacting it */
+#define SEARCH_OFFSET_UNKNOWN G_MAXSIZE
+
+#define SEARCH_CHUNK_INTERVAL 10   /* milliseconds between search chunks */
+
+#define BACKFILL_DELAY      30     /* seconds after startup */
+#define BACKFILL_INTERVAL   250    /* milliseconds between chunks */
+#define BACKFILL_CHUNK      (256 * 1024) /* bytes of logs per chunk */
+#define BACKFILL_MAX_LOGS   64     /* logs looked at per chunk */
+
+typedef struct {
+	guint count;
+	gsize offset;
+} LogSearchTokenStat;
+
+/* The index of a single log, while it's being built. */
+typedef struct {
+	char *dir;
+	char *key;
+	gboolean live;         /* Indexed as it was written; offsets are unknown */
+	GHashTable *tokens;    /* char * -> LogSearchTokenStat * */
+} LogSearchDoc;
+
+typedef struct {
+	guint doc;
+	guint count;
+	gsize offset;
+} LogSearchPosting;
+
+/* The loaded index of one log directory. */
+typedef struct {
+	char *dir;
+	GHashTable *docs;      /* key -> current doc number + 1 */
+	GPtrArray *keys;       /* doc number -> key */
+	GHashTable *postings;  /* token -> GArray of LogSearchPosting */
+	GPtrArray *vocabulary; /* The keys of postings, for substring lookups */
+	guint used;            /* For evicting the least recently used index */
+} LogSearchIndex;
+
+typedef struct {
+	PurpleLogType type;
+	char *name;
+	PurpleAccount *account;
+} LogSearchBackfillSet;
+
+typedef enum {
+	LOG_SEARCH_INDEXING,
+	LOG_SEARCH_CHECKING,
+	LOG_SEARCH_RESOLVING
+} LogSearchJobStage;
+
+/* A search started with purple_log_search_async(). */
+typedef struct {
+	void *handle;
+	LogSearchJobStage stage;
+	GList *logs;           /* The logs to search, not owned */
+	GList *next;           /* The next log to index, or result to resolve */
+	GPtrArray *terms;
+	char *query;
+	guint offset;
+	guint limit;
+	guint total;
+	GList *results;
+	GList *hits;           /* Matches from the index, still to be checked */
+	PurpleLogSearchCallback cb;
+	gpointer data;
+	guint timer;
+} LogSearchJob;
+
+static GHashTable *live_docs = NULL;       /* PurpleLog * -> LogSearchDoc * */
+static GHashTable *loaded_indexes = NULL;  /* dir -> LogSearchIndex * */
+static guint index_clock = 0;
+
+static GList *search_jobs = NULL;
+
+static GList *backfill_sets = NULL;
+static GList *backfill_logs = NULL;
+static guint backfill_timer = 0;
+
+/**************************************************************************
+ * Tokenizing
+ **************************************************************************/
+
+typedef void (*LogSearchTokenFunc)(const char *token, gsize offset, gpointer data);
+
+/* Splits plain text into case-folded words of letters and digits. */
+static void
+log_search_tokenize(const char *text, LogSearchTokenFunc func, gpointer data)
+{
+	char *salvaged = NULL;
+	const char *p, *start = NULL;
+	int chars = 0;
+
+	if (text == NULL)
+		return;
+
+	if (!g_utf8_validate(text, -1, NULL))
+		text = salvaged = purple_utf8_salvage(text);
+
+	for (p = text; ; p = g_utf8_next_char(p)) {
+		gunichar c = g_utf8_get_char(p);
+
+		if (c != 0 && g_unichar_isalnum(c)) {
+			if (start == NULL) {
+				start = p;
+				chars = 0;
+			}
+			chars++;
+			continue;
+		}
+
+		if (start != NULL && chars >= SEARCH_MIN_TOKEN &&
+		    p - start <= SEARCH_MAX_TOKEN) {
+			char *token = g_utf8_casefold(start, p - start);
+			func(token, start - text, data);
+			g_free(token);
+		}
+		start = NULL;
+
+		if (c == 0)
+			break;
+	}
+
+	g_free(salvaged);
+}
+
+static void
+log_search_doc_add_token(const char *token, gsize offset, gpointer data)
+{
+	LogSearchDoc *doc = data;
+	LogSearchTokenStat *stat = g_hash_table_lookup(doc->tokens, token);
+
+	if (stat == NULL) {
+		stat = g_new(LogSearchTokenStat, 1);
+		stat->count = 0;
+		stat->offset = doc->live ? SEARCH_OFFSET_UNKNOWN : offset;
+		g_hash_table_insert(doc->tokens, g_strdup(token), stat);
+	}
+	stat->count++;
+}
+
+static void
+log_search_doc_add_markup(LogSearchDoc *doc, const char *markup)
+{
+	char *text = purple_markup_strip_html(markup);
+	log_search_tokenize(text, log_search_doc_add_token, doc);
+	g_free(text);
+}
+
+/**************************************************************************
+ * Documents
+ **************************************************************************/
+
+static char *
+log_search_key(PurpleLog *log)
+{
+	return g_strdup_printf("%s\t%" G_GINT64_FORMAT,
+	                       log->logger ? log->logger->id : "",
+	                       (gint64)log->time);
+}
+
+static LogSearchDoc *
+log_search_doc_new(PurpleLog *log, char *dir)
+{
+	LogSearchDoc *doc = g_new0(LogSearchDoc, 1);
+
+	doc->dir = dir;
+	doc->key = log_search_key(log);
+	doc->tokens = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	return doc;
+}
+
+static void
+log_search_doc_free(LogSearchDoc *doc)
+{
+	g_hash_table_destroy(doc->tokens);
+	g_free(doc->key);
+	g_free(doc->dir);
+	g_free(doc);
+}
+
+static void
+log_search_index_add_posting(LogSearchIndex *idx, const char *token,
+                             guint doc, guint count, gsize offset)
+{
+	GArray *postings = g_hash_table_lookup(idx->postings, token);
+	LogSearchPosting posting;
+
+	if (postings == NULL) {
+		char *copy = g_strdup(token);
+
+		postings = g_array_new(FALSE, FALSE, sizeof(LogSearchPosting));
+		g_hash_table_insert(idx->postings, copy, postings);
+		g_ptr_array_add(idx->vocabulary, copy);
+	}
+
+	posting.doc = doc;
+	posting.count = count;
+	posting.offset = offset;
+	g_array_append_val(postings, posting);
+}
+
+static guint
+log_search_index_add_key(LogSearchIndex *idx, const char *key)
+{
+	char *copy = g_strdup(key);
+	guint doc = idx->keys->len;
+
+	g_ptr_array_add(idx->keys, copy);
+	g_hash_table_replace(idx->docs, copy, GUINT_TO_POINTER(doc + 1));
+
+	return doc;
+}
+
+static void
+log_search_index_add_doc(LogSearchIndex *idx, LogSearchDoc *doc)
+{
+	GHashTableIter iter;
+	gpointer token, value;
+	guint n = log_search_index_add_key(idx, doc->key);
+
+	g_hash_table_iter_init(&iter, doc->tokens);
+	while (g_hash_table_iter_next(&iter, &token, &value)) {
+		LogSearchTokenStat *stat = value;
+		log_search_index_add_posting(idx, token, n, stat->count, stat->offset);
+	}
+}
+
+/* Appends the block for @doc to its directory's index file. */
+static void
+log_search_doc_save(LogSearchDoc *doc)
+{
+	GHashTableIter iter;
+	gpointer token, value;
+	GString *block;
+	char *path;
+	FILE *file;
+
+	block = g_string_sized_new(64 + 16 * g_hash_table_size(doc->tokens));
+	g_string_append_printf(block, "D\t%s\n", doc->key);
+
+	g_hash_table_iter_init(&iter, doc->tokens);
+	while (g_hash_table_iter_next(&iter, &token, &value)) {
+		LogSearchTokenStat *stat = value;
+		g_string_append_printf(block, "%s\t%u\t%" G_GSIZE_FORMAT "\n",
+		                       (char *)token, stat->count, stat->offset);
+	}
+	g_string_append(block, "E\n");
+
+	purple_build_dir(doc->dir, S_IRUSR | S_IWUSR | S_IXUSR);
+	path = g_build_filename(doc->dir, SEARCH_INDEX_FILE, NULL);
+	if ((file = g_fopen(path, "a")) == NULL ||
+	    fwrite(block->str, block->len, 1, file) != 1)
+	{
+		purple_debug_error("log", "Unable to write search index %s: %s\n",
+		                   path, g_strerror(errno));
+	}
+	if (file != NULL)
+		fclose(file);
+	g_free(path);
+	g_string_free(block, TRUE);
+}
+
+/**************************************************************************
+ * Directory indexes
+ **************************************************************************/
+
+static void
+log_search_postings_free(gpointer data)
+{
+	g_array_free(data, TRUE);
+}
+
+static void
+log_search_index_free(gpointer data)
+{
+	LogSearchIndex *idx = data;
+
+	g_ptr_array_free(idx->vocabulary, TRUE);
+	g_hash_table_destroy(idx->postings);
+	g_hash_table_destroy(idx->docs);
+	g_ptr_array_foreach(idx->keys, (GFunc)g_free, NULL);
+	g_ptr_array_free(idx->keys, TRUE);
+	g_free(idx->dir);
+	g_free(idx);
+}
+
+static gboolean
+log_search_doc_is_current(LogSearchIndex *idx, guint doc)
+{
+	return GPOINTER_TO_UINT(g_hash_table_lookup(idx->docs,
+			g_ptr_array_index(idx->keys, doc))) == doc + 1;
+}
+
+/* Rewrites the index file of @idx with only the current block of each log. */
+static void
+log_search_index_compact(LogSearchIndex *idx)
+{
+	GString **blocks, *contents;
+	GHashTableIter iter;
+	gpointer token, value;
+	char *path;
+	guint i;
+
+	blocks = g_new0(GString *, idx->keys->len);
+
+	g_hash_table_iter_init(&iter, idx->postings);
+	while (g_hash_table_iter_next(&iter, &token, &value)) {
+		GArray *postings = value;
+
+		for (i = 0; i < postings->len; i++) {
+			LogSearchPosting *posting = &g_array_index(postings, LogSearchPosting, i);
+
+			if (!log_search_doc_is_current(idx, posting->doc))
+				continue;
+
+			if (blocks[posting->doc] == NULL)
+				blocks[posting->doc] = g_string_new(NULL);
+			g_string_append_printf(blocks[posting->doc], "%s\t%u\t%" G_GSIZE_FORMAT "\n",
+			                       (char *)token, posting->count, posting->offset);
+		}
+	}
+
+	contents = g_string_new(NULL);
+	for (i = 0; i < idx->keys->len; i++) {
+		if (!log_search_doc_is_current(idx, i))
+			continue;
+
+		g_string_append_printf(contents, "D\t%s\n",
+		                       (char *)g_ptr_array_index(idx->keys, i));
+		if (blocks[i] != NULL) {
+			g_string_append_len(contents, blocks[i]->str, blocks[i]->len);
+			g_string_free(blocks[i], TRUE);
+		}
+		g_string_append(contents, "E\n");
+	}
+	g_free(blocks);
+
+	path = g_build_filename(idx->dir, SEARCH_INDEX_FILE, NULL);
+	purple_debug_info("log", "Compacting search index %s to %u logs\n",
+	                  path, g_hash_table_size(idx->docs));
+	purple_util_write_data_to_file_absolute(path, contents->str, contents->len);
+	g_free(path);
+	g_string_free(contents, TRUE);
+}
+
+static void
+log_search_index_load(LogSearchIndex *idx)
+{
+	char *path = g_build_filename(idx->dir, SEARCH_INDEX_FILE, NULL);
+	char *contents, *line, *next;
+	GArray *pending;
+	char *key = NULL;
+
+	if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+		g_free(path);
+		return;
+	}
+
+	pending = g_array_new(FALSE, FALSE, sizeof(char *));
+
+	for (line = contents; line != NULL && *line != '\0'; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+
+		if (line[0] == 'D' && line[1] == '\t') {
+			key = line + 2;
+			g_array_set_size(pending, 0);
+		} else if (line[0] == 'E' && line[1] == '\0') {
+			guint doc, i;
+
+			if (key == NULL)
+				continue;
+
+			doc = log_search_index_add_key(idx, key);
+			for (i = 0; i < pending->len; i++) {
+				char *token = g_array_index(pending, char *, i);
+				char *count = strchr(token, '\t');
+				char *offset;
+
+				if (count == NULL || (offset = strchr(count + 1, '\t')) == NULL)
+					continue;
+				*count++ = '\0';
+				*offset++ = '\0';
+
+				log_search_index_add_posting(idx, token, doc,
+						strtoul(count, NULL, 10),
+						(gsize)g_ascii_strtoull(offset, NULL, 10));
+			}
+			key = NULL;
+		} else if (key != NULL) {
+			g_array_append_val(pending, line);
+		}
+	}
+
+	g_array_free(pending, TRUE);
+	g_free(contents);
+	g_free(path);
+
+	/* Every block appended for a log replaces the one before it. */
+	if (idx->keys->len >= SEARCH_COMPACT_MIN &&
+	    idx->keys->len > 2 * g_hash_table_size(idx->docs))
+		log_search_index_compact(idx);
+}
+
+static void
+log_search_trim_loaded(void)
+{
+	while (g_hash_table_size(loaded_indexes) > SEARCH_MAX_LOADED) {
+		GHashTableIter iter;
+		gpointer value;
+		LogSearchIndex *oldest = NULL;
+
+		g_hash_table_iter_init(&iter, loaded_indexes);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			LogSearchIndex *idx = value;
+			if (oldest == NULL || idx->used < oldest->used)
+				oldest = idx;
+		}
+
+		g_hash_table_remove(loaded_indexes, oldest->dir);
+	}
+}
+
+static LogSearchIndex *
+log_search_get_index(const char *dir)
+{
+	LogSearchIndex *idx = g_hash_table_lookup(loaded_indexes, dir);
+
+	if (idx == NULL) {
+		idx = g_new0(LogSearchIndex, 1);
+		idx->dir = g_strdup(dir);
+		idx->docs = g_hash_table_new(g_str_hash, g_str_equal);
+		idx->keys = g_ptr_array_new();
+		idx->postings = g_hash_table_new_full(g_str_hash, g_str_equal,
+		                                      g_free, log_search_postings_free);
+		idx->vocabulary = g_ptr_array_new();
+		log_search_index_load(idx);
+		g_hash_table_insert(loaded_indexes, idx->dir, idx);
+	}
+
+	idx->used = ++index_clock;
+	return idx;
+}
+
+/* Returns the current doc number of @log in @idx, reading and indexing the
+ * log first if it isn't there yet. */
+static guint
+log_search_index_log(LogSearchIndex *idx, PurpleLog *log)
+{
+	char *key = log_search_key(log);
+	gpointer n = g_hash_table_lookup(idx->docs, key);
+	LogSearchDoc *doc;
+	char *text;
+
+	g_free(key);
+	if (n != NULL)
+		return GPOINTER_TO_UINT(n) - 1;
+
+	doc = log_search_doc_new(log, g_strdup(idx->dir));
+	text = purple_log_read(log, NULL);
+	log_search_doc_add_markup(doc, text);
+	g_free(text);
+
+	log_search_doc_save(doc);
+	log_search_index_add_doc(idx, doc);
+	log_search_doc_free(doc);
+
+	return idx->keys->len - 1;
+}
+
+/**************************************************************************
+ * Searching
+ **************************************************************************/
+
+typedef struct {
+	double weight;
+	gsize offset;
+} LogSearchHit;
+
+typedef struct {
+	LogSearchIndex *idx;
+	GHashTable **hits;     /* One doc number -> LogSearchHit table per term */
+} LogSearchDir;
+
+static void
+log_search_add_query_term(const char *token, gsize offset, gpointer data)
+{
+	GPtrArray *terms = data;
+	guint i;
+
+	for (i = 0; i < terms->len; i++)
+		if (purple_strequal(g_ptr_array_index(terms, i), token))
+			return;
+
+	g_ptr_array_add(terms, g_strdup(token));
+}
+
+/* Collects, for every current doc of @idx, how well it matches @term.
+ * Every word containing @term counts, weighted by an inverse document
+ * frequency so that rare words rank higher. */
+static GHashTable *
+log_search_match_term(LogSearchIndex *idx, const char *term)
+{
+	GHashTable *hits = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	double ndocs = g_hash_table_size(idx->docs);
+	guint n;
+
+	for (n = 0; n < idx->vocabulary->len; n++) {
+		const char *token = g_ptr_array_index(idx->vocabulary, n);
+		GArray *postings;
+		double idf;
+		guint i;
+
+		if (strstr(token, term) == NULL)
+			continue;
+
+		postings = g_hash_table_lookup(idx->postings, token);
+		idf = log(1.0 + ndocs / postings->len);
+
+		for (i = 0; i < postings->len; i++) {
+			LogSearchPosting *posting = &g_array_index(postings, LogSearchPosting, i);
+			LogSearchHit *hit;
+
+			if (!log_search_doc_is_current(idx, posting->doc))
+				continue;
+
+			hit = g_hash_table_lookup(hits, GUINT_TO_POINTER(posting->doc));
+			if (hit == NULL) {
+				hit = g_new0(LogSearchHit, 1);
+				hit->offset = posting->offset;
+				g_hash_table_insert(hits, GUINT_TO_POINTER(posting->doc), hit);
+			} else if (posting->offset < hit->offset) {
+				hit->offset = posting->offset;
+			}
+			hit->weight += (1.0 + log(posting->count)) * idf;
+		}
+	}
+
+	return hits;
+}
+
+static void
+log_search_dir_free(gpointer data)
+{
+	LogSearchDir *sdir = data;
+	guint i;
+
+	if (sdir->hits != NULL) {
+		for (i = 0; sdir->hits[i] != NULL; i++)
+			g_hash_table_destroy(sdir->hits[i]);
+		g_free(sdir->hits);
+	}
+	g_free(sdir);
+}
+
+static gint
+log_search_result_compare(gconstpointer a, gconstpointer b)
+{
+	const PurpleLogSearchResult *ra = a;
+	const PurpleLogSearchResult *rb = b;
+
+	if (ra->score > rb->score)
+		return -1;
+	if (ra->score < rb->score)
+		return 1;
+
+	return purple_log_compare(ra->log, rb->log);
+}
+
+static PurpleLogSearchResult *
+log_search_result_new(PurpleLog *log, double score, gsize offset)
+{
+	PurpleLogSearchResult *result = g_new(PurpleLogSearchResult, 1);
+
+	result->log = log;
+	result->score = score;
+	result->offset = offset;
+
+	return result;
+}
+
+/* The old way: read every log and look for the text in it. */
+static PurpleLogSearchResult *
+log_search_substring(PurpleLog *log, const char *query)
+{
+	PurpleLogSearchResult *result = NULL;
+	char *read = purple_log_read(log, NULL);
+	char *text = purple_markup_strip_html(read);
+	const char *match;
+
+	if (text && *text && (match = purple_strcasestr(text, query)) != NULL)
+		result = log_search_result_new(log, 1.0, match - text);
+	g_free(text);
+	g_free(read);
+
+	return result;
+}
+
+/* Finds @query in a hit from the index, for the offset of the first match
+ * or to find out that the words of the query were not together. */
+static gboolean
+log_search_check(PurpleLogSearchResult *result, const char *query)
+{
+	PurpleLogSearchResult *match = log_search_substring(result->log, query);
+
+	if (match == NULL)
+		return FALSE;
+
+	result->offset = match->offset;
+	g_free(match);
+
+	return TRUE;
+}
+
+/* Whether the hits from the index have to be read to make sure they contain
+ * @query.  They don't if the query is a single word and nothing else. */
+static gboolean
+log_search_needs_check(const char *query, GPtrArray *terms)
+{
+	char *folded;
+	gboolean ret;
+
+	if (terms->len != 1)
+		return TRUE;
+
+	folded = g_utf8_casefold(query, -1);
+	ret = !purple_strequal(folded, g_ptr_array_index(terms, 0));
+	g_free(folded);
+
+	return ret;
+}
+
+static GPtrArray *
+log_search_terms_new(const char *query)
+{
+	GPtrArray *terms = g_ptr_array_new();
+	log_search_tokenize(query, log_search_add_query_term, terms);
+	return terms;
+}
+
+static void
+log_search_terms_free(GPtrArray *terms)
+{
+	g_ptr_array_foreach(terms, (GFunc)g_free, NULL);
+	g_ptr_array_free(terms, TRUE);
+}
+
+/* Returns the directory whose index @log belongs in, or NULL if it has to
+ * be searched the old way. */
+static char *
+log_search_log_dir(PurpleLog *log, GPtrArray *terms)
+{
+	if (terms->len == 0 || log->account == NULL)
+		return NULL;
+
+	return purple_log_get_log_dir(log->type, log->name, log->account);
+}
+
+/* Ranks the logs that can be looked up in an index, indexing those that
+ * aren't yet.  If @query is not NULL, the rest are searched the old way,
+ * and the hits from the index are checked against it. */
+static GList *
+log_search_rank(GList *logs, GPtrArray *terms, const char *query, GList *results)
+{
+	GHashTable *dirs;
+	GList *l;
+	gboolean check = query != NULL && log_search_needs_check(query, terms);
+
+	dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, log_search_dir_free);
+
+	for (l = logs; l != NULL; l = l->next) {
+		PurpleLog *log = l->data;
+		PurpleLogSearchResult *result = NULL;
+		LogSearchDir *sdir;
+		char *dir;
+		guint doc, i;
+		double score = 0.0;
+		gsize first = G_MAXSIZE;
+
+		if ((dir = log_search_log_dir(log, terms)) == NULL) {
+			if (query != NULL && (result = log_search_substring(log, query)) != NULL)
+				results = g_list_prepend(results, result);
+			continue;
+		}
+
+		if ((sdir = g_hash_table_lookup(dirs, dir)) == NULL) {
+			sdir = g_new0(LogSearchDir, 1);
+			sdir->idx = log_search_get_index(dir);
+			g_hash_table_insert(dirs, dir, sdir);
+		} else {
+			g_free(dir);
+		}
+
+		doc = log_search_index_log(sdir->idx, log);
+
+		/* Matching is done per directory, once every log in it that
+		 * we're going to need is indexed. */
+		if (sdir->hits == NULL) {
+			GList *rest;
+
+			for (rest = l->next; rest != NULL; rest = rest->next) {
+				PurpleLog *other = rest->data;
+				char *other_dir;
+
+				if (other->account == NULL)
+					continue;
+				other_dir = purple_log_get_log_dir(other->type, other->name, other->account);
+				if (purple_strequal(other_dir, sdir->idx->dir))
+					log_search_index_log(sdir->idx, other);
+				g_free(other_dir);
+			}
+
+			sdir->hits = g_new0(GHashTable *, terms->len + 1);
+			for (i = 0; i < terms->len; i++)
+				sdir->hits[i] = log_search_match_term(sdir->idx, g_ptr_array_index(terms, i));
+		}
+
+		for (i = 0; i < terms->len; i++) {
+			LogSearchHit *hit = g_hash_table_lookup(sdir->hits[i], GUINT_TO_POINTER(doc));
+
+			if (hit == NULL)
+				break;
+			score += hit->weight;
+			first = MIN(first, hit->offset);
+		}
+
+		if (i < terms->len)
+			continue;
+
+		result = log_search_result_new(log, score, first);
+		if (!check || log_search_check(result, query))
+			results = g_list_prepend(results, result);
+		else
+			g_free(result);
+	}
+
+	g_hash_table_destroy(dirs);
+	log_search_trim_loaded();
+
+	return g_list_sort(results, log_search_result_compare);
+}
+
+/* Drops the ranked results outside of the requested page. */
+static GList *
+log_search_page(GList *results, guint offset, guint limit, guint *total)
+{
+	GList *l;
+	guint count = 0;
+
+	for (l = results; l != NULL; count++) {
+		GList *next = l->next;
+
+		if (count < offset || (limit > 0 && count >= offset + limit)) {
+			g_free(l->data);
+			results = g_list_delete_link(results, l);
+		}
+		l = next;
+	}
+
+	if (total != NULL)
+		*total = count;
+
+	return results;
+}
+
+typedef struct {
+	GPtrArray *terms;
+	gsize offset;
+} LogSearchFirstMatch;
+
+static void
+log_search_first_match_token(const char *token, gsize offset, gpointer data)
+{
+	LogSearchFirstMatch *match = data;
+	guint i;
+
+	if (match->offset != SEARCH_OFFSET_UNKNOWN)
+		return;
+
+	for (i = 0; i < match->terms->len; i++) {
+		if (strstr(token, g_ptr_array_index(match->terms, i)) != NULL) {
+			match->offset = offset;
+			return;
+		}
+	}
+}
+
+/* Finds the first match in a log that was indexed as it was written. */
+static void
+log_search_resolve_offset(PurpleLogSearchResult *result, GPtrArray *terms)
+{
+	LogSearchFirstMatch match;
+	char *read, *text;
+
+	if (result->offset != SEARCH_OFFSET_UNKNOWN)
+		return;
+
+	read = purple_log_read(result->log, NULL);
+	text = purple_markup_strip_html(read);
+
+	match.terms = terms;
+	match.offset = SEARCH_OFFSET_UNKNOWN;
+	log_search_tokenize(text, log_search_first_match_token, &match);
+	result->offset = (match.offset != SEARCH_OFFSET_UNKNOWN) ? match.offset : 0;
+
+	g_free(text);
+	g_free(read);
+}
+
+GList *
+purple_log_search(GList *logs, const char *query, guint offset,
+                  guint limit, guint *total)
+{
+	GPtrArray *terms;
+	GList *results, *l;
+
+	g_return_val_if_fail(query != NULL, NULL);
+
+	terms = log_search_terms_new(query);
+	results = log_search_rank(logs, terms, query, NULL);
+	results = log_search_page(results, offset, limit, total);
+
+	for (l = results; l != NULL; l = l->next)
+		log_search_resolve_offset(l->data, terms);
+
+	log_search_terms_free(terms);
+
+	return results;
+}
+
+/**************************************************************************
+ * Searching without blocking
+ **************************************************************************/
+
+static void
+log_search_job_free(LogSearchJob *job)
+{
+	if (job->timer != 0)
+		purple_timeout_remove(job->timer);
+
+	purple_log_search_results_free(job->results);
+	purple_log_search_results_free(job->hits);
+	log_search_terms_free(job->terms);
+	g_free(job->query);
+	g_free(job);
+}
+
+/* Reads and indexes the logs of a search, then finds the first match in the
+ * results that need it, roughly BACKFILL_CHUNK bytes of logs at a time. */
+static gboolean
+log_search_job_cb(gpointer data)
+{
+	LogSearchJob *job = data;
+	gsize budget = BACKFILL_CHUNK;
+	GList *results;
+
+	while (budget > 0 && job->next != NULL) {
+		if (job->stage == LOG_SEARCH_INDEXING) {
+			PurpleLog *log = job->next->data;
+			char *dir = log_search_log_dir(log, job->terms);
+
+			if (dir == NULL) {
+				PurpleLogSearchResult *result = log_search_substring(log, job->query);
+
+				if (result != NULL)
+					job->results = g_list_prepend(job->results, result);
+				budget -= MIN(budget, (gsize)MAX(purple_log_get_size(log), 1));
+			} else {
+				LogSearchIndex *idx = log_search_get_index(dir);
+				char *key = log_search_key(log);
+
+				if (g_hash_table_lookup(idx->docs, key) == NULL) {
+					log_search_index_log(idx, log);
+					budget -= MIN(budget, (gsize)MAX(purple_log_get_size(log), 1));
+				}
+
+				g_free(key);
+				g_free(dir);
+			}
+		} else if (job->stage == LOG_SEARCH_CHECKING) {
+			GList *next = job->next->next;
+			PurpleLogSearchResult *result = job->next->data;
+
+			budget -= MIN(budget, (gsize)MAX(purple_log_get_size(result->log), 1));
+			if (!log_search_check(result, job->query)) {
+				g_free(result);
+				job->hits = g_list_delete_link(job->hits, job->next);
+			}
+
+			job->next = next;
+			continue;
+		} else {
+			PurpleLogSearchResult *result = job->next->data;
+
+			if (result->offset == SEARCH_OFFSET_UNKNOWN) {
+				log_search_resolve_offset(result, job->terms);
+				budget -= MIN(budget, (gsize)MAX(purple_log_get_size(result->log), 1));
+			}
+		}
+
+		job->next = job->next->next;
+	}
+
+	if (job->next != NULL)
+		return TRUE;
+
+	if (job->stage == LOG_SEARCH_INDEXING) {
+		/* Everything is indexed now, so this doesn't read any logs. */
+		if (log_search_needs_check(job->query, job->terms)) {
+			job->hits = log_search_rank(job->logs, job->terms, NULL, NULL);
+			job->stage = LOG_SEARCH_CHECKING;
+			job->next = job->hits;
+			if (job->next != NULL)
+				return TRUE;
+		} else {
+			job->results = log_search_rank(job->logs, job->terms, NULL, job->results);
+			job->stage = LOG_SEARCH_CHECKING;
+		}
+	}
+
+	if (job->stage == LOG_SEARCH_CHECKING) {
+		/* The old way's results were checked as they were found. */
+		job->results = g_list_sort(g_list_concat(job->results, job->hits),
+				log_search_result_compare);
+		job->hits = NULL;
+		job->results = log_search_page(job->results, job->offset, job->limit, &job->total);
+		job->stage = LOG_SEARCH_RESOLVING;
+		job->next = job->results;
+		if (job->next != NULL)
+			return TRUE;
+	}
+
+	job->timer = 0;
+	search_jobs = g_list_remove(search_jobs, job);
+
+	results = job->results;
+	job->results = NULL;
+	job->cb(results, job->total, job->data);
+	log_search_job_free(job);
+
+	return FALSE;
+}
+
+void
+purple_log_search_async(void *handle, GList *logs, const char *query,
+                        guint offset, guint limit,
+                        PurpleLogSearchCallback cb, gpointer data)
+{
+	LogSearchJob *job;
+
+	g_return_if_fail(query != NULL);
+	g_return_if_fail(cb != NULL);
+
+	job = g_new0(LogSearchJob, 1);
+	job->handle = handle;
+	job->stage = LOG_SEARCH_INDEXING;
+	job->logs = logs;
+	job->next = logs;
+	job->terms = log_search_terms_new(query);
+	job->query = g_strdup(query);
+	job->offset = offset;
+	job->limit = limit;
+	job->cb = cb;
+	job->data = data;
+	job->timer = purple_timeout_add(SEARCH_CHUNK_INTERVAL, log_search_job_cb, job);
+
+	search_jobs = g_list_prepend(search_jobs, job);
+}
+
+void
+purple_log_search_cancel_with_handle(void *handle)
+{
+	GList *l, *next;
+
+	for (l = search_jobs; l != NULL; l = next) {
+		LogSearchJob *job = l->data;
+
+		next = l->next;
+		if (job->handle != handle)
+			continue;
+
+		search_jobs = g_list_delete_link(search_jobs, l);
+		log_search_job_free(job);
+	}
+}
+
+void
+purple_log_search_results_free(GList *results)
+{
+	g_list_foreach(results, (GFunc)g_free, NULL);
+	g_list_free(results);
+}
+
+/**************************************************************************
+ * Indexing logs as they are written
+ **************************************************************************/
+
+void
+purple_log_search_index_message(PurpleLog *log, PurpleMessageFlags type,
+                                const char *from, const char *message,
+                                gsize written)
+{
+	LogSearchDoc *doc;
+
+	if (live_docs == NULL || written == 0 ||
+	    !purple_prefs_get_bool("/purple/logging/index_logs"))
+		return;
+
+	doc = g_hash_table_lookup(live_docs, log);
+	if (doc == NULL) {
+		char *dir = purple_log_get_log_dir(log->type, log->name, log->account);
+
+		if (dir == NULL)
+			return;
+
+		doc = log_search_doc_new(log, dir);
+		doc->live = TRUE;
+		g_hash_table_insert(live_docs, log, doc);
+	}
+
+	if (from != NULL && !(type & PURPLE_MESSAGE_SYSTEM))
+		log_search_tokenize(from, log_search_doc_add_token, doc);
+	log_search_doc_add_markup(doc, message);
+}
+
+void
+purple_log_search_forget(PurpleLog *log)
+{
+	LogSearchDoc *doc;
+	LogSearchIndex *idx;
+
+	if (live_docs == NULL || (doc = g_hash_table_lookup(live_docs, log)) == NULL)
+		return;
+
+	g_hash_table_steal(live_docs, log);
+
+	log_search_doc_save(doc);
+	if ((idx = g_hash_table_lookup(loaded_indexes, doc->dir)) != NULL)
+		log_search_index_add_doc(idx, doc);
+
+	log_search_doc_free(doc);
+}
+
+/**************************************************************************
+ * Indexing existing logs in the background
+ **************************************************************************/
+
+static void
+log_search_backfill_set_free(LogSearchBackfillSet *set)
+{
+	g_free(set->name);
+	g_free(set);
+}
+
+static void
+log_search_backfill_stop(void)
+{
+	if (backfill_timer != 0) {
+		purple_timeout_remove(backfill_timer);
+		backfill_timer = 0;
+	}
+
+	g_list_foreach(backfill_sets, (GFunc)log_search_backfill_set_free, NULL);
+	g_list_free(backfill_sets);
+	backfill_sets = NULL;
+
+	g_list_foreach(backfill_logs, (GFunc)purple_log_free, NULL);
+	g_list_free(backfill_logs);
+	backfill_logs = NULL;
+}
+
+/* Indexes logs until roughly BACKFILL_CHUNK bytes have been read. */
+static gboolean
+log_search_backfill_cb(gpointer data)
+{
+	gsize budget = BACKFILL_CHUNK;
+	guint looked = 0;
+
+	if (!purple_prefs_get_bool("/purple/logging/index_logs")) {
+		backfill_timer = 0;
+		log_search_backfill_stop();
+		return FALSE;
+	}
+
+	while (budget > 0 && looked < BACKFILL_MAX_LOGS) {
+		PurpleLog *log;
+		LogSearchIndex *idx;
+		char *dir, *key;
+
+		if (backfill_logs == NULL) {
+			LogSearchBackfillSet *set;
+
+			if (backfill_sets == NULL) {
+				purple_debug_info("log", "Finished indexing logs for search\n");
+				log_search_trim_loaded();
+				backfill_timer = 0;
+				return FALSE;
+			}
+
+			set = backfill_sets->data;
+			backfill_sets = g_list_delete_link(backfill_sets, backfill_sets);
+
+			/* The account may have gone away since we started. */
+			if (g_list_find(purple_accounts_get_all(), set->account))
+				backfill_logs = purple_log_get_logs(set->type, set->name, set->account);
+			log_search_backfill_set_free(set);
+			log_search_trim_loaded();
+			continue;
+		}
+
+		log = backfill_logs->data;
+		backfill_logs = g_list_delete_link(backfill_logs, backfill_logs);
+		looked++;
+
+		dir = purple_log_get_log_dir(log->type, log->name, log->account);
+		if (dir != NULL) {
+			idx = log_search_get_index(dir);
+			key = log_search_key(log);
+
+			if (g_hash_table_lookup(idx->docs, key) == NULL) {
+				int size = purple_log_get_size(log);
+
+				log_search_index_log(idx, log);
+				budget -= MIN(budget, (gsize)MAX(size, 1));
+			}
+
+			g_free(key);
+			g_free(dir);
+		}
+
+		purple_log_free(log);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+log_search_backfill_start_cb(gpointer data)
+{
+	GHashTable *sets;
+	GHashTableIter iter;
+	gpointer value;
+
+	backfill_timer = 0;
+
+	if (!purple_prefs_get_bool("/purple/logging/index_logs"))
+		return FALSE;
+
+	sets = purple_log_get_log_sets();
+	g_hash_table_iter_init(&iter, sets);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		PurpleLogSet *logset = value;
+		LogSearchBackfillSet *set;
+
+		if (logset->account == NULL || logset->type == PURPLE_LOG_SYSTEM)
+			continue;
+
+		set = g_new(LogSearchBackfillSet, 1);
+		set->type = logset->type;
+		set->name = g_strdup(logset->name);
+		set->account = logset->account;
+		backfill_sets = g_list_prepend(backfill_sets, set);
+	}
+	g_hash_table_destroy(sets);
+
+	purple_debug_info("log", "Indexing logs of %u conversations for search\n",
+	                  g_list_length(backfill_sets));
+
+	backfill_timer = purple_timeout_add(BACKFILL_INTERVAL, log_search_backfill_cb, NULL);
+
+	return FALSE;
+}
+
+static void
+log_search_index_logs_pref_cb(const char *name, PurplePrefType type,
+                              gconstpointer val, gpointer data)
+{
+	if (GPOINTER_TO_INT(val) && backfill_timer == 0 &&
+	    backfill_sets == NULL && backfill_logs == NULL)
+		backfill_timer = purple_timeout_add_seconds(BACKFILL_DELAY,
+				log_search_backfill_start_cb, NULL);
+}
+
+/**************************************************************************
+ * Subsystem
+ **************************************************************************/
+
+void
+purple_log_search_init(void)
+{
+	purple_prefs_add_bool("/purple/logging/index_logs", TRUE);
+
+	live_docs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+	                                  (GDestroyNotify)log_search_doc_free);
+	loaded_indexes = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+	                                       log_search_index_free);
+
+	purple_prefs_connect_callback(purple_log_get_handle(), "/purple/logging/index_logs",
+	                              log_search_index_logs_pref_cb, NULL);
+
+	if (purple_prefs_get_bool("/purple/logging/index_logs"))
+		backfill_timer = purple_timeout_add_seconds(BACKFILL_DELAY,
+				log_search_backfill_start_cb, NULL);
+}
+
+void
+purple_log_search_uninit(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	log_search_backfill_stop();
+
+	while (search_jobs != NULL) {
+		log_search_job_free(search_jobs->data);
+		search_jobs = g_list_delete_link(search_jobs, search_jobs);
+	}
+
+	/* Logs should all be freed by now, but don't lose what we have. */
+	g_hash_table_iter_init(&iter, live_docs);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		log_search_doc_save(value);
+
+	g_hash_table_destroy(live_docs);
+	live_docs = NULL;
+	g_hash_table_destroy(loaded_indexes);
+	loaded_indexes = NULL;
+}
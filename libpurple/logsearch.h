@@ -0,0 +1,175 @@
+/**
+ * @file logsearch.h Log Search API
+ * @ingroup core
+ */
+
+/* purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#ifndef _PURPLE_LOGSEARCH_H_
+#define _PURPLE_LOGSEARCH_H_
+
+#include "log.h"
+
+/**
+ * A single search hit.
+ */
+typedef struct _PurpleLogSearchResult {
+	PurpleLog *log;      /**< One of the logs that were searched. This is
+	                          not a copy and is owned by the caller of
+	                          purple_log_search(). */
+	double score;        /**< The rank of this hit; higher is better. */
+	gsize offset;        /**< Offset of the first match in the text of
+	                          purple_log_read() with the markup stripped,
+	                          in bytes. */
+} PurpleLogSearchResult;
+
+/**
+ * Called when a search started with purple_log_search_async() is done.
+ *
+ * @param results A list of PurpleLogSearchResults, best match first. Free
+ *                it with purple_log_search_results_free().
+ * @param total   The total number of matching logs.
+ * @param data    The data passed to purple_log_search_async().
+ */
+typedef void (*PurpleLogSearchCallback)(GList *results, guint total, gpointer data);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************************************/
+/** @name Log Search API                                                  */
+/**************************************************************************/
+/*@{*/
+
+/**
+ * Searches a set of logs for a query.
+ *
+ * A log matches if it contains the query, ignoring case.  The query is
+ * split into words the same way the logs are, and only logs with every
+ * word of the query somewhere in their own words are looked at.  Logs
+ * which have not been indexed yet are indexed first, so the first search
+ * over an unindexed log costs a purple_log_read(), and so does checking
+ * a query that is more than a single word.
+ *
+ * If the query contains no indexable words, this falls back to a
+ * case-insensitive substring search of every log.
+ *
+ * @param logs    A list of PurpleLogs to search, such as the one returned
+ *                by purple_log_get_logs().
+ * @param query   The text to search for.
+ * @param offset  The number of ranked results to skip.
+ * @param limit   The maximum number of results to return, or @c 0 for
+ *                no limit.
+ * @param total   If not @c NULL, set to the total number of matching logs.
+ *
+ * @return A list of PurpleLogSearchResults, best match first. Free it with
+ *         purple_log_search_results_free().
+ */
+GList *purple_log_search(GList *logs, const char *query, guint offset,
+                         guint limit, guint *total);
+
+/**
+ * Searches a set of logs for a query like purple_log_search(), but reads
+ * and indexes the logs a little at a time from the event loop instead of
+ * all at once.
+ *
+ * @param handle  A handle to cancel the search with, such as the log viewer
+ *                showing the results.
+ * @param logs    A list of PurpleLogs to search.  The list and the logs must
+ *                stay around until @a cb is called or the search is
+ *                cancelled.
+ * @param query   The text to search for.
+ * @param offset  The number of ranked results to skip.
+ * @param limit   The maximum number of results to return, or @c 0 for
+ *                no limit.
+ * @param cb      The function to call with the results.
+ * @param data    User data to pass to @a cb.
+ */
+void purple_log_search_async(void *handle, GList *logs, const char *query,
+                             guint offset, guint limit,
+                             PurpleLogSearchCallback cb, gpointer data);
+
+/**
+ * Cancels every search started with purple_log_search_async() for a handle.
+ * Their callbacks are not called.
+ *
+ * @param handle The handle passed to purple_log_search_async().
+ */
+void purple_log_search_cancel_with_handle(void *handle);
+
+/**
+ * Frees a list returned by purple_log_search().  The logs themselves
+ * are not freed.
+ *
+ * @param results The list of results.
+ */
+void purple_log_search_results_free(GList *results);
+
+/**
+ * Adds a message to the search index of a log.  This is called by
+ * purple_log_write() and should not be needed elsewhere.
+ *
+ * @param log     The log being written.
+ * @param type    The type of the message.
+ * @param from    Whom this message is coming from, or @c NULL.
+ * @param message The message, in Purple markup.
+ * @param written The number of bytes the logger wrote for this message, or
+ *                @c 0 if nothing was written.
+ */
+void purple_log_search_index_message(PurpleLog *log, PurpleMessageFlags type,
+                                     const char *from, const char *message,
+                                     gsize written);
+
+/**
+ * Saves and forgets the in-progress index of a log.  This is called by
+ * purple_log_free() and should not be needed elsewhere.
+ *
+ * @param log The log being freed.
+ */
+void purple_log_search_forget(PurpleLog *log);
+
+/*@}*/
+
+/**************************************************************************/
+/** @name Log Search Subsystem                                            */
+/**************************************************************************/
+/*@{*/
+
+/**
+ * Initializes the log search subsystem.  This is called by
+ * purple_log_init().
+ */
+void purple_log_search_init(void);
+
+/**
+ * Uninitializes the log search subsystem.  This is called by
+ * purple_log_uninit().
+ */
+void purple_log_search_uninit(void);
+
+/*@}*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PURPLE_LOGSEARCH_H_ */
@@ -37,6 +37,7 @@ typedef struct
 	gnutls_session_t session;
 	guint handshake_handler;
 	guint handshake_timer;
+	gboolean established;
 } PurpleSslGnutlsData;
 
 #define PURPLE_SSL_GNUTLS_DATA(gsc) ((PurpleSslGnutlsData *)gsc->private_data)
@@ -205,6 +206,31 @@ ssl_gnutls_uninit(void)
 #endif
 }
 
+static void
+ssl_gnutls_store_session(PurpleSslConnection *gsc)
+{
+	PurpleSslGnutlsData *gnutls_data = PURPLE_SSL_GNUTLS_DATA(gsc);
+	gnutls_datum_t data;
+
+	if (gnutls_session_get_data2(gnutls_data->session, &data) != GNUTLS_E_SUCCESS)
+		return;
+
+	purple_ssl_session_store(gsc, data.data, data.size);
+	gnutls_free(data.data);
+}
+
+static void
+ssl_gnutls_established(PurpleSslConnection *gsc, PurpleInputCondition cond)
+{
+	PurpleSslGnutlsData *gnutls_data = PURPLE_SSL_GNUTLS_DATA(gsc);
+
+	/* The next connection to this host can skip most of the handshake. */
+	gnutls_data->established = TRUE;
+	ssl_gnutls_store_session(gsc);
+
+	gsc->connect_cb(gsc->connect_cb_data, gsc, cond);
+}
+
 static void
 ssl_gnutls_verified_cb(PurpleCertificateVerificationStatus st,
 		       gpointer userdata)
@@ -213,9 +239,10 @@ ssl_gnutls_verified_cb(PurpleCertificateVerificationStatus st,
 
 	if (st == PURPLE_CERTIFICATE_VALID) {
 		/* Certificate valid? Good! Do the connection! */
-		gsc->connect_cb(gsc->connect_cb_data, gsc, PURPLE_INPUT_READ);
+		ssl_gnutls_established(gsc, PURPLE_INPUT_READ);
 	} else {
 		/* Otherwise, signal an error */
+		purple_ssl_session_forget(gsc);
 		if(gsc->error_cb != NULL)
 			gsc->error_cb(gsc, PURPLE_SSL_CERTIFICATE_INVALID,
 				      gsc->connect_cb_data);
@@ -245,6 +272,8 @@ static void ssl_gnutls_handshake_cb(gpointer data, gint source,
 		purple_debug_error("gnutls", "Handshake failed. Error %s\n",
 			gnutls_strerror(ret));
 
+		purple_ssl_session_forget(gsc);
+
 		if(gsc->error_cb != NULL)
 			gsc->error_cb(gsc, PURPLE_SSL_HANDSHAKE_FAILED,
 				gsc->connect_cb_data);
@@ -261,7 +290,9 @@ static void ssl_gnutls_handshake_cb(gpointer data, gint source,
 		GList * l;
 
 		/* TODO: Remove all this debugging babble */
-		purple_debug_info("gnutls", "Handshake complete\n");
+		purple_debug_info("gnutls", "Handshake complete%s\n",
+			gnutls_session_is_resumed(gnutls_data->session) ?
+				" (session resumed)" : "");
 
 		for (l=peers; l; l = l->next) {
 			PurpleCertificate *crt = l->data;
@@ -362,7 +393,7 @@ static void ssl_gnutls_handshake_cb(gpointer data, gint source,
 		} else {
 			/* Otherwise, just call the "connection complete"
 			   callback */
-			gsc->connect_cb(gsc->connect_cb_data, gsc, cond);
+			ssl_gnutls_established(gsc, cond);
 		}
 	}
 
@@ -415,6 +446,21 @@ ssl_gnutls_connect(PurpleSslConnection *gsc)
 	gnutls_credentials_set(gnutls_data->session, GNUTLS_CRD_CERTIFICATE,
 		xcred);
 
+#if GNUTLS_VERSION_NUMBER >= 0x020a00 && GNUTLS_VERSION_NUMBER < 0x030600
+	/* Newer versions do this by default */
+	gnutls_session_ticket_enable_client(gnutls_data->session);
+#endif
+
+	{
+		gconstpointer session_data;
+		gsize session_len;
+
+		session_data = purple_ssl_session_lookup(gsc, &session_len);
+		if (session_data != NULL)
+			gnutls_session_set_data(gnutls_data->session, session_data,
+			                        session_len);
+	}
+
 	gnutls_transport_set_ptr(gnutls_data->session, GINT_TO_POINTER(gsc->fd));
 
 	gnutls_data->handshake_handler = purple_input_add(gsc->fd,
@@ -449,6 +495,10 @@ ssl_gnutls_close(PurpleSslConnection *gsc)
 	if (gnutls_data->handshake_timer)
 		purple_timeout_remove(gnutls_data->handshake_timer);
 
+	/* Servers may have sent us a new session ticket since the handshake. */
+	if (gnutls_data->established)
+		ssl_gnutls_store_session(gsc);
+
 	gnutls_bye(gnutls_data->session, GNUTLS_SHUT_RDWR);
 
 	gnutls_deinit(gnutls_data->session);
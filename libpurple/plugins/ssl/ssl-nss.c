@@ -317,6 +317,7 @@ ssl_nss_verified_cb(PurpleCertificateVerificationStatus st,
 		gsc->connect_cb(gsc->connect_cb_data, gsc, PURPLE_INPUT_READ);
 	} else {
 		/* Otherwise, signal an error */
+		SSL_InvalidateSession(PURPLE_SSL_NSS_DATA(gsc)->in);
 		if(gsc->error_cb != NULL)
 			gsc->error_cb(gsc, PURPLE_SSL_CERTIFICATE_INVALID,
 				      gsc->connect_cb_data);
@@ -442,6 +443,8 @@ ssl_nss_handshake_cb(gpointer data, int fd, PurpleInputCondition cond)
 		purple_debug_error("nss", "Handshake failed %s (%d)\n", error_txt ? error_txt : "", PR_GetError());
 		g_free(error_txt);
 
+		SSL_InvalidateSession(nss_data->in);
+
 		if (gsc->error_cb != NULL)
 			gsc->error_cb(gsc, PURPLE_SSL_HANDSHAKE_FAILED, gsc->connect_cb_data);
 
@@ -539,6 +542,13 @@ ssl_nss_connect(PurpleSslConnection *gsc)
 	SSL_OptionSet(nss_data->in, SSL_SECURITY,            PR_TRUE);
 	SSL_OptionSet(nss_data->in, SSL_HANDSHAKE_AS_CLIENT, PR_TRUE);
 
+	/* NSS keeps its own cache of client sessions, and has no way to hand
+	 * them over to purple_ssl_session_store(), so resuming is left to it. */
+	SSL_OptionSet(nss_data->in, SSL_NO_CACHE,            PR_FALSE);
+#ifdef SSL_ENABLE_SESSION_TICKETS
+	SSL_OptionSet(nss_data->in, SSL_ENABLE_SESSION_TICKETS, PR_TRUE);
+#endif
+
 	/* If we have our internal verifier set up, use it. Otherwise,
 	 * use default. */
 	if (gsc->verifier != NULL)
@@ -457,6 +457,10 @@ int irc_cmd_quit(struct irc_conn *irc, const char *cmd, const char *target, cons
 	char *buf;
 
 	if (!irc->quitting) {
+		/* Nothing can be sent after the QUIT, so the user's own lines
+		 * go now and the rest are dropped */
+		irc_send_flush(irc);
+
 		/*
 		 * Use purple_account_get_string(irc->account, "quitmsg", IRC_DEFAULT_QUIT)
 		 * and uncomment the appropriate account preference in irc.c if we
@@ -104,7 +104,9 @@ static int irc_send_raw(PurpleConnection *gc, const char *buf, int len)
 	if (len == -1) {
 		len = strlen(buf);
 	}
+	irc->send_for_user = TRUE;
 	irc_send_len(irc, buf, len);
+	irc->send_for_user = FALSE;
 	return len;
 }
 
@@ -151,7 +153,152 @@ int irc_send(struct irc_conn *irc, const char *buf)
     return irc_send_len(irc, buf, strlen(buf));
 }
 
+/* Lines the server needs to see promptly skip the bucket, and lines
+ * which tend to come in large numbers wait for the user's own.  Anything
+ * the user asked for goes in their lane, whatever it is. */
+static enum irc_send_lane irc_send_get_lane(struct irc_conn *irc, const char *buf)
+{
+	static const char *urgent[] = {
+		"PONG", "PING", "QUIT", "CAP", "AUTHENTICATE", "PASS", "NICK", "USER", NULL
+	};
+	static const char *bulk[] = {
+		"WHO", "ISON", "JOIN", "NAMES", "LIST", "MODE", "MONITOR", "WATCH",
+		"CHATHISTORY", "USERHOST", NULL
+	};
+	gsize len = strcspn(buf, " \r\n");
+	int i;
+
+	for (i = 0; urgent[i]; i++)
+		if (len == strlen(urgent[i]) && !g_ascii_strncasecmp(buf, urgent[i], len))
+			return IRC_SEND_URGENT;
+
+	if (irc->send_for_user)
+		return IRC_SEND_USER;
+
+	for (i = 0; bulk[i]; i++)
+		if (len == strlen(bulk[i]) && !g_ascii_strncasecmp(buf, bulk[i], len))
+			return IRC_SEND_BULK;
+
+	return IRC_SEND_USER;
+}
+
+/* Adds a token for each interval since the bucket was last refilled */
+static void irc_send_refill(struct irc_conn *irc)
+{
+	GTimeVal now;
+	glong elapsed;
+	int tokens;
+
+	g_get_current_time(&now);
+	elapsed = (now.tv_sec - irc->send_refilled.tv_sec) * 1000 +
+	          (now.tv_usec - irc->send_refilled.tv_usec) / 1000;
+
+	if (elapsed < 0) {
+		/* The clock went backwards */
+		irc->send_refilled = now;
+		return;
+	}
+
+	tokens = elapsed / irc->send_interval;
+	if (tokens == 0)
+		return;
+
+	irc->send_tokens += tokens;
+	if (irc->send_tokens >= irc->send_burst) {
+		irc->send_tokens = irc->send_burst;
+		irc->send_refilled = now;
+	} else
+		g_time_val_add(&irc->send_refilled, (glong)tokens * irc->send_interval * 1000);
+}
+
+int irc_send_queue_length(struct irc_conn *irc)
+{
+	int i, length = 0;
+
+	for (i = 0; i < IRC_SEND_LANES; i++)
+		length += g_queue_get_length(irc->send_queue[i]);
+
+	return length;
+}
+
+static int irc_send_now(struct irc_conn *irc, const char *buf, int buflen);
+
+static gboolean irc_send_timeout(struct irc_conn *irc)
+{
+	char *buf;
+	int i;
+
+	irc_send_refill(irc);
+
+	for (i = 0; i < IRC_SEND_LANES && irc->send_tokens > 0; ) {
+		if ((buf = g_queue_pop_head(irc->send_queue[i])) == NULL) {
+			i++;
+			continue;
+		}
+
+		irc->send_tokens--;
+		irc_send_now(irc, buf, strlen(buf));
+		g_free(buf);
+	}
+
+	if (irc_send_queue_length(irc) > 0)
+		return TRUE;
+
+	irc->send_timer = 0;
+	irc->send_queue_noted = FALSE;
+	return FALSE;
+}
+
+/*
+ * Sends what the user is still waiting on ahead of a QUIT.  The bulk lane
+ * is dropped: it is only there to keep us from flooding the server, and
+ * sending all of it at once could get us killed before the QUIT is seen.
+ */
+void irc_send_flush(struct irc_conn *irc)
+{
+	char *buf;
+	int i;
+
+	for (i = 0; i < IRC_SEND_LANES; i++) {
+		while ((buf = g_queue_pop_head(irc->send_queue[i])) != NULL) {
+			if (i != IRC_SEND_BULK)
+				irc_send_now(irc, buf, strlen(buf));
+			g_free(buf);
+		}
+	}
+
+	if (irc->send_timer) {
+		purple_timeout_remove(irc->send_timer);
+		irc->send_timer = 0;
+	}
+	irc->send_queue_noted = FALSE;
+}
+
 int irc_send_len(struct irc_conn *irc, const char *buf, int buflen)
+{
+	enum irc_send_lane lane;
+
+	if (irc->send_interval <= 0)
+		return irc_send_now(irc, buf, buflen);
+
+	irc_send_refill(irc);
+	lane = irc_send_get_lane(irc, buf);
+
+	if (lane == IRC_SEND_URGENT || (irc->send_tokens > 0 && irc_send_queue_length(irc) == 0)) {
+		if (irc->send_tokens > 0)
+			irc->send_tokens--;
+		return irc_send_now(irc, buf, buflen);
+	}
+
+	g_queue_push_tail(irc->send_queue[lane], g_strndup(buf, buflen));
+	if (!irc->send_timer)
+		irc->send_timer = purple_timeout_add(irc->send_interval,
+			(GSourceFunc)irc_send_timeout, irc);
+
+	return buflen;
+}
+
+static int irc_send_now(struct irc_conn *irc, const char *buf, int buflen)
 {
 	int ret;
  	char *tosend= g_strdup(buf);
@@ -238,6 +385,10 @@ void irc_buddy_query(struct irc_conn *irc)
 
 static void irc_ison_buddy_init(char *name, struct irc_buddy *ib, GList **list)
 {
+	/* The server tells us about these without being asked */
+	if (ib->monitored)
+		return;
+
 	*list = g_list_append(*list, ib);
 }
 
@@ -257,6 +408,93 @@ static void irc_ison_one(struct irc_conn *irc, struct irc_buddy *ib)
 	g_free(buf);
 }
 
+static void irc_monitor_flush(struct irc_conn *irc, GString *string, gboolean add)
+{
+	char *buf;
+
+	if (!string->len)
+		return;
+
+	if (irc->presence == IRC_PRESENCE_MONITOR)
+		buf = irc_format(irc, "vvn", "MONITOR", add ? "+" : "-", string->str);
+	else
+		buf = irc_format(irc, "vn", "WATCH", string->str);
+	irc_send(irc, buf);
+	g_free(buf);
+
+	g_string_truncate(string, 0);
+}
+
+/* MONITOR takes a comma separated list of nicks, WATCH a space separated
+ * list of nicks each prefixed with + or -. */
+static void irc_monitor_send(struct irc_conn *irc, GList *ibs, gboolean add)
+{
+	GString *string;
+	struct irc_buddy *ib;
+
+	string = g_string_sized_new(512);
+
+	for (; ibs; ibs = ibs->next) {
+		ib = (struct irc_buddy *)ibs->data;
+		if (string->len + strlen(ib->name) + 2 > 450)
+			irc_monitor_flush(irc, string, add);
+
+		if (irc->presence == IRC_PRESENCE_MONITOR) {
+			if (string->len)
+				g_string_append_c(string, ',');
+		} else {
+			if (string->len)
+				g_string_append_c(string, ' ');
+			g_string_append_c(string, add ? '+' : '-');
+		}
+		g_string_append(string, ib->name);
+	}
+
+	irc_monitor_flush(irc, string, add);
+	g_string_free(string, TRUE);
+}
+
+static gboolean irc_monitor_has_room(struct irc_conn *irc)
+{
+	if (irc->presence == IRC_PRESENCE_ISON)
+		return FALSE;
+
+	return irc->monitor_limit <= 0 || irc->monitor_count < irc->monitor_limit;
+}
+
+static void irc_monitor_buddy_init(char *name, struct irc_buddy *ib, struct irc_conn *irc)
+{
+	if (ib->monitored || !irc_monitor_has_room(irc))
+		return;
+
+	ib->monitored = TRUE;
+	irc->monitor_count++;
+}
+
+static void irc_monitor_list_init(char *name, struct irc_buddy *ib, GList **list)
+{
+	if (ib->monitored)
+		*list = g_list_prepend(*list, ib);
+}
+
+void irc_buddies_monitor(struct irc_conn *irc)
+{
+	GList *list = NULL;
+
+	if (irc->presence == IRC_PRESENCE_ISON)
+		return;
+
+	g_hash_table_foreach(irc->buddies, (GHFunc)irc_monitor_buddy_init, irc);
+	g_hash_table_foreach(irc->buddies, (GHFunc)irc_monitor_list_init, &list);
+
+	purple_debug_info("irc", "Following %d buddies with %s\n",
+	                  irc->monitor_count,
+	                  irc->presence == IRC_PRESENCE_MONITOR ? "MONITOR" : "WATCH");
+
+	irc_monitor_send(irc, list, TRUE);
+	g_list_free(list);
+}
+
 
 static const char *irc_blist_icon(PurpleAccount *a, PurpleBuddy *b)
 {
@@ -332,6 +570,7 @@ static void irc_login(PurpleAccount *account)
 	struct irc_conn *irc;
 	char **userparts;
 	const char *username = purple_account_get_username(account);
+	int i;
 
 	gc = purple_account_get_connection(account);
 	gc->flags |= PURPLE_CONNECTION_NO_NEWLINES;
@@ -347,6 +586,12 @@ static void irc_login(PurpleAccount *account)
 	irc->fd = -1;
 	irc->account = account;
 	irc->outbuf = purple_circ_buffer_new(512);
+	for (i = 0; i < IRC_SEND_LANES; i++)
+		irc->send_queue[i] = g_queue_new();
+	irc->send_burst = MAX(1, purple_account_get_int(account, "send_burst", IRC_DEFAULT_SEND_BURST));
+	irc->send_interval = purple_account_get_int(account, "send_interval", IRC_DEFAULT_SEND_INTERVAL);
+	irc->send_tokens = irc->send_burst;
+	g_get_current_time(&irc->send_refilled);
 
 	userparts = g_strsplit(username, "@", 2);
 	purple_connection_set_display_name(gc, userparts[0]);
@@ -359,6 +604,11 @@ static void irc_login(PurpleAccount *account)
 	irc_cmd_table_build(irc);
 	irc->msgs = g_hash_table_new(g_str_hash, g_str_equal);
 	irc_msg_table_build(irc);
+	irc->caps_ls = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	irc->caps = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	irc->tags = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	irc->batches = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+					     (GDestroyNotify)irc_batch_free);
 
 	purple_connection_update_progress(gc, _("Connecting"), 1, 2);
 
@@ -399,18 +649,29 @@ static gboolean do_login(PurpleConnection *gc) {
 	const gboolean use_sasl = purple_account_get_bool(irc->account, "sasl", FALSE);
 #endif
 
+	/* Registration waits for CAP END on servers that know CAP, and those
+	 * that don't just ignore it */
+	irc->cap_negotiating = TRUE;
+	buf = irc_format(irc, "vvv", "CAP", "LS", "302");
+	if (irc_send(irc, buf) < 0) {
+		g_free(buf);
+		return FALSE;
+	}
+	g_free(buf);
+
 	if (pass && *pass) {
 #ifdef HAVE_CYRUS_SASL
-		if (use_sasl)
-			buf = irc_format(irc, "vv:", "CAP", "REQ", "sasl");
-		else /* intended to fall through */
+		/* The password is used for SASL once CAP is done */
+		if (!use_sasl)
 #endif
+		{
 			buf = irc_format(irc, "v:", "PASS", pass);
-		if (irc_send(irc, buf) < 0) {
+			if (irc_send(irc, buf) < 0) {
+				g_free(buf);
+				return FALSE;
+			}
 			g_free(buf);
-			return FALSE;
 		}
-		g_free(buf);
 	}
 
 	realname = purple_account_get_string(irc->account, "realname", "");
@@ -504,6 +765,7 @@ irc_ssl_connect_failure(PurpleSslConnection *gsc, PurpleSslErrorType error,
 static void irc_close(PurpleConnection *gc)
 {
 	struct irc_conn *irc = gc->proto_data;
+	int i;
 
 	if (irc == NULL)
 		return;
@@ -522,9 +784,19 @@ static void irc_close(PurpleConnection *gc)
 	}
 	if (irc->timer)
 		purple_timeout_remove(irc->timer);
+	if (irc->send_timer)
+		purple_timeout_remove(irc->send_timer);
+	for (i = 0; i < IRC_SEND_LANES; i++) {
+		g_queue_foreach(irc->send_queue[i], (GFunc)g_free, NULL);
+		g_queue_free(irc->send_queue[i]);
+	}
 	g_hash_table_destroy(irc->cmds);
 	g_hash_table_destroy(irc->msgs);
 	g_hash_table_destroy(irc->buddies);
+	g_hash_table_destroy(irc->caps_ls);
+	g_hash_table_destroy(irc->caps);
+	g_hash_table_destroy(irc->tags);
+	g_hash_table_destroy(irc->batches);
 	if (irc->motd)
 		g_string_free(irc->motd, TRUE);
 	g_free(irc->server);
@@ -551,6 +823,31 @@ static void irc_close(PurpleConnection *gc)
 	g_free(irc);
 }
 
+/* Lets the user know when what they said has to wait its turn, once
+ * each time the queue backs up */
+static void irc_send_queue_note(struct irc_conn *irc, PurpleConversation *convo)
+{
+	int length;
+	char *msg;
+
+	if (convo == NULL || irc->send_queue_noted)
+		return;
+
+	length = g_queue_get_length(irc->send_queue[IRC_SEND_USER]);
+	if (length == 0)
+		return;
+
+	msg = g_strdup_printf(ngettext(
+		"%d line is waiting to be sent, so that the server does not disconnect you for flooding.",
+		"%d lines are waiting to be sent, so that the server does not disconnect you for flooding.",
+		length), length);
+	purple_conversation_write(convo, NULL, msg,
+		PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, time(NULL));
+	g_free(msg);
+
+	irc->send_queue_noted = TRUE;
+}
+
 static int irc_im_send(PurpleConnection *gc, const char *who, const char *what, PurpleMessageFlags flags)
 {
 	struct irc_conn *irc = gc->proto_data;
@@ -564,6 +861,8 @@ static int irc_im_send(PurpleConnection *gc, const char *who, const char *what,
 
 	irc_cmd_privmsg(irc, "msg", NULL, args);
 	g_free(plain);
+
+	irc_send_queue_note(irc, purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, who, irc->account));
 	return 1;
 }
 
@@ -622,8 +921,16 @@ static void irc_add_buddy(PurpleConnection *gc, PurpleBuddy *buddy, PurpleGroup
 	/* if the timer isn't set, this is during signon, so we don't want to flood
 	 * ourself off with ISON's, so we don't, but after that we want to know when
 	 * someone's online asap */
-	if (irc->timer)
-		irc_ison_one(irc, ib);
+	if (irc->timer && !ib->monitored) {
+		if (irc_monitor_has_room(irc)) {
+			GList list = { ib, NULL, NULL };
+
+			ib->monitored = TRUE;
+			irc->monitor_count++;
+			irc_monitor_send(irc, &list, TRUE);
+		} else
+			irc_ison_one(irc, ib);
+	}
 }
 
 static void irc_remove_buddy(PurpleConnection *gc, PurpleBuddy *buddy, PurpleGroup *group)
@@ -633,6 +940,13 @@ static void irc_remove_buddy(PurpleConnection *gc, PurpleBuddy *buddy, PurpleGro
 
 	ib = g_hash_table_lookup(irc->buddies, purple_buddy_get_name(buddy));
 	if (ib && --ib->ref == 0) {
+		if (ib->monitored) {
+			GList list = { ib, NULL, NULL };
+
+			irc_monitor_send(irc, &list, FALSE);
+			irc->monitor_count--;
+		}
+		irc->buddies_outstanding = g_list_remove(irc->buddies_outstanding, ib);
 		g_hash_table_remove(irc->buddies, purple_buddy_get_name(buddy));
 	}
 }
@@ -746,7 +1060,9 @@ static void irc_chat_join (PurpleConnection *gc, GHashTable *data)
 
 	args[0] = g_hash_table_lookup(data, "channel");
 	args[1] = g_hash_table_lookup(data, "password");
+	irc->send_for_user = TRUE;
 	irc_cmd_join(irc, "join", NULL, args);
+	irc->send_for_user = FALSE;
 }
 
 static char *irc_get_chat_name(GHashTable *data) {
@@ -808,6 +1124,8 @@ static int irc_chat_send(PurpleConnection *gc, int id, const char *what, PurpleM
 
 	serv_got_chat_in(gc, id, purple_connection_get_display_name(gc), flags, what, time(NULL));
 	g_free(tmp);
+
+	irc_send_queue_note(irc, convo);
 	return 0;
 }
 
@@ -877,7 +1195,9 @@ static PurpleRoomlist *irc_roomlist_get_list(PurpleConnection *gc)
 	purple_roomlist_set_fields(irc->roomlist, fields);
 
 	buf = irc_format(irc, "v", "LIST");
+	irc->send_for_user = TRUE;
 	irc_send(irc, buf);
+	irc->send_for_user = FALSE;
 	g_free(buf);
 
 	return irc->roomlist;
@@ -1001,7 +1321,7 @@ static gboolean load_plugin (PurplePlugin *plugin) {
 }
 
 
-static PurplePluginInfo info =
+PurplePluginInfo irc_plugin_info =
 {
 	PURPLE_PLUGIN_MAGIC,
 	PURPLE_MAJOR_VERSION,
@@ -1036,7 +1356,7 @@ static PurplePluginInfo info =
 	NULL
 };
 
-static void _init_plugin(PurplePlugin *plugin)
+void irc_init_plugin(PurplePlugin *plugin)
 {
 	PurpleAccountUserSplit *split;
 	PurpleAccountOption *option;
@@ -1067,6 +1387,12 @@ static void _init_plugin(PurplePlugin *plugin)
 	option = purple_account_option_bool_new(_("Use SSL"), "ssl", FALSE);
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
 
+	option = purple_account_option_int_new(_("Lines sent before pacing"), "send_burst", IRC_DEFAULT_SEND_BURST);
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+	option = purple_account_option_int_new(_("Milliseconds between paced lines (0 to not pace)"), "send_interval", IRC_DEFAULT_SEND_INTERVAL);
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
 #ifdef HAVE_CYRUS_SASL
 	option = purple_account_option_bool_new(_("Authenticate with SASL"), "sasl", FALSE);
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
@@ -1084,5 +1410,3 @@ static void _init_plugin(PurplePlugin *plugin)
 
 	irc_register_commands();
 }
-
-PURPLE_INIT_PLUGIN(irc, _init_plugin, info);
@@ -31,6 +31,7 @@
 
 #include "circbuffer.h"
 #include "ft.h"
+#include "plugin.h"
 #include "roomlist.h"
 #include "sslconn.h"
 
@@ -46,11 +47,23 @@
 
 #define IRC_INITIAL_BUFSIZE 1024
 
+/* Flood protection: lines sent at once, then milliseconds between lines */
+#define IRC_DEFAULT_SEND_BURST 5
+#define IRC_DEFAULT_SEND_INTERVAL 2200
+
+/* Most messages asked for in one CHATHISTORY request */
+#define IRC_HISTORY_BATCH 100
+
 #define IRC_NAMES_FLAG "irc-namelist"
 
+/* The time of the last message we had in a chat before rejoining it */
+#define IRC_HISTORY_SEEN "irc-history-seen"
+
 
 enum { IRC_USEROPT_SERVER, IRC_USEROPT_PORT, IRC_USEROPT_CHARSET };
 enum irc_state { IRC_STATE_NEW, IRC_STATE_ESTABLISHED };
+enum irc_presence { IRC_PRESENCE_ISON, IRC_PRESENCE_MONITOR, IRC_PRESENCE_WATCH };
+enum irc_send_lane { IRC_SEND_URGENT, IRC_SEND_USER, IRC_SEND_BULK, IRC_SEND_LANES };
 
 struct irc_conn {
 	PurpleAccount *account;
@@ -64,6 +77,25 @@ struct irc_conn {
 	gboolean ison_outstanding;
 	GList *buddies_outstanding;
 
+	/* How the server lets us follow buddies, from RPL_ISUPPORT.  Buddies
+	 * that don't fit on a MONITOR or WATCH list are still polled. */
+	enum irc_presence presence;
+	int monitor_limit;
+	int monitor_count;
+
+	/* IRCv3 capabilities: those the server offers, mapped to their
+	 * values, and those we have enabled. */
+	GHashTable *caps_ls;
+	GHashTable *caps;
+	gboolean cap_negotiating;
+	int cap_pending;
+	gboolean cap_sasl;
+
+	/* Tags of the message being handled, and open batches by reference */
+	GHashTable *tags;
+	GHashTable *batches;
+	int chathistory_limit;
+
 	char *inbuf;
 	int inbuflen;
 	int inbufused;
@@ -93,6 +125,19 @@ struct irc_conn {
 	PurpleCircBuffer *outbuf;
 	guint writeh;
 
+	/* Lines waiting for a token from the flood protection bucket, in
+	 * one queue for each lane, most urgent first */
+	GQueue *send_queue[IRC_SEND_LANES];
+	int send_tokens;
+	int send_burst;
+	int send_interval;
+	GTimeVal send_refilled;
+	guint send_timer;
+	gboolean send_queue_noted;
+	/* Set while sending what the user asked for, which never waits in
+	 * the bulk lane */
+	gboolean send_for_user;
+
 	time_t recv_time;
 
 	char *mode_chars;
@@ -112,16 +157,32 @@ struct irc_buddy {
 	gboolean online;
 	gboolean flag;
  	gboolean new_online_status;
+	gboolean monitored;
 	int ref;
 };
 
+struct irc_batch {
+	char *ref;
+	char *type;
+	char *target;
+	int count;
+	char *last_time;
+	char *last_msgid;
+	GHashTable *joins;
+};
+
 typedef int (*IRCCmdCallback) (struct irc_conn *irc, const char *cmd, const char *target, const char **args);
 
 int irc_send(struct irc_conn *irc, const char *buf);
 int irc_send_len(struct irc_conn *irc, const char *buf, int len);
+int irc_send_queue_length(struct irc_conn *irc);
+void irc_send_flush(struct irc_conn *irc);
 gboolean irc_blist_timeout(struct irc_conn *irc);
 gboolean irc_who_channel_timeout(struct irc_conn *irc);
 void irc_buddy_query(struct irc_conn *irc);
+void irc_buddies_monitor(struct irc_conn *irc);
+gboolean irc_cap_enabled(struct irc_conn *irc, const char *cap);
+void irc_batch_free(struct irc_batch *batch);
 
 char *irc_escape_privmsg(const char *text, gssize length);
 
@@ -137,6 +198,11 @@ void irc_msg_table_build(struct irc_conn *irc);
 void irc_parse_msg(struct irc_conn *irc, char *input);
 char *irc_parse_ctcp(struct irc_conn *irc, const char *from, const char *to, const char *msg, int notice);
 char *irc_format(struct irc_conn *irc, const char *format, ...);
+char *irc_tag_unescape(const char *value);
+void irc_parse_tags(struct irc_conn *irc, const char *tags);
+const char *irc_tag(struct irc_conn *irc, const char *tag);
+time_t irc_tag_time(struct irc_conn *irc);
+struct irc_batch *irc_tag_batch(struct irc_conn *irc);
 
 void irc_msg_default(struct irc_conn *irc, const char *name, const char *from, char **args);
 void irc_msg_away(struct irc_conn *irc, const char *name, const char *from, char **args);
@@ -151,6 +217,10 @@ void irc_msg_features(struct irc_conn *irc, const char *name, const char *from,
 void irc_msg_invite(struct irc_conn *irc, const char *name, const char *from, char **args);
 void irc_msg_inviteonly(struct irc_conn *irc, const char *name, const char *from, char **args);
 void irc_msg_ison(struct irc_conn *irc, const char *name, const char *from, char **args);
+void irc_msg_monitor(struct irc_conn *irc, const char *name, const char *from, char **args);
+void irc_msg_monlistfull(struct irc_conn *irc, const char *name, const char *from, char **args);
+void irc_msg_watch(struct irc_conn *irc, const char *name, const char *from, char **args);
+void irc_msg_toomanywatch(struct irc_conn *irc, const char *name, const char *from, char **args);
 void irc_msg_join(struct irc_conn *irc, const char *name, const char *from, char **args);
 void irc_msg_kick(struct irc_conn *irc, const char *name, const char *from, char **args);
 void irc_msg_list(struct irc_conn *irc, const char *name, const char *from, char **args);
@@ -181,8 +251,9 @@ void irc_msg_unknown(struct irc_conn *irc, const char *name, const char *from, c
 void irc_msg_wallops(struct irc_conn *irc, const char *name, const char *from, char **args);
 void irc_msg_whois(struct irc_conn *irc, const char *name, const char *from, char **args);
 void irc_msg_who(struct irc_conn *irc, const char *name, const char *from, char **args);
-#ifdef HAVE_CYRUS_SASL
+void irc_msg_batch(struct irc_conn *irc, const char *name, const char *from, char **args);
 void irc_msg_cap(struct irc_conn *irc, const char *name, const char *from, char **args);
+#ifdef HAVE_CYRUS_SASL
 void irc_msg_auth(struct irc_conn *irc, char *arg);
 void irc_msg_authok(struct irc_conn *irc, const char *name, const char *from, char **args);
 void irc_msg_authtryagain(struct irc_conn *irc, const char *name, const char *from, char **args);
@@ -220,6 +291,10 @@ int irc_cmd_wallops(struct irc_conn *irc, const char *cmd, const char *target, c
 int irc_cmd_whois(struct irc_conn *irc, const char *cmd, const char *target, const char **args);
 int irc_cmd_whowas(struct irc_conn *irc, const char *cmd, const char *target, const char **args);
 
+/* The plugin itself is in libirc.c, so the rest can be linked elsewhere. */
+extern PurplePluginInfo irc_plugin_info;
+void irc_init_plugin(PurplePlugin *plugin);
+
 PurpleXfer *irc_dccsend_new_xfer(PurpleConnection *gc, const char *who);
 void irc_dccsend_send_file(PurpleConnection *gc, const char *who, const char *file);
 void irc_dccsend_recv(struct irc_conn *irc, const char *from, const char *msg);
@@ -52,7 +52,11 @@ static void irc_msg_handle_privmsg(struct irc_conn *irc, const char *name,
                                    const char *from, const char *to,
                                    const char *rawmsg, gboolean notice);
 
+static void irc_cap_end(struct irc_conn *irc);
+static gboolean irc_batch_is_history(struct irc_batch *batch);
+
 #ifdef HAVE_CYRUS_SASL
+static void irc_sasl_start(struct irc_conn *irc);
 static void irc_sasl_finish(struct irc_conn *irc);
 #endif
 
@@ -121,6 +125,9 @@ static void irc_connected(struct irc_conn *irc, const char *nick)
 		g_hash_table_replace(irc->buddies, ib->name, ib);
 	}
 
+	/* Let the server tell us when buddies come and go if it can, and
+	 * only poll for the ones it can't fit on its list */
+	irc_buddies_monitor(irc);
 	irc_blist_timeout(irc);
 	if (!irc->timer)
 		irc->timer = purple_timeout_add_seconds(45, (GSourceFunc)irc_blist_timeout, (gpointer)irc);
@@ -215,6 +222,18 @@ void irc_msg_features(struct irc_conn *irc, const char *name, const char *from,
 		if (!strncmp(features[i], "PREFIX=", 7)) {
 			if ((val = strchr(features[i] + 7, ')')) != NULL)
 				irc->mode_chars = g_strdup(val + 1);
+		} else if (!strncmp(features[i], "MONITOR", 7)
+		           && (features[i][7] == '\0' || features[i][7] == '=')) {
+			irc->presence = IRC_PRESENCE_MONITOR;
+			irc->monitor_limit = features[i][7] ? atoi(features[i] + 8) : 0;
+		} else if (!strncmp(features[i], "WATCH", 5)
+		           && (features[i][5] == '\0' || features[i][5] == '=')
+		           && irc->presence != IRC_PRESENCE_MONITOR) {
+			/* MONITOR does the same thing and is better specified */
+			irc->presence = IRC_PRESENCE_WATCH;
+			irc->monitor_limit = features[i][5] ? atoi(features[i] + 6) : 0;
+		} else if (!strncmp(features[i], "CHATHISTORY=", 12)) {
+			irc->chathistory_limit = atoi(features[i] + 12);
 		}
 	}
 
@@ -666,6 +685,10 @@ void irc_msg_unknown(struct irc_conn *irc, const char *name, const char *from, c
 
 	g_return_if_fail(gc);
 
+	/* We always try CAP, and servers which don't know it are fine */
+	if (!g_ascii_strcasecmp(args[1], "CAP"))
+		return;
+
 	buf = g_strdup_printf(_("Unknown message '%s'"), args[1]);
 	purple_notify_error(gc, _("Unknown message"), buf, _("The IRC server received a message it did not understand."));
 	g_free(buf);
@@ -703,19 +726,21 @@ void irc_msg_names(struct irc_conn *irc, const char *name, const char *from, cha
 				end = strchr(cur, ' ');
 				if (!end)
 					end = cur + strlen(cur);
-				if (*cur == '@') {
-					f = PURPLE_CBFLAGS_OP;
-					cur++;
-				} else if (*cur == '%') {
-					f = PURPLE_CBFLAGS_HALFOP;
-					cur++;
-				} else if(*cur == '+') {
-					f = PURPLE_CBFLAGS_VOICE;
-					cur++;
-				} else if(irc->mode_chars
-					  && strchr(irc->mode_chars, *cur)) {
-					if (*cur == '~')
-						f = PURPLE_CBFLAGS_FOUNDER;
+				/* With multi-prefix, there is a prefix for each
+				 * mode rather than just the highest one */
+				while (cur < end) {
+					if (*cur == '@')
+						f |= PURPLE_CBFLAGS_OP;
+					else if (*cur == '%')
+						f |= PURPLE_CBFLAGS_HALFOP;
+					else if (*cur == '+')
+						f |= PURPLE_CBFLAGS_VOICE;
+					else if (*cur == '~' && irc->mode_chars
+						 && strchr(irc->mode_chars, *cur))
+						f |= PURPLE_CBFLAGS_FOUNDER;
+					else if (!irc->mode_chars
+						 || !strchr(irc->mode_chars, *cur))
+						break;
 					cur++;
 				}
 				tmp = g_strndup(cur, end - cur);
@@ -924,6 +949,92 @@ void irc_msg_ison(struct irc_conn *irc, const char *name, const char *from, char
 		g_hash_table_foreach(irc->buddies, (GHFunc)irc_buddy_status, (gpointer)irc);
 }
 
+/* Sets the status of one buddy the server told us about.  target may be
+ * a bare nick or nick!user@host. */
+static void irc_buddy_monitored(struct irc_conn *irc, const char *target, gboolean online)
+{
+	struct irc_buddy *ib;
+	char *nick;
+
+	nick = irc_mask_nick(target);
+	ib = g_hash_table_lookup(irc->buddies, nick);
+	if (ib != NULL) {
+		ib->new_online_status = online;
+		irc_buddy_status(ib->name, ib, irc);
+	}
+	g_free(nick);
+}
+
+/* No longer asks the server about a buddy, leaving it to ISON */
+static void irc_buddy_unmonitored(struct irc_conn *irc, const char *nick)
+{
+	struct irc_buddy *ib;
+
+	ib = g_hash_table_lookup(irc->buddies, nick);
+	if (ib == NULL || !ib->monitored)
+		return;
+
+	purple_debug_info("irc", "Server list is full, polling for %s\n", ib->name);
+	ib->monitored = FALSE;
+	irc->monitor_count--;
+}
+
+/* 730 RPL_MONONLINE and 731 RPL_MONOFFLINE */
+void irc_msg_monitor(struct irc_conn *irc, const char *name, const char *from, char **args)
+{
+	char **targets;
+	int i;
+
+	if (!args || !args[1])
+		return;
+
+	targets = g_strsplit(args[1], ",", -1);
+	for (i = 0; targets[i]; i++) {
+		if (*targets[i])
+			irc_buddy_monitored(irc, targets[i], !strcmp(name, "730"));
+	}
+	g_strfreev(targets);
+}
+
+/* 734 ERR_MONLISTFULL */
+void irc_msg_monlistfull(struct irc_conn *irc, const char *name, const char *from, char **args)
+{
+	char **targets;
+	int i;
+
+	if (!args || !args[1] || !args[2])
+		return;
+
+	/* The server knows its limit better than RPL_ISUPPORT did */
+	if (atoi(args[1]) > 0)
+		irc->monitor_limit = atoi(args[1]);
+
+	targets = g_strsplit(args[2], ",", -1);
+	for (i = 0; targets[i]; i++)
+		irc_buddy_unmonitored(irc, targets[i]);
+	g_strfreev(targets);
+}
+
+/* 600 RPL_LOGON, 601 RPL_LOGOFF, 604 RPL_NOWON and 605 RPL_NOWOFF */
+void irc_msg_watch(struct irc_conn *irc, const char *name, const char *from, char **args)
+{
+	if (!args || !args[1])
+		return;
+
+	irc_buddy_monitored(irc, args[1],
+	                    !strcmp(name, "600") || !strcmp(name, "604"));
+}
+
+/* 512 ERR_TOOMANYWATCH */
+void irc_msg_toomanywatch(struct irc_conn *irc, const char *name, const char *from, char **args)
+{
+	if (!args || !args[1] || irc->presence != IRC_PRESENCE_WATCH)
+		return;
+
+	irc_buddy_unmonitored(irc, args[1]);
+	irc->monitor_limit = irc->monitor_count;
+}
+
 static void irc_buddy_status(char *name, struct irc_buddy *ib, struct irc_conn *irc)
 {
 	PurpleConnection *gc = purple_account_get_connection(irc->account);
@@ -941,6 +1052,74 @@ static void irc_buddy_status(char *name, struct irc_buddy *ib, struct irc_conn *
 	}
 }
 
+static gboolean irc_history_enabled(struct irc_conn *irc)
+{
+	return irc_cap_enabled(irc, "draft/chathistory") &&
+	       irc_cap_enabled(irc, "batch") &&
+	       irc_cap_enabled(irc, "server-time");
+}
+
+static int irc_history_limit(struct irc_conn *irc)
+{
+	if (irc->chathistory_limit > 0 && irc->chathistory_limit < IRC_HISTORY_BATCH)
+		return irc->chathistory_limit;
+	return IRC_HISTORY_BATCH;
+}
+
+/* Asks for the messages sent to a channel after the one with a msgid, or
+ * after a server-time timestamp.  Each reply is a batch, and if it's full
+ * the next one is asked for when it ends. */
+static void irc_history_request(struct irc_conn *irc, const char *chan,
+                                const char *key, const char *after)
+{
+	char *buf, *criteria, *limit;
+
+	criteria = g_strdup_printf("%s=%s", key, after);
+	limit = g_strdup_printf("%d", irc_history_limit(irc));
+	buf = irc_format(irc, "vvcvv", "CHATHISTORY", "AFTER", chan, criteria, limit);
+	irc_send(irc, buf);
+	g_free(buf);
+	g_free(limit);
+	g_free(criteria);
+}
+
+/* Whether a line replayed from a chat's history is no newer than the last
+ * message we had before rejoining.  The conversation only knows that to
+ * the second, so the history asked for starts at the beginning of it. */
+static gboolean irc_history_seen(struct irc_conn *irc, const char *to)
+{
+	PurpleConversation *convo;
+	time_t seen;
+
+	convo = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT,
+	                                              irc_nick_skip_mode(irc, to),
+	                                              irc->account);
+	if (convo == NULL)
+		return FALSE;
+
+	seen = (time_t)GPOINTER_TO_SIZE(purple_conversation_get_data(convo, IRC_HISTORY_SEEN));
+	return seen > 0 && irc_tag_time(irc) <= seen;
+}
+
+/* The time of the last message said in a chat we're rejoining, so what
+ * was missed while we were away can be fetched */
+static gboolean irc_chat_last_seen(PurpleConversation *convo, time_t *when)
+{
+	PurpleConvMessageIter iter;
+	PurpleConvMessage *msg;
+
+	purple_conversation_message_iter_init(&iter, convo, TRUE);
+	while ((msg = purple_conversation_message_iter_next(&iter)) != NULL) {
+		if (purple_conversation_message_get_flags(msg) &
+		    (PURPLE_MESSAGE_SEND | PURPLE_MESSAGE_RECV)) {
+			*when = purple_conversation_message_get_timestamp(msg);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 void irc_msg_join(struct irc_conn *irc, const char *name, const char *from, char **args)
 {
 	PurpleConnection *gc = purple_account_get_connection(irc->account);
@@ -950,6 +1129,7 @@ void irc_msg_join(struct irc_conn *irc, const char *name, const char *from, char
 
 	char *nick, *userhost, *buf;
 	struct irc_buddy *ib;
+	struct irc_batch *batch;
 	static int id = 1;
 
 	g_return_if_fail(gc);
@@ -957,6 +1137,17 @@ void irc_msg_join(struct irc_conn *irc, const char *name, const char *from, char
 	nick = irc_mask_nick(from);
 
 	if (!purple_utf8_strcasecmp(nick, purple_connection_get_display_name(gc))) {
+		time_t last_seen;
+		gboolean rejoin = FALSE;
+
+		if (irc_history_enabled(irc)) {
+			convo = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT,
+								    args[0],
+								    irc->account);
+			if (convo)
+				rejoin = irc_chat_last_seen(convo, &last_seen);
+		}
+
 		/* We are joining a channel for the first time */
 		serv_got_joined_chat(gc, id++, args[0]);
 		g_free(nick);
@@ -975,6 +1166,15 @@ void irc_msg_join(struct irc_conn *irc, const char *name, const char *from, char
 		buf = irc_format(irc, "vc", "WHO", args[0]);
 		irc_send(irc, buf);
 		g_free(buf);
+
+		if (rejoin) {
+			purple_conversation_set_data(convo, IRC_HISTORY_SEEN,
+			                             GSIZE_TO_POINTER(last_seen));
+			buf = g_strdup(purple_utf8_strftime("%Y-%m-%dT%H:%M:%S.000Z",
+			                                    gmtime(&last_seen)));
+			irc_history_request(irc, args[0], "timestamp", buf);
+			g_free(buf);
+		}
 		
 		/* Until purple_conversation_present does something that
 		 * one would expect in Pidgin, this call produces buggy
@@ -990,6 +1190,17 @@ void irc_msg_join(struct irc_conn *irc, const char *name, const char *from, char
 		return;
 	}
 
+	/* Joins after a netsplit are added all at once when the batch ends */
+	batch = irc_tag_batch(irc);
+	if (batch && batch->joins) {
+		GList *masks = g_hash_table_lookup(batch->joins, convo);
+
+		g_hash_table_insert(batch->joins, convo,
+		                    g_list_prepend(masks, g_strdup(from)));
+		g_free(nick);
+		return;
+	}
+
 	userhost = irc_mask_userhost(from);
 	chat = PURPLE_CONV_CHAT(convo);
 	
@@ -1303,6 +1514,8 @@ static void irc_msg_handle_privmsg(struct irc_conn *irc, const char *name, const
 {
 	PurpleConnection *gc = purple_account_get_connection(irc->account);
 	PurpleConversation *convo;
+	PurpleMessageFlags flags = 0;
+	struct irc_batch *batch;
 	char *tmp;
 	char *msg;
 	char *nick;
@@ -1311,6 +1524,31 @@ static void irc_msg_handle_privmsg(struct irc_conn *irc, const char *name, const
 		return;
 
 	nick = irc_mask_nick(from);
+
+	batch = irc_tag_batch(irc);
+	if (batch && irc_batch_is_history(batch)) {
+		batch->count++;
+		g_free(batch->last_time);
+		batch->last_time = g_strdup(irc_tag(irc, "time"));
+		g_free(batch->last_msgid);
+		batch->last_msgid = g_strdup(irc_tag(irc, "msgid"));
+
+		if (irc_history_seen(irc, to)) {
+			g_free(nick);
+			return;
+		}
+
+		/* Don't answer CTCP requests from the past */
+		if (rawmsg[0] == '\001' && strncmp(rawmsg + 1, "ACTION ", 7)) {
+			g_free(nick);
+			return;
+		}
+
+		flags |= PURPLE_MESSAGE_DELAYED;
+		if (!purple_utf8_strcasecmp(nick, purple_connection_get_display_name(gc)))
+			flags |= PURPLE_MESSAGE_SEND;
+	}
+
 	tmp = irc_parse_ctcp(irc, nick, to, rawmsg, notice);
 	if (!tmp) {
 		g_free(nick);
@@ -1330,11 +1568,11 @@ static void irc_msg_handle_privmsg(struct irc_conn *irc, const char *name, const
 	}
 
 	if (!purple_utf8_strcasecmp(to, purple_connection_get_display_name(gc))) {
-		serv_got_im(gc, nick, msg, 0, time(NULL));
+		serv_got_im(gc, nick, msg, flags, irc_tag_time(irc));
 	} else {
 		convo = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT, irc_nick_skip_mode(irc, to), irc->account);
 		if (convo)
-			serv_got_chat_in(gc, purple_conv_chat_get_id(PURPLE_CONV_CHAT(convo)), nick, 0, msg, time(NULL));
+			serv_got_chat_in(gc, purple_conv_chat_get_id(PURPLE_CONV_CHAT(convo)), nick, flags, msg, irc_tag_time(irc));
 		else
 			purple_debug_error("irc", "Got a %s on %s, which does not exist\n",
 			                   notice ? "NOTICE" : "PRIVMSG", to);
@@ -1408,6 +1646,327 @@ void irc_msg_wallops(struct irc_conn *irc, const char *name, const char *from, c
 	g_free(msg);
 }
 
+/* The capabilities we make use of, if the server offers them */
+static const char *irc_caps_wanted[] = {
+	"multi-prefix",
+	"batch",
+	"server-time",
+	"message-tags",
+	"draft/chathistory",
+	NULL
+};
+
+gboolean irc_cap_enabled(struct irc_conn *irc, const char *cap)
+{
+	return g_hash_table_lookup(irc->caps, cap) != NULL;
+}
+
+static gboolean irc_cap_use_sasl(struct irc_conn *irc)
+{
+#ifdef HAVE_CYRUS_SASL
+	PurpleConnection *gc = purple_account_get_connection(irc->account);
+	const char *pass = purple_connection_get_password(gc);
+
+	return purple_account_get_bool(irc->account, "sasl", FALSE) && pass && *pass;
+#else
+	return FALSE;
+#endif
+}
+
+/* Ends negotiation, which lets registration go on */
+static void irc_cap_end(struct irc_conn *irc)
+{
+	char *buf;
+
+	if (!irc->cap_negotiating)
+		return;
+	irc->cap_negotiating = FALSE;
+
+	buf = irc_format(irc, "vv", "CAP", "END");
+	irc_send(irc, buf);
+	g_free(buf);
+}
+
+/* Asks for those of the capabilities we want that the server offers and
+ * aren't enabled yet, returning whether there were any. */
+static gboolean irc_cap_request(struct irc_conn *irc, gboolean sasl)
+{
+	GString *req;
+	char *buf;
+	gboolean ret;
+	int i;
+
+	req = g_string_new(NULL);
+
+	if (sasl && g_hash_table_lookup(irc->caps_ls, "sasl"))
+		g_string_append(req, "sasl");
+
+	for (i = 0; irc_caps_wanted[i]; i++) {
+		if (!g_hash_table_lookup(irc->caps_ls, irc_caps_wanted[i])
+		    || irc_cap_enabled(irc, irc_caps_wanted[i]))
+			continue;
+
+		if (req->len)
+			g_string_append_c(req, ' ');
+		g_string_append(req, irc_caps_wanted[i]);
+	}
+
+	ret = req->len > 0;
+	if (ret) {
+		buf = irc_format(irc, "vv:", "CAP", "REQ", req->str);
+		irc_send(irc, buf);
+		g_free(buf);
+		irc->cap_pending++;
+	}
+
+	g_string_free(req, TRUE);
+	return ret;
+}
+
+/* Capabilities are offered as name or name=value */
+static void irc_cap_parse_ls(struct irc_conn *irc, const char *list)
+{
+	char **caps;
+	int i;
+
+	caps = g_strsplit(list, " ", -1);
+	for (i = 0; caps[i]; i++) {
+		char *value = strchr(caps[i], '=');
+
+		if (value)
+			*value++ = '\0';
+		if (*caps[i] == '\0')
+			continue;
+
+		g_hash_table_replace(irc->caps_ls, g_strdup(caps[i]),
+		                     g_strdup(value ? value : ""));
+	}
+	g_strfreev(caps);
+}
+
+static void irc_cap_sasl_unsupported(struct irc_conn *irc)
+{
+	PurpleConnection *gc = purple_account_get_connection(irc->account);
+
+	purple_connection_error_reason (gc,
+		PURPLE_CONNECTION_ERROR_AUTHENTICATION_IMPOSSIBLE,
+		_("SASL authentication failed: Server does not support SASL authentication."));
+	irc_cap_end(irc);
+}
+
+/* Goes on once the server has answered all our CAP REQs */
+static void irc_cap_answered(struct irc_conn *irc)
+{
+	if (irc->cap_pending > 0 && --irc->cap_pending > 0)
+		return;
+
+#ifdef HAVE_CYRUS_SASL
+	if (irc_cap_use_sasl(irc)) {
+		if (irc->cap_sasl)
+			/* CAP END is sent when it's done */
+			irc_sasl_start(irc);
+		else
+			irc_cap_sasl_unsupported(irc);
+		return;
+	}
+#endif
+
+	irc_cap_end(irc);
+}
+
+void irc_msg_cap(struct irc_conn *irc, const char *name, const char *from, char **args)
+{
+	const char *sub = args[1];
+	const char *list = args[2];
+	gboolean more = FALSE;
+	char **caps;
+	char *buf;
+	int i;
+
+	/* Replies to CAP LS 302 may go over several lines, all but the last
+	 * with a "*" before the list */
+	if (list[0] == '*' && list[1] == ' ') {
+		more = TRUE;
+		list += 2;
+		if (*list == ':')
+			list++;
+	}
+
+	if (!strcmp(sub, "LS")) {
+		irc_cap_parse_ls(irc, list);
+		if (more || !irc->cap_negotiating)
+			return;
+
+		if (irc_cap_use_sasl(irc) && !g_hash_table_lookup(irc->caps_ls, "sasl")) {
+			irc_cap_sasl_unsupported(irc);
+			return;
+		}
+
+		if (!irc_cap_request(irc, irc_cap_use_sasl(irc)))
+			irc_cap_end(irc);
+	} else if (!strcmp(sub, "ACK")) {
+		caps = g_strsplit(list, " ", -1);
+		for (i = 0; caps[i]; i++) {
+			if (*caps[i] == '-') {
+				g_hash_table_remove(irc->caps, caps[i] + 1);
+			} else if (*caps[i]) {
+				purple_debug_info("irc", "Enabled capability %s\n", caps[i]);
+				g_hash_table_replace(irc->caps, g_strdup(caps[i]), GINT_TO_POINTER(TRUE));
+				if (!strcmp(caps[i], "sasl"))
+					irc->cap_sasl = TRUE;
+			}
+		}
+		g_strfreev(caps);
+
+		if (!irc->cap_negotiating)
+			return;
+
+		irc_cap_answered(irc);
+	} else if (!strcmp(sub, "NAK")) {
+		int count = 0;
+
+		if (!irc->cap_negotiating)
+			return;
+
+		caps = g_strsplit(list, " ", -1);
+		for (i = 0; caps[i]; i++)
+			if (*caps[i])
+				count++;
+
+		/* A request is refused as a whole, so ask for each of them on its
+		 * own to get those the server does have */
+		if (count > 1) {
+			for (i = 0; caps[i]; i++) {
+				if (*caps[i] == '\0')
+					continue;
+
+				buf = irc_format(irc, "vv:", "CAP", "REQ", caps[i]);
+				irc_send(irc, buf);
+				g_free(buf);
+				irc->cap_pending++;
+			}
+		} else if (count == 1) {
+			purple_debug_info("irc", "Server refused capability %s\n", list);
+		}
+		g_strfreev(caps);
+
+		irc_cap_answered(irc);
+	} else if (!strcmp(sub, "NEW")) {
+		irc_cap_parse_ls(irc, list);
+		irc_cap_request(irc, FALSE);
+	} else if (!strcmp(sub, "DEL")) {
+		caps = g_strsplit(list, " ", -1);
+		for (i = 0; caps[i]; i++) {
+			g_hash_table_remove(irc->caps_ls, caps[i]);
+			g_hash_table_remove(irc->caps, caps[i]);
+		}
+		g_strfreev(caps);
+	}
+}
+
+static gboolean irc_batch_is_history(struct irc_batch *batch)
+{
+	return !strcmp(batch->type, "chathistory") ||
+	       !strcmp(batch->type, "draft/chathistory");
+}
+
+static void irc_batch_free_joins(PurpleConversation *convo, GList *masks, gpointer data)
+{
+	g_list_foreach(masks, (GFunc)g_free, NULL);
+	g_list_free(masks);
+}
+
+void irc_batch_free(struct irc_batch *batch)
+{
+	if (batch->joins) {
+		g_hash_table_foreach(batch->joins, (GHFunc)irc_batch_free_joins, NULL);
+		g_hash_table_destroy(batch->joins);
+	}
+	g_free(batch->ref);
+	g_free(batch->type);
+	g_free(batch->target);
+	g_free(batch->last_time);
+	g_free(batch->last_msgid);
+	g_free(batch);
+}
+
+/* Adds everyone who joined a chat during a batch in one go */
+static void irc_batch_add_users(PurpleConversation *convo, GList *masks, struct irc_conn *irc)
+{
+	PurpleConvChat *chat;
+	PurpleConvChatBuddy *cb;
+	GList *users = NULL, *flags = NULL, *l;
+	struct irc_buddy *ib;
+
+	/* The chat may have gone away since */
+	if (g_list_find(purple_get_chats(), convo) == NULL)
+		return;
+
+	chat = PURPLE_CONV_CHAT(convo);
+
+	for (l = masks; l != NULL; l = l->next) {
+		users = g_list_prepend(users, irc_mask_nick(l->data));
+		flags = g_list_prepend(flags, GINT_TO_POINTER(PURPLE_CBFLAGS_NONE));
+	}
+
+	purple_conv_chat_add_users(chat, users, NULL, flags, TRUE);
+
+	for (l = masks; l != NULL; l = l->next) {
+		char *nick = irc_mask_nick(l->data);
+		char *userhost = irc_mask_userhost(l->data);
+
+		if ((cb = purple_conv_chat_cb_find(chat, nick)) != NULL)
+			purple_conv_chat_cb_set_attribute(chat, cb, "userhost", userhost);
+
+		if ((ib = g_hash_table_lookup(irc->buddies, nick)) != NULL) {
+			ib->new_online_status = TRUE;
+			irc_buddy_status(ib->name, ib, irc);
+		}
+
+		g_free(userhost);
+		g_free(nick);
+	}
+
+	g_list_foreach(users, (GFunc)g_free, NULL);
+	g_list_free(users);
+	g_list_free(flags);
+}
+
+void irc_msg_batch(struct irc_conn *irc, const char *name, const char *from, char **args)
+{
+	struct irc_batch *batch;
+
+	if (args[0][0] == '+' && args[0][1]) {
+		batch = g_new0(struct irc_batch, 1);
+		batch->ref = g_strdup(args[0] + 1);
+		batch->type = g_strdup(args[1] ? args[1] : "");
+		batch->target = g_strdup(args[2]);
+		if (!strcmp(batch->type, "netjoin"))
+			batch->joins = g_hash_table_new(g_direct_hash, g_direct_equal);
+		g_hash_table_replace(irc->batches, batch->ref, batch);
+	} else if (args[0][0] == '-') {
+		batch = g_hash_table_lookup(irc->batches, args[0] + 1);
+		if (batch == NULL)
+			return;
+
+		if (batch->joins)
+			g_hash_table_foreach(batch->joins, (GHFunc)irc_batch_add_users, irc);
+
+		/* A full batch of history may not have been all of it.  Messages
+		 * can share a timestamp, so carry on from the msgid if there's
+		 * one. */
+		if (irc_batch_is_history(batch) && batch->target
+		    && batch->count >= irc_history_limit(irc)) {
+			if (batch->last_msgid)
+				irc_history_request(irc, batch->target, "msgid", batch->last_msgid);
+			else if (batch->last_time)
+				irc_history_request(irc, batch->target, "timestamp", batch->last_time);
+		}
+
+		g_hash_table_remove(irc->batches, args[0] + 1);
+	}
+}
+
 #ifdef HAVE_CYRUS_SASL
 static int
 irc_sasl_cb_secret(sasl_conn_t *conn, void *ctx, int id, sasl_secret_t **secret)
@@ -1567,25 +2126,14 @@ irc_auth_start_cyrus(struct irc_conn *irc)
 }
 
 /* SASL authentication */
-void
-irc_msg_cap(struct irc_conn *irc, const char *name, const char *from, char **args)
+static void
+irc_sasl_start(struct irc_conn *irc)
 {
 	int ret = 0;
 	int id = 0;
 	PurpleConnection *gc = purple_account_get_connection(irc->account);
 	const char *mech_list = NULL;
 
-	if (strncmp(args[2], "sasl ", 6))
-		return;
-	if (strncmp(args[1], "ACK", 4)) {
-		const char *tmp = _("SASL authentication failed: Server does not support SASL authentication.");
-		purple_connection_error_reason (gc,
-			PURPLE_CONNECTION_ERROR_AUTHENTICATION_IMPOSSIBLE, tmp);
-
-		irc_sasl_finish(irc);
-		return;
-	}
-
 	if ((ret = sasl_client_init(NULL)) != SASL_OK) {
 		const char *tmp = _("SASL authentication failed: Initializing SASL failed.");
 		purple_connection_error_reason (gc,
@@ -1691,16 +2239,12 @@ irc_msg_auth(struct irc_conn *irc, char *arg)
 void
 irc_msg_authok(struct irc_conn *irc, const char *name, const char *from, char **args)
 {
-	char *buf;
-
 	sasl_dispose(&irc->sasl_conn);
 	irc->sasl_conn = NULL;
 	purple_debug_info("irc", "Succesfully authenticated using SASL.\n");
 
 	/* Finish auth session */
-	buf = irc_format(irc, "vv", "CAP", "END");
-	irc_send(irc, buf);
-	g_free(buf);
+	irc_cap_end(irc);
 }
 
 void
@@ -1768,8 +2312,6 @@ irc_msg_authfail(struct irc_conn *irc, const char *name, const char *from, char
 static void
 irc_sasl_finish(struct irc_conn *irc)
 {
-	char *buf;
-
 	sasl_dispose(&irc->sasl_conn);
 	irc->sasl_conn = NULL;
 
@@ -1777,9 +2319,7 @@ irc_sasl_finish(struct irc_conn *irc)
 	irc->sasl_cb = NULL;
 
 	/* Auth failed, abort */
-	buf = irc_format(irc, "vv", "CAP", "END");
-	irc_send(irc, buf);
-	g_free(buf);
+	irc_cap_end(irc);
 }
 #endif
 
@@ -107,15 +107,24 @@ static struct _irc_msg {
 	{ "482", "nc:", 3, irc_msg_notop },		/* Need to be op to do that	*/
 	{ "501", "n:", 2, irc_msg_badmode },		/* Unknown mode flag		*/
 	{ "506", "nc:", 3, irc_msg_nosend },		/* Must identify to send	*/
+	{ "512", "nn:", 2, irc_msg_toomanywatch },	/* WATCH list is full		*/
 	{ "515", "nc:", 3, irc_msg_regonly },		/* Registration required	*/
+	{ "600", "nnvvv:", 2, irc_msg_watch },		/* WATCH: buddy logged on	*/
+	{ "601", "nnvvv:", 2, irc_msg_watch },		/* WATCH: buddy logged off	*/
+	{ "604", "nnvvv:", 2, irc_msg_watch },		/* WATCH: buddy is online	*/
+	{ "605", "nnvvv:", 2, irc_msg_watch },		/* WATCH: buddy is offline	*/
+	{ "730", "n:", 2, irc_msg_monitor },		/* MONITOR: buddies online	*/
+	{ "731", "n:", 2, irc_msg_monitor },		/* MONITOR: buddies offline	*/
+	{ "734", "nvn:", 3, irc_msg_monlistfull },	/* MONITOR list is full		*/
 #ifdef HAVE_CYRUS_SASL
 	{ "903", "*", 0, irc_msg_authok},		/* SASL auth successful		*/
 	{ "904", "*", 0, irc_msg_authtryagain },	/* SASL auth failed, can recover*/
 	{ "905", "*", 0, irc_msg_authfail },		/* SASL auth failed		*/
 	{ "906", "*", 0, irc_msg_authfail },		/* SASL auth failed		*/
 	{ "907", "*", 0, irc_msg_authfail },		/* SASL auth failed		*/
-	{ "cap", "vv:", 3, irc_msg_cap },		/* SASL capable			*/
 #endif
+	{ "batch", "vvv", 1, irc_msg_batch },		/* Batch started or ended	*/
+	{ "cap", "vv:", 3, irc_msg_cap },		/* Capability negotiation	*/
 	{ "invite", "n:", 2, irc_msg_invite },		/* Invited			*/
 	{ "join", ":", 1, irc_msg_join },		/* Joined a channel		*/
 	{ "kick", "cn:", 3, irc_msg_kick },		/* KICK				*/
@@ -194,7 +203,9 @@ static PurpleCmdRet irc_parse_purple_cmd(PurpleConversation *conv, const gchar *
 	if ((cmdent = g_hash_table_lookup(irc->cmds, cmd)) == NULL)
 		return PURPLE_CMD_RET_FAILED;
 
+	irc->send_for_user = TRUE;
 	(cmdent->cb)(irc, cmd, purple_conversation_get_name(conv), (const char **)args);
+	irc->send_for_user = FALSE;
 
 	return PURPLE_CMD_RET_OK;
 }
@@ -662,6 +673,92 @@ char *irc_format(struct irc_conn *irc, const char *format, ...)
 	return (g_string_free(string, FALSE));
 }
 
+/* Message tags escape ';', ' ', '\\', CR and LF */
+char *irc_tag_unescape(const char *value)
+{
+	GString *str = g_string_sized_new(strlen(value));
+
+	for (; *value; value++) {
+		if (*value != '\\') {
+			g_string_append_c(str, *value);
+			continue;
+		}
+
+		switch (*++value) {
+		case ':':
+			g_string_append_c(str, ';');
+			break;
+		case 's':
+			g_string_append_c(str, ' ');
+			break;
+		case 'r':
+			g_string_append_c(str, '\r');
+			break;
+		case 'n':
+			g_string_append_c(str, '\n');
+			break;
+		case '\0':
+			/* A lone backslash at the end is dropped */
+			value--;
+			break;
+		default:
+			g_string_append_c(str, *value);
+			break;
+		}
+	}
+
+	return g_string_free(str, FALSE);
+}
+
+/* Adds the tags of a message, without the leading '@', to irc->tags */
+void irc_parse_tags(struct irc_conn *irc, const char *tags)
+{
+	char **list;
+	int i;
+
+	list = g_strsplit(tags, ";", -1);
+	for (i = 0; list[i]; i++) {
+		char *value = strchr(list[i], '=');
+
+		if (value)
+			*value++ = '\0';
+		if (*list[i] == '\0')
+			continue;
+
+		g_hash_table_replace(irc->tags, g_strdup(list[i]),
+		                     irc_tag_unescape(value ? value : ""));
+	}
+	g_strfreev(list);
+}
+
+/* Returns the value of a tag on the message being handled, or NULL */
+const char *irc_tag(struct irc_conn *irc, const char *tag)
+{
+	return g_hash_table_lookup(irc->tags, tag);
+}
+
+/* The time the message being handled was sent, if the server said */
+time_t irc_tag_time(struct irc_conn *irc)
+{
+	const char *stamp = irc_tag(irc, "time");
+
+	if (stamp && *stamp) {
+		time_t when = purple_str_to_time(stamp, TRUE, NULL, NULL, NULL);
+		if (when > 0)
+			return when;
+	}
+
+	return time(NULL);
+}
+
+/* The batch the message being handled is part of, if any */
+struct irc_batch *irc_tag_batch(struct irc_conn *irc)
+{
+	const char *ref = irc_tag(irc, "batch");
+
+	return ref ? g_hash_table_lookup(irc->batches, ref) : NULL;
+}
+
 void irc_parse_msg(struct irc_conn *irc, char *input)
 {
 	struct _irc_msg *msgent;
@@ -680,6 +777,19 @@ void irc_parse_msg(struct irc_conn *irc, char *input)
 	 */
 	purple_signal_emit(_irc_plugin, "irc-receiving-text", gc, &input);
 
+	g_hash_table_remove_all(irc->tags);
+	if (input[0] == '@') {
+		if ((cur = strchr(input, ' ')) == NULL) {
+			irc_parse_error_cb(irc, input);
+			return;
+		}
+		*cur = '\0';
+		irc_parse_tags(irc, input + 1);
+		input = cur + 1;
+		while (*input == ' ')
+			input++;
+	}
+
 	if (!strncmp(input, "PING ", 5)) {
 		msg = irc_format(irc, "vv", "PONG", input + 5);
 		irc_send(irc, msg);
@@ -348,6 +348,16 @@ JabberChat *jabber_join_chat(JabberStream *js, const char *room,
 		if (history_since_string && *history_since_string) {
 			xmlnode_set_attrib(history, "since", history_since_string);
 		}
+	} else if (purple_account_get_bool(account, "mam", FALSE)) {
+		char *room_jid = g_strdup_printf("%s@%s", room, server);
+
+		/* The room's archive fills in the history after we've joined */
+		if (jabber_mam_room_has_archive(js, room_jid)) {
+			xmlnode *history = xmlnode_new_child(x, "history");
+			xmlnode_set_attrib(history, "maxstanzas", "0");
+		}
+
+		g_free(room_jid);
 	}
 
 	jabber_send(js, presence);
@@ -447,6 +457,7 @@ void jabber_chat_free(JabberChat *chat)
 	g_free(chat->room);
 	g_free(chat->server);
 	g_free(chat->handle);
+	g_free(chat->mam_first);
 	g_hash_table_destroy(chat->members);
 	g_hash_table_destroy(chat->components);
 	g_free(chat);
@@ -1256,6 +1267,62 @@ void jabber_chat_disco_traffic(JabberChat *chat)
 	g_free(room_jid);
 }
 
+static void jabber_chat_disco_archive_cb(JabberStream *js, const char *from,
+                                         JabberIqType type, const char *id,
+                                         xmlnode *packet, gpointer data)
+{
+	JabberChat *chat;
+	xmlnode *query, *feature;
+	char *room_jid;
+
+	if(!(chat = jabber_chat_find_by_id(js, GPOINTER_TO_INT(data))))
+		return;
+
+	if (type == JABBER_IQ_ERROR ||
+			!(query = xmlnode_get_child_with_namespace(packet, "query", NS_DISCO_INFO)))
+		return;
+
+	for(feature = xmlnode_get_child(query, "feature"); feature;
+			feature = xmlnode_get_next_twin(feature)) {
+		const char *var = xmlnode_get_attrib(feature, "var");
+
+		if (purple_strequal(var, NS_XMPP_MAM_2)) {
+			chat->mam = TRUE;
+			chat->mam_xmlns = NS_XMPP_MAM_2;
+			break;
+		} else if (purple_strequal(var, NS_XMPP_MAM)) {
+			chat->mam = TRUE;
+			chat->mam_xmlns = NS_XMPP_MAM;
+		}
+	}
+
+	room_jid = g_strdup_printf("%s@%s", chat->room, chat->server);
+	jabber_mam_room_discovered(js, room_jid, chat->mam);
+	g_free(room_jid);
+
+	if (chat->mam)
+		jabber_mam_fetch_room(js, chat);
+}
+
+void jabber_chat_disco_archive(JabberChat *chat)
+{
+	JabberIq *iq;
+	char *room_jid;
+
+	if (!purple_account_get_bool(purple_connection_get_account(chat->js->gc),
+			"mam", FALSE))
+		return;
+
+	room_jid = g_strdup_printf("%s@%s", chat->room, chat->server);
+
+	iq = jabber_iq_new_query(chat->js, JABBER_IQ_GET, NS_DISCO_INFO);
+	xmlnode_set_attrib(iq->node, "to", room_jid);
+	jabber_iq_set_callback(iq, jabber_chat_disco_archive_cb, GINT_TO_POINTER(chat->id));
+	jabber_iq_send(iq);
+
+	g_free(room_jid);
+}
+
 typedef struct {
 	const gchar *cap;
 	gboolean *all_support;
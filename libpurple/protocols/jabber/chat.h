@@ -53,6 +53,11 @@ typedef struct _JabberChat {
 	GHashTable *members;
 	gboolean left;
 	time_t joined;
+	gboolean mam;        /* the room keeps an archive */
+	const char *mam_xmlns; /* the version of XEP-0313 it speaks */
+	char *mam_first;     /* archive ID of the oldest message fetched */
+	gboolean mam_complete;
+	gboolean mam_synced; /* caught up with the archive since joining */
 } JabberChat;
 
 GList *jabber_chat_info(PurpleConnection *gc);
@@ -109,6 +114,12 @@ void jabber_roomlist_cancel(PurpleRoomlist *list);
 
 void jabber_chat_disco_traffic(JabberChat *chat);
 
+/**
+ * Asks the room whether it keeps an archive and, if it does, fetches the
+ * most recent page of it.
+ */
+void jabber_chat_disco_archive(JabberChat *chat);
+
 char *jabber_roomlist_room_serialize(PurpleRoomlistRoom *room);
 
 gboolean jabber_chat_all_participants_have_capability(const JabberChat *chat,
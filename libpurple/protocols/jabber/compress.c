@@ -0,0 +1,331 @@
+/*
+ * purple - Jabber Protocol Plugin
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ *
+ */
+
+#include "internal.h"
+#include "debug.h"
+
+#include "jabber.h"
+#include "compress.h"
+#include "parser.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+struct _JabberCompress {
+	/* The features to go on with if the server turns us down */
+	xmlnode *features;
+	gboolean active;
+
+#ifdef HAVE_ZLIB
+	/*
+	 * Each direction has a single zlib stream for the life of the
+	 * connection, so everything already sent serves as the dictionary
+	 * for what comes next.
+	 */
+	z_stream deflate;
+	z_stream inflate;
+#endif
+
+	GString *out;
+	guint flush_timer;
+};
+
+void
+jabber_compress_free(JabberCompress *compress)
+{
+	if (compress == NULL)
+		return;
+
+#ifdef HAVE_ZLIB
+	if (compress->active) {
+		deflateEnd(&compress->deflate);
+		inflateEnd(&compress->inflate);
+	}
+#endif
+
+	if (compress->flush_timer)
+		purple_timeout_remove(compress->flush_timer);
+	if (compress->features)
+		xmlnode_free(compress->features);
+	if (compress->out)
+		g_string_free(compress->out, TRUE);
+
+	g_free(compress);
+}
+
+gboolean
+jabber_compress_active(JabberStream *js)
+{
+	return js->compress && js->compress->active;
+}
+
+#ifdef HAVE_ZLIB
+
+static gboolean
+offers_zlib(xmlnode *features)
+{
+	xmlnode *compression, *method;
+
+	compression = xmlnode_get_child_with_namespace(features, "compression",
+			NS_COMPRESS_FEATURE);
+
+	for (method = xmlnode_get_child(compression, "method"); method;
+			method = xmlnode_get_next_twin(method)) {
+		char *name = xmlnode_get_data(method);
+		gboolean zlib = purple_strequal(name, "zlib");
+
+		g_free(name);
+		if (zlib)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+gboolean
+jabber_compress_start(JabberStream *js, xmlnode *features)
+{
+	PurpleAccount *account = purple_connection_get_account(js->gc);
+	xmlnode *compress, *method;
+
+	/* Only a plain TCP stream is ours to compress, and only once */
+	if (js->bosh || js->websocket || js->compress)
+		return FALSE;
+
+	/* Compressing under TLS lets whoever can inject text into the stream
+	 * guess at the secrets in it from the size of what gets sent (CRIME) */
+	if (jabber_stream_is_ssl(js))
+		return FALSE;
+
+#ifdef HAVE_CYRUS_SASL
+	if (js->sasl_maxbuf > 0)
+		return FALSE;
+#endif
+
+	if (!purple_account_get_bool(account, "compress", TRUE) ||
+			!offers_zlib(features))
+		return FALSE;
+
+	js->compress = g_new0(JabberCompress, 1);
+	js->compress->features = xmlnode_copy(features);
+
+	compress = xmlnode_new("compress");
+	xmlnode_set_namespace(compress, NS_COMPRESS);
+	method = xmlnode_new_child(compress, "method");
+	xmlnode_insert_data(method, "zlib", -1);
+
+	jabber_send(js, compress);
+	xmlnode_free(compress);
+
+	return TRUE;
+}
+
+static void
+compress_error(JabberStream *js, int ret)
+{
+	purple_debug_error("jabber", "zlib error %d\n", ret);
+	purple_connection_error_reason(js->gc,
+			PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+			_("Stream compression failed"));
+}
+
+void
+jabber_compress_parse(JabberStream *js, xmlnode *packet)
+{
+	JabberCompress *compress = js->compress;
+	xmlnode *features;
+
+	if (compress == NULL || compress->features == NULL) {
+		purple_debug_warning("jabber", "Ignoring spurious %s\n", packet->name);
+		return;
+	}
+
+	features = compress->features;
+	compress->features = NULL;
+
+	if (g_str_equal(packet->name, "compressed")) {
+		int ret;
+
+		if ((ret = deflateInit(&compress->deflate, Z_DEFAULT_COMPRESSION)) != Z_OK) {
+			compress_error(js, ret);
+		} else if ((ret = inflateInit(&compress->inflate)) != Z_OK) {
+			deflateEnd(&compress->deflate);
+			compress_error(js, ret);
+		} else {
+			purple_debug_info("jabber", "Stream compression enabled\n");
+			compress->active = TRUE;
+			compress->out = g_string_sized_new(1024);
+			/* A new stream is opened, compressed this time */
+			js->reinit = TRUE;
+		}
+	} else {
+		purple_debug_info("jabber", "Server refused to compress the stream\n");
+		jabber_stream_features_parse(js, features);
+	}
+
+	xmlnode_free(features);
+}
+
+static gboolean
+compress_deflate(JabberStream *js, const char *data, gsize len, int flush)
+{
+	JabberCompress *compress = js->compress;
+	z_stream *z = &compress->deflate;
+	int ret;
+
+	z->next_in = (Bytef *)data;
+	z->avail_in = len;
+
+	do {
+		gsize start = compress->out->len;
+		gsize room = MAX(len + 64, 1024);
+
+		g_string_set_size(compress->out, start + room);
+		z->next_out = (Bytef *)compress->out->str + start;
+		z->avail_out = room;
+
+		ret = deflate(z, flush);
+		g_string_set_size(compress->out, start + room - z->avail_out);
+
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			compress_error(js, ret);
+			return FALSE;
+		}
+	} while (z->avail_in > 0 || z->avail_out == 0);
+
+	return TRUE;
+}
+
+static gboolean
+compress_flush_cb(gpointer data)
+{
+	JabberStream *js = data;
+
+	js->compress->flush_timer = 0;
+	jabber_compress_flush(js);
+
+	return FALSE;
+}
+
+void
+jabber_compress_send(JabberStream *js, const char *data, int len)
+{
+	JabberCompress *compress = js->compress;
+
+	g_return_if_fail(compress != NULL && compress->active);
+
+	if (!compress_deflate(js, data, len, Z_NO_FLUSH))
+		return;
+
+	if (compress->flush_timer == 0)
+		compress->flush_timer = purple_timeout_add(0, compress_flush_cb, js);
+}
+
+void
+jabber_compress_flush(JabberStream *js)
+{
+	JabberCompress *compress = js->compress;
+
+	if (compress == NULL || !compress->active)
+		return;
+
+	if (compress->flush_timer) {
+		purple_timeout_remove(compress->flush_timer);
+		compress->flush_timer = 0;
+	}
+
+	/* A sync flush ends on a byte boundary, so the server can decompress
+	 * everything up to here without waiting for more */
+	if (!compress_deflate(js, NULL, 0, Z_SYNC_FLUSH))
+		return;
+
+	if (compress->out->len > 0)
+		jabber_stream_write(js, compress->out->str, compress->out->len);
+	g_string_truncate(compress->out, 0);
+}
+
+void
+jabber_compress_recv(JabberStream *js, const char *data, int len)
+{
+	z_stream *z = &js->compress->inflate;
+	char buf[4096];
+	int ret;
+
+	z->next_in = (Bytef *)data;
+	z->avail_in = len;
+
+	do {
+		gsize olen;
+
+		z->next_out = (Bytef *)buf;
+		z->avail_out = sizeof(buf) - 1;
+
+		ret = inflate(z, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			compress_error(js, ret);
+			return;
+		}
+
+		olen = sizeof(buf) - 1 - z->avail_out;
+		if (olen > 0) {
+			buf[olen] = '\0';
+			purple_debug_info("jabber", "Recv (zlib)(%" G_GSIZE_FORMAT "): %s\n",
+			                  olen, buf);
+			jabber_parser_process(js, buf, olen);
+		}
+	} while (z->avail_in > 0 || z->avail_out == 0);
+}
+
+#else /* !HAVE_ZLIB */
+
+gboolean
+jabber_compress_start(JabberStream *js, xmlnode *features)
+{
+	return FALSE;
+}
+
+void
+jabber_compress_parse(JabberStream *js, xmlnode *packet)
+{
+	purple_debug_warning("jabber", "Ignoring spurious %s\n", packet->name);
+}
+
+void
+jabber_compress_send(JabberStream *js, const char *data, int len)
+{
+	g_return_if_reached();
+}
+
+void
+jabber_compress_flush(JabberStream *js)
+{
+}
+
+void
+jabber_compress_recv(JabberStream *js, const char *data, int len)
+{
+	g_return_if_reached();
+}
+
+#endif /* HAVE_ZLIB */
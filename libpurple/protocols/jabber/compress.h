@@ -0,0 +1,72 @@
+/*
+ * purple - Jabber Protocol Plugin
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ *
+ */
+
+#ifndef PURPLE_JABBER_COMPRESS_H_
+#define PURPLE_JABBER_COMPRESS_H_
+
+#include "xmlnode.h"
+
+/* XEP-0138 Stream Compression */
+typedef struct _JabberCompress JabberCompress;
+
+void jabber_compress_free(JabberCompress *compress);
+
+/**
+ * Asks the server to compress the stream, if it offers zlib and the
+ * account allows it.  This is only tried once authenticated, so that
+ * credentials never share a compression context with anything else.
+ *
+ * @param features The <stream:features/> offered by the server.
+ *
+ * @return TRUE if compression was requested, in which case nothing else
+ *         should happen until the server answers.
+ */
+gboolean jabber_compress_start(JabberStream *js, xmlnode *features);
+
+/**
+ * Handles the server's <compressed/> or <failure/>.
+ */
+void jabber_compress_parse(JabberStream *js, xmlnode *packet);
+
+/**
+ * Returns whether the stream is being compressed.
+ */
+gboolean jabber_compress_active(JabberStream *js);
+
+/**
+ * Compresses data to be sent.  It is written out, with everything else
+ * queued during the same pass of the main loop, by one flush.
+ */
+void jabber_compress_send(JabberStream *js, const char *data, int len);
+
+/**
+ * Writes out everything queued by jabber_compress_send() right away.
+ */
+void jabber_compress_flush(JabberStream *js);
+
+/**
+ * Decompresses data read from the server and feeds it to the parser.
+ */
+void jabber_compress_recv(JabberStream *js, const char *data, int len);
+
+#endif /* PURPLE_JABBER_COMPRESS_H_ */
@@ -306,6 +306,8 @@ static void jabber_disco_info_cb(JabberStream *js, const char *from,
 					capabilities |= JABBER_CAP_CARBONS;
 				else if(!strcmp(var, NS_XMPP_MAM))
 					capabilities |= JABBER_CAP_MAM;
+				else if(!strcmp(var, NS_XMPP_MAM_2))
+					capabilities |= JABBER_CAP_MAM | JABBER_CAP_MAM_2;
 			}
 		}
 
@@ -403,14 +405,7 @@ jabber_disco_finish_server_info_result_cb(JabberStream *js)
 
 	if ((js->server_caps & JABBER_CAP_MAM) && purple_account_get_bool(js->gc->account, "mam", FALSE)) {
 		purple_debug_info("jabber", "MAM Requesting.\n");
-
-		time_t mam_laststamp = (time_t *)purple_account_get_int(js->gc->account, "mam_laststamp", time(0));
-		purple_account_set_int(js->gc->account, "mam_laststamp", mam_laststamp + 1);
-
-		const struct tm *unixtime = gmtime(&mam_laststamp);
-		strcpy(js->mam->last_timestamp, purple_utf8_strftime("%Y-%m-%dT%H:%M:%SZ", unixtime));
-
-		jabber_mam_add_to_queue(js, js->mam->last_timestamp, NULL, NULL);
+		jabber_mam_sync(js);
 	}
 
 	/* If there are manually specified bytestream proxies, query them */
@@ -605,6 +600,8 @@ jabber_disco_server_info_result_cb(JabberStream *js, const char *from,
 			js->server_caps |= JABBER_CAP_CARBONS;
 		} else if(!strcmp(var, NS_XMPP_MAM)) {
 			js->server_caps |= JABBER_CAP_MAM;
+		} else if(!strcmp(var, NS_XMPP_MAM_2)) {
+			js->server_caps |= JABBER_CAP_MAM | JABBER_CAP_MAM_2;
 		}
 	}
 
@@ -77,6 +77,9 @@
  * anything in the last 120 seconds
  */
 #define DEFAULT_INACTIVITY_TIME 120
+/* Write out serialized stanzas once this many bytes have piled up,
+ * rather than waiting for the main loop to come around again */
+#define JABBER_SEND_BUFFER_MAX (64 * 1024)
 
 GList *jabber_features = NULL;
 GList *jabber_identities = NULL;
@@ -85,6 +88,15 @@ static GHashTable *jabber_cmds = NULL; /* PurplePlugin * => GSList of ids */
 
 static gint plugin_ref = 0;
 
+/*
+ * The per-packet signals are emitted by ID for the plugin that registered
+ * them first; any other instance falls back to emitting them by name.
+ */
+static PurplePlugin *signal_plugin = NULL;
+static gulong receiving_xmlnode_signal = 0;
+static gulong sending_xmlnode_signal = 0;
+static gulong sending_text_signal = 0;
+
 static void jabber_unregister_account_cb(JabberStream *js);
 static void try_srv_connect(JabberStream *js);
 
@@ -92,6 +104,12 @@ static void jabber_stream_init(JabberStream *js)
 {
 	char *open_stream;
 
+	if (js->websocket) {
+		/* Each WebSocket message is parsed as a document of its own */
+		jabber_websocket_open_stream(js->websocket);
+		return;
+	}
+
 	if (js->stream_id) {
 		g_free(js->stream_id);
 		js->stream_id = NULL;
@@ -176,6 +194,7 @@ static void jabber_bind_result_cb(JabberStream *js, const char *from,
 		return;
 	}
 
+	jabber_sm_enable(js);
 	jabber_session_init(js);
 }
 
@@ -263,6 +282,26 @@ jabber_process_starttls(JabberStream *js, xmlnode *packet)
 	return FALSE;
 }
 
+void jabber_bind_resource(JabberStream *js)
+{
+	xmlnode *bind, *resource;
+	char *requested_resource;
+	JabberIq *iq = jabber_iq_new(js, JABBER_IQ_SET);
+	bind = xmlnode_new_child(iq->node, "bind");
+	xmlnode_set_namespace(bind, NS_XMPP_BIND);
+	requested_resource = jabber_prep_resource(js->user->resource);
+
+	if (requested_resource != NULL) {
+		resource = xmlnode_new_child(bind, "resource");
+		xmlnode_insert_data(resource, requested_resource, -1);
+		g_free(requested_resource);
+	}
+
+	jabber_iq_set_callback(iq, jabber_bind_result_cb, NULL);
+
+	jabber_iq_send(iq);
+}
+
 void jabber_stream_features_parse(JabberStream *js, xmlnode *packet)
 {
 	PurpleAccount *account = purple_connection_get_account(js->gc);
@@ -286,23 +325,14 @@ void jabber_stream_features_parse(JabberStream *js, xmlnode *packet)
 	} else if(xmlnode_get_child(packet, "mechanisms")) {
 		jabber_stream_set_state(js, JABBER_STREAM_AUTHENTICATING);
 		jabber_auth_start(js, packet);
+	} else if (jabber_compress_start(js, packet)) {
+		/* The stream is restarted once the server agrees */
 	} else if(xmlnode_get_child(packet, "bind")) {
-		xmlnode *bind, *resource;
-		char *requested_resource;
-		JabberIq *iq = jabber_iq_new(js, JABBER_IQ_SET);
-		bind = xmlnode_new_child(iq->node, "bind");
-		xmlnode_set_namespace(bind, NS_XMPP_BIND);
-		requested_resource = jabber_prep_resource(js->user->resource);
-
-		if (requested_resource != NULL) {
-			resource = xmlnode_new_child(bind, "resource");
-			xmlnode_insert_data(resource, requested_resource, -1);
-			g_free(requested_resource);
-		}
-
-		jabber_iq_set_callback(iq, jabber_bind_result_cb, NULL);
+		if (xmlnode_get_child_with_namespace(packet, "sm", NS_STREAM_MANAGEMENT))
+			js->server_caps |= JABBER_CAP_STREAM_MANAGEMENT;
 
-		jabber_iq_send(iq);
+		if (!jabber_sm_resume(js, packet))
+			jabber_bind_resource(js);
 	} else if (xmlnode_get_child_with_namespace(packet, "ver", NS_ROSTER_VERSIONING)) {
 		js->server_caps |= JABBER_CAP_ROSTER_VERSIONING;
 	} else /* if(xmlnode_get_child_with_namespace(packet, "auth")) */ {
@@ -332,7 +362,13 @@ void jabber_process_packet(JabberStream *js, xmlnode **packet)
 	const char *name;
 	const char *xmlns;
 
-	purple_signal_emit(purple_connection_get_prpl(js->gc), "jabber-receiving-xmlnode", js->gc, packet);
+	/* The server counts what it sent, whatever a plugin does with it */
+	jabber_sm_inbound(js, *packet);
+
+	if (purple_connection_get_prpl(js->gc) == signal_plugin)
+		purple_signal_emit_by_id(receiving_xmlnode_signal, js->gc, packet);
+	else
+		purple_signal_emit(purple_connection_get_prpl(js->gc), "jabber-receiving-xmlnode", js->gc, packet);
 
 	/* if the signal leaves us with a null packet, we're done */
 	if(NULL == *packet)
@@ -363,6 +399,10 @@ void jabber_process_packet(JabberStream *js, xmlnode **packet)
 			else if (g_str_equal(name, "failure"))
 				jabber_auth_handle_failure(js, *packet);
 		}
+	} else if (purple_strequal(xmlns, NS_STREAM_MANAGEMENT)) {
+		jabber_sm_parse(js, *packet);
+	} else if (purple_strequal(xmlns, NS_COMPRESS)) {
+		jabber_compress_parse(js, *packet);
 	} else if (purple_strequal(xmlns, NS_XMPP_TLS)) {
 		if (js->state != JABBER_STREAM_INITIALIZING_ENCRYPTION || js->gsc)
 			purple_debug_warning("jabber", "Ignoring spurious %s\n", name);
@@ -463,63 +503,66 @@ static gboolean do_jabber_send_raw(JabberStream *js, const char *data, int len)
 	return success;
 }
 
-void jabber_send_raw(JabberStream *js, const char *data, int len)
+static gboolean
+jabber_send_debug_enabled(void)
 {
-	PurpleConnection *gc;
-	PurpleAccount *account;
+	PurpleDebugUiOps *ops;
 
-	gc = js->gc;
-	account = purple_connection_get_account(gc);
-
-	g_return_if_fail(data != NULL);
+	if (purple_debug_is_enabled())
+		return TRUE;
 
-	/* because printing a tab to debug every minute gets old */
-	if (data && strcmp(data, "\t") != 0) {
-		const char *username;
-		char *text = NULL, *last_part = NULL, *tag_start = NULL;
-
-		/* Because debug logs with plaintext passwords make me sad */
-		if (!purple_debug_is_unsafe() && js->state != JABBER_STREAM_CONNECTED &&
-				/* Either <auth> or <query><password>... */
-				(((tag_start = strstr(data, "<auth ")) &&
-					strstr(data, "xmlns='" NS_XMPP_SASL "'")) ||
-				((tag_start = strstr(data, "<query ")) &&
-					strstr(data, "xmlns='jabber:iq:auth'>") &&
-					(tag_start = strstr(tag_start, "<password>"))))) {
-			char *data_start, *tag_end = strchr(tag_start, '>');
-			text = g_strdup(data);
-
-			/* Better to print out some wacky debugging than crash
-			 * due to a plugin sending bad xml */
-			if (tag_end == NULL)
-				tag_end = tag_start;
-
-			data_start = text + (tag_end - data) + 1;
-
-			last_part = strchr(data_start, '<');
-			*data_start = '\0';
-		}
+	ops = purple_debug_get_ui_ops();
+	return ops != NULL && ops->print != NULL &&
+		(ops->is_enabled == NULL || ops->is_enabled(PURPLE_DEBUG_MISC, "jabber"));
+}
 
-		username = purple_connection_get_display_name(gc);
-		if (!username)
-			username = purple_account_get_username(account);
+static void jabber_send_debug(JabberStream *js, const char *data)
+{
+	PurpleConnection *gc = js->gc;
+	const char *username;
+	char *text = NULL, *last_part = NULL, *tag_start = NULL;
 
-		purple_debug_misc("jabber", "Sending%s (%s): %s%s%s\n",
-				jabber_stream_is_ssl(js) ? " (ssl)" : "", username,
-				text ? text : data,
-				last_part ? "password removed" : "",
-				last_part ? last_part : "");
+	/* because printing a tab to debug every minute gets old */
+	if (strcmp(data, "\t") == 0 || !jabber_send_debug_enabled())
+		return;
 
-		g_free(text);
+	/* Because debug logs with plaintext passwords make me sad */
+	if (!purple_debug_is_unsafe() && js->state != JABBER_STREAM_CONNECTED &&
+			/* Either <auth> or <query><password>... */
+			(((tag_start = strstr(data, "<auth ")) &&
+				strstr(data, "xmlns='" NS_XMPP_SASL "'")) ||
+			((tag_start = strstr(data, "<query ")) &&
+				strstr(data, "xmlns='jabber:iq:auth'>") &&
+				(tag_start = strstr(tag_start, "<password>"))))) {
+		char *data_start, *tag_end = strchr(tag_start, '>');
+		text = g_strdup(data);
+
+		/* Better to print out some wacky debugging than crash
+		 * due to a plugin sending bad xml */
+		if (tag_end == NULL)
+			tag_end = tag_start;
+
+		data_start = text + (tag_end - data) + 1;
+
+		last_part = strchr(data_start, '<');
+		*data_start = '\0';
 	}
 
-	purple_signal_emit(purple_connection_get_prpl(gc), "jabber-sending-text", gc, &data);
-	if (data == NULL)
-		return;
+	username = purple_connection_get_display_name(gc);
+	if (!username)
+		username = purple_account_get_username(purple_connection_get_account(gc));
 
-	if (len == -1)
-		len = strlen(data);
+	purple_debug_misc("jabber", "Sending%s (%s): %s%s%s\n",
+			jabber_stream_is_ssl(js) ? " (ssl)" : "", username,
+			text ? text : data,
+			last_part ? "password removed" : "",
+			last_part ? last_part : "");
+
+	g_free(text);
+}
 
+static void jabber_send_encoded(JabberStream *js, const char *data, int len)
+{
 	/* If we've got a security layer, we need to encode the data,
 	 * splitting it on the maximum buffer length negotiated */
 #ifdef HAVE_CYRUS_SASL
@@ -546,7 +589,7 @@ void jabber_send_raw(JabberStream *js, const char *data, int len)
 				purple_debug_error("jabber",
 					"sasl_encode error %d: %s\n", rc,
 					sasl_errdetail(js->sasl));
-				purple_connection_error_reason(gc,
+				purple_connection_error_reason(js->gc,
 					PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
 					error);
 				g_free(error);
@@ -566,10 +609,75 @@ void jabber_send_raw(JabberStream *js, const char *data, int len)
 
 	if (js->bosh)
 		jabber_bosh_connection_send_raw(js->bosh, data);
+	else if (js->websocket)
+		jabber_websocket_send_raw(js->websocket, data, len);
+	else if (jabber_compress_active(js))
+		jabber_compress_send(js, data, len);
 	else
 		do_jabber_send_raw(js, data, len);
 }
 
+gboolean jabber_stream_write(JabberStream *js, const char *data, int len)
+{
+	return do_jabber_send_raw(js, data, len);
+}
+
+void jabber_stream_flush(JabberStream *js)
+{
+	if (js->send_timer) {
+		purple_timeout_remove(js->send_timer);
+		js->send_timer = 0;
+	}
+
+	if (js->send_buffer == NULL || js->send_buffer->len == 0)
+		return;
+
+	jabber_send_encoded(js, js->send_buffer->str, js->send_buffer->len);
+	g_string_truncate(js->send_buffer, 0);
+
+	/* Don't hang on to the memory of one huge stanza forever */
+	if (js->send_buffer->allocated_len > JABBER_SEND_BUFFER_MAX) {
+		g_string_free(js->send_buffer, TRUE);
+		js->send_buffer = NULL;
+	}
+}
+
+static gboolean jabber_send_buffer_cb(gpointer data)
+{
+	JabberStream *js = data;
+
+	js->send_timer = 0;
+	jabber_stream_flush(js);
+
+	return FALSE;
+}
+
+void jabber_send_raw(JabberStream *js, const char *data, int len)
+{
+	PurpleConnection *gc;
+
+	gc = js->gc;
+
+	g_return_if_fail(data != NULL);
+
+	/* Anything already serialized has to go out first */
+	jabber_stream_flush(js);
+
+	jabber_send_debug(js, data);
+
+	if (purple_connection_get_prpl(gc) == signal_plugin)
+		purple_signal_emit_by_id(sending_text_signal, gc, &data);
+	else
+		purple_signal_emit(purple_connection_get_prpl(gc), "jabber-sending-text", gc, &data);
+	if (data == NULL)
+		return;
+
+	if (len == -1)
+		len = strlen(data);
+
+	jabber_send_encoded(js, data, len);
+}
+
 int jabber_prpl_send_raw(PurpleConnection *gc, const char *buf, int len)
 {
 	JabberStream *js = purple_connection_get_protocol_data(gc);
@@ -581,6 +689,7 @@ int jabber_prpl_send_raw(PurpleConnection *gc, const char *buf, int len)
 	 */
 
 	jabber_send_raw(js, buf, len);
+	jabber_sm_outbound_raw(js, buf, len);
 	return (len < 0 ? (int)strlen(buf) : len);
 }
 
@@ -590,6 +699,7 @@ void jabber_send_signal_cb(PurpleConnection *pc, xmlnode **packet,
 	JabberStream *js;
 	char *txt;
 	int len;
+	gsize start;
 
 	if (NULL == packet)
 		return;
@@ -601,19 +711,49 @@ void jabber_send_signal_cb(PurpleConnection *pc, xmlnode **packet,
 	if (NULL == js)
 		return;
 
-	if (js->bosh)
+	if (js->bosh || js->websocket)
 		if (g_str_equal((*packet)->name, "message") ||
 				g_str_equal((*packet)->name, "iq") ||
 				g_str_equal((*packet)->name, "presence"))
 			xmlnode_set_namespace(*packet, NS_XMPP_CLIENT);
-	txt = xmlnode_to_str(*packet, &len);
-	jabber_send_raw(js, txt, len);
-	g_free(txt);
+
+	/*
+	 * If nothing can rewrite the text, serialize the stanza straight onto
+	 * the end of the send buffer and let everything sent during this pass
+	 * of the main loop go out in a single write.  A WebSocket message has
+	 * to hold exactly one stanza, so those are always sent one by one.
+	 */
+	if (js->bosh || js->websocket ||
+			purple_connection_get_prpl(pc) != signal_plugin ||
+			purple_signal_has_handlers(sending_text_signal)) {
+		txt = xmlnode_to_str(*packet, &len);
+		jabber_send_raw(js, txt, len);
+		g_free(txt);
+		jabber_sm_outbound(js, *packet);
+		return;
+	}
+
+	if (js->send_buffer == NULL)
+		js->send_buffer = g_string_sized_new(1024);
+
+	start = js->send_buffer->len;
+	xmlnode_append_to_gstring(*packet, js->send_buffer);
+	jabber_send_debug(js, js->send_buffer->str + start);
+
+	if (js->send_buffer->len >= JABBER_SEND_BUFFER_MAX)
+		jabber_stream_flush(js);
+	else if (js->send_timer == 0)
+		js->send_timer = purple_timeout_add(0, jabber_send_buffer_cb, js);
+
+	jabber_sm_outbound(js, *packet);
 }
 
 void jabber_send(JabberStream *js, xmlnode *packet)
 {
-	purple_signal_emit(purple_connection_get_prpl(js->gc), "jabber-sending-xmlnode", js->gc, &packet);
+	if (purple_connection_get_prpl(js->gc) == signal_plugin)
+		purple_signal_emit_by_id(sending_xmlnode_signal, js->gc, &packet);
+	else
+		purple_signal_emit(purple_connection_get_prpl(js->gc), "jabber-sending-xmlnode", js->gc, &packet);
 }
 
 static gboolean jabber_keepalive_timeout(PurpleConnection *gc)
@@ -657,8 +797,12 @@ jabber_recv_cb_ssl(gpointer data, PurpleSslConnection *gsc,
 	while((len = purple_ssl_read(gsc, buf, sizeof(buf) - 1)) > 0) {
 		gc->last_received = time(NULL);
 		buf[len] = '\0';
-		purple_debug_info("jabber", "Recv (ssl)(%d): %s\n", len, buf);
-		jabber_parser_process(js, buf, len);
+		if (jabber_compress_active(js))
+			jabber_compress_recv(js, buf, len);
+		else {
+			purple_debug_info("jabber", "Recv (ssl)(%d): %s\n", len, buf);
+			jabber_parser_process(js, buf, len);
+		}
 		if(js->reinit)
 			jabber_stream_init(js);
 	}
@@ -717,8 +861,12 @@ jabber_recv_cb(gpointer data, gint source, PurpleInputCondition condition)
 		}
 #endif
 		buf[len] = '\0';
-		purple_debug_info("jabber", "Recv (%d): %s\n", len, buf);
-		jabber_parser_process(js, buf, len);
+		if (jabber_compress_active(js))
+			jabber_compress_recv(js, buf, len);
+		else {
+			purple_debug_info("jabber", "Recv (%d): %s\n", len, buf);
+			jabber_parser_process(js, buf, len);
+		}
 		if(js->reinit)
 			jabber_stream_init(js);
 	} else if(len < 0 && errno == EAGAIN) {
@@ -764,43 +912,43 @@ static void
 txt_resolved_cb(GList *responses, gpointer data)
 {
 	JabberStream *js = data;
-	gboolean found = FALSE;
+	char *bosh_url = NULL;
 
 	js->srv_query_data = NULL;
 
+	/* A WebSocket does the same job as BOSH with a lot less overhead, so
+	 * it's preferred when the server offers both */
 	while (responses) {
 		PurpleTxtResponse *resp = responses->data;
 		gchar **token;
 		token = g_strsplit(purple_txt_response_get_content(resp), "=", 2);
-		if (!strcmp(token[0], "_xmpp-client-xbosh")) {
+		if (token[1] == NULL) {
+			/* Not one of ours */
+		} else if (!strcmp(token[0], "_xmpp-client-websocket") && !js->websocket) {
 			purple_debug_info("jabber","Found alternative connection method using %s at %s.\n", token[0], token[1]);
-			js->bosh = jabber_bosh_connection_init(js, token[1]);
-			g_strfreev(token);
-			break;
+			js->websocket = jabber_websocket_new(js, token[1]);
+		} else if (!strcmp(token[0], "_xmpp-client-xbosh") && !bosh_url) {
+			purple_debug_info("jabber","Found alternative connection method using %s at %s.\n", token[0], token[1]);
+			bosh_url = g_strdup(token[1]);
 		}
 		g_strfreev(token);
 		purple_txt_response_destroy(resp);
 		responses = g_list_delete_link(responses, responses);
 	}
 
-	if (js->bosh) {
-		found = TRUE;
+	if (js->websocket)
+		jabber_websocket_connect(js->websocket);
+	else if (bosh_url && (js->bosh = jabber_bosh_connection_init(js, bosh_url)))
 		jabber_bosh_connection_connect(js->bosh);
-	}
-
-	if (!found) {
+	else {
 		purple_debug_warning("jabber", "Unable to find alternative XMPP connection "
 				  "methods after failing to connect directly.\n");
 		purple_connection_error_reason(js->gc,
 				PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
 				_("Unable to connect"));
-		return;
 	}
 
-	if (responses) {
-		g_list_foreach(responses, (GFunc)purple_txt_response_destroy, NULL);
-		g_list_free(responses);
-	}
+	g_free(bosh_url);
 }
 
 static void
@@ -852,6 +1000,9 @@ jabber_ssl_connect_failure(PurpleSslConnection *gsc, PurpleSslErrorType error,
 
 static void tls_init(JabberStream *js)
 {
+	/* Nothing buffered may end up on the wire after the handshake */
+	jabber_stream_flush(js);
+
 	purple_input_remove(js->gc->inpa);
 	js->gc->inpa = 0;
 	js->gsc = purple_ssl_connect_with_host_fd(js->gc->account, js->fd,
@@ -933,7 +1084,8 @@ jabber_stream_new(PurpleAccount *account)
 	js = gc->proto_data = g_new0(JabberStream, 1);
 	js->gc = gc;
 	js->fd = -1;
-	js->mam = calloc(1, sizeof(mam_t));
+	js->mam = jabber_mam_new(js);
+	js->sm = jabber_sm_new(js);
 
 	if (g_strcmp0("prpl-facebook-xmpp",
 		purple_account_get_protocol_id(account)) == 0)
@@ -1035,9 +1187,25 @@ jabber_stream_connect(JabberStream *js)
 			"connect_server", "");
 	const char *bosh_url = purple_account_get_string(account,
 			"bosh_url", "");
+	const char *websocket_url = purple_account_get_string(account,
+			"websocket_url", "");
 
 	jabber_stream_set_state(js, JABBER_STREAM_CONNECTING);
 
+	/* A WebSocket is cheaper than BOSH, so it wins if both are given */
+	if (*websocket_url) {
+		js->websocket = jabber_websocket_new(js, websocket_url);
+		if (js->websocket)
+			jabber_websocket_connect(js->websocket);
+		else {
+			purple_connection_error_reason(gc,
+				PURPLE_CONNECTION_ERROR_INVALID_SETTINGS,
+				_("Malformed WebSocket URL"));
+		}
+
+		return;
+	}
+
 	/* If both BOSH and a Connect Server are specified, we prefer BOSH. I'm not
 	 * attached to that choice, though.
 	 */
@@ -1597,14 +1765,24 @@ void jabber_unregister_account(PurpleAccount *account, PurpleAccountUnregistrati
 void jabber_close(PurpleConnection *gc)
 {
 	JabberStream *js = purple_connection_get_protocol_data(gc);
+	gboolean resumable;
 
 	/* Close all of the open Jingle sessions on this stream */
 	jingle_terminate_sessions(js);
 
+	/* Closing the stream would end a session we may yet resume */
+	resumable = jabber_sm_detach(js);
+
 	if (js->bosh)
 		jabber_bosh_connection_close(js->bosh);
-	else if ((js->gsc && js->gsc->fd > 0) || js->fd > 0)
+	else if (js->websocket) {
+		if (!resumable)
+			jabber_websocket_close(js->websocket);
+	} else if (!resumable && ((js->gsc && js->gsc->fd > 0) || js->fd > 0)) {
 		jabber_send_raw(js, "</stream:stream>", -1);
+		/* It can't wait for the main loop when we're about to close */
+		jabber_compress_flush(js);
+	}
 
 	if (js->srv_query_data)
 		purple_srv_cancel(js->srv_query_data);
@@ -1619,6 +1797,9 @@ void jabber_close(PurpleConnection *gc)
 
 	if (js->bosh)
 		jabber_bosh_connection_destroy(js->bosh);
+	if (js->websocket)
+		jabber_websocket_free(js->websocket);
+	jabber_compress_free(js->compress);
 
 	jabber_buddy_remove_all_pending_buddy_info_requests(js);
 
@@ -1662,6 +1843,10 @@ void jabber_close(PurpleConnection *gc)
 	g_free(js->avatar_hash);
 	g_free(js->caps_hash);
 
+	if (js->send_timer)
+		purple_timeout_remove(js->send_timer);
+	if (js->send_buffer)
+		g_string_free(js->send_buffer, TRUE);
 	if (js->write_buffer)
 		purple_circ_buffer_destroy(js->write_buffer);
 	if(js->writeh)
@@ -1733,9 +1918,10 @@ void jabber_close(PurpleConnection *gc)
 		}
 	}
 
-	jabber_mam_clear(js->mam);
-	free(js->mam);
+	jabber_mam_free(js->mam);
 	js->mam = NULL;
+	jabber_sm_free(js->sm);
+	js->sm = NULL;
 
 	g_free(js);
 
@@ -1773,8 +1959,9 @@ void jabber_stream_set_state(JabberStream *js, JabberStreamState state)
 
 			break;
 		case JABBER_STREAM_CONNECTED:
-			/* Send initial presence */
-			jabber_presence_send(js, TRUE);
+			/* Send initial presence, unless the server still has it from
+			 * the session we resumed */
+			jabber_presence_send(js, !jabber_sm_resumed(js));
 			/* Start up the inactivity timer */
 			jabber_stream_restart_inactivity_timer(js);
 
@@ -2096,8 +2283,11 @@ static void jabber_identities_destroy(void)
 
 gboolean jabber_stream_is_ssl(JabberStream *js)
 {
-	return (js->bosh && jabber_bosh_connection_is_ssl(js->bosh)) ||
-	       (!js->bosh && js->gsc);
+	if (js->bosh)
+		return jabber_bosh_connection_is_ssl(js->bosh);
+	if (js->websocket)
+		return jabber_websocket_is_ssl(js->websocket);
+	return js->gsc != NULL;
 }
 
 static gboolean
@@ -2112,6 +2302,8 @@ inactivity_cb(gpointer data)
 
 	if (js->bosh)
 		jabber_bosh_connection_send_keepalive(js->bosh);
+	else if (js->websocket)
+		jabber_websocket_send_keepalive(js->websocket);
 	else
 		jabber_send_raw(js, "\t", 1);
 
@@ -2898,6 +3090,32 @@ static PurpleCmdRet jabber_cmd_chat_topic(PurpleConversation *conv,
 	return PURPLE_CMD_RET_OK;
 }
 
+static PurpleCmdRet jabber_cmd_chat_history(PurpleConversation *conv,
+		const char *cmd, char **args, char **error, void *data)
+{
+	JabberChat *chat = jabber_chat_find_by_conv(conv);
+
+	if (!chat)
+		return PURPLE_CMD_RET_FAILED;
+
+	if (!chat->mam) {
+		*error = g_strdup(_("This room does not keep a message archive."));
+		return PURPLE_CMD_RET_FAILED;
+	}
+
+	if (chat->mam_complete) {
+		purple_conv_chat_write(PURPLE_CONV_CHAT(conv), "",
+				_("There are no older messages in the archive."),
+				PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, time(NULL));
+		return PURPLE_CMD_RET_OK;
+	}
+
+	if (!jabber_mam_fetch_room(chat->js, chat))
+		return PURPLE_CMD_RET_FAILED;
+
+	return PURPLE_CMD_RET_OK;
+}
+
 static PurpleCmdRet jabber_cmd_chat_nick(PurpleConversation *conv,
 		const char *cmd, char **args, char **error, void *data)
 {
@@ -3635,6 +3853,13 @@ static void jabber_register_commands(PurplePlugin *plugin)
 	                  _("configure:  Configure a chat room."), NULL);
 	commands = g_slist_prepend(commands, GUINT_TO_POINTER(id));
 
+	id = purple_cmd_register("history", "", PURPLE_CMD_P_PRPL,
+	                  PURPLE_CMD_FLAG_CHAT | PURPLE_CMD_FLAG_PRPL_ONLY,
+	                  "prpl-jabber", jabber_cmd_chat_history,
+	                  _("history:  Fetch older messages from the room's archive."),
+	                  NULL);
+	commands = g_slist_prepend(commands, GUINT_TO_POINTER(id));
+
 	id = purple_cmd_register("nick", "s", PURPLE_CMD_P_PRPL,
 	                  PURPLE_CMD_FLAG_CHAT | PURPLE_CMD_FLAG_PRPL_ONLY,
 	                  "prpl-jabber", jabber_cmd_chat_nick,
@@ -3913,6 +4138,8 @@ jabber_do_init(void)
 	jabber_iq_init();
 	jabber_presence_init();
 	jabber_caps_init();
+	jabber_mam_init();
+	jabber_sm_init();
 	/* PEP things should be init via jabber_pep_init, not here */
 	jabber_pep_init();
 	jabber_data_init();
@@ -3936,6 +4163,8 @@ jabber_do_uninit(void)
 	jabber_ibb_uninit();
 	/* PEP things should be uninit via jabber_pep_uninit, not here */
 	jabber_pep_uninit();
+	jabber_sm_uninit();
+	jabber_mam_uninit();
 	jabber_caps_uninit();
 	jabber_presence_uninit();
 	jabber_iq_uninit();
@@ -3955,6 +4184,8 @@ jabber_do_uninit(void)
 
 void jabber_plugin_init(PurplePlugin *plugin)
 {
+	gulong receiving_xmlnode, sending_xmlnode, sending_text;
+
 	++plugin_ref;
 
 	if (plugin_ref == 1)
@@ -4007,12 +4238,12 @@ void jabber_plugin_init(PurplePlugin *plugin)
 			plugin, PURPLE_CALLBACK(jabber_iq_signal_unregister), NULL);
 
 
-	purple_signal_register(plugin, "jabber-receiving-xmlnode",
+	receiving_xmlnode = purple_signal_register(plugin, "jabber-receiving-xmlnode",
 			purple_marshal_VOID__POINTER_POINTER, NULL, 2,
 			purple_value_new(PURPLE_TYPE_SUBTYPE, PURPLE_SUBTYPE_CONNECTION),
 			purple_value_new_outgoing(PURPLE_TYPE_SUBTYPE, PURPLE_SUBTYPE_XMLNODE));
 
-	purple_signal_register(plugin, "jabber-sending-xmlnode",
+	sending_xmlnode = purple_signal_register(plugin, "jabber-sending-xmlnode",
 			purple_marshal_VOID__POINTER_POINTER, NULL, 2,
 			purple_value_new(PURPLE_TYPE_SUBTYPE, PURPLE_SUBTYPE_CONNECTION),
 			purple_value_new_outgoing(PURPLE_TYPE_SUBTYPE, PURPLE_SUBTYPE_XMLNODE));
@@ -4025,7 +4256,7 @@ void jabber_plugin_init(PurplePlugin *plugin)
 			plugin, PURPLE_CALLBACK(jabber_send_signal_cb),
 			NULL, PURPLE_SIGNAL_PRIORITY_HIGHEST);
 
-	purple_signal_register(plugin, "jabber-sending-text",
+	sending_text = purple_signal_register(plugin, "jabber-sending-text",
 			     purple_marshal_VOID__POINTER_POINTER, NULL, 2,
 			     purple_value_new(PURPLE_TYPE_SUBTYPE, PURPLE_SUBTYPE_CONNECTION),
 			     purple_value_new_outgoing(PURPLE_TYPE_STRING));
@@ -4065,12 +4296,26 @@ void jabber_plugin_init(PurplePlugin *plugin)
 			purple_value_new(PURPLE_TYPE_STRING), /* type */
 			purple_value_new(PURPLE_TYPE_STRING), /* from */
 			purple_value_new(PURPLE_TYPE_SUBTYPE, PURPLE_SUBTYPE_XMLNODE));
+
+	if (signal_plugin == NULL) {
+		signal_plugin = plugin;
+		receiving_xmlnode_signal = receiving_xmlnode;
+		sending_xmlnode_signal = sending_xmlnode;
+		sending_text_signal = sending_text;
+	}
 }
 
 void jabber_plugin_uninit(PurplePlugin *plugin)
 {
 	g_return_if_fail(plugin_ref > 0);
 
+	if (plugin == signal_plugin) {
+		signal_plugin = NULL;
+		receiving_xmlnode_signal = 0;
+		sending_xmlnode_signal = 0;
+		sending_text_signal = 0;
+	}
+
 	purple_signals_unregister_by_instance(plugin);
 	purple_plugin_ipc_unregister_all(plugin);
 
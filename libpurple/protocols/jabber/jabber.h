@@ -53,6 +53,8 @@ typedef enum {
 
 	JABBER_CAP_CARBONS        = 1 << 17,
 	JABBER_CAP_MAM            = 1 << 18,
+	JABBER_CAP_STREAM_MANAGEMENT = 1 << 19,
+	JABBER_CAP_MAM_2          = 1 << 20,
 
 	JABBER_CAP_RETRIEVED      = 1 << 31
 } JabberCapabilities;
@@ -62,6 +64,7 @@ typedef struct _JabberStream JabberStream;
 #include <libxml/parser.h>
 #include <glib.h>
 #include "circbuffer.h"
+#include "compress.h"
 #include "connection.h"
 #include "dnsquery.h"
 #include "dnssrv.h"
@@ -69,6 +72,7 @@ typedef struct _JabberStream JabberStream;
 #include "media.h"
 #include "mediamanager.h"
 #include "roomlist.h"
+#include "sm.h"
 #include "sslconn.h"
 
 #include "namespaces.h"
@@ -79,6 +83,7 @@ typedef struct _JabberStream JabberStream;
 #include "xmlnode.h"
 #include "buddy.h"
 #include "bosh.h"
+#include "websocket.h"
 
 #ifdef HAVE_CYRUS_SASL
 #include <sasl/sasl.h>
@@ -198,6 +203,10 @@ struct _JabberStream
 	PurpleCircBuffer *write_buffer;
 	guint writeh;
 
+	/* Stanzas serialized by jabber_send() but not yet written out */
+	GString *send_buffer;
+	guint send_timer;
+
 	gboolean reinit;
 
 	JabberCapabilities server_caps;
@@ -269,6 +278,12 @@ struct _JabberStream
 	/* BOSH stuff */
 	PurpleBOSHConnection *bosh;
 
+	/* XMPP over WebSocket, used instead of BOSH when available */
+	JabberWebSocket *websocket;
+
+	/* XEP-0138 Stream Compression */
+	JabberCompress *compress;
+
 	/**
 	 * This linked list contains PurpleUtilFetchUrlData structs
 	 * for when we lookup buddy icons from a url
@@ -292,7 +307,8 @@ struct _JabberStream
 	/* facebook quirks */
 	gboolean facebook_roster_cleanup_performed;
 
-	mam_t *mam;
+	JabberMam *mam;
+	JabberSm *sm;
 };
 
 typedef gboolean (JabberFeatureEnabled)(JabberStream *js, const gchar *namespace);
@@ -326,9 +342,20 @@ extern GList *jabber_features;
 extern GList *jabber_identities;
 
 void jabber_stream_features_parse(JabberStream *js, xmlnode *packet);
+void jabber_bind_resource(JabberStream *js);
 void jabber_process_packet(JabberStream *js, xmlnode **packet);
 void jabber_send(JabberStream *js, xmlnode *data);
 void jabber_send_raw(JabberStream *js, const char *data, int len);
+/**
+ * Writes out any stanzas jabber_send() has serialized but not yet sent.
+ * This happens on its own once per pass of the main loop.
+ */
+void jabber_stream_flush(JabberStream *js);
+/**
+ * Writes data to the connection as it is, after it has been through any
+ * compression or security layer.
+ */
+gboolean jabber_stream_write(JabberStream *js, const char *data, int len);
 void jabber_send_signal_cb(PurpleConnection *pc, xmlnode **packet,
                            gpointer unused);
 
@@ -293,6 +293,12 @@ init_plugin(PurplePlugin *plugin)
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
 						   option);
 
+	option = purple_account_option_bool_new(
+						_("Compress unencrypted streams when the server allows it"),
+						"compress", TRUE);
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+						   option);
+
 	option = purple_account_option_int_new(_("Connect port"), "port", 5222);
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
 						   option);
@@ -315,6 +321,16 @@ init_plugin(PurplePlugin *plugin)
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
 						  option);
 
+	option = purple_account_option_string_new(_("WebSocket URL"),
+						  "websocket_url", NULL);
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+						  option);
+
+	option = purple_account_option_int_new(_("Message archive page size"),
+						"mam_page_size", 250);
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+						   option);
+
 	/* this should probably be part of global smiley theme settings later on,
 	  shared with MSN */
 	option = purple_account_option_bool_new(_("Show Custom Smileys"),
@@ -22,225 +22,1057 @@
  */
 
 #include "internal.h"
-#include "request.h"
+#include "debug.h"
+#include "util.h"
 
 #include "jabber.h"
+#include "chat.h"
+#include "iq.h"
+#include "jutil.h"
 #include "mam.h"
 
-struct list_s
-{
-	void *data;
-	list_t *prev;
-	list_t *next;
+#define JABBER_MAM_FILENAME "xmpp-mam.xml"
+
+/* How many pages one connection may have requested at once. */
+#define JABBER_MAM_MAX_QUERIES 4
+
+#define JABBER_MAM_DEFAULT_PAGE_SIZE 250
+#define JABBER_MAM_MIN_PAGE_SIZE 10
+#define JABBER_MAM_MAX_PAGE_SIZE 1000
+
+/* How many archive IDs to remember for dropping duplicates. */
+#define JABBER_MAM_SEEN_MAX 4096
+
+/*
+ * Where to resume the archive from.  The archive ID is exact; the time
+ * is used when there is no ID or the server no longer knows it.
+ */
+typedef struct {
+	char *last;
+	time_t stamp;
+} JabberMamCursor;
+
+typedef struct {
+	JabberMamCursor archive;
+	GHashTable *contacts; /* char *bare_jid -> JabberMamCursor */
+	GHashTable *rooms;    /* char *room_jid -> JabberMamCursor, for rooms
+	                         known to keep an archive */
+} JabberMamState;
+
+typedef struct {
+	char *queryid;
+	char *iq_id;
+	const char *xmlns; /* the version of XEP-0313 the query was sent in */
+	char *archive; /* room JID, or NULL for our own archive */
+	char *with;    /* bare JID, or NULL for the whole archive */
+	time_t start;
+	char *after;   /* RSM cursor, or NULL */
+	char *before;  /* RSM cursor to page back from, or NULL for the end */
+	gboolean backwards;
+	gboolean backfill; /* older than what is already in the room */
+	guint count;   /* results received for the current page */
+} JabberMamQuery;
+
+/* Archive IDs already handled, remembered up to JABBER_MAM_SEEN_MAX. */
+typedef struct {
+	GHashTable *ids;
+	GQueue *order;
+} JabberMamSeen;
+
+struct _JabberMam {
+	JabberStream *js;
+	JabberMamState *state;
+
+	GQueue *pending;
+	GHashTable *queries; /* char *queryid -> JabberMamQuery */
+	guint next_query;
+
+	/* The whole-archive query hasn't finished yet. */
+	gboolean syncing;
+
+	JabberMamSeen *seen;
+	GHashTable *room_seen; /* char *room_jid -> JabberMamSeen */
+
+	/* Our own IDs for the messages we sent, which come back from the
+	 * archive as outgoing messages. */
+	JabberMamSeen *sent;
 };
 
-list_t * list_append(list_t *li, void *data)
+static GHashTable *states = NULL; /* char *account_jid -> JabberMamState */
+static guint       save_timer = 0;
+
+static void
+jabber_mam_cursor_free(JabberMamCursor *cursor)
 {
-	list_t *nli = malloc(sizeof(list_t));
-	nli->data = data;
-	if(!li) {
-		nli->prev = nli->next = NULL;
-	} else {
-	        nli->prev = li;
-	        nli->next = li->next;
-	        if(li->next)
-			li->next->prev = nli;
-		li->next = nli;
-	}
-	return nli;
+	g_free(cursor->last);
+	g_free(cursor);
 }
 
-list_t * list_insert(list_t *li, void *data)
+static void
+jabber_mam_state_free(JabberMamState *state)
 {
-	list_t *nli = malloc(sizeof(list_t));
-	nli->data = data;
-	if(!li) {
-		nli->prev = nli->next = NULL;
-	} else {
-		nli->next = li;
-		nli->prev = li->prev;
-		if(li->prev)
-			li->prev->next = nli;
-		li->prev = nli;
-	}
-	return nli;
+	g_free(state->archive.last);
+	g_hash_table_destroy(state->contacts);
+	g_hash_table_destroy(state->rooms);
+	g_free(state);
+}
+
+static JabberMamState *
+jabber_mam_state_new(void)
+{
+	JabberMamState *state = g_new0(JabberMamState, 1);
+	state->contacts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)jabber_mam_cursor_free);
+	state->rooms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)jabber_mam_cursor_free);
+	return state;
+}
+
+static void
+jabber_mam_cursor_to_xmlnode(const JabberMamCursor *cursor, xmlnode *node)
+{
+	char *stamp = g_strdup_printf("%" G_GINT64_FORMAT, (gint64)cursor->stamp);
+
+	if (cursor->last)
+		xmlnode_set_attrib(node, "last", cursor->last);
+	xmlnode_set_attrib(node, "stamp", stamp);
+	g_free(stamp);
 }
 
-list_t * list_delete(list_t *li, void *data)
+static void
+jabber_mam_cursor_from_xmlnode(JabberMamCursor *cursor, xmlnode *node)
 {
-	if(!li)
-		return NULL;
+	const char *stamp = xmlnode_get_attrib(node, "stamp");
+
+	cursor->last = g_strdup(xmlnode_get_attrib(node, "last"));
+	cursor->stamp = stamp ? (time_t)g_ascii_strtoll(stamp, NULL, 10) : 0;
+}
 
-	list_t *i = li;
-	if(data) {
-		i = list_get_first(li);
-		while(i) {
-			if(data == list_get_data(i))
-				break;
-			i = i->next;
+static void
+jabber_mam_store_contact(gpointer key, gpointer value, gpointer user_data)
+{
+	xmlnode *contact = xmlnode_new_child(user_data, "contact");
+
+	xmlnode_set_attrib(contact, "jid", key);
+	jabber_mam_cursor_to_xmlnode(value, contact);
+}
+
+static void
+jabber_mam_store_room(gpointer key, gpointer value, gpointer user_data)
+{
+	xmlnode *room = xmlnode_new_child(user_data, "room");
+
+	xmlnode_set_attrib(room, "jid", key);
+	jabber_mam_cursor_to_xmlnode(value, room);
+}
+
+static void
+jabber_mam_store_account(gpointer key, gpointer value, gpointer user_data)
+{
+	JabberMamState *state = value;
+	xmlnode *account = xmlnode_new_child(user_data, "account");
+
+	xmlnode_set_attrib(account, "jid", key);
+	jabber_mam_cursor_to_xmlnode(&state->archive, account);
+	g_hash_table_foreach(state->contacts, jabber_mam_store_contact, account);
+	g_hash_table_foreach(state->rooms, jabber_mam_store_room, account);
+}
+
+static gboolean
+do_jabber_mam_store(gpointer data)
+{
+	char *str;
+	int length = 0;
+	xmlnode *root = xmlnode_new("mam");
+
+	xmlnode_set_attrib(root, "version", "1.0");
+	g_hash_table_foreach(states, jabber_mam_store_account, root);
+	str = xmlnode_to_formatted_str(root, &length);
+	xmlnode_free(root);
+	purple_util_write_data_to_file(JABBER_MAM_FILENAME, str, length);
+	g_free(str);
+
+	save_timer = 0;
+	return FALSE;
+}
+
+static void
+schedule_mam_save(void)
+{
+	if (save_timer == 0)
+		save_timer = purple_timeout_add_seconds(5, do_jabber_mam_store, NULL);
+}
+
+static void
+jabber_mam_load(void)
+{
+	xmlnode *root = purple_util_read_xml_from_file(JABBER_MAM_FILENAME,
+			"XMPP message archive state");
+	xmlnode *account, *contact, *room;
+
+	if (!root)
+		return;
+
+	for (account = xmlnode_get_child(root, "account"); account;
+			account = xmlnode_get_next_twin(account)) {
+		const char *jid = xmlnode_get_attrib(account, "jid");
+		JabberMamState *state;
+
+		if (!jid)
+			continue;
+
+		state = jabber_mam_state_new();
+		jabber_mam_cursor_from_xmlnode(&state->archive, account);
+
+		for (contact = xmlnode_get_child(account, "contact"); contact;
+				contact = xmlnode_get_next_twin(contact)) {
+			const char *with = xmlnode_get_attrib(contact, "jid");
+			JabberMamCursor *cursor;
+
+			if (!with)
+				continue;
+
+			cursor = g_new0(JabberMamCursor, 1);
+			jabber_mam_cursor_from_xmlnode(cursor, contact);
+			g_hash_table_replace(state->contacts, g_strdup(with), cursor);
+		}
+
+		for (room = xmlnode_get_child(account, "room"); room;
+				room = xmlnode_get_next_twin(room)) {
+			const char *room_jid = xmlnode_get_attrib(room, "jid");
+			JabberMamCursor *cursor;
+
+			if (!room_jid)
+				continue;
+
+			cursor = g_new0(JabberMamCursor, 1);
+			jabber_mam_cursor_from_xmlnode(cursor, room);
+			g_hash_table_replace(state->rooms, g_strdup(room_jid), cursor);
 		}
-		if(!i)
-			return li;
+
+		g_hash_table_replace(states, g_strdup(jid), state);
 	}
 
-	list_t *r = NULL;
-	if(i->next) {
-		i->next->prev = i->prev;
-		r = i->next;
+	xmlnode_free(root);
+}
+
+void jabber_mam_init(void)
+{
+	states = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)jabber_mam_state_free);
+	jabber_mam_load();
+}
+
+void jabber_mam_uninit(void)
+{
+	if (save_timer != 0) {
+		purple_timeout_remove(save_timer);
+		do_jabber_mam_store(NULL);
 	}
-	if(i->prev) {
-		i->prev->next = i->next;
-		r = i->prev;
+	g_hash_table_destroy(states);
+	states = NULL;
+}
+
+static void
+jabber_mam_query_free(JabberMamQuery *query)
+{
+	g_free(query->queryid);
+	g_free(query->iq_id);
+	g_free(query->archive);
+	g_free(query->with);
+	g_free(query->after);
+	g_free(query->before);
+	g_free(query);
+}
+
+static JabberMamSeen *
+jabber_mam_seen_new(void)
+{
+	JabberMamSeen *seen = g_new0(JabberMamSeen, 1);
+
+	seen->ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	seen->order = g_queue_new();
+
+	return seen;
+}
+
+static void
+jabber_mam_seen_free(JabberMamSeen *seen)
+{
+	/* The keys are shared with order */
+	g_hash_table_destroy(seen->ids);
+	g_queue_free(seen->order);
+	g_free(seen);
+}
+
+/* Returns TRUE if this is the first time we've seen the archive ID. */
+static gboolean
+jabber_mam_seen_add(JabberMamSeen *seen, const char *id)
+{
+	char *key;
+
+	if (g_hash_table_lookup(seen->ids, id))
+		return FALSE;
+
+	key = g_strdup(id);
+	g_hash_table_insert(seen->ids, key, key);
+	g_queue_push_tail(seen->order, key);
+
+	if (g_queue_get_length(seen->order) > JABBER_MAM_SEEN_MAX)
+		g_hash_table_remove(seen->ids, g_queue_pop_head(seen->order));
+
+	return TRUE;
+}
+
+static JabberMamSeen *
+jabber_mam_get_room_seen(JabberMam *mam, const char *room)
+{
+	JabberMamSeen *seen = g_hash_table_lookup(mam->room_seen, room);
+
+	if (seen == NULL) {
+		seen = jabber_mam_seen_new();
+		g_hash_table_insert(mam->room_seen, g_strdup(room), seen);
 	}
-	free(i);
-	return r;
+
+	return seen;
 }
 
-inline list_t * list_get_first(list_t *li)
+JabberMam *jabber_mam_new(JabberStream *js)
 {
-	if(!li)
-		return NULL;
-	while(li->prev)
-		li = li->prev;
-	return li;
+	JabberMam *mam = g_new0(JabberMam, 1);
+
+	mam->js = js;
+	mam->pending = g_queue_new();
+	mam->queries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+			(GDestroyNotify)jabber_mam_query_free);
+	mam->seen = jabber_mam_seen_new();
+	mam->room_seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)jabber_mam_seen_free);
+	mam->sent = jabber_mam_seen_new();
+
+	return mam;
 }
 
-inline list_t * list_get_next(list_t *li)
+void jabber_mam_free(JabberMam *mam)
 {
-	return li->next;
+	if (!mam)
+		return;
+
+	g_queue_foreach(mam->pending, (GFunc)jabber_mam_query_free, NULL);
+	g_queue_free(mam->pending);
+	g_hash_table_destroy(mam->queries);
+	jabber_mam_seen_free(mam->seen);
+	g_hash_table_destroy(mam->room_seen);
+	jabber_mam_seen_free(mam->sent);
+	g_free(mam);
 }
 
-inline void * list_get_data(list_t *li)
+/*
+ * The account's state is looked up the first time it is needed, since
+ * the stream doesn't know its own JID when it is created.
+ */
+static JabberMamState *
+jabber_mam_get_state(JabberMam *mam)
 {
-	return li->data;
+	JabberStream *js = mam->js;
+	char *jid;
+
+	if (mam->state)
+		return mam->state;
+
+	jid = jabber_id_get_bare_jid(js->user);
+	mam->state = g_hash_table_lookup(states, jid);
+
+	if (mam->state == NULL) {
+		PurpleAccount *account = purple_connection_get_account(js->gc);
+
+		mam->state = jabber_mam_state_new();
+		/* Pick up where the old timestamp-only sync left off. */
+		mam->state->archive.stamp =
+			purple_account_get_int(account, "mam_laststamp", 0);
+		g_hash_table_insert(states, jid, mam->state);
+		schedule_mam_save();
+	} else
+		g_free(jid);
+
+	return mam->state;
 }
 
-void jabber_mam_clear(mam_t *mam)
+static void
+jabber_mam_cursor_update(JabberMamCursor *cursor, const char *id, time_t stamp)
 {
-	if (mam)
+	if (stamp < cursor->stamp)
 		return;
 
-	list_t *queue_item = list_get_first(mam->queue);
-	while (queue_item) {
-		mam_item_t *mam_item = list_get_data(queue_item);
+	if (cursor->stamp == stamp && purple_strequal(cursor->last, id))
+		return;
 
-		free(mam_item->start);
-		free(mam_item->end);
-		free(mam_item->with);
-		free(mam_item);
+	g_free(cursor->last);
+	cursor->last = g_strdup(id);
+	cursor->stamp = stamp;
 
-		queue_item = list_get_next(queue_item);
+	schedule_mam_save();
+}
+
+static JabberMamCursor *
+jabber_mam_get_contact_cursor(JabberMam *mam, const char *with, gboolean create)
+{
+	JabberMamState *state = jabber_mam_get_state(mam);
+	JabberMamCursor *cursor = g_hash_table_lookup(state->contacts, with);
+
+	if (cursor == NULL && create) {
+		cursor = g_new0(JabberMamCursor, 1);
+		g_hash_table_insert(state->contacts, g_strdup(with), cursor);
 	}
+
+	return cursor;
 }
 
-void jabber_mam_add_to_queue(JabberStream *js, const char* start, const char* end, const char* with)
+static gboolean
+jabber_mam_is_querying(JabberMam *mam, const char *archive, const char *with)
 {
-	if (!js->mam)
+	GHashTableIter iter;
+	JabberMamQuery *query;
+	GList *l;
+
+	g_hash_table_iter_init(&iter, mam->queries);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&query))
+		if (purple_strequal(query->archive, archive) &&
+				purple_strequal(query->with, with))
+			return TRUE;
+
+	for (l = mam->pending->head; l; l = l->next) {
+		query = l->data;
+		if (purple_strequal(query->archive, archive) &&
+				purple_strequal(query->with, with))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void jabber_mam_query_cb(JabberStream *js, const char *from,
+		JabberIqType type, const char *id, xmlnode *packet, gpointer data);
+
+static void
+jabber_mam_add_field(xmlnode *x, const char *var, const char *data)
+{
+	xmlnode *field = xmlnode_new_child(x, "field");
+	xmlnode *value;
+
+	xmlnode_set_attrib(field, "var", var);
+	value = xmlnode_new_child(field, "value");
+	xmlnode_insert_data(value, data, -1);
+}
+
+static void
+jabber_mam_send_query(JabberMam *mam, JabberMamQuery *query)
+{
+	JabberStream *js = mam->js;
+	JabberIq *iq = jabber_iq_new_query(js, JABBER_IQ_SET, query->xmlns);
+	xmlnode *node = xmlnode_get_child(iq->node, "query");
+	xmlnode *x, *set, *value;
+	int page_size;
+	char *max;
+
+	if (query->archive)
+		xmlnode_set_attrib(iq->node, "to", query->archive);
+	xmlnode_set_attrib(node, "queryid", query->queryid);
+
+	x = xmlnode_new_child(node, "x");
+	xmlnode_set_namespace(x, "jabber:x:data");
+	xmlnode_set_attrib(x, "type", "submit");
+
+	jabber_mam_add_field(x, "FORM_TYPE", query->xmlns);
+	xmlnode_set_attrib(xmlnode_get_child(x, "field"), "type", "hidden");
+
+	if (query->start) {
+		/*
+		 * With an archive ID to resume after, the message it names is at
+		 * the start time itself; without one, skip the second we last saw.
+		 */
+		time_t start = query->after ? query->start : query->start + 1;
+		jabber_mam_add_field(x, "start",
+				purple_utf8_strftime("%Y-%m-%dT%H:%M:%SZ", gmtime(&start)));
+	}
+
+	if (query->with)
+		jabber_mam_add_field(x, "with", query->with);
+
+	page_size = purple_account_get_int(purple_connection_get_account(js->gc),
+			"mam_page_size", JABBER_MAM_DEFAULT_PAGE_SIZE);
+	page_size = CLAMP(page_size, JABBER_MAM_MIN_PAGE_SIZE,
+			JABBER_MAM_MAX_PAGE_SIZE);
+
+	set = xmlnode_new_child(node, "set");
+	xmlnode_set_namespace(set, NS_RSM);
+
+	max = g_strdup_printf("%d", page_size);
+	value = xmlnode_new_child(set, "max");
+	xmlnode_insert_data(value, max, -1);
+	g_free(max);
+
+	if (query->after) {
+		value = xmlnode_new_child(set, "after");
+		xmlnode_insert_data(value, query->after, -1);
+	}
+
+	if (query->backwards) {
+		/* An empty <before/> asks for the last page. */
+		value = xmlnode_new_child(set, "before");
+		if (query->before)
+			xmlnode_insert_data(value, query->before, -1);
+	}
+
+	g_free(query->iq_id);
+	query->iq_id = g_strdup(iq->id);
+	query->count = 0;
+
+	jabber_iq_set_callback(iq, jabber_mam_query_cb, NULL);
+	jabber_iq_send(iq);
+}
+
+static void
+jabber_mam_pump(JabberMam *mam)
+{
+	while (g_hash_table_size(mam->queries) < JABBER_MAM_MAX_QUERIES &&
+			!g_queue_is_empty(mam->pending)) {
+		JabberMamQuery *query = g_queue_pop_head(mam->pending);
+
+		g_hash_table_insert(mam->queries, query->queryid, query);
+		jabber_mam_send_query(mam, query);
+	}
+}
+
+static void
+jabber_mam_queue(JabberMam *mam, const char *with, const JabberMamCursor *cursor)
+{
+	JabberMamQuery *query = g_new0(JabberMamQuery, 1);
+
+	query->queryid = g_strdup_printf("mam%u", ++mam->next_query);
+	query->xmlns = (mam->js->server_caps & JABBER_CAP_MAM_2) ?
+			NS_XMPP_MAM_2 : NS_XMPP_MAM;
+	query->with = g_strdup(with);
+	query->start = cursor->stamp;
+	query->after = g_strdup(cursor->last);
+
+	/* Open conversations go ahead of the whole archive. */
+	if (with)
+		g_queue_push_head(mam->pending, query);
+	else
+		g_queue_push_tail(mam->pending, query);
+}
+
+static void
+jabber_mam_query_done(JabberMam *mam, JabberMamQuery *query)
+{
+	purple_debug_info("jabber", "MAM query %s%s%s%s%s finished\n",
+			query->queryid, query->archive ? " to " : "",
+			query->archive ? query->archive : "",
+			query->with ? " with " : "", query->with ? query->with : "");
+
+	if (query->archive == NULL && query->with == NULL)
+		mam->syncing = FALSE;
+
+	g_hash_table_remove(mam->queries, query->queryid);
+	jabber_mam_pump(mam);
+}
+
+static void
+jabber_mam_room_notice(JabberMam *mam, JabberMamQuery *query, const char *msg)
+{
+	JabberID *jid = jabber_id_new(query->archive);
+	JabberChat *chat = jid ? jabber_chat_find(mam->js, jid->node, jid->domain) : NULL;
+
+	if (chat && chat->conv)
+		purple_conv_chat_write(PURPLE_CONV_CHAT(chat->conv), "", msg,
+				PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, time(NULL));
+
+	jabber_id_free(jid);
+}
+
+static void
+jabber_mam_query_fin(JabberMam *mam, JabberMamQuery *query, xmlnode *fin)
+{
+	const char *complete = xmlnode_get_attrib(fin, "complete");
+	xmlnode *set = xmlnode_get_child_with_namespace(fin, "set", NS_RSM);
+	xmlnode *last = set ? xmlnode_get_child(set, "last") : NULL;
+	char *last_id = last ? xmlnode_get_data(last) : NULL;
+
+	if (query->archive) {
+		/* Rooms are fetched one page at a time, newest first. */
+		JabberID *jid = jabber_id_new(query->archive);
+		JabberChat *chat = jid ? jabber_chat_find(mam->js, jid->node, jid->domain) : NULL;
+		xmlnode *first = set ? xmlnode_get_child(set, "first") : NULL;
+
+		if (!query->backwards) {
+			/* Catching up after a rejoin goes forward to the end. */
+			if (chat && first && chat->mam_first == NULL)
+				chat->mam_first = xmlnode_get_data(first);
+
+			if (chat && !purple_strequal(complete, "true") &&
+					query->count > 0 && last_id != NULL) {
+				jabber_id_free(jid);
+				g_free(query->after);
+				query->after = last_id;
+				jabber_mam_send_query(mam, query);
+				return;
+			}
+		} else if (chat) {
+			if (first) {
+				g_free(chat->mam_first);
+				chat->mam_first = xmlnode_get_data(first);
+			}
+			chat->mam_complete = purple_strequal(complete, "true") ||
+					query->count == 0 || first == NULL;
+		}
+
+		if (chat)
+			chat->mam_synced = TRUE;
+
+		jabber_id_free(jid);
+		g_free(last_id);
+
+		if (query->backfill && query->count > 0)
+			jabber_mam_room_notice(mam, query, _("End of earlier messages."));
+
+		jabber_mam_query_done(mam, query);
+		return;
+	}
+
+	if (purple_strequal(complete, "true") || query->count == 0 ||
+			last_id == NULL) {
+		g_free(last_id);
+		jabber_mam_query_done(mam, query);
 		return;
+	}
 
-	mam_item_t *mam_item = calloc(1, sizeof(mam_item_t));
+	g_free(query->after);
+	query->after = last_id;
+	jabber_mam_send_query(mam, query);
+}
 
-	if (start) {
-		mam_item->start = calloc(1, strlen(start) + 1);
-		strcpy(mam_item->start, start);
+static void
+jabber_mam_query_cb(JabberStream *js, const char *from,
+		JabberIqType type, const char *id, xmlnode *packet, gpointer data)
+{
+	JabberMam *mam = js->mam;
+	GHashTableIter iter;
+	JabberMamQuery *query = NULL, *q;
+	xmlnode *fin;
+
+	g_hash_table_iter_init(&iter, mam->queries);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&q)) {
+		if (purple_strequal(q->iq_id, id)) {
+			query = q;
+			break;
+		}
 	}
 
-	if (end) {
-		mam_item->end = calloc(1, strlen(end) + 1);
-		strcpy(mam_item->end, end);
+	/* Already finished by a <fin/> message. */
+	if (query == NULL)
+		return;
+
+	if (type == JABBER_IQ_ERROR) {
+		if (query->after && query->count == 0) {
+			/* The server has forgotten the ID; fall back to the time. */
+			purple_debug_warning("jabber", "MAM query %s: archive ID %s "
+					"rejected, resuming by time\n", query->queryid, query->after);
+			g_free(query->after);
+			query->after = NULL;
+			jabber_mam_send_query(mam, query);
+		} else {
+			purple_debug_error("jabber", "MAM query %s failed\n",
+					query->queryid);
+			jabber_mam_query_done(mam, query);
+		}
+		return;
 	}
 
-	if (with) {
-		mam_item->with = calloc(1, strlen(with) + 1);
-		strcpy(mam_item->with, with);
+	/* Newer servers put the <fin/> in the result instead of a message. */
+	fin = xmlnode_get_child_with_namespace(packet, "fin", query->xmlns);
+	if (fin)
+		jabber_mam_query_fin(mam, query, fin);
+}
+
+void jabber_mam_sync(JabberStream *js)
+{
+	JabberMam *mam = js->mam;
+	JabberMamState *state;
+	GList *l;
+
+	if (!mam)
+		return;
+
+	state = jabber_mam_get_state(mam);
+
+	if (state->archive.stamp == 0 && state->archive.last == NULL) {
+		/* Never synced before; there's nothing to catch up on. */
+		jabber_mam_cursor_update(&state->archive, NULL, time(NULL));
+	} else if (!mam->syncing) {
+		mam->syncing = TRUE;
+		jabber_mam_queue(mam, NULL, &state->archive);
 	}
 
-	js->mam->queue = list_append(js->mam->queue, mam_item);
+	for (l = purple_get_ims(); l; l = l->next) {
+		PurpleConversation *conv = l->data;
+
+		if (purple_conversation_get_gc(conv) == js->gc)
+			jabber_mam_sync_with(js, purple_conversation_get_name(conv));
+	}
 
-	jabber_mam_process(js, NULL);
+	jabber_mam_pump(mam);
 }
 
-void jabber_mam_process(JabberStream *js, const char* after)
+void jabber_mam_sync_with(JabberStream *js, const char *with)
 {
-	if (!js->mam)
+	JabberMam *mam = js->mam;
+	JabberMamCursor *cursor;
+	JabberMamCursor start;
+	char *bare;
+
+	if (!mam || !with)
 		return;
 
-	if (js->mam->current && js->mam->current->completed) {
-		free(js->mam->current->start);
-		free(js->mam->current->end);
-		free(js->mam->current->with);
+	bare = jabber_get_bare_jid(with);
+	if (!bare)
+		return;
 
-		memset(js->mam->last_timestamp, 0, 32);
+	if (jabber_mam_is_querying(mam, NULL, bare)) {
+		g_free(bare);
+		return;
+	}
 
-		free(js->mam->current);
-		js->mam->current = NULL;
+	cursor = jabber_mam_get_contact_cursor(mam, bare, FALSE);
+	if (cursor == NULL) {
+		/* The archive ID of the whole archive means nothing to a query
+		 * filtered to one contact, so go by time. */
+		start.last = NULL;
+		start.stamp = jabber_mam_get_state(mam)->archive.stamp;
+		cursor = &start;
 	}
 
-	if (!js->mam->current) {
-		list_t *queue_item = list_get_first(js->mam->queue);
-		if (queue_item) {
-			js->mam->queue = list_delete(js->mam->queue, queue_item);
+	if (cursor->stamp != 0) {
+		jabber_mam_queue(mam, bare, cursor);
+		jabber_mam_pump(mam);
+	}
 
-			js->mam->current = list_get_data(queue_item);
+	g_free(bare);
+}
 
-			js->mam->queue = list_get_next(js->mam->queue);
-		}
+static JabberMamQuery *
+jabber_mam_find_query(JabberMam *mam, const char *queryid)
+{
+	JabberMamQuery *query = NULL;
+
+	if (queryid)
+		query = g_hash_table_lookup(mam->queries, queryid);
+	else if (g_hash_table_size(mam->queries) == 1) {
+		/* Some servers leave the queryid off; that's fine as long as
+		 * there's only one query it could be. */
+		GHashTableIter iter;
+		g_hash_table_iter_init(&iter, mam->queries);
+		g_hash_table_iter_next(&iter, NULL, (gpointer *)&query);
 	}
 
-	if (js->mam->current)
-		jabber_mam_request(js, after);
+	return query;
 }
 
-void jabber_mam_request(JabberStream *js, const char* after)
+gboolean jabber_mam_is_archive(JabberStream *js, const char *from)
 {
+	JabberMam *mam = js->mam;
+	GHashTableIter iter;
+	JabberMamQuery *query;
+	char *bare;
+	gboolean found = FALSE;
+
+	if (!mam || !from)
+		return FALSE;
+
+	bare = jabber_get_bare_jid(from);
+	g_hash_table_iter_init(&iter, mam->queries);
+	while (!found && g_hash_table_iter_next(&iter, NULL, (gpointer *)&query))
+		found = purple_strequal(query->archive, bare);
+	g_free(bare);
+
+	return found;
+}
+
+gboolean jabber_mam_is_backfill(JabberStream *js, xmlnode *result)
+{
+	JabberMamQuery *query;
+
 	if (!js->mam)
-		return;
+		return FALSE;
 
-	JabberIq *iq = jabber_iq_new_query(js, JABBER_IQ_SET, NS_XMPP_MAM);
-	xmlnode *query = xmlnode_get_child(iq->node, "query");
+	query = jabber_mam_find_query(js->mam, xmlnode_get_attrib(result, "queryid"));
 
-	xmlnode *x = xmlnode_new_child(query, "x");
-	xmlnode_set_namespace(x, "jabber:x:data");
-	xmlnode_set_attrib(x, "type", "submit");
+	/* What we missed comes first; anything after that was there. */
+	return query && query->archive && query->backfill;
+}
 
-	xmlnode *field = xmlnode_new_child(x, "field");
-	xmlnode_set_attrib(field, "type", "hidden");
-	xmlnode_set_attrib(field, "var", "FORM_TYPE");
-	xmlnode *value = xmlnode_new_child(field, "value");
-	xmlnode_insert_data(value, NS_XMPP_MAM, -1);
+static gboolean
+jabber_mam_handle_room_result(JabberMam *mam, JabberMamQuery *query,
+                              const char *archive, const char *id,
+                              time_t stamp)
+{
+	JabberMamCursor *cursor;
+	char *bare = archive ? jabber_get_bare_jid(archive) : NULL;
 
-	if (after) {
-		xmlnode *set = xmlnode_new_child(query, "set");
-		xmlnode_set_namespace(set, NS_RSM);
+	/* Only the room we asked gets to put things in the room. */
+	if (query == NULL || !purple_strequal(query->archive, bare)) {
+		purple_debug_warning("jabber", "Ignoring archived message from %s "
+				"that we didn't ask for\n", archive ? archive : "(null)");
+		g_free(bare);
+		return FALSE;
+	}
+	g_free(bare);
 
-		value = xmlnode_new_child(set, "after");
-		xmlnode_insert_data(value, after, -1);
+	query->count++;
+
+	/* Older pages go below what's already there, so set them apart. */
+	if (query->backfill && query->count == 1)
+		jabber_mam_room_notice(mam, query,
+				_("Earlier messages from the room's archive:"));
+
+	cursor = g_hash_table_lookup(jabber_mam_get_state(mam)->rooms, query->archive);
+	if (cursor)
+		jabber_mam_cursor_update(cursor, id, stamp);
+
+	return id == NULL ||
+		jabber_mam_seen_add(jabber_mam_get_room_seen(mam, query->archive), id);
+}
+
+gboolean jabber_mam_handle_result(JabberStream *js, const char *archive,
+                                  xmlnode *result, const char *with,
+                                  const char *sent_id, time_t stamp)
+{
+	JabberMam *mam = js->mam;
+	const char *id = xmlnode_get_attrib(result, "id");
+	JabberMamQuery *query;
+	char *bare;
+
+	if (!mam)
+		return TRUE;
+
+	query = jabber_mam_find_query(mam, xmlnode_get_attrib(result, "queryid"));
+
+	if (!jabber_is_own_account(js, archive) || (query && query->archive))
+		return jabber_mam_handle_room_result(mam, query, archive, id, stamp);
+
+	if (query) {
+		query->count++;
+
+		/* Only the whole-archive query moves the archive's cursor; a
+		 * query filtered to one contact would skip everybody else. */
+		if (query->with == NULL)
+			jabber_mam_cursor_update(&jabber_mam_get_state(mam)->archive,
+					id, stamp);
 	}
 
-	if (js->mam->current->start) {
-		field = xmlnode_new_child(x, "field");
-		xmlnode_set_attrib(field, "var", "start");
+	bare = with ? jabber_get_bare_jid(with) : NULL;
+	if (bare) {
+		jabber_mam_cursor_update(jabber_mam_get_contact_cursor(mam, bare, TRUE),
+				id, stamp);
+		g_free(bare);
+	}
 
-		value = xmlnode_new_child(field, "value");
-		xmlnode_insert_data(value, js->mam->current->start, -1);
+	/* Already shown when we sent it, but its archive ID is news to us. */
+	if (sent_id && g_hash_table_lookup(mam->sent->ids, sent_id)) {
+		if (id)
+			jabber_mam_seen_add(mam->seen, id);
+		return FALSE;
 	}
 
-	if (js->mam->current->end) {
-		field = xmlnode_new_child(x, "field");
-		xmlnode_set_attrib(field, "var", "end");
+	return id == NULL || jabber_mam_seen_add(mam->seen, id);
+}
+
+void jabber_mam_handle_fin(JabberStream *js, xmlnode *fin)
+{
+	JabberMam *mam = js->mam;
+	JabberMamQuery *query;
+
+	if (!mam)
+		return;
+
+	query = jabber_mam_find_query(mam, xmlnode_get_attrib(fin, "queryid"));
+	if (query && purple_strequal(xmlnode_get_namespace(fin), query->xmlns))
+		jabber_mam_query_fin(mam, query, fin);
+}
+
+/*
+ * While the whole-archive query is catching up, cursors only move with
+ * the queries; a message that arrives meanwhile is in the archive and
+ * the query will get to it.  So does one the archive gave no ID, since
+ * only an ID says exactly where in the archive it is.
+ */
+static void
+jabber_mam_record_live(JabberMam *mam, const char *id, const char *with,
+                       time_t stamp)
+{
+	char *bare;
+
+	if (mam->syncing || id == NULL)
+		return;
 
-		value = xmlnode_new_child(field, "value");
-		xmlnode_insert_data(value, js->mam->current->end, -1);
+	jabber_mam_cursor_update(&jabber_mam_get_state(mam)->archive, id, stamp);
+
+	bare = with ? jabber_get_bare_jid(with) : NULL;
+	if (bare && !jabber_mam_is_querying(mam, NULL, bare))
+		jabber_mam_cursor_update(jabber_mam_get_contact_cursor(mam, bare, TRUE),
+				id, stamp);
+	g_free(bare);
+}
+
+static const char *
+jabber_mam_get_stanza_id(xmlnode *packet, const char *by)
+{
+	xmlnode *sid;
+
+	for (sid = xmlnode_get_child_with_namespace(packet, "stanza-id", NS_STANZA_ID);
+			sid; sid = xmlnode_get_next_twin(sid)) {
+		if (purple_strequal(xmlnode_get_attrib(sid, "by"), by))
+			return xmlnode_get_attrib(sid, "id");
 	}
 
-	if (js->mam->current->with) {
-		field = xmlnode_new_child(x, "field");
-		xmlnode_set_attrib(field, "var", "with");
+	return NULL;
+}
+
+static gboolean
+jabber_mam_handle_room_live(JabberMam *mam, xmlnode *packet, const char *from,
+                            time_t stamp)
+{
+	JabberMamCursor *cursor;
+	const char *id;
+	char *room;
+
+	room = from ? jabber_get_bare_jid(from) : NULL;
+	if (!room)
+		return TRUE;
 
-		value = xmlnode_new_child(field, "value");
-		xmlnode_insert_data(value, js->mam->current->with, -1);
+	/* XEP-0359: the ID the room's archive gave this message, if any */
+	id = jabber_mam_get_stanza_id(packet, room);
+	if (id && !jabber_mam_seen_add(jabber_mam_get_room_seen(mam, room), id)) {
+		g_free(room);
+		return FALSE;
 	}
 
-	jabber_iq_send(iq);
+	cursor = g_hash_table_lookup(jabber_mam_get_state(mam)->rooms, room);
+	if (cursor)
+		jabber_mam_cursor_update(cursor, id, stamp);
+
+	g_free(room);
+	return TRUE;
+}
+
+gboolean jabber_mam_handle_live(JabberStream *js, xmlnode *packet,
+                                const char *with, time_t stamp)
+{
+	JabberMam *mam = js->mam;
+	PurpleAccount *account = purple_connection_get_account(js->gc);
+	const char *id;
+	char *own;
+
+	if (!mam || !purple_account_get_bool(account, "mam", FALSE))
+		return TRUE;
+
+	if (purple_strequal(xmlnode_get_attrib(packet, "type"), "groupchat"))
+		return jabber_mam_handle_room_live(mam, packet, with, stamp);
+
+	/* XEP-0359: the ID our own archive gave this message, if any */
+	own = jabber_id_get_bare_jid(js->user);
+	id = jabber_mam_get_stanza_id(packet, own);
+	g_free(own);
+
+	if (id && !jabber_mam_seen_add(mam->seen, id))
+		return FALSE;
+
+	jabber_mam_record_live(mam, id, with, stamp);
+
+	return TRUE;
+}
+
+/*
+ * The archive doesn't tell us what ID it gave a message we sent, so the
+ * cursors stay where they are until it comes back in a query.
+ */
+void jabber_mam_message_sent(JabberStream *js, const char *id)
+{
+	JabberMam *mam = js->mam;
+
+	if (!mam || !id || !purple_account_get_bool(
+			purple_connection_get_account(js->gc), "mam", FALSE))
+		return;
+
+	jabber_mam_seen_add(mam->sent, id);
 }
 
+gboolean jabber_mam_room_has_archive(JabberStream *js, const char *room)
+{
+	if (!js->mam)
+		return FALSE;
+
+	return g_hash_table_lookup(jabber_mam_get_state(js->mam)->rooms, room) != NULL;
+}
+
+void jabber_mam_room_discovered(JabberStream *js, const char *room,
+                                gboolean has_archive)
+{
+	JabberMamState *state;
+
+	if (!js->mam)
+		return;
+
+	state = jabber_mam_get_state(js->mam);
+
+	if (!has_archive) {
+		if (g_hash_table_remove(state->rooms, room))
+			schedule_mam_save();
+	} else if (g_hash_table_lookup(state->rooms, room) == NULL) {
+		g_hash_table_insert(state->rooms, g_strdup(room),
+				g_new0(JabberMamCursor, 1));
+		schedule_mam_save();
+	}
+}
+
+gboolean jabber_mam_fetch_room(JabberStream *js, JabberChat *chat)
+{
+	JabberMam *mam = js->mam;
+	JabberMamQuery *query;
+	JabberMamCursor *cursor;
+	char *room;
+
+	if (!mam)
+		return FALSE;
+
+	room = g_strdup_printf("%s@%s", chat->room, chat->server);
+
+	if (jabber_mam_is_querying(mam, room, NULL)) {
+		g_free(room);
+		return TRUE;
+	}
+
+	cursor = g_hash_table_lookup(jabber_mam_get_state(mam)->rooms, room);
+
+	query = g_new0(JabberMamQuery, 1);
+	query->queryid = g_strdup_printf("mam%u", ++mam->next_query);
+	query->xmlns = chat->mam_xmlns ? chat->mam_xmlns : NS_XMPP_MAM;
+	query->archive = room;
+
+	if (!chat->mam_synced && cursor && cursor->stamp != 0) {
+		/* Been here before: only what came after the last message we
+		 * saw is news, the rest is in the logs already. */
+		query->start = cursor->stamp;
+		query->after = g_strdup(cursor->last);
+	} else {
+		query->backwards = TRUE;
+		query->before = g_strdup(chat->mam_first);
+		query->backfill = chat->mam_synced;
+	}
+
+	/* Somebody is looking at the room, so it goes first. */
+	g_queue_push_head(mam->pending, query);
+	jabber_mam_pump(mam);
+
+	return TRUE;
+}
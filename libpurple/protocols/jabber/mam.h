@@ -26,32 +26,97 @@
 
 #include "xmlnode.h"
 
-typedef struct list_s list_t;
-
-list_t * list_append(list_t *, void *);
-list_t * list_insert(list_t *, void *);
-list_t * list_delete(list_t *, void *);
-list_t * list_get_first(list_t *);
-list_t * list_get_next(list_t *);
-void   * list_get_data(list_t *);
-
-typedef struct {
-    char *start;
-    char *end;
-    char *with;
-    gboolean completed;
-} mam_item_t;
-
-typedef struct {
-    list_t *queue;
-    mam_item_t *current;
-    char last_timestamp[32];
-    guint32 count;
-} mam_t;
-
-void jabber_mam_clear(mam_t *mam);
-void jabber_mam_add_to_queue(JabberStream *js, const char* start, const char* end, const char* with);
-void jabber_mam_process(JabberStream *js, const char* after);
-void jabber_mam_request(JabberStream *js, const char* after);
+typedef struct _JabberMam JabberMam;
+struct _JabberChat;
+
+void jabber_mam_init(void);
+void jabber_mam_uninit(void);
+
+JabberMam *jabber_mam_new(JabberStream *js);
+void jabber_mam_free(JabberMam *mam);
+
+/**
+ * Starts catching up on everything archived since the last sync, along
+ * with a query per open conversation so those catch up first.
+ */
+void jabber_mam_sync(JabberStream *js);
+
+/**
+ * Catches up on the conversation with one contact, resuming from where
+ * that conversation was last seen.
+ */
+void jabber_mam_sync_with(JabberStream *js, const char *with);
+
+/**
+ * Returns whether a JID is an archive we are querying, and so may send
+ * us forwarded messages.
+ */
+gboolean jabber_mam_is_archive(JabberStream *js, const char *from);
+
+/**
+ * Records a <result/> from an archive.
+ *
+ * @param archive The JID the result came from.
+ * @param result  The <result/> element.
+ * @param with    The JID of the other party of the archived message.
+ * @param sent_id Our own ID for the archived message, if we sent it.
+ * @param stamp   When the archived message was sent.
+ *
+ * @return FALSE if the message has already been handled and should be
+ *         dropped.
+ */
+gboolean jabber_mam_handle_result(JabberStream *js, const char *archive,
+                                  xmlnode *result, const char *with,
+                                  const char *sent_id, time_t stamp);
+
+/**
+ * Returns whether a <result/> is from an older page of a room's archive,
+ * fetched after the most recent one.  Those messages were logged when
+ * they were live, and are shown below what's already in the room.
+ */
+gboolean jabber_mam_is_backfill(JabberStream *js, xmlnode *result);
+
+/**
+ * Handles the <fin/> that ends a page of results, either on its own
+ * message or inside the query's result.
+ */
+void jabber_mam_handle_fin(JabberStream *js, xmlnode *fin);
+
+/**
+ * Records a message that arrived outside of a query, so the next sync
+ * resumes after it.
+ *
+ * @return FALSE if the message has already been handled and should be
+ *         dropped.
+ */
+gboolean jabber_mam_handle_live(JabberStream *js, xmlnode *packet,
+                                const char *with, time_t stamp);
+
+/**
+ * Records the ID of a message we sent, so it isn't shown again when it
+ * comes back from the archive.
+ */
+void jabber_mam_message_sent(JabberStream *js, const char *id);
+
+/**
+ * Returns whether a room is known to keep an archive, in which case its
+ * history doesn't need to be replayed when joining.
+ */
+gboolean jabber_mam_room_has_archive(JabberStream *js, const char *room);
+
+/**
+ * Records whether a room keeps an archive, as found by service discovery.
+ */
+void jabber_mam_room_discovered(JabberStream *js, const char *room,
+                                gboolean has_archive);
+
+/**
+ * Fetches the page of a room's history before the oldest one fetched so
+ * far.  On joining a room we've been in before, fetches everything after
+ * the last message we saw there instead; otherwise the most recent page.
+ *
+ * @return FALSE if message archiving is not available.
+ */
+gboolean jabber_mam_fetch_room(JabberStream *js, struct _JabberChat *chat);
 
 #endif /* PURPLE_JABBER_MAM_H_ */
@@ -233,7 +233,8 @@ static void handle_groupchat(JabberMessage *jm)
 	if(!chat)
 		return;
 
-	if(jm->subject) {
+	/* An old subject from the archive is not the current topic */
+	if(jm->subject && !jm->archived) {
 		purple_conv_chat_set_topic(PURPLE_CONV_CHAT(chat->conv), jid->resource,
 				jm->subject);
 		if(!jm->xhtml && !jm->body) {
@@ -252,14 +253,17 @@ static void handle_groupchat(JabberMessage *jm)
 	}
 
 	if(jm->xhtml || jm->body) {
+		/* Older pages of the archive were logged when they were live. */
+		PurpleMessageFlags flags = jm->backfill ? PURPLE_MESSAGE_NO_LOG : 0;
+
 		if(jid->resource)
 			serv_got_chat_in(jm->js->gc, chat->id, jid->resource,
-							jm->delayed ? PURPLE_MESSAGE_DELAYED : 0,
+							flags | (jm->delayed ? PURPLE_MESSAGE_DELAYED : 0),
 							jm->xhtml ? jm->xhtml : jm->body, jm->sent);
 		else if(chat->muc)
 			purple_conv_chat_write(PURPLE_CONV_CHAT(chat->conv), "",
 							jm->xhtml ? jm->xhtml : jm->body,
-							PURPLE_MESSAGE_SYSTEM, jm->sent);
+							flags | PURPLE_MESSAGE_SYSTEM, jm->sent);
 	}
 
 	jabber_id_free(jid);
@@ -510,18 +514,30 @@ void jabber_message_parse(JabberStream *js, xmlnode *packet)
 	gboolean signal_return, is_outgoing = FALSE;
 	time_t message_timestamp = time(NULL);
 	gboolean delayed = FALSE;
+	gboolean archived = FALSE;
+	gboolean backfill = FALSE;
+	gboolean own;
+	const char *archive;
 
 	/* Check if this is a carbon-copy of a message.
 	 * If so, use that instead for the rest of this function,
 	 * but keep track of wether the from and to should be swapped.
 	 */
 	from = xmlnode_get_attrib(packet, "from");
+	archive = from;
+	own = jabber_is_own_account(js, from);
 
-	if (jabber_is_own_account(js, from)) {
-		xmlnode *received = xmlnode_get_child_with_namespace(packet, "received", NS_XMPP_CARBONS);
-		xmlnode *sent = xmlnode_get_child_with_namespace(packet, "sent", NS_XMPP_CARBONS);
-		xmlnode *result = xmlnode_get_child_with_namespace(packet, "result", NS_XMPP_MAM);
-		xmlnode *fin = xmlnode_get_child_with_namespace(packet, "fin", NS_XMPP_MAM);
+	/* Rooms we're querying send their archives too, but never carbons */
+	if (own || jabber_mam_is_archive(js, from)) {
+		xmlnode *received = own ? xmlnode_get_child_with_namespace(packet, "received", NS_XMPP_CARBONS) : NULL;
+		xmlnode *sent = own ? xmlnode_get_child_with_namespace(packet, "sent", NS_XMPP_CARBONS) : NULL;
+		xmlnode *result = xmlnode_get_child_with_namespace(packet, "result", NS_XMPP_MAM_2);
+		xmlnode *fin = xmlnode_get_child_with_namespace(packet, "fin", NS_XMPP_MAM_2);
+
+		if (!result)
+			result = xmlnode_get_child_with_namespace(packet, "result", NS_XMPP_MAM);
+		if (!fin)
+			fin = xmlnode_get_child_with_namespace(packet, "fin", NS_XMPP_MAM);
 
 		if (received || sent || result) {
 			xmlnode *forwarded = xmlnode_get_child_with_namespace(received ? received : sent ? sent : result, "forwarded", NS_XMPP_FORWARD);
@@ -542,8 +558,6 @@ void jabber_message_parse(JabberStream *js, xmlnode *packet)
 						if (!jid)
 							return;
 
-						js->mam->count++;
-
 						gboolean equal = (purple_strequal(jid->node, js->user->node) &&
 							g_str_equal(jid->domain, js->user->domain));
 
@@ -559,11 +573,6 @@ void jabber_message_parse(JabberStream *js, xmlnode *packet)
 						const char *timestamp = xmlnode_get_attrib(delay, "stamp");
 
 						if(timestamp) {
-							if (result) {
-								memset(js->mam->last_timestamp, 0, 32);
-								strcpy(js->mam->last_timestamp, timestamp);
-							}
-
 							purple_debug_info("jabber", "Found a delay stamp: %s\n", timestamp);
 
 							delayed = TRUE;
@@ -571,29 +580,41 @@ void jabber_message_parse(JabberStream *js, xmlnode *packet)
 							message_timestamp = purple_str_to_time(timestamp, TRUE, NULL, NULL, NULL);
 						}
 					}
-				}
-			}
-		} else if (fin) {
-			char *complete_attrib = xmlnode_get_attrib(fin, "complete");
-			gboolean complete = complete_attrib != NULL && strcmp(complete_attrib, "true") == 0 ? TRUE : FALSE;
-			if (complete || js->mam->count == 0) {
-				js->mam->current->completed = TRUE;
 
-				jabber_mam_process(js, NULL);
-			} else {
-				xmlnode *set = xmlnode_get_child_with_namespace(fin, "set", NS_RSM);
-				if (set) {
-					xmlnode *last = xmlnode_get_child(set, "last");
-					if (last) {
-						js->mam->count = 0;
-						jabber_mam_process(js, xmlnode_get_data(last));
+					if (result) {
+						const char *sent_id = NULL;
+
+						archived = TRUE;
+						backfill = jabber_mam_is_backfill(js, result);
+
+						if (is_outgoing) {
+							xmlnode *origin = xmlnode_get_child_with_namespace(packet, "origin-id", NS_STANZA_ID);
+
+							sent_id = xmlnode_get_attrib(origin ? origin : packet, "id");
+						}
+
+						if (!jabber_mam_handle_result(js, archive, result,
+								is_outgoing ? xmlnode_get_attrib(packet, "to") : from,
+								sent_id, message_timestamp)) {
+							purple_debug_info("jabber", "Dropping archived message we already have.\n");
+							return;
+						}
 					}
 				}
 			}
+		} else if (fin) {
+			jabber_mam_handle_fin(js, fin);
 			return;
 		}
 	}
 
+	if (!archived && !jabber_mam_handle_live(js, packet,
+			is_outgoing ? xmlnode_get_attrib(packet, "to") : from,
+			message_timestamp)) {
+		purple_debug_info("jabber", "Dropping message we already got from the archive.\n");
+		return;
+	}
+
 	from = xmlnode_get_attrib(packet, "from");
 	id   = xmlnode_get_attrib(packet, "id");
 	to   = xmlnode_get_attrib(packet, "to");
@@ -610,9 +631,8 @@ void jabber_message_parse(JabberStream *js, xmlnode *packet)
 	jm->delayed = delayed;
 	jm->chat_state = JM_STATE_NONE;
 	jm->outgoing = is_outgoing;
-
-	if (jm->sent > purple_account_get_int(js->gc->account, "mam_laststamp", 0))
-		purple_account_set_int(js->gc->account, "mam_laststamp", jm->sent);
+	jm->archived = archived;
+	jm->backfill = backfill;
 
 	if(type) {
 		if(!strcmp(type, "normal"))
@@ -1180,7 +1200,14 @@ void jabber_message_send(JabberMessage *jm)
 		}
 	}
 
-	purple_account_set_int(jm->js->gc->account, "mam_laststamp", time(0));
+	if (jm->body && jm->type != JABBER_MESSAGE_GROUPCHAT && jm->id) {
+		/* XEP-0359, so we know it when the archive hands it back */
+		child = xmlnode_new_child(message, "origin-id");
+		xmlnode_set_namespace(child, NS_STANZA_ID);
+		xmlnode_set_attrib(child, "id", jm->id);
+
+		jabber_mam_message_sent(jm->js, jm->id);
+	}
 
 	jabber_send(jm->js, message);
 
@@ -1434,14 +1461,7 @@ void jabber_toggle_mam(PurplePluginAction *action) {
 
 	if (has_mam) {
 		purple_debug_info("jabber", "MAM Requesting.\n");
-
-		time_t mam_laststamp = (time_t *)purple_account_get_int(js->gc->account, "mam_laststamp", time(0));
-		purple_account_set_int(js->gc->account, "mam_laststamp", mam_laststamp);
-
-		const struct tm *unixtime = gmtime(&mam_laststamp);
-		strcpy(js->mam->last_timestamp, purple_utf8_strftime("%Y-%m-%dT%H:%M:%SZ", unixtime));
-
-		jabber_mam_add_to_queue(js, js->mam->last_timestamp, NULL, NULL);
+		jabber_mam_sync(js);
 	}
 
 	/* Force an update of the account actions. */
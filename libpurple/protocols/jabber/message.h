@@ -63,6 +63,8 @@ typedef struct _JabberMessage {
 	GList *etc;
 	GList *eventitems;
 	gboolean outgoing;
+	gboolean archived; /* came from a message archive query */
+	gboolean backfill; /* from an older page of a room's archive */
 } JabberMessage;
 
 void jabber_message_free(JabberMessage *jm);
@@ -70,9 +70,16 @@
 /* XEP-0124 Bidirectional-streams Over Synchronous HTTP (BOSH) */
 #define NS_BOSH "http://jabber.org/protocol/httpbind"
 
+/* XEP-0138 Stream Compression */
+#define NS_COMPRESS         "http://jabber.org/protocol/compress"
+#define NS_COMPRESS_FEATURE "http://jabber.org/features/compress"
+
 /* XEP-0191 Simple Communications Blocking */
 #define NS_SIMPLE_BLOCKING "urn:xmpp:blocking"
 
+/* XEP-0198 Stream Management */
+#define NS_STREAM_MANAGEMENT "urn:xmpp:sm:3"
+
 /* XEP-0199 Ping */
 #define NS_PING "urn:xmpp:ping"
 
@@ -86,6 +93,9 @@
 /* XEP-0206 XMPP over BOSH */
 #define NS_XMPP_BOSH "urn:xmpp:xbosh"
 
+/* RFC 7395 XMPP over WebSocket */
+#define NS_XMPP_FRAMING "urn:ietf:params:xml:ns:xmpp-framing"
+
 /* XEP-0224 Attention */
 #define NS_ATTENTION "urn:xmpp:attention:0"
 
@@ -106,6 +116,10 @@
 
 /* XEP-0313 Message Archive Management */
 #define NS_XMPP_MAM "urn:xmpp:mam:0"
+#define NS_XMPP_MAM_2 "urn:xmpp:mam:2"
+
+/* XEP-0359 Unique and Stable Stanza IDs */
+#define NS_STANZA_ID "urn:xmpp:sid:0"
 
 /* Google extensions */
 #define NS_GOOGLE_CAMERA "http://www.google.com/xmpp/protocol/camera/v1"
@@ -117,7 +117,8 @@ jabber_parser_element_start_libxml(void *user_data,
 		if(js->current)
 			node = xmlnode_new_child(js->current, (const char*) element_name);
 		else
-			node = xmlnode_new((const char*) element_name);
+			/* The whole stanza goes away in one go once it's handled */
+			node = xmlnode_new_arena((const char*) element_name);
 		xmlnode_set_namespace(node, (const char*) namespace);
 		xmlnode_set_prefix(node, (const char *)prefix);
 
@@ -136,13 +137,14 @@ jabber_parser_element_start_libxml(void *user_data,
 			const char *name = (const char *)attributes[i];
 			const char *prefix = (const char *)attributes[i+1];
 			const char *attrib_ns = (const char *)attributes[i+2];
-			char *txt;
 			int attrib_len = attributes[i+4] - attributes[i+3];
 			char *attrib = g_strndup((gchar *)attributes[i+3], attrib_len);
 
-			txt = attrib;
-			attrib = purple_unescape_text(txt);
-			g_free(txt);
+			if (strchr(attrib, '&') != NULL) {
+				char *txt = attrib;
+				attrib = purple_unescape_text(txt);
+				g_free(txt);
+			}
 			xmlnode_set_attrib_full(node, name, attrib_ns, prefix, attrib);
 			g_free(attrib);
 		}
@@ -166,6 +168,7 @@ jabber_parser_element_end_libxml(void *user_data, const xmlChar *element_name,
 	} else {
 		xmlnode *packet = js->current;
 		js->current = NULL;
+		xmlnode_seal_arena(packet);
 		jabber_process_packet(js, &packet);
 		if (packet != NULL)
 			xmlnode_free(packet);
@@ -633,6 +633,7 @@ handle_presence_chat(JabberStream *js, JabberPresence *presence, xmlnode *packet
 			purple_conv_chat_set_nick(PURPLE_CONV_CHAT(chat->conv), chat->handle);
 
 			jabber_chat_disco_traffic(chat);
+			jabber_chat_disco_archive(chat);
 			g_free(room_jid);
 		}
 
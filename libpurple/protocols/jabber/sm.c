@@ -0,0 +1,717 @@
+/*
+ * purple - Jabber Protocol Plugin
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ *
+ */
+
+#include "internal.h"
+#include "debug.h"
+#include "prpl.h"
+#include "signals.h"
+
+#include "jabber.h"
+#include "buddy.h"
+#include "chat.h"
+#include "jutil.h"
+#include "sm.h"
+
+/*
+ * Ask the server to acknowledge what we've sent once this many stanzas
+ * are outstanding, or this many seconds after the first of them.
+ */
+#define JABBER_SM_ACK_EVERY 5
+#define JABBER_SM_ACK_DELAY 5
+
+/* What a stream had built up that a resumed stream carries on with. */
+typedef struct {
+	char *jid;
+	GHashTable *buddies;
+	GHashTable *chats;   /* The rooms we're still in as far as they know */
+	GList *chat_servers;
+	JabberCapabilities server_caps;
+	gboolean googletalk;
+	gboolean pep;
+	gboolean vcard_fetched;
+	char *avatar_hash;
+	gboolean allowBuzz;
+	time_t idle;
+
+	/* The last presence we sent */
+	JabberBuddyState old_state;
+	char *old_msg;
+	int old_priority;
+	char *old_avatarhash;
+	time_t old_idle;
+} JabberSmSnapshot;
+
+struct _JabberSm {
+	JabberStream *js;
+
+	char *id;          /* NULL unless the server will let us resume */
+	guint max;         /* seconds the server keeps the session, or 0 */
+	gboolean enabling; /* <enable/> sent, so what we send is counted */
+	gboolean enabled;  /* <enabled/> received, so what we get is counted */
+	gboolean resumed;
+	gboolean lost;     /* the connection broke rather than being closed */
+
+	guint32 inbound;   /* stanzas received */
+	guint32 acked;     /* stanzas sent and acknowledged */
+	GQueue *unacked;   /* copies of the rest, oldest first */
+	guint unrequested; /* stanzas sent since the last <r/> */
+	guint ack_timer;
+
+	/* Only set once the stream is gone and the session is kept */
+	time_t expires;
+	JabberSmSnapshot *snapshot;
+
+	/* The kept session of this account, while we try to resume it */
+	JabberSm *previous;
+};
+
+static GHashTable *sessions = NULL; /* char *username -> JabberSm */
+static GHashTable *streams = NULL;  /* PurpleConnection -> JabberSm */
+static int sm_handle;
+
+static void
+jabber_sm_snapshot_free(JabberSmSnapshot *snapshot)
+{
+	if (snapshot == NULL)
+		return;
+
+	g_free(snapshot->jid);
+	if (snapshot->buddies)
+		g_hash_table_destroy(snapshot->buddies);
+	if (snapshot->chats)
+		g_hash_table_destroy(snapshot->chats);
+	while (snapshot->chat_servers) {
+		g_free(snapshot->chat_servers->data);
+		snapshot->chat_servers = g_list_delete_link(snapshot->chat_servers,
+				snapshot->chat_servers);
+	}
+	g_free(snapshot->avatar_hash);
+	g_free(snapshot->old_msg);
+	g_free(snapshot->old_avatarhash);
+	g_free(snapshot);
+}
+
+JabberSm *
+jabber_sm_new(JabberStream *js)
+{
+	JabberSm *sm = g_new0(JabberSm, 1);
+
+	sm->js = js;
+	sm->unacked = g_queue_new();
+	g_hash_table_insert(streams, js->gc, sm);
+
+	return sm;
+}
+
+void
+jabber_sm_free(JabberSm *sm)
+{
+	xmlnode *node;
+
+	if (sm == NULL)
+		return;
+
+	if (sm->js && streams)
+		g_hash_table_remove(streams, sm->js->gc);
+	if (sm->ack_timer)
+		purple_timeout_remove(sm->ack_timer);
+
+	while ((node = g_queue_pop_head(sm->unacked)))
+		xmlnode_free(node);
+	g_queue_free(sm->unacked);
+
+	g_free(sm->id);
+	jabber_sm_snapshot_free(sm->snapshot);
+	jabber_sm_free(sm->previous);
+	g_free(sm);
+}
+
+static gboolean
+jabber_sm_is_stanza(xmlnode *packet)
+{
+	const char *xmlns = xmlnode_get_namespace(packet);
+
+	if (xmlns && !g_str_equal(xmlns, NS_XMPP_CLIENT))
+		return FALSE;
+
+	return g_str_equal(packet->name, "message") ||
+			g_str_equal(packet->name, "presence") ||
+			g_str_equal(packet->name, "iq");
+}
+
+static void
+jabber_sm_send_request(JabberSm *sm)
+{
+	xmlnode *r;
+
+	if (sm->ack_timer) {
+		purple_timeout_remove(sm->ack_timer);
+		sm->ack_timer = 0;
+	}
+	sm->unrequested = 0;
+
+	r = xmlnode_new("r");
+	xmlnode_set_namespace(r, NS_STREAM_MANAGEMENT);
+	jabber_send(sm->js, r);
+	xmlnode_free(r);
+}
+
+static gboolean
+jabber_sm_ack_timeout(gpointer data)
+{
+	JabberSm *sm = data;
+
+	sm->ack_timer = 0;
+	jabber_sm_send_request(sm);
+
+	return FALSE;
+}
+
+static void
+jabber_sm_handle_ack(JabberSm *sm, const char *h)
+{
+	guint32 acked, count;
+	guint length = g_queue_get_length(sm->unacked);
+
+	if (h == NULL)
+		return;
+
+	acked = (guint32)g_ascii_strtoull(h, NULL, 10);
+	/* The counters wrap around at 2^32, and so does this */
+	count = acked - sm->acked;
+
+	/*
+	 * Raw text that couldn't be parsed into stanzas isn't kept, so the
+	 * server may count more than we have.  Keep in step with its count.
+	 */
+	if (count > length) {
+		purple_debug_warning("jabber", "Server acknowledged %u stanzas, "
+				"but only %u were outstanding\n", count, length);
+		count = length;
+	}
+
+	while (count--)
+		xmlnode_free(g_queue_pop_head(sm->unacked));
+	sm->acked = acked;
+}
+
+/*
+ * Sends again what a previous session never got acknowledged.  When that
+ * session couldn't be resumed, only messages are worth sending: nobody is
+ * waiting on replies to the IQs any more, and presence is sent afresh.
+ */
+static void
+jabber_sm_resend(JabberStream *js, JabberSm *previous, gboolean messages_only)
+{
+	xmlnode *node;
+	guint count = 0;
+
+	while ((node = g_queue_pop_head(previous->unacked))) {
+		if (!messages_only || g_str_equal(node->name, "message")) {
+			jabber_send(js, node);
+			count++;
+		}
+		xmlnode_free(node);
+	}
+
+	if (count > 0)
+		purple_debug_info("jabber", "Sent %u unacknowledged stanzas again\n",
+				count);
+}
+
+gboolean
+jabber_sm_resume(JabberStream *js, xmlnode *features)
+{
+	JabberSm *sm = js->sm;
+	JabberSm *previous;
+	gpointer key;
+	xmlnode *resume;
+	char *h;
+
+	if (sm == NULL || !g_hash_table_lookup_extended(sessions,
+			purple_account_get_username(purple_connection_get_account(js->gc)),
+			&key, (gpointer *)&previous))
+		return FALSE;
+
+	/* Either it's resumed now, or whatever it still has is sent after
+	 * binding */
+	g_hash_table_steal(sessions, key);
+	g_free(key);
+	sm->previous = previous;
+
+	if (js->bosh || previous->id == NULL ||
+			!xmlnode_get_child_with_namespace(features, "sm", NS_STREAM_MANAGEMENT))
+		return FALSE;
+
+	if (previous->expires && previous->expires < time(NULL)) {
+		purple_debug_info("jabber", "Session %s has expired\n", previous->id);
+		return FALSE;
+	}
+
+	purple_debug_info("jabber", "Resuming session %s\n", previous->id);
+
+	resume = xmlnode_new("resume");
+	xmlnode_set_namespace(resume, NS_STREAM_MANAGEMENT);
+	xmlnode_set_attrib(resume, "previd", previous->id);
+	h = g_strdup_printf("%u", previous->inbound);
+	xmlnode_set_attrib(resume, "h", h);
+	g_free(h);
+
+	jabber_send(js, resume);
+	xmlnode_free(resume);
+
+	return TRUE;
+}
+
+void
+jabber_sm_enable(JabberStream *js)
+{
+	JabberSm *sm = js->sm;
+	JabberSm *previous;
+
+	if (sm == NULL)
+		return;
+
+	if (!js->bosh && (js->server_caps & JABBER_CAP_STREAM_MANAGEMENT)) {
+		xmlnode *enable = xmlnode_new("enable");
+		xmlnode_set_namespace(enable, NS_STREAM_MANAGEMENT);
+		xmlnode_set_attrib(enable, "resume", "true");
+		jabber_send(js, enable);
+		xmlnode_free(enable);
+
+		/* What we send is counted from here on */
+		sm->enabling = TRUE;
+	}
+
+	previous = sm->previous;
+	sm->previous = NULL;
+	if (previous) {
+		jabber_sm_resend(js, previous, TRUE);
+		jabber_sm_free(previous);
+	}
+}
+
+gboolean
+jabber_sm_resumed(JabberStream *js)
+{
+	return js->sm != NULL && js->sm->resumed;
+}
+
+static void
+jabber_sm_restore(JabberStream *js, JabberSmSnapshot *snapshot)
+{
+	JabberID *user = jabber_id_new(snapshot->jid);
+
+	if (user) {
+		jabber_id_free(js->user);
+		js->user = user;
+	}
+	purple_connection_set_display_name(js->gc, snapshot->jid);
+
+	g_hash_table_destroy(js->buddies);
+	js->buddies = snapshot->buddies;
+	snapshot->buddies = NULL;
+	js->user_jb = jabber_buddy_find(js, snapshot->jid, TRUE);
+	js->user_jb->subscription |= JABBER_SUB_BOTH;
+
+	while (js->chat_servers) {
+		g_free(js->chat_servers->data);
+		js->chat_servers = g_list_delete_link(js->chat_servers, js->chat_servers);
+	}
+	js->chat_servers = snapshot->chat_servers;
+	snapshot->chat_servers = NULL;
+
+	js->server_caps |= snapshot->server_caps;
+	js->googletalk = snapshot->googletalk;
+	js->pep = snapshot->pep;
+	js->vcard_fetched = snapshot->vcard_fetched;
+	g_free(js->avatar_hash);
+	js->avatar_hash = snapshot->avatar_hash;
+	snapshot->avatar_hash = NULL;
+	js->allowBuzz = snapshot->allowBuzz;
+	js->idle = snapshot->idle;
+
+	js->old_state = snapshot->old_state;
+	g_free(js->old_msg);
+	js->old_msg = snapshot->old_msg;
+	snapshot->old_msg = NULL;
+	js->old_priority = snapshot->old_priority;
+	g_free(js->old_avatarhash);
+	js->old_avatarhash = snapshot->old_avatarhash;
+	snapshot->old_avatarhash = NULL;
+	js->old_idle = snapshot->old_idle;
+}
+
+/*
+ * The core left the rooms when the old connection went, but the rooms
+ * never saw us go.  Rejoin the conversations from what we knew of them,
+ * and really leave the ones that were closed in the meantime.
+ */
+static void
+jabber_sm_restore_chats(JabberStream *js, JabberSmSnapshot *snapshot)
+{
+	PurpleAccount *account = purple_connection_get_account(js->gc);
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (snapshot->chats == NULL)
+		return;
+
+	g_hash_table_destroy(js->chats);
+	js->chats = snapshot->chats;
+	snapshot->chats = NULL;
+
+	g_hash_table_iter_init(&iter, js->chats);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		JabberChat *chat = value;
+		PurpleConversation *conv;
+		PurpleConvChat *conv_chat;
+		GList *users = NULL, *flags = NULL;
+		GHashTableIter members;
+		gpointer handle;
+
+		chat->js = js;
+		conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT,
+				key, account);
+
+		if (conv == NULL || chat->left) {
+			if (!chat->left)
+				jabber_chat_part(chat, NULL);
+			g_hash_table_iter_remove(&iter);
+			continue;
+		}
+
+		/* Rejoining forgets the occupants, so note their flags first. */
+		conv_chat = PURPLE_CONV_CHAT(conv);
+		g_hash_table_iter_init(&members, chat->members);
+		while (g_hash_table_iter_next(&members, &handle, NULL)) {
+			users = g_list_prepend(users, handle);
+			flags = g_list_prepend(flags, GINT_TO_POINTER(
+					purple_conv_chat_user_get_flags(conv_chat, handle)));
+		}
+
+		chat->conv = serv_got_joined_chat(js->gc, chat->id, key);
+		purple_conv_chat_set_nick(PURPLE_CONV_CHAT(chat->conv), chat->handle);
+		purple_conv_chat_add_users(PURPLE_CONV_CHAT(chat->conv), users, NULL,
+				flags, FALSE);
+
+		g_list_free(users);
+		g_list_free(flags);
+	}
+}
+
+/* The core forgot every buddy's status when the old connection went. */
+static void
+jabber_sm_restore_status(gpointer key, gpointer value, gpointer data)
+{
+	JabberStream *js = data;
+	JabberBuddyResource *jbr = jabber_buddy_find_resource(value, NULL);
+	PurpleAccount *account = purple_connection_get_account(js->gc);
+
+	if (jbr == NULL)
+		return;
+
+	purple_prpl_got_user_status(account, key,
+			jabber_buddy_state_get_status_id(jbr->state),
+			"priority", jbr->priority,
+			"message", jbr->status,
+			NULL);
+	purple_prpl_got_user_idle(account, key, jbr->idle, jbr->idle);
+}
+
+static void
+jabber_sm_handle_resumed(JabberStream *js, xmlnode *packet)
+{
+	JabberSm *sm = js->sm;
+	JabberSm *previous = sm->previous;
+
+	if (previous == NULL || previous->id == NULL ||
+			!purple_strequal(xmlnode_get_attrib(packet, "previd"), previous->id)) {
+		purple_connection_error_reason(js->gc,
+			PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+			_("Invalid response from server"));
+		return;
+	}
+
+	sm->previous = NULL;
+	jabber_sm_handle_ack(previous, xmlnode_get_attrib(packet, "h"));
+
+	purple_debug_info("jabber", "Resumed session %s\n", previous->id);
+
+	sm->id = previous->id;
+	previous->id = NULL;
+	sm->max = previous->max;
+	sm->inbound = previous->inbound;
+	sm->acked = previous->acked;
+	sm->enabling = sm->enabled = sm->resumed = TRUE;
+
+	jabber_sm_restore(js, previous->snapshot);
+
+	/* These go out before anything new */
+	jabber_sm_resend(js, previous, FALSE);
+	jabber_sm_restore_chats(js, previous->snapshot);
+	jabber_sm_free(previous);
+
+	jabber_stream_set_state(js, JABBER_STREAM_CONNECTED);
+	g_hash_table_foreach(js->buddies, jabber_sm_restore_status, js);
+}
+
+void
+jabber_sm_parse(JabberStream *js, xmlnode *packet)
+{
+	JabberSm *sm = js->sm;
+	const char *name = packet->name;
+
+	if (sm == NULL)
+		return;
+
+	if (g_str_equal(name, "r")) {
+		xmlnode *a;
+		char *h;
+
+		if (!sm->enabled)
+			return;
+
+		a = xmlnode_new("a");
+		xmlnode_set_namespace(a, NS_STREAM_MANAGEMENT);
+		h = g_strdup_printf("%u", sm->inbound);
+		xmlnode_set_attrib(a, "h", h);
+		g_free(h);
+		jabber_send(js, a);
+		xmlnode_free(a);
+	} else if (g_str_equal(name, "a")) {
+		if (sm->enabling)
+			jabber_sm_handle_ack(sm, xmlnode_get_attrib(packet, "h"));
+	} else if (g_str_equal(name, "enabled")) {
+		const char *resume = xmlnode_get_attrib(packet, "resume");
+		const char *max = xmlnode_get_attrib(packet, "max");
+
+		if (!sm->enabling) {
+			purple_debug_warning("jabber", "Ignoring spurious <enabled/>\n");
+			return;
+		}
+
+		sm->enabled = TRUE;
+		if (purple_strequal(resume, "true") || purple_strequal(resume, "1")) {
+			g_free(sm->id);
+			sm->id = g_strdup(xmlnode_get_attrib(packet, "id"));
+		}
+		sm->max = max ? atoi(max) : 0;
+
+		purple_debug_info("jabber", "Stream management enabled%s%s\n",
+				sm->id ? ", session " : "", sm->id ? sm->id : "");
+	} else if (g_str_equal(name, "resumed")) {
+		jabber_sm_handle_resumed(js, packet);
+	} else if (g_str_equal(name, "failed")) {
+		if (sm->previous && !sm->enabling) {
+			/* Resumption failed, so bind as usual.  The server may still
+			 * say what it handled of the old session. */
+			purple_debug_info("jabber", "Could not resume session %s\n",
+					sm->previous->id);
+			jabber_sm_handle_ack(sm->previous, xmlnode_get_attrib(packet, "h"));
+			g_free(sm->previous->id);
+			sm->previous->id = NULL;
+			jabber_bind_resource(js);
+		} else {
+			xmlnode *node;
+
+			purple_debug_warning("jabber", "Could not enable stream management\n");
+			sm->enabling = sm->enabled = FALSE;
+			while ((node = g_queue_pop_head(sm->unacked)))
+				xmlnode_free(node);
+		}
+	} else {
+		purple_debug_warning("jabber", "Unknown stream management element: %s\n",
+				name);
+	}
+}
+
+void
+jabber_sm_inbound(JabberStream *js, xmlnode *packet)
+{
+	JabberSm *sm = js->sm;
+
+	if (sm && sm->enabled && jabber_sm_is_stanza(packet))
+		sm->inbound++;
+}
+
+/*
+ * Text sent with jabber_prpl_send_raw(), such as from the XML console, is
+ * counted by the server like anything else.  Keep what stanzas we can
+ * make out of it.
+ */
+void
+jabber_sm_outbound_raw(JabberStream *js, const char *data, int len)
+{
+	JabberSm *sm = js->sm;
+	xmlnode *wrapper, *child;
+	char *text;
+
+	if (sm == NULL || !sm->enabling)
+		return;
+
+	if (len < 0)
+		len = strlen(data);
+	text = g_strdup_printf("<raw>%.*s</raw>", len, data);
+	wrapper = xmlnode_from_str(text, -1);
+	g_free(text);
+
+	if (wrapper == NULL) {
+		purple_debug_warning("jabber", "Could not count the stanzas in "
+				"raw text; acknowledgements may not line up\n");
+		return;
+	}
+
+	for (child = wrapper->child; child; child = child->next)
+		if (child->type == XMLNODE_TYPE_TAG)
+			jabber_sm_outbound(js, child);
+
+	xmlnode_free(wrapper);
+}
+
+void
+jabber_sm_outbound(JabberStream *js, xmlnode *packet)
+{
+	JabberSm *sm = js->sm;
+
+	if (sm == NULL || !sm->enabling || !jabber_sm_is_stanza(packet))
+		return;
+
+	g_queue_push_tail(sm->unacked, xmlnode_copy(packet));
+
+	if (++sm->unrequested >= JABBER_SM_ACK_EVERY)
+		jabber_sm_send_request(sm);
+	else if (sm->ack_timer == 0)
+		sm->ack_timer = purple_timeout_add_seconds(JABBER_SM_ACK_DELAY,
+				jabber_sm_ack_timeout, sm);
+}
+
+/* Nothing of the connection may outlive it. */
+static void
+jabber_sm_detach_chat(gpointer key, gpointer value, gpointer data)
+{
+	JabberChat *chat = value;
+
+	if (chat->config_dialog_handle) {
+		purple_request_close(chat->config_dialog_type, chat->config_dialog_handle);
+		chat->config_dialog_handle = NULL;
+	}
+	chat->conv = NULL;
+	chat->js = NULL;
+}
+
+gboolean
+jabber_sm_detach(JabberStream *js)
+{
+	JabberSm *sm = js->sm;
+	JabberSmSnapshot *snapshot;
+
+	if (sm && sm->lost && sm->previous && sm->previous->id) {
+		/* Lost again before the server answered; try the next time */
+		g_hash_table_replace(sessions,
+				g_strdup(purple_account_get_username(purple_connection_get_account(js->gc))),
+				sm->previous);
+		sm->previous = NULL;
+		return FALSE;
+	}
+
+	if (sm == NULL || !sm->lost || !sm->enabled || sm->id == NULL ||
+			js->user == NULL || js->buddies == NULL)
+		return FALSE;
+
+	g_hash_table_remove(streams, js->gc);
+	if (sm->ack_timer) {
+		purple_timeout_remove(sm->ack_timer);
+		sm->ack_timer = 0;
+	}
+
+	snapshot = g_new0(JabberSmSnapshot, 1);
+	snapshot->jid = jabber_id_get_full_jid(js->user);
+	snapshot->buddies = js->buddies;
+	js->buddies = NULL;
+	js->user_jb = NULL;
+	snapshot->chats = js->chats;
+	js->chats = NULL;
+	if (snapshot->chats)
+		g_hash_table_foreach(snapshot->chats, jabber_sm_detach_chat, NULL);
+	snapshot->chat_servers = js->chat_servers;
+	js->chat_servers = NULL;
+	snapshot->server_caps = js->server_caps;
+	snapshot->googletalk = js->googletalk;
+	snapshot->pep = js->pep;
+	snapshot->vcard_fetched = js->vcard_fetched;
+	snapshot->avatar_hash = g_strdup(js->avatar_hash);
+	snapshot->allowBuzz = js->allowBuzz;
+	snapshot->idle = js->idle;
+	snapshot->old_state = js->old_state;
+	snapshot->old_msg = g_strdup(js->old_msg);
+	snapshot->old_priority = js->old_priority;
+	snapshot->old_avatarhash = g_strdup(js->old_avatarhash);
+	snapshot->old_idle = js->old_idle;
+
+	sm->snapshot = snapshot;
+	sm->expires = sm->max ? time(NULL) + sm->max : 0;
+	sm->js = NULL;
+
+	purple_debug_info("jabber", "Keeping session %s (%u unacknowledged) "
+			"to resume later\n", sm->id, g_queue_get_length(sm->unacked));
+
+	g_hash_table_replace(sessions,
+			g_strdup(purple_account_get_username(purple_connection_get_account(js->gc))),
+			sm);
+	js->sm = NULL;
+
+	return TRUE;
+}
+
+static void
+jabber_sm_connection_error_cb(PurpleConnection *gc, PurpleConnectionError reason,
+                              const char *description, gpointer data)
+{
+	JabberSm *sm = g_hash_table_lookup(streams, gc);
+
+	if (sm && reason == PURPLE_CONNECTION_ERROR_NETWORK_ERROR)
+		sm->lost = TRUE;
+}
+
+void
+jabber_sm_init(void)
+{
+	sessions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)jabber_sm_free);
+	streams = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	purple_signal_connect(purple_connections_get_handle(), "connection-error",
+			&sm_handle, PURPLE_CALLBACK(jabber_sm_connection_error_cb), NULL);
+}
+
+void
+jabber_sm_uninit(void)
+{
+	purple_signals_disconnect_by_handle(&sm_handle);
+
+	g_hash_table_destroy(sessions);
+	sessions = NULL;
+	g_hash_table_destroy(streams);
+	streams = NULL;
+}
@@ -0,0 +1,93 @@
+/*
+ * purple - Jabber Protocol Plugin
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ *
+ */
+
+#ifndef PURPLE_JABBER_SM_H_
+#define PURPLE_JABBER_SM_H_
+
+#include "xmlnode.h"
+
+/* XEP-0198 Stream Management */
+typedef struct _JabberSm JabberSm;
+
+void jabber_sm_init(void);
+void jabber_sm_uninit(void);
+
+JabberSm *jabber_sm_new(JabberStream *js);
+void jabber_sm_free(JabberSm *sm);
+
+/**
+ * Asks the server to resume the session a previous connection of this
+ * account left behind, if there is one and the server allows it.
+ *
+ * @param features The <stream:features/> offered after authentication.
+ *
+ * @return TRUE if a resumption was requested, in which case the resource
+ *         must not be bound.
+ */
+gboolean jabber_sm_resume(JabberStream *js, xmlnode *features);
+
+/**
+ * Enables stream management on a freshly bound session, when the server
+ * supports it.  Messages a previous connection never got acknowledged
+ * are sent again.
+ */
+void jabber_sm_enable(JabberStream *js);
+
+/**
+ * Returns whether this stream picked up where a previous one left off,
+ * so the roster and presences it already had need not be fetched again.
+ */
+gboolean jabber_sm_resumed(JabberStream *js);
+
+/**
+ * Handles a stream management element (<enabled/>, <r/>, <a/> and so on).
+ */
+void jabber_sm_parse(JabberStream *js, xmlnode *packet);
+
+/**
+ * Counts a stanza received from the server.
+ */
+void jabber_sm_inbound(JabberStream *js, xmlnode *packet);
+
+/**
+ * Keeps a copy of a stanza sent to the server until it is acknowledged.
+ */
+void jabber_sm_outbound(JabberStream *js, xmlnode *packet);
+
+/**
+ * Keeps copies of the stanzas in raw text sent to the server, as for
+ * jabber_sm_outbound().
+ */
+void jabber_sm_outbound_raw(JabberStream *js, const char *data, int len);
+
+/**
+ * Called as the stream is closed.  If the connection was lost and the
+ * server will let us resume, the session is kept for the next connection
+ * of the account.
+ *
+ * @return TRUE if the session was kept, in which case the stream must be
+ *         dropped without closing it.
+ */
+gboolean jabber_sm_detach(JabberStream *js);
+
+#endif /* PURPLE_JABBER_SM_H_ */
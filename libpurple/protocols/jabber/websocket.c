@@ -0,0 +1,874 @@
+/*
+ * purple - Jabber Protocol Plugin
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ *
+ */
+#include "internal.h"
+#include "circbuffer.h"
+#include "cipher.h"
+#include "debug.h"
+#include "prpl.h"
+#include "util.h"
+#include "xmlnode.h"
+
+#include "namespaces.h"
+#include "websocket.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/* The most we'll buffer of the server's handshake response */
+#define MAX_HANDSHAKE_SIZE (16 * 1024)
+/* The largest message we'll put together from frames */
+#define MAX_MESSAGE_SIZE   (8 * 1024 * 1024)
+
+struct _JabberWebSocket {
+	JabberStream *js;
+	PurpleSslConnection *psc;
+	int fd;
+	guint readh;
+	guint writeh;
+
+	PurpleCircBuffer *write_buf;
+	GString *read_buf;
+
+	/* The text frames of the message being received */
+	GString *message;
+
+	/* decoded URL */
+	char *host;
+	char *path;
+	guint16 port;
+	gboolean ssl;
+
+	/* The Sec-WebSocket-Key sent with the handshake */
+	char *key;
+
+	enum {
+		WS_OFFLINE,
+		WS_CONNECTING,
+		WS_HANDSHAKE,
+		WS_OPEN,
+		WS_CLOSED
+	} state;
+};
+
+void
+jabber_websocket_frame_append(GString *buf, guint8 opcode,
+                              const char *data, gsize len, gboolean mask)
+{
+	guint8 header[14];
+	gsize header_len = 2;
+	gsize start, i;
+
+	header[0] = 0x80 | (opcode & 0x0f);
+
+	if (len < 126) {
+		header[1] = len;
+	} else if (len <= 0xffff) {
+		header[1] = 126;
+		header[2] = (len >> 8) & 0xff;
+		header[3] = len & 0xff;
+		header_len = 4;
+	} else {
+		header[1] = 127;
+		for (i = 0; i < 8; i++)
+			header[2 + i] = ((guint64)len >> (56 - 8 * i)) & 0xff;
+		header_len = 10;
+	}
+
+	if (mask) {
+		guint32 key = g_random_int();
+
+		header[1] |= 0x80;
+		memcpy(header + header_len, &key, 4);
+		header_len += 4;
+	}
+
+	g_string_append_len(buf, (const char *)header, header_len);
+
+	start = buf->len;
+	g_string_append_len(buf, data, len);
+
+	if (mask) {
+		const guint8 *key = header + header_len - 4;
+
+		for (i = 0; i < len; i++)
+			buf->str[start + i] ^= key[i % 4];
+	}
+}
+
+gssize
+jabber_websocket_frame_parse(const guchar *data, gsize len, gboolean *fin,
+                             guint8 *opcode, const guchar **payload,
+                             gsize *payload_len)
+{
+	gsize header_len = 2;
+	guint64 length;
+	int i;
+
+	if (len < 2)
+		return 0;
+
+	/* No extensions are negotiated, so the reserved bits must be clear, and
+	 * a server must never mask what it sends. */
+	if ((data[0] & 0x70) || (data[1] & 0x80))
+		return -1;
+
+	length = data[1] & 0x7f;
+	if (length == 126) {
+		if (len < 4)
+			return 0;
+		length = (data[2] << 8) | data[3];
+		header_len = 4;
+	} else if (length == 127) {
+		if (len < 10)
+			return 0;
+		length = 0;
+		for (i = 2; i < 10; i++)
+			length = (length << 8) | data[i];
+		header_len = 10;
+	}
+
+	/* Control frames can't be fragmented, and are short */
+	if ((data[0] & 0x08) && (!(data[0] & 0x80) || length > 125))
+		return -1;
+
+	if (length > MAX_MESSAGE_SIZE)
+		return -1;
+
+	if (len - header_len < length)
+		return 0;
+
+	*fin = (data[0] & 0x80) != 0;
+	*opcode = data[0] & 0x0f;
+	*payload = data + header_len;
+	*payload_len = length;
+
+	return header_len + length;
+}
+
+char *
+jabber_websocket_accept_key(const char *key)
+{
+	PurpleCipherContext *context;
+	guchar digest[20];
+	gboolean ok;
+
+	context = purple_cipher_context_new_by_name("sha1", NULL);
+	g_return_val_if_fail(context != NULL, NULL);
+
+	purple_cipher_context_append(context, (const guchar *)key, strlen(key));
+	purple_cipher_context_append(context, (const guchar *)WEBSOCKET_GUID,
+	                             strlen(WEBSOCKET_GUID));
+	ok = purple_cipher_context_digest(context, sizeof(digest), digest, NULL);
+	purple_cipher_context_destroy(context);
+
+	g_return_val_if_fail(ok, NULL);
+
+	return purple_base64_encode(digest, sizeof(digest));
+}
+
+JabberWebSocket *
+jabber_websocket_new(JabberStream *js, const char *url)
+{
+	JabberWebSocket *ws;
+	char *http_url, *host, *path, *user, *passwd;
+	gboolean ssl;
+	int port;
+
+	/* purple_url_parse() only knows about http:// and https:// */
+	if (g_ascii_strncasecmp(url, "wss://", 6) == 0) {
+		http_url = g_strconcat("https://", url + 6, NULL);
+		ssl = TRUE;
+	} else if (g_ascii_strncasecmp(url, "ws://", 5) == 0) {
+		http_url = g_strconcat("http://", url + 5, NULL);
+		ssl = FALSE;
+	} else {
+		purple_debug_info("jabber", "Not a WebSocket URL: %s\n", url);
+		return NULL;
+	}
+
+	if (!purple_url_parse(http_url, &host, &port, &path, &user, &passwd)) {
+		purple_debug_info("jabber", "Unable to parse given URL.\n");
+		g_free(http_url);
+		return NULL;
+	}
+	g_free(http_url);
+
+	if ((user && user[0] != '\0') || (passwd && passwd[0] != '\0')) {
+		purple_debug_info("jabber", "Ignoring unexpected username and password "
+		                            "in WebSocket URL.\n");
+	}
+
+	g_free(user);
+	g_free(passwd);
+
+	ws = g_new0(JabberWebSocket, 1);
+	ws->js = js;
+	ws->fd = -1;
+	ws->host = host;
+	ws->port = port;
+	ws->path = g_strdup_printf("/%s", path);
+	g_free(path);
+	ws->ssl = ssl;
+	ws->state = WS_OFFLINE;
+	ws->write_buf = purple_circ_buffer_new(0 /* default grow size */);
+
+	g_free(js->serverFQDN);
+	if (purple_ip_address_is_valid(host))
+		js->serverFQDN = g_strdup(js->user->domain);
+	else
+		js->serverFQDN = g_strdup(host);
+
+	return ws;
+}
+
+void
+jabber_websocket_free(JabberWebSocket *ws)
+{
+	if (ws->readh)
+		purple_input_remove(ws->readh);
+	if (ws->writeh)
+		purple_input_remove(ws->writeh);
+	if (ws->psc)
+		purple_ssl_close(ws->psc);
+	if (ws->fd >= 0)
+		close(ws->fd);
+
+	purple_proxy_connect_cancel_with_handle(ws);
+
+	purple_circ_buffer_destroy(ws->write_buf);
+	if (ws->read_buf)
+		g_string_free(ws->read_buf, TRUE);
+	if (ws->message)
+		g_string_free(ws->message, TRUE);
+
+	g_free(ws->host);
+	g_free(ws->path);
+	g_free(ws->key);
+	g_free(ws);
+}
+
+gboolean
+jabber_websocket_is_ssl(JabberWebSocket *ws)
+{
+	return ws->ssl;
+}
+
+/*
+ * Drops the connection after an error.  Nothing more is read or written,
+ * and the JabberStream goes away with the PurpleConnection.
+ */
+static void
+websocket_error(JabberWebSocket *ws, PurpleConnectionError reason,
+                const char *msg)
+{
+	ws->state = WS_CLOSED;
+	purple_connection_error_reason(ws->js->gc, reason, msg);
+}
+
+static void
+websocket_lost(JabberWebSocket *ws)
+{
+	char *tmp = g_strdup_printf(_("Lost connection with server: %s"),
+			g_strerror(errno));
+	websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, tmp);
+	g_free(tmp);
+}
+
+static int
+websocket_do_send(JabberWebSocket *ws, const char *data, int len)
+{
+	if (ws->psc)
+		return purple_ssl_write(ws->psc, data, len);
+	else
+		return write(ws->fd, data, len);
+}
+
+static void
+websocket_send_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+	JabberWebSocket *ws = data;
+	int ret;
+	int writelen = purple_circ_buffer_get_max_read(ws->write_buf);
+
+	if (writelen == 0) {
+		purple_input_remove(ws->writeh);
+		ws->writeh = 0;
+		return;
+	}
+
+	ret = websocket_do_send(ws, ws->write_buf->outptr, writelen);
+
+	if (ret < 0 && errno == EAGAIN)
+		return;
+	else if (ret <= 0) {
+		websocket_lost(ws);
+		return;
+	}
+
+	purple_circ_buffer_mark_read(ws->write_buf, ret);
+}
+
+static void
+websocket_write(JabberWebSocket *ws, const char *data, gsize len)
+{
+	int ret;
+
+	if (ws->writeh == 0)
+		ret = websocket_do_send(ws, data, len);
+	else {
+		ret = -1;
+		errno = EAGAIN;
+	}
+
+	if (ret < 0 && errno != EAGAIN) {
+		websocket_lost(ws);
+		return;
+	} else if ((gsize)ret < len) {
+		if (ret < 0)
+			ret = 0;
+		if (ws->writeh == 0)
+			ws->writeh = purple_input_add(ws->psc ? ws->psc->fd : ws->fd,
+					PURPLE_INPUT_WRITE, websocket_send_cb, ws);
+		purple_circ_buffer_append(ws->write_buf, data + ret, len - ret);
+	}
+}
+
+static void
+websocket_send_frame(JabberWebSocket *ws, guint8 opcode, const char *data,
+                     gsize len)
+{
+	GString *frame;
+
+	if (ws->state != WS_OPEN) {
+		purple_debug_warning("jabber", "WebSocket %p isn't open. Ignoring "
+				"frame of type 0x%x.\n", ws, opcode);
+		return;
+	}
+
+	frame = g_string_sized_new(len + 14);
+	jabber_websocket_frame_append(frame, opcode, data, len, TRUE);
+	websocket_write(ws, frame->str, frame->len);
+	g_string_free(frame, TRUE);
+}
+
+void
+jabber_websocket_send_raw(JabberWebSocket *ws, const char *data, int len)
+{
+	JabberStream *js = ws->js;
+
+	if (len < 0)
+		len = strlen(data);
+
+	if (js->state == JABBER_STREAM_CONNECTED)
+		jabber_stream_restart_inactivity_timer(js);
+
+	websocket_send_frame(ws, JABBER_WEBSOCKET_TEXT, data, len);
+}
+
+void
+jabber_websocket_send_keepalive(JabberWebSocket *ws)
+{
+	websocket_send_frame(ws, JABBER_WEBSOCKET_PING, NULL, 0);
+}
+
+void
+jabber_websocket_open_stream(JabberWebSocket *ws)
+{
+	JabberStream *js = ws->js;
+	char *open;
+
+	g_free(js->stream_id);
+	js->stream_id = NULL;
+	js->reinit = FALSE;
+
+	open = g_strdup_printf("<open xmlns='" NS_XMPP_FRAMING "' "
+	                       "to='%s' "
+	                       "xml:lang='en' "
+	                       "version='1.0'/>",
+	                       js->user->domain);
+	jabber_send_raw(js, open, -1);
+	g_free(open);
+}
+
+void
+jabber_websocket_close(JabberWebSocket *ws)
+{
+	/* 1000, a normal closure */
+	static const char status[2] = "\x03\xe8";
+
+	if (ws->state != WS_OPEN)
+		return;
+
+	jabber_send_raw(ws->js, "<close xmlns='" NS_XMPP_FRAMING "'/>", -1);
+	websocket_send_frame(ws, JABBER_WEBSOCKET_CLOSE, status, sizeof(status));
+	ws->state = WS_CLOSED;
+}
+
+/*
+ * Handles the <open/> the server answers ours with, in place of
+ * <stream:stream>.
+ */
+static void
+websocket_stream_opened(JabberWebSocket *ws, xmlnode *open)
+{
+	JabberStream *js = ws->js;
+	const char *version = xmlnode_get_attrib(open, "version");
+	const char *id = xmlnode_get_attrib(open, "id");
+
+	if (!purple_strequal(version, "1.0")) {
+		websocket_error(ws, PURPLE_CONNECTION_ERROR_AUTHENTICATION_IMPOSSIBLE,
+				_("XMPP Version Mismatch"));
+		return;
+	}
+
+	js->protocol_version.major = 1;
+	js->protocol_version.minor = 0;
+
+	g_free(js->stream_id);
+	js->stream_id = g_strdup(id ? id : "");
+}
+
+static void
+websocket_stream_closed(JabberWebSocket *ws, xmlnode *close)
+{
+	const char *uri = xmlnode_get_attrib(close, "see-other-uri");
+
+	if (uri)
+		purple_debug_warning("jabber", "WebSocket server wants us at %s, "
+		                     "which isn't supported\n", uri);
+
+	jabber_websocket_close(ws);
+	websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+			_("Server closed the connection"));
+}
+
+/*
+ * Handles one complete message, which holds exactly one element.
+ */
+static void
+websocket_message_received(JabberWebSocket *ws, const char *data, gsize len)
+{
+	JabberStream *js = ws->js;
+	xmlnode *node;
+	const char *xmlns;
+
+	purple_debug_info("jabber", "Recv (ws%s)(%" G_GSIZE_FORMAT "): %.*s\n",
+	                  ws->ssl ? "s" : "", len, (int)len, data);
+
+	node = xmlnode_from_str(data, len);
+	if (node == NULL) {
+		websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+				_("Invalid XML"));
+		return;
+	}
+
+	xmlns = xmlnode_get_namespace(node);
+
+	if (purple_strequal(xmlns, NS_XMPP_FRAMING)) {
+		if (g_str_equal(node->name, "open"))
+			websocket_stream_opened(ws, node);
+		else if (g_str_equal(node->name, "close"))
+			websocket_stream_closed(ws, node);
+		xmlnode_free(node);
+		return;
+	}
+
+	/* Stanzas carry their own namespace, but tolerate servers that leave
+	 * it off as they do over BOSH. */
+	if (xmlns == NULL &&
+			(g_str_equal(node->name, "iq") ||
+			 g_str_equal(node->name, "message") ||
+			 g_str_equal(node->name, "presence")))
+		xmlnode_set_namespace(node, NS_XMPP_CLIENT);
+
+	jabber_process_packet(js, &node);
+	if (node)
+		xmlnode_free(node);
+
+	/* After authenticating, a new stream is opened on the same connection */
+	if (js->reinit && ws->state == WS_OPEN)
+		jabber_websocket_open_stream(ws);
+}
+
+/*
+ * @return The number of bytes used, or -1 after an error.
+ */
+static gssize
+websocket_process_frame(JabberWebSocket *ws, const guchar *data, gsize len)
+{
+	const guchar *payload;
+	gsize payload_len;
+	gboolean fin;
+	guint8 opcode;
+	gssize used;
+
+	used = jabber_websocket_frame_parse(data, len, &fin, &opcode,
+	                                    &payload, &payload_len);
+	if (used <= 0) {
+		if (used < 0)
+			websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+					_("Invalid response from server"));
+		return used;
+	}
+
+	switch (opcode) {
+		case JABBER_WEBSOCKET_TEXT:
+		case JABBER_WEBSOCKET_CONTINUATION:
+			if ((opcode == JABBER_WEBSOCKET_TEXT) != (ws->message == NULL)) {
+				websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+						_("Invalid response from server"));
+				return -1;
+			}
+
+			if (fin && ws->message == NULL) {
+				/* The usual case: the whole message in one frame */
+				websocket_message_received(ws, (const char *)payload,
+				                           payload_len);
+				break;
+			}
+
+			if (ws->message == NULL)
+				ws->message = g_string_sized_new(payload_len);
+			if (ws->message->len + payload_len > MAX_MESSAGE_SIZE) {
+				websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+						_("Invalid response from server"));
+				return -1;
+			}
+			g_string_append_len(ws->message, (const char *)payload,
+			                    payload_len);
+
+			if (fin) {
+				GString *message = ws->message;
+				ws->message = NULL;
+				websocket_message_received(ws, message->str, message->len);
+				g_string_free(message, TRUE);
+			}
+			break;
+
+		case JABBER_WEBSOCKET_PING:
+			websocket_send_frame(ws, JABBER_WEBSOCKET_PONG,
+			                     (const char *)payload, payload_len);
+			break;
+
+		case JABBER_WEBSOCKET_PONG:
+			break;
+
+		case JABBER_WEBSOCKET_CLOSE:
+			purple_debug_info("jabber", "WebSocket server closed the "
+			                  "connection (%p)\n", ws);
+			/* Echo the status back, as the closing handshake asks */
+			websocket_send_frame(ws, JABBER_WEBSOCKET_CLOSE,
+			                     (const char *)payload, MIN(payload_len, 2));
+			websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+					_("Server closed the connection"));
+			return -1;
+
+		default:
+			/* Binary frames have no place in RFC 7395 */
+			websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+					_("Invalid response from server"));
+			return -1;
+	}
+
+	return used;
+}
+
+static gboolean
+websocket_header_has_token(const char *value, const char *token)
+{
+	gchar **tokens = g_strsplit(value, ",", -1);
+	gboolean found = FALSE;
+	int i;
+
+	for (i = 0; tokens[i] && !found; i++)
+		found = !g_ascii_strcasecmp(g_strstrip(tokens[i]), token);
+
+	g_strfreev(tokens);
+
+	return found;
+}
+
+/*
+ * Checks the server's answer to the opening handshake.
+ *
+ * @return NULL if the server agreed to speak XMPP over a WebSocket, or
+ *         else why not.
+ */
+static const char *
+websocket_check_handshake(JabberWebSocket *ws, const char *response)
+{
+	gchar **lines = g_strsplit(response, "\r\n", -1);
+	gboolean upgrade = FALSE, connection = FALSE, protocol = FALSE;
+	char *expected_accept;
+	const char *error = NULL;
+	gboolean accepted = FALSE;
+	int i;
+
+	/* HTTP/1.1 101 Switching Protocols */
+	if (lines[0] == NULL || strncmp(lines[0], "HTTP/1.1 ", 9) != 0) {
+		g_strfreev(lines);
+		return _("Invalid response from server");
+	}
+	if (strncmp(lines[0] + 9, "101", 3) != 0) {
+		purple_debug_error("jabber", "WebSocket handshake refused: %s\n",
+		                   lines[0]);
+		g_strfreev(lines);
+		return _("The server does not support XMPP over WebSocket");
+	}
+
+	expected_accept = jabber_websocket_accept_key(ws->key);
+
+	for (i = 1; lines[i] && *lines[i]; i++) {
+		char *value = strchr(lines[i], ':');
+
+		if (value == NULL)
+			continue;
+
+		*value++ = '\0';
+		value = g_strstrip(value);
+
+		if (!g_ascii_strcasecmp(lines[i], "Upgrade"))
+			upgrade = !g_ascii_strcasecmp(value, "websocket");
+		else if (!g_ascii_strcasecmp(lines[i], "Connection"))
+			connection = websocket_header_has_token(value, "upgrade");
+		else if (!g_ascii_strcasecmp(lines[i], "Sec-WebSocket-Accept"))
+			accepted = purple_strequal(value, expected_accept);
+		else if (!g_ascii_strcasecmp(lines[i], "Sec-WebSocket-Protocol"))
+			protocol = g_str_equal(value, "xmpp");
+	}
+
+	if (!upgrade || !connection || !accepted)
+		error = _("Invalid response from server");
+	else if (!protocol)
+		error = _("The server does not support XMPP over WebSocket");
+
+	g_free(expected_accept);
+	g_strfreev(lines);
+
+	return error;
+}
+
+static void
+websocket_process(JabberWebSocket *ws)
+{
+	JabberStream *js = ws->js;
+	gsize handled = 0;
+
+	if (ws->state == WS_HANDSHAKE) {
+		const char *end = g_strstr_len(ws->read_buf->str, ws->read_buf->len,
+		                               "\r\n\r\n");
+		const char *error;
+		char *response;
+
+		if (end == NULL) {
+			if (ws->read_buf->len > MAX_HANDSHAKE_SIZE)
+				websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+						_("Invalid response from server"));
+			return;
+		}
+
+		handled = end - ws->read_buf->str + 4;
+		response = g_strndup(ws->read_buf->str, handled);
+		purple_debug_misc("jabber", "WebSocket handshake response: %s\n",
+		                  response);
+		error = websocket_check_handshake(ws, response);
+		g_free(response);
+
+		if (error) {
+			websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error);
+			return;
+		}
+
+		ws->state = WS_OPEN;
+		jabber_stream_set_state(js, JABBER_STREAM_INITIALIZING);
+	}
+
+	while (ws->state == WS_OPEN && handled < ws->read_buf->len) {
+		gssize used = websocket_process_frame(ws,
+				(const guchar *)ws->read_buf->str + handled,
+				ws->read_buf->len - handled);
+
+		if (used <= 0)
+			break;
+
+		handled += used;
+	}
+
+	if (ws->state == WS_CLOSED)
+		return;
+
+	g_string_erase(ws->read_buf, 0, handled);
+}
+
+static void
+websocket_read(JabberWebSocket *ws)
+{
+	char buffer[4096];
+	int cnt;
+
+	if (!ws->read_buf)
+		ws->read_buf = g_string_new(NULL);
+
+	do {
+		if (ws->psc)
+			cnt = purple_ssl_read(ws->psc, buffer, sizeof(buffer));
+		else
+			cnt = read(ws->fd, buffer, sizeof(buffer));
+
+		if (cnt > 0)
+			g_string_append_len(ws->read_buf, buffer, cnt);
+	} while (cnt > 0);
+
+	ws->js->gc->last_received = time(NULL);
+
+	/* Process whatever did arrive before noticing the connection is gone */
+	if (ws->read_buf->len > 0)
+		websocket_process(ws);
+
+	if (ws->state == WS_CLOSED)
+		return;
+
+	if (cnt == 0)
+		websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+				_("Server closed the connection"));
+	else if (cnt < 0 && errno != EAGAIN)
+		websocket_lost(ws);
+}
+
+static void
+websocket_read_cb(gpointer data, gint fd, PurpleInputCondition condition)
+{
+	websocket_read(data);
+}
+
+static void
+websocket_read_cb_ssl(gpointer data, PurpleSslConnection *psc,
+                      PurpleInputCondition cond)
+{
+	websocket_read(data);
+}
+
+static void
+websocket_established(JabberWebSocket *ws)
+{
+	guchar nonce[16];
+	GString *request;
+	int i;
+
+	for (i = 0; i < (int)sizeof(nonce); i++)
+		nonce[i] = g_random_int_range(0, 256);
+
+	g_free(ws->key);
+	ws->key = purple_base64_encode(nonce, sizeof(nonce));
+
+	request = g_string_new(NULL);
+	g_string_printf(request, "GET %s HTTP/1.1\r\n", ws->path);
+	if (ws->port == (ws->ssl ? 443 : 80))
+		g_string_append_printf(request, "Host: %s\r\n", ws->host);
+	else
+		g_string_append_printf(request, "Host: %s:%d\r\n", ws->host, ws->port);
+	g_string_append_printf(request,
+	                       "Upgrade: websocket\r\n"
+	                       "Connection: Upgrade\r\n"
+	                       "Sec-WebSocket-Key: %s\r\n"
+	                       "Sec-WebSocket-Protocol: xmpp\r\n"
+	                       "Sec-WebSocket-Version: 13\r\n\r\n",
+	                       ws->key);
+
+	purple_debug_misc("jabber", "WebSocket handshake: %s\n", request->str);
+
+	ws->state = WS_HANDSHAKE;
+	websocket_write(ws, request->str, request->len);
+	g_string_free(request, TRUE);
+}
+
+static void
+websocket_ssl_established_cb(gpointer data, PurpleSslConnection *psc,
+                             PurpleInputCondition cond)
+{
+	JabberWebSocket *ws = data;
+
+	purple_ssl_input_add(psc, websocket_read_cb_ssl, ws);
+	websocket_established(ws);
+}
+
+static void
+websocket_ssl_error_cb(PurpleSslConnection *psc, PurpleSslErrorType error,
+                       gpointer data)
+{
+	JabberWebSocket *ws = data;
+
+	/* sslconn frees the connection on error */
+	ws->psc = NULL;
+	ws->state = WS_CLOSED;
+
+	purple_connection_ssl_error(ws->js->gc, error);
+}
+
+static void
+websocket_established_cb(gpointer data, gint source, const gchar *error)
+{
+	JabberWebSocket *ws = data;
+
+	if (source < 0) {
+		gchar *tmp;
+		tmp = g_strdup_printf(_("Unable to establish a connection with the server: %s"),
+		        error);
+		websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, tmp);
+		g_free(tmp);
+		return;
+	}
+
+	ws->fd = source;
+	ws->readh = purple_input_add(ws->fd, PURPLE_INPUT_READ,
+	        websocket_read_cb, ws);
+	websocket_established(ws);
+}
+
+void
+jabber_websocket_connect(JabberWebSocket *ws)
+{
+	PurpleConnection *gc = ws->js->gc;
+	PurpleAccount *account = purple_connection_get_account(gc);
+
+	g_return_if_fail(ws->state == WS_OFFLINE);
+	ws->state = WS_CONNECTING;
+
+	if (ws->ssl) {
+		if (purple_ssl_is_supported()) {
+			ws->psc = purple_ssl_connect(account, ws->host, ws->port,
+			                             websocket_ssl_established_cb,
+			                             websocket_ssl_error_cb, ws);
+			if (!ws->psc) {
+				websocket_error(ws, PURPLE_CONNECTION_ERROR_NO_SSL_SUPPORT,
+						_("Unable to establish SSL connection"));
+			}
+		} else {
+			websocket_error(ws, PURPLE_CONNECTION_ERROR_NO_SSL_SUPPORT,
+					_("SSL support unavailable"));
+		}
+	} else if (purple_proxy_connect(ws, account, ws->host, ws->port,
+	                                websocket_established_cb, ws) == NULL) {
+		websocket_error(ws, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+				_("Unable to connect"));
+	}
+}
@@ -0,0 +1,100 @@
+/**
+ * @file websocket.h XMPP over WebSocket (RFC 7395)
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#ifndef PURPLE_JABBER_WEBSOCKET_H_
+#define PURPLE_JABBER_WEBSOCKET_H_
+
+typedef struct _JabberWebSocket JabberWebSocket;
+
+#include "jabber.h"
+
+/* WebSocket opcodes (RFC 6455) */
+#define JABBER_WEBSOCKET_CONTINUATION 0x0
+#define JABBER_WEBSOCKET_TEXT         0x1
+#define JABBER_WEBSOCKET_BINARY       0x2
+#define JABBER_WEBSOCKET_CLOSE        0x8
+#define JABBER_WEBSOCKET_PING         0x9
+#define JABBER_WEBSOCKET_PONG         0xA
+
+/**
+ * Creates a WebSocket transport for a ws:// or wss:// URL.
+ *
+ * @return The new transport, or NULL if the URL could not be parsed.
+ */
+JabberWebSocket *jabber_websocket_new(JabberStream *js, const char *url);
+void jabber_websocket_free(JabberWebSocket *ws);
+
+gboolean jabber_websocket_is_ssl(JabberWebSocket *ws);
+void jabber_websocket_send_keepalive(JabberWebSocket *ws);
+
+void jabber_websocket_connect(JabberWebSocket *ws);
+
+/**
+ * Sends <open/>, starting a new stream on the connection.  Used in place
+ * of <stream:stream>, both at first and after authenticating.
+ */
+void jabber_websocket_open_stream(JabberWebSocket *ws);
+
+/**
+ * Closes the stream with <close/> and ends the WebSocket connection.
+ */
+void jabber_websocket_close(JabberWebSocket *ws);
+
+/**
+ * Sends data as a single WebSocket message.  RFC 7395 needs each
+ * message to be exactly one complete element.
+ */
+void jabber_websocket_send_raw(JabberWebSocket *ws, const char *data, int len);
+
+/**
+ * Appends a single frame to a buffer.  Frames sent by a client must be
+ * masked; the tests use unmasked ones to stand in for a server.
+ */
+void jabber_websocket_frame_append(GString *buf, guint8 opcode,
+                                   const char *data, gsize len, gboolean mask);
+
+/**
+ * Parses the frame at the start of a buffer.  Frames from a server are
+ * never masked and masked ones are rejected.
+ *
+ * @param data        The received data.
+ * @param len         The length of data.
+ * @param fin         Set to whether this is the last frame of a message.
+ * @param opcode      Set to the opcode of the frame.
+ * @param payload     Set to the start of the payload, within data.
+ * @param payload_len Set to the length of the payload.
+ *
+ * @return The length of the frame, 0 if data does not hold all of it yet,
+ *         or -1 if it is not a valid frame.
+ */
+gssize jabber_websocket_frame_parse(const guchar *data, gsize len,
+                                    gboolean *fin, guint8 *opcode,
+                                    const guchar **payload, gsize *payload_len);
+
+/**
+ * Computes the Sec-WebSocket-Accept value a server has to answer a
+ * Sec-WebSocket-Key with.
+ */
+char *jabber_websocket_accept_key(const char *key);
+
+#endif /* PURPLE_JABBER_WEBSOCKET_H_ */
@@ -626,6 +626,7 @@ void yahoo_process_chat_join(PurpleConnection *gc, struct yahoo_packet *pkt)
 
 	if (account->deny && c) {
 		PurpleConversationUiOps *ops = purple_conversation_get_ui_ops(c);
+		purple_conv_chat_flush_users(PURPLE_CONV_CHAT(c));
 		for (l = account->deny; l != NULL; l = l->next) {
 			for (roomies = members; roomies; roomies = roomies->next) {
 				if (!purple_utf8_strcasecmp((char *)l->data, roomies->data)) {
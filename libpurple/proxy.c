@@ -61,6 +61,13 @@ struct _PurpleProxyConnectData {
 
 	PurpleProxyConnectData *child;
 
+	/*
+	 * The connection attempts that are racing each other, and the
+	 * timer that starts the next one.
+	 */
+	GSList *attempts;
+	guint attempt_timer;
+
 	/*
 	 * All of the following variables are used when establishing a
 	 * connection through a proxy.
@@ -75,6 +82,18 @@ struct _PurpleProxyConnectData {
 	PurpleAccount *account;
 };
 
+typedef struct {
+	PurpleProxyConnectData *connect_data;
+	int fd;
+	guint inpa;
+	int family;
+	struct sockaddr *addr;   /* Goes back on the list if the attempt is cancelled */
+	socklen_t addrlen;
+} PurpleProxyConnectAttempt;
+
+/* How long to wait for an attempt before starting the next one (RFC 8305). */
+#define CONNECTION_ATTEMPT_DELAY 250
+
 static const char * const socks5errors[] = {
 	"succeeded\n",
 	"general SOCKS server failure\n",
@@ -91,7 +110,11 @@ static PurpleProxyInfo *global_proxy_info = NULL;
 
 static GSList *handles = NULL;
 
+/* Maps a lower case host name to the address family that last won a race. */
+static GHashTable *preferred_families = NULL;
+
 static void try_connect(PurpleProxyConnectData *connect_data);
+static void cancel_connect_attempts(PurpleProxyConnectData *connect_data);
 
 /*
  * TODO: Eventually (GObjectification) this bad boy will be removed, because it is
@@ -609,6 +632,8 @@ purple_proxy_connect_data_destroy(PurpleProxyConnectData *connect_data)
 static void
 purple_proxy_connect_data_disconnect(PurpleProxyConnectData *connect_data, const gchar *error_message)
 {
+	cancel_connect_attempts(connect_data);
+
 	if (connect_data->child != NULL)
 	{
 		purple_proxy_connect_cancel(connect_data->child);
@@ -797,61 +822,6 @@ proxy_connect_udp_none(PurpleProxyConnectData *connect_data, struct sockaddr *ad
 	}
 }
 
-static void
-proxy_connect_none(PurpleProxyConnectData *connect_data, struct sockaddr *addr, socklen_t addrlen)
-{
-	purple_debug_info("proxy", "Connecting to %s:%d with no proxy\n",
-			connect_data->host, connect_data->port);
-
-	connect_data->fd = socket(addr->sa_family, SOCK_STREAM, 0);
-	if (connect_data->fd < 0)
-	{
-		purple_proxy_connect_data_disconnect_formatted(connect_data,
-				_("Unable to create socket: %s"), g_strerror(errno));
-		return;
-	}
-	_purple_network_set_common_socket_flags(connect_data->fd);
-
-	if (connect(connect_data->fd, addr, addrlen) != 0)
-	{
-		if ((errno == EINPROGRESS) || (errno == EINTR))
-		{
-			purple_debug_info("proxy", "Connection in progress\n");
-			connect_data->inpa = purple_input_add(connect_data->fd,
-					PURPLE_INPUT_WRITE, socket_ready_cb, connect_data);
-		}
-		else
-		{
-			purple_proxy_connect_data_disconnect(connect_data, g_strerror(errno));
-		}
-	}
-	else
-	{
-		/*
-		 * The connection happened IMMEDIATELY... strange, but whatever.
-		 */
-		int error = ETIMEDOUT;
-		int ret;
-
-		purple_debug_info("proxy", "Connected immediately.\n");
-
-		ret = purple_input_get_error(connect_data->fd, &error);
-		if ((ret != 0) || (error != 0))
-		{
-			if (ret != 0)
-				error = errno;
-			purple_proxy_connect_data_disconnect(connect_data, g_strerror(error));
-			return;
-		}
-
-		/*
-		 * We want to call the "connected" callback eventually, but we
-		 * don't want to call it before we return, just in case.
-		 */
-		purple_timeout_add(10, clean_connect, connect_data);
-	}
-}
-
 /**
  * This is a utility function used by the HTTP, SOCKS4 and SOCKS5
  * connect functions.  It writes data from a buffer to a socket.
@@ -1241,39 +1211,6 @@ http_canwrite(gpointer data, gint source, PurpleInputCondition cond) {
 
 }
 
-static void
-proxy_connect_http(PurpleProxyConnectData *connect_data, struct sockaddr *addr, socklen_t addrlen)
-{
-	purple_debug_info("proxy",
-			   "Connecting to %s:%d via %s:%d using HTTP\n",
-			   connect_data->host, connect_data->port,
-			   (purple_proxy_info_get_host(connect_data->gpi) ? purple_proxy_info_get_host(connect_data->gpi) : "(null)"),
-			   purple_proxy_info_get_port(connect_data->gpi));
-
-	connect_data->fd = socket(addr->sa_family, SOCK_STREAM, 0);
-	if (connect_data->fd < 0)
-	{
-		purple_proxy_connect_data_disconnect_formatted(connect_data,
-				_("Unable to create socket: %s"), g_strerror(errno));
-		return;
-	}
-	_purple_network_set_common_socket_flags(connect_data->fd);
-
-	if (connect(connect_data->fd, addr, addrlen) != 0) {
-		if (errno == EINPROGRESS || errno == EINTR) {
-			purple_debug_info("proxy", "Connection in progress\n");
-
-			connect_data->inpa = purple_input_add(connect_data->fd,
-					PURPLE_INPUT_WRITE, http_canwrite, connect_data);
-		} else
-			purple_proxy_connect_data_disconnect(connect_data, g_strerror(errno));
-	} else {
-		purple_debug_info("proxy", "Connected immediately.\n");
-
-		http_canwrite(connect_data, connect_data->fd, PURPLE_INPUT_WRITE);
-	}
-}
-
 static void
 s4_canread(gpointer data, gint source, PurpleInputCondition cond)
 {
@@ -1428,45 +1365,6 @@ s4_canwrite(gpointer data, gint source, PurpleInputCondition cond)
 	}
 }
 
-static void
-proxy_connect_socks4(PurpleProxyConnectData *connect_data, struct sockaddr *addr, socklen_t addrlen)
-{
-	purple_debug_info("proxy",
-			   "Connecting to %s:%d via %s:%d using SOCKS4\n",
-			   connect_data->host, connect_data->port,
-			   purple_proxy_info_get_host(connect_data->gpi),
-			   purple_proxy_info_get_port(connect_data->gpi));
-
-	connect_data->fd = socket(addr->sa_family, SOCK_STREAM, 0);
-	if (connect_data->fd < 0)
-	{
-		purple_proxy_connect_data_disconnect_formatted(connect_data,
-				_("Unable to create socket: %s"), g_strerror(errno));
-		return;
-	}
-	_purple_network_set_common_socket_flags(connect_data->fd);
-
-	if (connect(connect_data->fd, addr, addrlen) != 0)
-	{
-		if ((errno == EINPROGRESS) || (errno == EINTR))
-		{
-			purple_debug_info("proxy", "Connection in progress.\n");
-			connect_data->inpa = purple_input_add(connect_data->fd,
-					PURPLE_INPUT_WRITE, s4_canwrite, connect_data);
-		}
-		else
-		{
-			purple_proxy_connect_data_disconnect(connect_data, g_strerror(errno));
-		}
-	}
-	else
-	{
-		purple_debug_info("proxy", "Connected immediately.\n");
-
-		s4_canwrite(connect_data, connect_data->fd, PURPLE_INPUT_WRITE);
-	}
-}
-
 static gboolean
 s5_ensure_buffer_length(PurpleProxyConnectData *connect_data, guint len)
 {
@@ -2086,63 +1984,29 @@ s5_canwrite(gpointer data, gint source, PurpleInputCondition cond)
 	proxy_do_write(connect_data, connect_data->fd, PURPLE_INPUT_WRITE);
 }
 
-static void
-proxy_connect_socks5(PurpleProxyConnectData *connect_data, struct sockaddr *addr, socklen_t addrlen)
-{
-	purple_debug_info("proxy",
-			   "Connecting to %s:%d via %s:%d using SOCKS5\n",
-			   connect_data->host, connect_data->port,
-			   purple_proxy_info_get_host(connect_data->gpi),
-			   purple_proxy_info_get_port(connect_data->gpi));
-
-	connect_data->fd = socket(addr->sa_family, SOCK_STREAM, 0);
-	if (connect_data->fd < 0)
-	{
-		purple_proxy_connect_data_disconnect_formatted(connect_data,
-				_("Unable to create socket: %s"), g_strerror(errno));
-		return;
-	}
-	_purple_network_set_common_socket_flags(connect_data->fd);
-
-	if (connect(connect_data->fd, addr, addrlen) != 0)
-	{
-		if ((errno == EINPROGRESS) || (errno == EINTR))
-		{
-			purple_debug_info("socks5 proxy", "Connection in progress\n");
-			connect_data->inpa = purple_input_add(connect_data->fd,
-					PURPLE_INPUT_WRITE, s5_canwrite, connect_data);
-		}
-		else
-		{
-			purple_proxy_connect_data_disconnect(connect_data, g_strerror(errno));
-		}
-	}
-	else
-	{
-		purple_debug_info("proxy", "Connected immediately.\n");
-
-		s5_canwrite(connect_data, connect_data->fd, PURPLE_INPUT_WRITE);
-	}
-}
-
 /**
  * This function attempts to connect to the next IP address in the list
- * of IP addresses returned to us by purple_dnsquery_a() and attemps
- * to connect to each one.  This is called after the hostname is
- * resolved, and each time a connection attempt fails (assuming there
- * is another IP address to try).
+ * of IP addresses returned to us by purple_dnsquery_a().  This is called
+ * after the hostname is resolved, and each time a connection attempt
+ * fails (assuming there is another IP address to try).
+ *
+ * Stream connections race the addresses against each other the way
+ * RFC 8305 ("Happy Eyeballs") describes: a new attempt is started every
+ * CONNECTION_ATTEMPT_DELAY milliseconds, or as soon as the previous one
+ * fails, and the first socket to connect wins.  Only the TCP connection
+ * is raced.  The proxy handshake, if any, happens on the winning socket.
  */
 #ifndef INET6_ADDRSTRLEN
 #define INET6_ADDRSTRLEN 46
 #endif
 
-static void try_connect(PurpleProxyConnectData *connect_data)
+static struct sockaddr *
+next_host(PurpleProxyConnectData *connect_data, socklen_t *addrlen)
 {
-	socklen_t addrlen;
 	struct sockaddr *addr;
 	char ipaddr[INET6_ADDRSTRLEN];
 
-	addrlen = GPOINTER_TO_INT(connect_data->hosts->data);
+	*addrlen = GPOINTER_TO_INT(connect_data->hosts->data);
 	connect_data->hosts = g_slist_remove(connect_data->hosts, connect_data->hosts->data);
 	addr = connect_data->hosts->data;
 	connect_data->hosts = g_slist_remove(connect_data->hosts, connect_data->hosts->data);
@@ -2159,39 +2023,336 @@ static void try_connect(PurpleProxyConnectData *connect_data)
 #endif
 	purple_debug_info("proxy", "Attempting connection to %s\n", ipaddr);
 
-	if (connect_data->socket_type == SOCK_DGRAM) {
-		proxy_connect_udp_none(connect_data, addr, addrlen);
-		g_free(addr);
+	return addr;
+}
+
+/**
+ * The host whose addresses are being raced: the proxy server if there
+ * is one, otherwise the host we were asked to connect to.
+ */
+static const char *
+get_connect_host(PurpleProxyConnectData *connect_data)
+{
+	if (connect_data->socket_type == SOCK_DGRAM ||
+			purple_proxy_info_get_type(connect_data->gpi) == PURPLE_PROXY_NONE)
+		return connect_data->host;
+
+	return purple_proxy_info_get_host(connect_data->gpi);
+}
+
+static int
+get_preferred_family(PurpleProxyConnectData *connect_data)
+{
+	gchar *key;
+	gpointer family = NULL;
+
+	if (preferred_families != NULL) {
+		key = g_ascii_strdown(get_connect_host(connect_data), -1);
+		family = g_hash_table_lookup(preferred_families, key);
+		g_free(key);
+	}
+
+	return family != NULL ? GPOINTER_TO_INT(family) : AF_INET6;
+}
+
+static void
+set_preferred_family(PurpleProxyConnectData *connect_data, int family)
+{
+	if (preferred_families == NULL)
 		return;
+
+	g_hash_table_replace(preferred_families,
+			g_ascii_strdown(get_connect_host(connect_data), -1),
+			GINT_TO_POINTER(family));
+}
+
+/**
+ * Reorder the list of length/address pairs so that the address families
+ * alternate, starting with the preferred one.  The resolver's order is
+ * otherwise kept.
+ */
+static GSList *
+interleave_hosts(GSList *hosts, int family)
+{
+	GSList *first = NULL, *second = NULL, *sorted = NULL;
+	gpointer len;
+	struct sockaddr *addr;
+
+	while (hosts != NULL) {
+		len = hosts->data;
+		hosts = g_slist_delete_link(hosts, hosts);
+		addr = hosts->data;
+		hosts = g_slist_delete_link(hosts, hosts);
+
+		if (addr->sa_family == family) {
+			first = g_slist_prepend(first, len);
+			first = g_slist_prepend(first, addr);
+		} else {
+			second = g_slist_prepend(second, len);
+			second = g_slist_prepend(second, addr);
+		}
 	}
 
+	first = g_slist_reverse(first);
+	second = g_slist_reverse(second);
+
+	while (first != NULL || second != NULL) {
+		if (first != NULL) {
+			sorted = g_slist_prepend(sorted, first->data);
+			first = g_slist_delete_link(first, first);
+			sorted = g_slist_prepend(sorted, first->data);
+			first = g_slist_delete_link(first, first);
+		}
+		if (second != NULL) {
+			sorted = g_slist_prepend(sorted, second->data);
+			second = g_slist_delete_link(second, second);
+			sorted = g_slist_prepend(sorted, second->data);
+			second = g_slist_delete_link(second, second);
+		}
+	}
+
+	/* The pairs are now address/length, backwards. */
+	return g_slist_reverse(sorted);
+}
+
+static void
+cancel_connect_attempts(PurpleProxyConnectData *connect_data)
+{
+	PurpleProxyConnectAttempt *attempt;
+
+	if (connect_data->attempt_timer > 0) {
+		purple_timeout_remove(connect_data->attempt_timer);
+		connect_data->attempt_timer = 0;
+	}
+
+	/*
+	 * The addresses of the attempts that were still going haven't been
+	 * given a fair chance, so they go back to the front of the list, in
+	 * the order they were started, in case the winner fails later on.
+	 */
+	while (connect_data->attempts != NULL) {
+		attempt = connect_data->attempts->data;
+		connect_data->attempts = g_slist_delete_link(connect_data->attempts,
+				connect_data->attempts);
+
+		purple_input_remove(attempt->inpa);
+		close(attempt->fd);
+		connect_data->hosts = g_slist_prepend(connect_data->hosts, attempt->addr);
+		connect_data->hosts = g_slist_prepend(connect_data->hosts,
+				GINT_TO_POINTER(attempt->addrlen));
+		g_free(attempt);
+	}
+}
+
+/**
+ * Called when the race has been won.  connect_data->fd is connected to
+ * either the host or the proxy server, so start talking to the proxy.
+ */
+static void
+proxy_connect_established(PurpleProxyConnectData *connect_data)
+{
 	switch (purple_proxy_info_get_type(connect_data->gpi)) {
 		case PURPLE_PROXY_NONE:
-			proxy_connect_none(connect_data, addr, addrlen);
+			purple_proxy_connect_data_connected(connect_data);
 			break;
 
 		case PURPLE_PROXY_HTTP:
-			proxy_connect_http(connect_data, addr, addrlen);
+		case PURPLE_PROXY_USE_ENVVAR:
+			http_canwrite(connect_data, connect_data->fd, PURPLE_INPUT_WRITE);
 			break;
 
 		case PURPLE_PROXY_SOCKS4:
-			proxy_connect_socks4(connect_data, addr, addrlen);
+			s4_canwrite(connect_data, connect_data->fd, PURPLE_INPUT_WRITE);
 			break;
 
 		case PURPLE_PROXY_SOCKS5:
 		case PURPLE_PROXY_TOR:
-			proxy_connect_socks5(connect_data, addr, addrlen);
+			s5_canwrite(connect_data, connect_data->fd, PURPLE_INPUT_WRITE);
 			break;
 
+		default:
+			break;
+	}
+}
+
+static void start_connect_attempt(PurpleProxyConnectData *connect_data);
+
+static void
+connect_attempt_ready_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+	PurpleProxyConnectAttempt *attempt = data;
+	PurpleProxyConnectData *connect_data = attempt->connect_data;
+	int error = 0;
+	int ret;
+
+	/* See socket_ready_cb() for why EINPROGRESS can show up here. */
+	ret = purple_input_get_error(attempt->fd, &error);
+
+	if (ret == 0 && error == EINPROGRESS)
+		return;
+
+	connect_data->attempts = g_slist_remove(connect_data->attempts, attempt);
+	purple_input_remove(attempt->inpa);
+
+	if (ret != 0 || error != 0) {
+		if (ret != 0)
+			error = errno;
+		purple_debug_error("proxy", "Error connecting to %s:%d (%s).\n",
+						connect_data->host, connect_data->port, g_strerror(error));
+
+		close(attempt->fd);
+		g_free(attempt->addr);
+		g_free(attempt);
+
+		/* Don't wait for the timer, try the next address right away. */
+		if (connect_data->hosts != NULL)
+			start_connect_attempt(connect_data);
+		else if (connect_data->attempts == NULL)
+			purple_proxy_connect_data_disconnect(connect_data, g_strerror(error));
+		return;
+	}
+
+	purple_debug_info("proxy", "Connection to %s won using %s.\n",
+			get_connect_host(connect_data),
+			attempt->family == AF_INET6 ? "IPv6" : "IPv4");
+
+	connect_data->fd = attempt->fd;
+	set_preferred_family(connect_data, attempt->family);
+	g_free(attempt->addr);
+	g_free(attempt);
+
+	/* We have a winner.  Stop the rest of the race. */
+	cancel_connect_attempts(connect_data);
+
+	proxy_connect_established(connect_data);
+}
+
+static gboolean
+connect_attempt_delay_cb(gpointer data)
+{
+	PurpleProxyConnectData *connect_data = data;
+
+	connect_data->attempt_timer = 0;
+	start_connect_attempt(connect_data);
+
+	return FALSE;
+}
+
+static void
+start_connect_attempt(PurpleProxyConnectData *connect_data)
+{
+	PurpleProxyConnectAttempt *attempt;
+	struct sockaddr *addr;
+	socklen_t addrlen;
+	gchar *error_message = NULL;
+	int fd;
+
+	if (connect_data->attempt_timer > 0) {
+		purple_timeout_remove(connect_data->attempt_timer);
+		connect_data->attempt_timer = 0;
+	}
+
+	while (connect_data->hosts != NULL) {
+		addr = next_host(connect_data, &addrlen);
+
+		fd = socket(addr->sa_family, SOCK_STREAM, 0);
+		if (fd < 0) {
+			g_free(error_message);
+			error_message = g_strdup_printf(_("Unable to create socket: %s"),
+					g_strerror(errno));
+			g_free(addr);
+			continue;
+		}
+		_purple_network_set_common_socket_flags(fd);
+
+		if (connect(fd, addr, addrlen) != 0 &&
+				errno != EINPROGRESS && errno != EINTR) {
+			g_free(error_message);
+			error_message = g_strdup(g_strerror(errno));
+			close(fd);
+			g_free(addr);
+			continue;
+		}
+
+		/*
+		 * Even if the connection happened immediately, wait for the
+		 * socket to become writable so we don't call back before
+		 * we return.
+		 */
+		attempt = g_new0(PurpleProxyConnectAttempt, 1);
+		attempt->connect_data = connect_data;
+		attempt->fd = fd;
+		attempt->family = addr->sa_family;
+		attempt->addr = addr;
+		attempt->addrlen = addrlen;
+		attempt->inpa = purple_input_add(fd, PURPLE_INPUT_WRITE,
+				connect_attempt_ready_cb, attempt);
+		connect_data->attempts = g_slist_prepend(connect_data->attempts, attempt);
+
+		if (connect_data->hosts != NULL)
+			connect_data->attempt_timer = purple_timeout_add(CONNECTION_ATTEMPT_DELAY,
+					connect_attempt_delay_cb, connect_data);
+
+		g_free(error_message);
+		return;
+	}
+
+	/* Every address we had left failed before it got going. */
+	if (connect_data->attempts == NULL)
+		purple_proxy_connect_data_disconnect(connect_data,
+				error_message ? error_message : _("Unable to connect"));
+	g_free(error_message);
+}
+
+static void try_connect(PurpleProxyConnectData *connect_data)
+{
+	socklen_t addrlen;
+	struct sockaddr *addr;
+
+	if (connect_data->socket_type == SOCK_DGRAM) {
+		addr = next_host(connect_data, &addrlen);
+		proxy_connect_udp_none(connect_data, addr, addrlen);
+		g_free(addr);
+		return;
+	}
+
+	switch (purple_proxy_info_get_type(connect_data->gpi)) {
+		case PURPLE_PROXY_NONE:
+			purple_debug_info("proxy", "Connecting to %s:%d with no proxy\n",
+					connect_data->host, connect_data->port);
+			break;
+
+		case PURPLE_PROXY_HTTP:
 		case PURPLE_PROXY_USE_ENVVAR:
-			proxy_connect_http(connect_data, addr, addrlen);
+			purple_debug_info("proxy",
+					   "Connecting to %s:%d via %s:%d using HTTP\n",
+					   connect_data->host, connect_data->port,
+					   (purple_proxy_info_get_host(connect_data->gpi) ? purple_proxy_info_get_host(connect_data->gpi) : "(null)"),
+					   purple_proxy_info_get_port(connect_data->gpi));
+			break;
+
+		case PURPLE_PROXY_SOCKS4:
+			purple_debug_info("proxy",
+					   "Connecting to %s:%d via %s:%d using SOCKS4\n",
+					   connect_data->host, connect_data->port,
+					   purple_proxy_info_get_host(connect_data->gpi),
+					   purple_proxy_info_get_port(connect_data->gpi));
+			break;
+
+		case PURPLE_PROXY_SOCKS5:
+		case PURPLE_PROXY_TOR:
+			purple_debug_info("proxy",
+					   "Connecting to %s:%d via %s:%d using SOCKS5\n",
+					   connect_data->host, connect_data->port,
+					   purple_proxy_info_get_host(connect_data->gpi),
+					   purple_proxy_info_get_port(connect_data->gpi));
 			break;
 
 		default:
 			break;
 	}
 
-	g_free(addr);
+	start_connect_attempt(connect_data);
 }
 
 static void
@@ -2215,6 +2376,8 @@ connection_host_resolved(GSList *hosts, gpointer data,
 		return;
 	}
 
+	if (connect_data->socket_type == SOCK_STREAM)
+		hosts = interleave_hosts(hosts, get_preferred_family(connect_data));
 	connect_data->hosts = hosts;
 
 	try_connect(connect_data);
@@ -2615,6 +2778,9 @@ purple_proxy_init(void)
 	/* Initialize a default proxy info struct. */
 	global_proxy_info = purple_proxy_info_new();
 
+	preferred_families = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+
 	/* Proxy */
 	purple_prefs_add_none("/purple/proxy");
 	purple_prefs_add_string("/purple/proxy/type", "none");
@@ -2658,4 +2824,7 @@ purple_proxy_uninit(void)
 
 	purple_proxy_info_destroy(global_proxy_info);
 	global_proxy_info = NULL;
+
+	g_hash_table_destroy(preferred_families);
+	preferred_families = NULL;
 }
@@ -26,6 +26,9 @@
 #include "internal.h"
 
 #include "dbus-maybe.h"
+#ifdef HAVE_DBUS
+# include "dbus-bindings.h"
+#endif
 #include "debug.h"
 #include "signals.h"
 #include "value.h"
@@ -44,9 +47,12 @@ typedef struct
 
 } PurpleInstanceData;
 
+typedef struct _PurpleSignalHandlerData PurpleSignalHandlerData;
+
 typedef struct
 {
 	gulong id;
+	const char *name;
 
 	PurpleSignalMarshalFunc marshal;
 
@@ -58,9 +64,27 @@ typedef struct
 	size_t handler_count;
 
 	gulong next_handler_id;
+
+	/*
+	 * The handlers in priority order, NULL-terminated, or NULL if nothing
+	 * is connected.  This is what emission walks, so it is rebuilt on
+	 * every connect and disconnect rather than on every emit.
+	 */
+	PurpleSignalHandlerData **handler_array;
+
+	/* Emissions of this signal currently on the stack. */
+	guint emitting;
+
+	/*
+	 * Handlers and handler arrays that were dropped while an emission
+	 * was still walking them.  Freed once the last emission returns.
+	 */
+	GSList *dead;
+
+	gboolean dbus;
 } PurpleSignalData;
 
-typedef struct
+struct _PurpleSignalHandlerData
 {
 	gulong id;
 	PurpleCallback cb;
@@ -69,10 +93,16 @@ typedef struct
 	gboolean use_vargs;
 	int priority;
 
-} PurpleSignalHandlerData;
+};
 
 static GHashTable *instance_table = NULL;
 
+/*
+ * Every registered signal, indexed by its ID.  IDs are never reused, so
+ * a stale ID finds a NULL slot rather than somebody else's signal.
+ */
+static GPtrArray *signal_table = NULL;
+
 static void
 destroy_instance_data(PurpleInstanceData *instance_data)
 {
@@ -84,8 +114,13 @@ destroy_instance_data(PurpleInstanceData *instance_data)
 static void
 destroy_signal_data(PurpleSignalData *signal_data)
 {
+	g_ptr_array_index(signal_table, signal_data->id) = NULL;
+
 	g_list_foreach(signal_data->handlers, (GFunc)g_free, NULL);
 	g_list_free(signal_data->handlers);
+	g_free(signal_data->handler_array);
+	g_slist_foreach(signal_data->dead, (GFunc)g_free, NULL);
+	g_slist_free(signal_data->dead);
 
 	if (signal_data->values != NULL)
 	{
@@ -133,7 +168,8 @@ purple_signal_register(void *instance, const char *signal,
 	}
 
 	signal_data = g_new0(PurpleSignalData, 1);
-	signal_data->id              = instance_data->next_signal_id;
+	signal_data->id              = signal_table->len;
+	signal_data->name            = g_strdup(signal);
 	signal_data->marshal         = marshal;
 	signal_data->next_handler_id = 1;
 	signal_data->ret_value       = ret_value;
@@ -153,8 +189,15 @@ purple_signal_register(void *instance, const char *signal,
 		va_end(args);
 	}
 
+	/*
+	 * This is a hack that keeps our "dbus-method-called" signal from
+	 * being propagated to dbus.
+	 */
+	signal_data->dbus = (strcmp(signal, "dbus-method-called") != 0);
+
 	g_hash_table_insert(instance_data->signals,
-						g_strdup(signal), signal_data);
+						(char *)signal_data->name, signal_data);
+	g_ptr_array_add(signal_table, signal_data);
 
 	instance_data->next_signal_id++;
 	instance_data->signal_count++;
@@ -234,6 +277,56 @@ purple_signal_get_values(void *instance, const char *signal,
 		*ret_value = signal_data->ret_value;
 }
 
+/*
+ * Rebuilds the array emission walks after the handler list has changed.
+ * An emission in progress keeps walking the old array, so that is not
+ * freed until it has returned.
+ */
+static void
+handlers_changed(PurpleSignalData *signal_data)
+{
+	PurpleSignalHandlerData **array = NULL;
+
+	if (signal_data->handler_count > 0)
+	{
+		GList *l;
+		size_t i = 0;
+
+		array = g_new(PurpleSignalHandlerData *,
+		              signal_data->handler_count + 1);
+
+		for (l = signal_data->handlers; l != NULL; l = l->next)
+			array[i++] = l->data;
+
+		array[i] = NULL;
+	}
+
+	if (signal_data->handler_array != NULL)
+	{
+		if (signal_data->emitting > 0)
+			signal_data->dead = g_slist_prepend(signal_data->dead,
+			                                    signal_data->handler_array);
+		else
+			g_free(signal_data->handler_array);
+	}
+
+	signal_data->handler_array = array;
+}
+
+static void
+handler_free(PurpleSignalData *signal_data,
+             PurpleSignalHandlerData *handler_data)
+{
+	if (signal_data->emitting > 0)
+	{
+		/* Tell the emission to skip this one. */
+		handler_data->cb = NULL;
+		signal_data->dead = g_slist_prepend(signal_data->dead, handler_data);
+	}
+	else
+		g_free(handler_data);
+}
+
 static gint handler_priority(void * a, void * b) {
 	PurpleSignalHandlerData *ah = (PurpleSignalHandlerData*)a;
 	PurpleSignalHandlerData *bh = (PurpleSignalHandlerData*)b;
@@ -291,6 +384,8 @@ signal_connect_common(void *instance, const char *signal, void *handle,
 	signal_data->handler_count++;
 	signal_data->next_handler_id++;
 
+	handlers_changed(signal_data);
+
 	return handler_data->id;
 }
 
@@ -361,11 +456,12 @@ purple_signal_disconnect(void *instance, const char *signal,
 
 		if (handler_data->handle == handle && handler_data->cb == func)
 		{
-			g_free(handler_data);
+			handler_free(signal_data, handler_data);
 
 			signal_data->handlers = g_list_delete_link(signal_data->handlers,
 												       l);
 			signal_data->handler_count--;
+			handlers_changed(signal_data);
 
 			found = TRUE;
 
@@ -387,6 +483,7 @@ disconnect_handle_from_signals(const char *signal,
 {
 	GList *l, *l_next;
 	PurpleSignalHandlerData *handler_data;
+	gboolean found = FALSE;
 
 	for (l = signal_data->handlers; l != NULL; l = l_next)
 	{
@@ -395,13 +492,17 @@ disconnect_handle_from_signals(const char *signal,
 
 		if (handler_data->handle == handle)
 		{
-			g_free(handler_data);
+			handler_free(signal_data, handler_data);
 
 			signal_data->handler_count--;
 			signal_data->handlers = g_list_delete_link(signal_data->handlers,
 			                                           l);
+			found = TRUE;
 		}
 	}
+
+	if (found)
+		handlers_changed(signal_data);
 }
 
 static void
@@ -422,35 +523,16 @@ purple_signals_disconnect_by_handle(void *handle)
 						 (GHFunc)disconnect_handle_from_instance, handle);
 }
 
-void
-purple_signal_emit(void *instance, const char *signal, ...)
-{
-	va_list args;
-
-	g_return_if_fail(instance != NULL);
-	g_return_if_fail(signal   != NULL);
-
-	va_start(args, signal);
-	purple_signal_emit_vargs(instance, signal, args);
-	va_end(args);
-}
-
-void
-purple_signal_emit_vargs(void *instance, const char *signal, va_list args)
+static PurpleSignalData *
+signal_lookup(void *instance, const char *signal)
 {
 	PurpleInstanceData *instance_data;
 	PurpleSignalData *signal_data;
-	PurpleSignalHandlerData *handler_data;
-	GList *l, *l_next;
-	va_list tmp;
-
-	g_return_if_fail(instance != NULL);
-	g_return_if_fail(signal   != NULL);
 
 	instance_data =
 		(PurpleInstanceData *)g_hash_table_lookup(instance_table, instance);
 
-	g_return_if_fail(instance_data != NULL);
+	g_return_val_if_fail(instance_data != NULL, NULL);
 
 	signal_data =
 		(PurpleSignalData *)g_hash_table_lookup(instance_data->signals, signal);
@@ -459,51 +541,210 @@ purple_signal_emit_vargs(void *instance, const char *signal, va_list args)
 	{
 		purple_debug(PURPLE_DEBUG_ERROR, "signals",
 				   "Signal data for %s not found!\n", signal);
-		return;
 	}
 
-	for (l = signal_data->handlers; l != NULL; l = l_next)
+	return signal_data;
+}
+
+static PurpleSignalData *
+signal_lookup_by_id(gulong signal_id)
+{
+	PurpleSignalData *signal_data = NULL;
+
+	if (signal_id < signal_table->len)
+		signal_data = g_ptr_array_index(signal_table, signal_id);
+
+	if (signal_data == NULL)
 	{
-		l_next = l->next;
+		purple_debug(PURPLE_DEBUG_ERROR, "signals",
+				   "Signal data for ID %lu not found!\n", signal_id);
+	}
 
-		handler_data = (PurpleSignalHandlerData *)l->data;
+	return signal_data;
+}
+
+/*
+ * Whether emitting this signal would do anything at all.  When it
+ * wouldn't, callers return before touching the arguments.
+ */
+static gboolean
+signal_is_live(PurpleSignalData *signal_data)
+{
+	if (signal_data->handler_array != NULL)
+		return TRUE;
+
+#ifdef HAVE_DBUS
+	if (signal_data->dbus && purple_dbus_get_connection() != NULL)
+		return TRUE;
+#endif	/* HAVE_DBUS */
+
+	return FALSE;
+}
+
+static void
+signal_emission_done(PurpleSignalData *signal_data)
+{
+	signal_data->emitting--;
+
+	if (signal_data->emitting == 0 && signal_data->dead != NULL)
+	{
+		g_slist_foreach(signal_data->dead, (GFunc)g_free, NULL);
+		g_slist_free(signal_data->dead);
+		signal_data->dead = NULL;
+	}
+}
 
-		/* This is necessary because a va_list may only be
-		 * evaluated once */
+static void
+signal_emit(PurpleSignalData *signal_data, va_list args)
+{
+	PurpleSignalHandlerData **handlers;
+	PurpleSignalHandlerData *handler_data;
+	va_list tmp;
+
+	handlers = signal_data->handler_array;
+
+	if (handlers != NULL)
+	{
+		signal_data->emitting++;
+
+		for (; (handler_data = *handlers) != NULL; handlers++)
+		{
+			/* Disconnected by an earlier handler. */
+			if (handler_data->cb == NULL)
+				continue;
+
+			/* This is necessary because a va_list may only be
+			 * evaluated once */
+			G_VA_COPY(tmp, args);
+
+			if (handler_data->use_vargs)
+			{
+				((void (*)(va_list, void *))handler_data->cb)(tmp,
+															  handler_data->data);
+			}
+			else
+			{
+				signal_data->marshal(handler_data->cb, tmp,
+									 handler_data->data, NULL);
+			}
+
+			va_end(tmp);
+		}
+
+		signal_emission_done(signal_data);
+	}
+
+#ifdef HAVE_DBUS
+	if (signal_data->dbus)
+		purple_dbus_signal_emit_purple(signal_data->name,
+				   signal_data->num_values, signal_data->values, args);
+#endif	/* HAVE_DBUS */
+}
+
+static void *
+signal_emit_return_1(PurpleSignalData *signal_data, va_list args)
+{
+	PurpleSignalHandlerData **handlers;
+	PurpleSignalHandlerData *handler_data;
+	void *ret_val = NULL;
+	va_list tmp;
+
+#ifdef HAVE_DBUS
+	if (signal_data->dbus)
+	{
 		G_VA_COPY(tmp, args);
+		purple_dbus_signal_emit_purple(signal_data->name,
+				   signal_data->num_values, signal_data->values, tmp);
+		va_end(tmp);
+	}
+#endif	/* HAVE_DBUS */
+
+	handlers = signal_data->handler_array;
+
+	if (handlers == NULL)
+		return NULL;
+
+	signal_data->emitting++;
+
+	for (; (handler_data = *handlers) != NULL; handlers++)
+	{
+		if (handler_data->cb == NULL)
+			continue;
 
+		G_VA_COPY(tmp, args);
 		if (handler_data->use_vargs)
 		{
-			((void (*)(va_list, void *))handler_data->cb)(tmp,
-														  handler_data->data);
+			ret_val = ((void *(*)(va_list, void *))handler_data->cb)(
+				tmp, handler_data->data);
 		}
 		else
 		{
 			signal_data->marshal(handler_data->cb, tmp,
-								 handler_data->data, NULL);
+								 handler_data->data, &ret_val);
 		}
-
 		va_end(tmp);
+
+		if (ret_val != NULL)
+			break;
 	}
 
-#ifdef HAVE_DBUS
-	purple_dbus_signal_emit_purple(signal, signal_data->num_values,
-				   signal_data->values, args);
-#endif	/* HAVE_DBUS */
+	signal_emission_done(signal_data);
+
+	return ret_val;
+}
+
+void
+purple_signal_emit(void *instance, const char *signal, ...)
+{
+	PurpleSignalData *signal_data;
+	va_list args;
+
+	g_return_if_fail(instance != NULL);
+	g_return_if_fail(signal   != NULL);
+
+	signal_data = signal_lookup(instance, signal);
+
+	if (signal_data == NULL || !signal_is_live(signal_data))
+		return;
 
+	va_start(args, signal);
+	signal_emit(signal_data, args);
+	va_end(args);
+}
+
+void
+purple_signal_emit_vargs(void *instance, const char *signal, va_list args)
+{
+	PurpleSignalData *signal_data;
+
+	g_return_if_fail(instance != NULL);
+	g_return_if_fail(signal   != NULL);
+
+	signal_data = signal_lookup(instance, signal);
+
+	if (signal_data == NULL)
+		return;
+
+	signal_emit(signal_data, args);
 }
 
 void *
 purple_signal_emit_return_1(void *instance, const char *signal, ...)
 {
+	PurpleSignalData *signal_data;
 	void *ret_val;
 	va_list args;
 
 	g_return_val_if_fail(instance != NULL, NULL);
 	g_return_val_if_fail(signal   != NULL, NULL);
 
+	signal_data = signal_lookup(instance, signal);
+
+	if (signal_data == NULL || !signal_is_live(signal_data))
+		return NULL;
+
 	va_start(args, signal);
-	ret_val = purple_signal_emit_vargs_return_1(instance, signal, args);
+	ret_val = signal_emit_return_1(signal_data, args);
 	va_end(args);
 
 	return ret_val;
@@ -513,63 +754,98 @@ void *
 purple_signal_emit_vargs_return_1(void *instance, const char *signal,
 								va_list args)
 {
-	PurpleInstanceData *instance_data;
 	PurpleSignalData *signal_data;
-	PurpleSignalHandlerData *handler_data;
-	GList *l, *l_next;
-	va_list tmp;
 
 	g_return_val_if_fail(instance != NULL, NULL);
 	g_return_val_if_fail(signal   != NULL, NULL);
 
-	instance_data =
-		(PurpleInstanceData *)g_hash_table_lookup(instance_table, instance);
+	signal_data = signal_lookup(instance, signal);
 
-	g_return_val_if_fail(instance_data != NULL, NULL);
+	if (signal_data == NULL)
+		return NULL;
 
-	signal_data =
-		(PurpleSignalData *)g_hash_table_lookup(instance_data->signals, signal);
+	return signal_emit_return_1(signal_data, args);
+}
+
+void
+purple_signal_emit_by_id(gulong signal_id, ...)
+{
+	PurpleSignalData *signal_data;
+	va_list args;
+
+	g_return_if_fail(signal_id != 0);
+
+	signal_data = signal_lookup_by_id(signal_id);
+
+	if (signal_data == NULL || !signal_is_live(signal_data))
+		return;
+
+	va_start(args, signal_id);
+	signal_emit(signal_data, args);
+	va_end(args);
+}
+
+void
+purple_signal_emit_by_id_vargs(gulong signal_id, va_list args)
+{
+	PurpleSignalData *signal_data;
+
+	g_return_if_fail(signal_id != 0);
+
+	signal_data = signal_lookup_by_id(signal_id);
 
 	if (signal_data == NULL)
-	{
-		purple_debug(PURPLE_DEBUG_ERROR, "signals",
-				   "Signal data for %s not found!\n", signal);
-		return 0;
-	}
+		return;
 
-#ifdef HAVE_DBUS
-	G_VA_COPY(tmp, args);
-	purple_dbus_signal_emit_purple(signal, signal_data->num_values,
-				   signal_data->values, tmp);
-	va_end(tmp);
-#endif	/* HAVE_DBUS */
+	signal_emit(signal_data, args);
+}
 
-	for (l = signal_data->handlers; l != NULL; l = l_next)
-	{
-		void *ret_val = NULL;
+void *
+purple_signal_emit_by_id_return_1(gulong signal_id, ...)
+{
+	PurpleSignalData *signal_data;
+	void *ret_val;
+	va_list args;
 
-		l_next = l->next;
+	g_return_val_if_fail(signal_id != 0, NULL);
 
-		handler_data = (PurpleSignalHandlerData *)l->data;
+	signal_data = signal_lookup_by_id(signal_id);
 
-		G_VA_COPY(tmp, args);
-		if (handler_data->use_vargs)
-		{
-			ret_val = ((void *(*)(va_list, void *))handler_data->cb)(
-				tmp, handler_data->data);
-		}
-		else
-		{
-			signal_data->marshal(handler_data->cb, tmp,
-								 handler_data->data, &ret_val);
-		}
-		va_end(tmp);
+	if (signal_data == NULL || !signal_is_live(signal_data))
+		return NULL;
 
-		if (ret_val != NULL)
-			return ret_val;
-	}
+	va_start(args, signal_id);
+	ret_val = signal_emit_return_1(signal_data, args);
+	va_end(args);
 
-	return NULL;
+	return ret_val;
+}
+
+void *
+purple_signal_emit_by_id_vargs_return_1(gulong signal_id, va_list args)
+{
+	PurpleSignalData *signal_data;
+
+	g_return_val_if_fail(signal_id != 0, NULL);
+
+	signal_data = signal_lookup_by_id(signal_id);
+
+	if (signal_data == NULL)
+		return NULL;
+
+	return signal_emit_return_1(signal_data, args);
+}
+
+gboolean
+purple_signal_has_handlers(gulong signal_id)
+{
+	PurpleSignalData *signal_data;
+
+	g_return_val_if_fail(signal_id != 0, FALSE);
+
+	signal_data = signal_lookup_by_id(signal_id);
+
+	return (signal_data != NULL && signal_data->handler_array != NULL);
 }
 
 void
@@ -580,6 +856,10 @@ purple_signals_init()
 	instance_table =
 		g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							  NULL, (GDestroyNotify)destroy_instance_data);
+
+	/* Signal IDs start at 1. */
+	signal_table = g_ptr_array_new();
+	g_ptr_array_add(signal_table, NULL);
 }
 
 void
@@ -589,6 +869,9 @@ purple_signals_uninit()
 
 	g_hash_table_destroy(instance_table);
 	instance_table = NULL;
+
+	g_ptr_array_free(signal_table, TRUE);
+	signal_table = NULL;
 }
 
 /**************************************************************************
@@ -74,8 +74,10 @@ extern "C" {
  * @param num_values The number of values to be passed to the callbacks.
  * @param ...        The values to pass to the callbacks.
  *
- * @return The signal ID local to that instance, or 0 if the signal
- *         couldn't be registered.
+ * @return The signal ID, or 0 if the signal couldn't be registered.
+ *         The ID is unique across all instances and is never reused, so
+ *         it can be kept and passed to purple_signal_emit_by_id() for as
+ *         long as the signal stays registered.
  *
  * @see PurpleValue
  */
@@ -274,6 +276,74 @@ void *purple_signal_emit_return_1(void *instance, const char *signal, ...);
 void *purple_signal_emit_vargs_return_1(void *instance, const char *signal,
 									  va_list args);
 
+/**
+ * Emits a signal by the ID purple_signal_register() returned for it.
+ *
+ * This skips looking up the instance and signal names, which makes it
+ * the better choice for signals that fire on every message.
+ *
+ * @param signal_id The ID of the signal being emitted.
+ *
+ * @see purple_signal_emit()
+ * @since 2.11.0
+ */
+void purple_signal_emit_by_id(gulong signal_id, ...);
+
+/**
+ * Emits a signal by its ID, using a va_list of arguments.
+ *
+ * @param signal_id The ID of the signal being emitted.
+ * @param args      The arguments list.
+ *
+ * @see purple_signal_emit_vargs()
+ * @since 2.11.0
+ */
+void purple_signal_emit_by_id_vargs(gulong signal_id, va_list args);
+
+/**
+ * Emits a signal by its ID and returns the first non-NULL return value.
+ *
+ * Further signal handlers are NOT called after a handler returns
+ * something other than NULL.
+ *
+ * @param signal_id The ID of the signal being emitted.
+ *
+ * @return The first non-NULL return value
+ *
+ * @see purple_signal_emit_return_1()
+ * @since 2.11.0
+ */
+void *purple_signal_emit_by_id_return_1(gulong signal_id, ...);
+
+/**
+ * Emits a signal by its ID, using a va_list of arguments, and returns
+ * the first non-NULL return value.
+ *
+ * @param signal_id The ID of the signal being emitted.
+ * @param args      The arguments list.
+ *
+ * @return The first non-NULL return value
+ *
+ * @see purple_signal_emit_vargs_return_1()
+ * @since 2.11.0
+ */
+void *purple_signal_emit_by_id_vargs_return_1(gulong signal_id, va_list args);
+
+/**
+ * Returns whether any handlers are connected to a signal.
+ *
+ * Emitters can use this to avoid building arguments nobody will see.
+ * Note that a signal with no handlers may still be sent out over D-Bus
+ * when it is emitted.
+ *
+ * @param signal_id The ID of the signal.
+ *
+ * @return @c TRUE if at least one handler is connected.
+ *
+ * @since 2.11.0
+ */
+gboolean purple_signal_has_handlers(gulong signal_id);
+
 /**
  * Initializes the signals subsystem.
  */
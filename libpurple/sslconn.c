@@ -29,12 +29,214 @@
 
 #include "certificate.h"
 #include "debug.h"
+#include "prefs.h"
 #include "request.h"
 #include "sslconn.h"
+#include "util.h"
+#include "xmlnode.h"
+
+/* The number of hosts to remember sessions for. */
+#define SSL_SESSION_CACHE_SIZE 64
+/* Servers rarely keep sessions around longer than this. */
+#define SSL_SESSION_MAX_AGE (24 * 60 * 60)
 
 static gboolean _ssl_initialized = FALSE;
 static PurpleSslOps *_ssl_ops = NULL;
 
+/*
+ * A session the SSL backend handed us after a successful handshake, in
+ * whatever form the backend can resume it from.
+ */
+typedef struct
+{
+	char *key;          /* host:port */
+	guchar *data;
+	gsize len;
+	time_t expires;
+	GList *link;        /* Our node in session_lru. */
+} PurpleSslSession;
+
+/* host:port => PurpleSslSession */
+static GHashTable *sessions = NULL;
+/* Most recently used first. */
+static GQueue session_lru = G_QUEUE_INIT;
+static guint save_timer = 0;
+
+static void *
+ssl_get_handle(void)
+{
+	static int handle;
+
+	return &handle;
+}
+
+static char *
+session_key(PurpleSslConnection *gsc)
+{
+	if (gsc->host == NULL)
+		return NULL;
+
+	return g_strdup_printf("%s:%d", gsc->host, gsc->port);
+}
+
+static void
+session_free(PurpleSslSession *session)
+{
+	/* These are as good as the keys to the connection. */
+	memset(session->data, 0, session->len);
+
+	g_free(session->key);
+	g_free(session->data);
+	g_free(session);
+}
+
+static void
+session_remove(PurpleSslSession *session)
+{
+	g_queue_delete_link(&session_lru, session->link);
+	g_hash_table_remove(sessions, session->key);
+}
+
+static void
+session_add(char *key, guchar *data, gsize len, time_t expires)
+{
+	PurpleSslSession *session;
+
+	if ((session = g_hash_table_lookup(sessions, key)) != NULL)
+		session_remove(session);
+
+	while (g_queue_get_length(&session_lru) >= SSL_SESSION_CACHE_SIZE)
+		session_remove(g_queue_peek_tail(&session_lru));
+
+	session = g_new0(PurpleSslSession, 1);
+	session->key = key;
+	session->data = data;
+	session->len = len;
+	session->expires = expires;
+
+	g_queue_push_head(&session_lru, session);
+	session->link = g_queue_peek_head_link(&session_lru);
+	g_hash_table_insert(sessions, session->key, session);
+}
+
+static void
+sync_sessions(void)
+{
+	xmlnode *root;
+	GList *l;
+	char *data;
+
+	root = xmlnode_new("ssl-sessions");
+	xmlnode_set_attrib(root, "version", "1.0");
+
+	/* Oldest first, so they're read back in the same order. */
+	for (l = g_queue_peek_tail_link(&session_lru); l != NULL; l = l->prev) {
+		PurpleSslSession *session = l->data;
+		xmlnode *node;
+		char *tmp;
+
+		node = xmlnode_new_child(root, "session");
+		xmlnode_set_attrib(node, "host", session->key);
+		tmp = g_strdup_printf("%" G_GINT64_FORMAT, (gint64)session->expires);
+		xmlnode_set_attrib(node, "expires", tmp);
+		g_free(tmp);
+
+		tmp = purple_base64_encode(session->data, session->len);
+		xmlnode_insert_data(node, tmp, -1);
+		g_free(tmp);
+	}
+
+	data = xmlnode_to_formatted_str(root, NULL);
+	purple_util_write_data_to_file("ssl-sessions.xml", data, -1);
+	g_free(data);
+	xmlnode_free(root);
+}
+
+static gboolean
+save_cb(gpointer data)
+{
+	sync_sessions();
+	save_timer = 0;
+	return FALSE;
+}
+
+static void
+schedule_sessions_save(void)
+{
+	if (!purple_prefs_get_bool("/purple/ssl/persist_sessions"))
+		return;
+
+	if (save_timer == 0)
+		save_timer = purple_timeout_add_seconds(5, save_cb, NULL);
+}
+
+static void
+load_sessions(void)
+{
+	xmlnode *root, *node;
+	time_t now = time(NULL);
+
+	root = purple_util_read_xml_from_file("ssl-sessions.xml", _("SSL sessions"));
+
+	if (root == NULL)
+		return;
+
+	for (node = xmlnode_get_child(root, "session"); node != NULL;
+			node = xmlnode_get_next_twin(node))
+	{
+		const char *host = xmlnode_get_attrib(node, "host");
+		const char *expires_str = xmlnode_get_attrib(node, "expires");
+		time_t expires;
+		char *tmp;
+		guchar *data;
+		gsize len;
+
+		if (host == NULL || expires_str == NULL)
+			continue;
+
+		expires = (time_t)g_ascii_strtoll(expires_str, NULL, 10);
+		if (expires <= now)
+			continue;
+
+		tmp = xmlnode_get_data(node);
+		if (tmp == NULL)
+			continue;
+
+		data = purple_base64_decode(tmp, &len);
+		g_free(tmp);
+
+		if (data == NULL || len == 0) {
+			g_free(data);
+			continue;
+		}
+
+		session_add(g_strdup(host), data, len, expires);
+	}
+
+	xmlnode_free(root);
+}
+
+static void
+persist_sessions_pref_cb(const char *name, PurplePrefType type,
+		gconstpointer val, gpointer data)
+{
+	char *filename;
+
+	if (GPOINTER_TO_INT(val)) {
+		schedule_sessions_save();
+		return;
+	}
+
+	if (save_timer != 0) {
+		purple_timeout_remove(save_timer);
+		save_timer = 0;
+	}
+
+	filename = g_build_filename(purple_user_dir(), "ssl-sessions.xml", NULL);
+	g_unlink(filename);
+	g_free(filename);
+}
+
 static gboolean
 ssl_init(void)
 {
@@ -284,6 +486,75 @@ purple_ssl_write(PurpleSslConnection *gsc, const void *data, size_t len)
 	return (ops->write)(gsc, data, len);
 }
 
+gconstpointer
+purple_ssl_session_lookup(PurpleSslConnection *gsc, gsize *len)
+{
+	PurpleSslSession *session;
+	char *key;
+
+	g_return_val_if_fail(gsc != NULL, NULL);
+	g_return_val_if_fail(len != NULL, NULL);
+
+	if (sessions == NULL || (key = session_key(gsc)) == NULL)
+		return NULL;
+
+	session = g_hash_table_lookup(sessions, key);
+	g_free(key);
+
+	if (session == NULL)
+		return NULL;
+
+	if (session->expires <= time(NULL)) {
+		session_remove(session);
+		schedule_sessions_save();
+		return NULL;
+	}
+
+	/* Move it to the front. */
+	g_queue_unlink(&session_lru, session->link);
+	g_queue_push_head_link(&session_lru, session->link);
+
+	purple_debug_info("sslconn", "Trying to resume session with %s\n",
+			session->key);
+
+	*len = session->len;
+	return session->data;
+}
+
+void
+purple_ssl_session_store(PurpleSslConnection *gsc, gconstpointer data, gsize len)
+{
+	char *key;
+
+	g_return_if_fail(gsc != NULL);
+	g_return_if_fail(data != NULL);
+
+	if (sessions == NULL || len == 0 || (key = session_key(gsc)) == NULL)
+		return;
+
+	session_add(key, g_memdup(data, len), len, time(NULL) + SSL_SESSION_MAX_AGE);
+	schedule_sessions_save();
+}
+
+void
+purple_ssl_session_forget(PurpleSslConnection *gsc)
+{
+	PurpleSslSession *session;
+	char *key;
+
+	g_return_if_fail(gsc != NULL);
+
+	if (sessions == NULL || (key = session_key(gsc)) == NULL)
+		return;
+
+	if ((session = g_hash_table_lookup(sessions, key)) != NULL) {
+		session_remove(session);
+		schedule_sessions_save();
+	}
+
+	g_free(key);
+}
+
 GList *
 purple_ssl_get_peer_certificates(PurpleSslConnection *gsc)
 {
@@ -310,6 +581,18 @@ purple_ssl_get_ops(void)
 void
 purple_ssl_init(void)
 {
+	purple_prefs_add_none("/purple/ssl");
+	purple_prefs_add_bool("/purple/ssl/persist_sessions", FALSE);
+
+	sessions = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+			(GDestroyNotify)session_free);
+
+	if (purple_prefs_get_bool("/purple/ssl/persist_sessions"))
+		load_sessions();
+
+	purple_prefs_connect_callback(ssl_get_handle(), "/purple/ssl/persist_sessions",
+			persist_sessions_pref_cb, NULL);
+
 	/* Although purple_ssl_is_supported will do the initialization on
 	   command, SSL plugins tend to register CertificateSchemes as well
 	   as providing SSL ops. */
@@ -323,6 +606,18 @@ purple_ssl_uninit(void)
 {
 	PurpleSslOps *ops;
 
+	purple_prefs_disconnect_by_handle(ssl_get_handle());
+
+	if (save_timer != 0) {
+		purple_timeout_remove(save_timer);
+		save_timer = 0;
+		sync_sessions();
+	}
+
+	g_queue_clear(&session_lru);
+	g_hash_table_destroy(sessions);
+	sessions = NULL;
+
 	if (!_ssl_initialized)
 		return;
 
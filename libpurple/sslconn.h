@@ -305,6 +305,56 @@ GList * purple_ssl_get_peer_certificates(PurpleSslConnection *gsc);
 
 /*@}*/
 
+/**************************************************************************/
+/** @name Session Cache API                                               */
+/**************************************************************************/
+/*@{*/
+
+/**
+ * Returns the session the last connection to the same host and port
+ * left behind, so the SSL backend can try to resume it rather than
+ * doing a full handshake.  This is meant to be called by SSL backends.
+ *
+ * If the /purple/ssl/persist_sessions preference is set, sessions are
+ * kept on disk and survive restarts.
+ *
+ * @param gsc The SSL connection handle.
+ * @param len Set to the length of the session data.
+ *
+ * @return The session data, as given to purple_ssl_session_store(), or
+ *         @c NULL if there is none.  It is owned by the cache and is only
+ *         valid until the next call to a session cache function.
+ *
+ * @since 2.11.0
+ */
+gconstpointer purple_ssl_session_lookup(PurpleSslConnection *gsc, gsize *len);
+
+/**
+ * Remembers a session for the connection's host and port, replacing
+ * any earlier one.  SSL backends call this once the peer has been
+ * verified.
+ *
+ * @param gsc  The SSL connection handle.
+ * @param data The session, in whatever form the backend resumes it from.
+ * @param len  The length of @a data.
+ *
+ * @since 2.11.0
+ */
+void purple_ssl_session_store(PurpleSslConnection *gsc, gconstpointer data, gsize len);
+
+/**
+ * Forgets the session remembered for the connection's host and port.
+ * SSL backends call this when a handshake fails, in case the session
+ * was the reason.
+ *
+ * @param gsc The SSL connection handle.
+ *
+ * @since 2.11.0
+ */
+void purple_ssl_session_forget(PurpleSslConnection *gsc);
+
+/*@}*/
+
 /**************************************************************************/
 /** @name Subsystem API                                                   */
 /**************************************************************************/
@@ -11,12 +11,54 @@
 /******************************************************************************
  * libpurple goodies
  *****************************************************************************/
+#define PURPLE_GLIB_READ_COND  (G_IO_IN | G_IO_HUP | G_IO_ERR)
+#define PURPLE_GLIB_WRITE_COND (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+typedef struct _PurpleCheckIOClosure {
+	PurpleInputFunction function;
+	gpointer data;
+} PurpleCheckIOClosure;
+
+static gboolean
+purple_check_io_invoke(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	PurpleCheckIOClosure *closure = data;
+	PurpleInputCondition purple_cond = 0;
+
+	if (condition & PURPLE_GLIB_READ_COND)
+		purple_cond |= PURPLE_INPUT_READ;
+	if (condition & PURPLE_GLIB_WRITE_COND)
+		purple_cond |= PURPLE_INPUT_WRITE;
+
+	closure->function(closure->data, g_io_channel_unix_get_fd(source),
+			  purple_cond);
+
+	return TRUE;
+}
+
 static guint
 purple_check_input_add(gint fd, PurpleInputCondition condition,
                      PurpleInputFunction function, gpointer data)
 {
-	/* this is a no-op for now, feel free to implement it */
-	return 0;
+	PurpleCheckIOClosure *closure = g_new0(PurpleCheckIOClosure, 1);
+	GIOChannel *channel;
+	GIOCondition cond = 0;
+	guint result;
+
+	closure->function = function;
+	closure->data = data;
+
+	if (condition & PURPLE_INPUT_READ)
+		cond |= PURPLE_GLIB_READ_COND;
+	if (condition & PURPLE_INPUT_WRITE)
+		cond |= PURPLE_GLIB_WRITE_COND;
+
+	channel = g_io_channel_unix_new(fd);
+	result = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond,
+			purple_check_io_invoke, closure, g_free);
+	g_io_channel_unref(channel);
+
+	return result;
 }
 
 static PurpleEventLoopUiOps eventloop_ui_ops = {
@@ -87,10 +129,14 @@ int main(void)
 	sr = srunner_create (master_suite());
 
 	srunner_add_suite(sr, cipher_suite());
+	srunner_add_suite(sr, ft_suite());
+	srunner_add_suite(sr, irc_parse_suite());
 	srunner_add_suite(sr, jabber_caps_suite());
 	srunner_add_suite(sr, jabber_digest_md5_suite());
 	srunner_add_suite(sr, jabber_jutil_suite());
+	srunner_add_suite(sr, jabber_mam_suite());
 	srunner_add_suite(sr, jabber_scram_suite());
+	srunner_add_suite(sr, jabber_websocket_suite());
 	srunner_add_suite(sr, oscar_util_suite());
 	srunner_add_suite(sr, yahoo_util_suite());
 	srunner_add_suite(sr, util_suite());
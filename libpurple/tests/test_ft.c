@@ -0,0 +1,283 @@
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "tests.h"
+#include "../ft.h"
+
+/*
+ * The default is small enough for every "make check".  Set PURPLE_FT_BENCH
+ * to send enough that the transfer buffers get to grow all the way.
+ */
+#define FT_TEST_SIZE  (1024 * 1024)
+#define FT_BENCH_SIZE (64 * 1024 * 1024)
+
+/* Same as FT_PROGRESS_INTERVAL in ft.c */
+#define FT_TEST_PROGRESS_INTERVAL 100
+
+/* Same as PURPLE_XFER_USE_SENDFILE in ft.c */
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+# define FT_TEST_SENDFILE
+#endif
+
+typedef struct {
+	GMainLoop *loop;
+	int running;
+	gboolean cancelled;
+	size_t sent;
+	size_t received;
+	int progress_calls;
+	double progress;
+	gboolean copied;       /* sendfile() gave up, and the data was copied */
+} FtBench;
+
+static FtBench bench;
+
+static void
+bench_end(PurpleXfer *xfer)
+{
+	if (purple_xfer_get_type(xfer) == PURPLE_XFER_SEND)
+		bench.sent = purple_xfer_get_bytes_sent(xfer);
+	else
+		bench.received = purple_xfer_get_bytes_sent(xfer);
+
+	if (--bench.running == 0)
+		g_main_loop_quit(bench.loop);
+}
+
+static void
+bench_cancel(PurpleXfer *xfer)
+{
+	bench.cancelled = TRUE;
+	g_main_loop_quit(bench.loop);
+}
+
+static void
+bench_update_progress(PurpleXfer *xfer, double percent)
+{
+	bench.progress_calls++;
+	bench.progress = percent;
+}
+
+static PurpleXferUiOps bench_ui_ops = {
+	NULL, /* new_xfer */
+	NULL, /* destroy */
+	NULL, /* add_xfer */
+	bench_update_progress,
+	NULL, /* cancel_local */
+	NULL, /* cancel_remote */
+	NULL, /* ui_write */
+	NULL, /* ui_read */
+	NULL, /* data_not_sent */
+	NULL  /* add_thumbnail */
+};
+
+/* ft.c only says it fell back from sendfile() in the debug log */
+static void
+bench_debug_print(PurpleDebugLevel level, const char *category,
+		const char *arg_s)
+{
+	if (purple_strequal(category, "xfer") &&
+			strstr(arg_s, "sendfile() is not supported") != NULL)
+		bench.copied = TRUE;
+}
+
+static PurpleDebugUiOps bench_debug_ui_ops = {
+	bench_debug_print,
+	NULL, /* is_enabled */
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+static PurpleXfer *
+bench_xfer_new(PurpleAccount *account, PurpleXferType type,
+		const char *filename, size_t size)
+{
+	PurpleXfer *xfer = purple_xfer_new(account, type, "bench");
+
+	purple_xfer_set_filename(xfer, "bench");
+	purple_xfer_set_local_filename(xfer, filename);
+	purple_xfer_set_size(xfer, size);
+	purple_xfer_set_end_fnc(xfer, bench_end);
+	if (type == PURPLE_XFER_SEND)
+		purple_xfer_set_cancel_send_fnc(xfer, bench_cancel);
+	else
+		purple_xfer_set_cancel_recv_fnc(xfer, bench_cancel);
+
+	/* purple_xfer_end() drops the reference purple_xfer_new() gave us,
+	 * keep one around so the results can be checked afterwards. */
+	purple_xfer_ref(xfer);
+
+	return xfer;
+}
+
+/*
+ * Sends a file to ourselves over a socketpair, through the same code that
+ * moves the data of the prpls that leave the socket to the core, and
+ * returns how long it took.  With append set, the sending socket gets
+ * O_APPEND, which sendfile() refuses with EINVAL.
+ */
+static gdouble
+ft_loopback(size_t size, gboolean append)
+{
+	PurpleAccount *account;
+	PurpleXfer *send, *recv;
+	PurpleDebugUiOps *debug_ui_ops;
+	gchar *src_path, *dest_path, *src, *dest;
+	gsize dest_len;
+	GTimer *timer;
+	gdouble elapsed;
+	int fds[2], fd;
+	size_t i;
+
+	src = g_malloc(size);
+	for (i = 0; i < size; i++)
+		src[i] = (i * 7) + (i >> 16);
+
+	fd = g_file_open_tmp("purple-ft-XXXXXX", &src_path, NULL);
+	fail_if(fd < 0, "Unable to create the file to send");
+	close(fd);
+	fail_unless(g_file_set_contents(src_path, src, size, NULL), NULL);
+
+	fd = g_file_open_tmp("purple-ft-XXXXXX", &dest_path, NULL);
+	fail_if(fd < 0, "Unable to create the file to receive");
+	close(fd);
+
+	fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, NULL);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK | (append ? O_APPEND : 0));
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	if (append)
+		fail_unless(fcntl(fds[0], F_GETFL) & O_APPEND, NULL);
+
+	account = purple_account_new("bench@localhost", "prpl-check");
+	send = bench_xfer_new(account, PURPLE_XFER_SEND, src_path, size);
+	recv = bench_xfer_new(account, PURPLE_XFER_RECEIVE, dest_path, size);
+
+	bench.loop = g_main_loop_new(NULL, FALSE);
+	bench.running = 2;
+
+	debug_ui_ops = purple_debug_get_ui_ops();
+	purple_debug_set_ui_ops(&bench_debug_ui_ops);
+
+	timer = g_timer_new();
+	purple_xfer_start(recv, fds[1], NULL, 0);
+	purple_xfer_start(send, fds[0], NULL, 0);
+	g_main_loop_run(bench.loop);
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+	g_main_loop_unref(bench.loop);
+
+	purple_debug_set_ui_ops(debug_ui_ops);
+
+	fail_if(bench.cancelled, "The transfer was cancelled");
+	fail_unless(bench.sent == size, NULL);
+	fail_unless(bench.received == size, NULL);
+	fail_unless(purple_xfer_is_completed(send), NULL);
+	fail_unless(purple_xfer_is_completed(recv), NULL);
+
+	fail_unless(g_file_get_contents(dest_path, &dest, &dest_len, NULL), NULL);
+	fail_unless(dest_len == size, "Expected %" G_GSIZE_FORMAT " bytes but got %"
+			G_GSIZE_FORMAT, (gsize)size, dest_len);
+	fail_unless(memcmp(src, dest, size) == 0,
+			"The received file is different");
+
+	purple_xfer_unref(send);
+	purple_xfer_unref(recv);
+	purple_account_destroy(account);
+
+	g_unlink(src_path);
+	g_unlink(dest_path);
+	g_free(src_path);
+	g_free(dest_path);
+	g_free(src);
+	g_free(dest);
+
+	return elapsed;
+}
+
+/*
+ * Reports how fast the transfer went with PURPLE_CHECK_DEBUG set.  Only
+ * sends the full FT_BENCH_SIZE when PURPLE_FT_BENCH is set.
+ */
+START_TEST(test_ft_loopback)
+{
+	size_t size = g_getenv("PURPLE_FT_BENCH") ? FT_BENCH_SIZE : FT_TEST_SIZE;
+	gdouble elapsed;
+
+	memset(&bench, 0, sizeof(bench));
+	elapsed = ft_loopback(size, FALSE);
+#ifdef FT_TEST_SENDFILE
+	fail_if(bench.copied, "sendfile() should work on a socket");
+#endif
+
+	purple_debug_info("ft-bench", "Transferred %.1f MiB in %.3f seconds: %.1f MiB/s\n",
+			size / 1048576.0, elapsed,
+			elapsed > 0 ? size / 1048576.0 / elapsed : 0.0);
+}
+END_TEST
+
+/* sendfile() fails with EINVAL, the data has to be copied instead */
+START_TEST(test_ft_sendfile_fallback)
+{
+	memset(&bench, 0, sizeof(bench));
+	ft_loopback(FT_TEST_SIZE, TRUE);
+#ifdef FT_TEST_SENDFILE
+	fail_unless(bench.copied, "Expected sendfile() to be given up on");
+#endif
+}
+END_TEST
+
+/*
+ * The UI only hears about the progress every FT_PROGRESS_INTERVAL, plus
+ * once when each side finishes.
+ */
+START_TEST(test_ft_progress)
+{
+	gdouble elapsed;
+	int limit;
+
+	memset(&bench, 0, sizeof(bench));
+	purple_xfers_set_ui_ops(&bench_ui_ops);
+	elapsed = ft_loopback(FT_TEST_SIZE, FALSE);
+	purple_xfers_set_ui_ops(NULL);
+
+	/* For each of the two transfers: the first chunk, one per interval
+	 * after that, and both purple_xfer_set_completed() and do_transfer()
+	 * telling it about the end. */
+	limit = 2 * ((int)(elapsed * 1000) / FT_TEST_PROGRESS_INTERVAL + 3);
+
+	fail_unless(bench.progress_calls >= 2, "Expected progress updates");
+	fail_unless(bench.progress_calls <= limit,
+			"Expected at most %d progress updates in %.3f seconds, got %d",
+			limit, elapsed, bench.progress_calls);
+	fail_unless(bench.progress == 1.0, "Expected the progress to end at 1.0, "
+			"got %f", bench.progress);
+}
+END_TEST
+
+Suite *
+ft_suite(void)
+{
+	Suite *s = suite_create("File Transfer");
+
+	TCase *tc = tcase_create("Loopback");
+	tcase_set_timeout(tc, 60);
+	tcase_add_test(tc, test_ft_loopback);
+	tcase_add_test(tc, test_ft_sendfile_fallback);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("Progress");
+	tcase_add_test(tc, test_ft_progress);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -0,0 +1,63 @@
+#include <string.h>
+
+#include "tests.h"
+#include "../protocols/irc/irc.h"
+
+START_TEST(test_irc_tag_unescape)
+{
+	assert_string_equal_free("", irc_tag_unescape(""));
+	assert_string_equal_free("plain", irc_tag_unescape("plain"));
+	assert_string_equal_free("a;b c\\d", irc_tag_unescape("a\\:b\\sc\\\\d"));
+	assert_string_equal_free("line\r\nbreak", irc_tag_unescape("line\\r\\nbreak"));
+
+	/* Other escaped characters stand for themselves */
+	assert_string_equal_free("xb", irc_tag_unescape("\\xb"));
+
+	/* A lone backslash at the end is dropped */
+	assert_string_equal_free("end", irc_tag_unescape("end\\"));
+}
+END_TEST
+
+START_TEST(test_irc_parse_tags)
+{
+	struct irc_conn irc;
+
+	memset(&irc, 0, sizeof(irc));
+	irc.tags = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	irc_parse_tags(&irc, "time=2019-01-01T12:00:00.123Z;msgid=abc\\:1;"
+			"+example.com/flag;;batch=ref=1;account=");
+
+	fail_unless(g_hash_table_size(irc.tags) == 5, NULL);
+	assert_string_equal("2019-01-01T12:00:00.123Z", irc_tag(&irc, "time"));
+	assert_string_equal("abc;1", irc_tag(&irc, "msgid"));
+	assert_string_equal("ref=1", irc_tag(&irc, "batch"));
+
+	/* Tags without a value, or with an empty one, are there but empty */
+	assert_string_equal("", irc_tag(&irc, "+example.com/flag"));
+	assert_string_equal("", irc_tag(&irc, "account"));
+	fail_unless(irc_tag(&irc, "label") == NULL, NULL);
+
+	/* A later tag of the same name wins */
+	g_hash_table_remove_all(irc.tags);
+	irc_parse_tags(&irc, "msgid=1;msgid=2");
+	assert_string_equal("2", irc_tag(&irc, "msgid"));
+
+	g_hash_table_destroy(irc.tags);
+}
+END_TEST
+
+Suite *irc_parse_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("IRC Parsing Functions");
+
+	tc = tcase_create("Message tags");
+	tcase_add_test(tc, test_irc_tag_unescape);
+	tcase_add_test(tc, test_irc_parse_tags);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -0,0 +1,236 @@
+#include <string.h>
+
+#include "tests.h"
+#include "../util.h"
+#include "../protocols/jabber/jabber.h"
+#include "../protocols/jabber/chat.h"
+#include "../protocols/jabber/iq.h"
+#include "../protocols/jabber/jutil.h"
+#include "../protocols/jabber/mam.h"
+#include "../protocols/jabber/namespaces.h"
+
+#define MAM_TEST_ROOM "room@conference.example.com"
+
+/*
+ * Just enough of a JabberStream for the archive code, which keeps the
+ * last stanza it sent.
+ */
+typedef struct {
+	PurpleAccount *account;
+	PurpleConnection *gc;
+	JabberStream *js;
+	JabberChat *chat;
+	xmlnode *sent;
+} MamTest;
+
+static MamTest mt;
+
+/* Stands in for the prpl, so jabber_send() has somewhere to go */
+static PurplePlugin mam_test_prpl;
+
+static void
+mam_test_sending_cb(PurpleConnection *gc, xmlnode **packet, gpointer data)
+{
+	if (mt.sent)
+		xmlnode_free(mt.sent);
+	mt.sent = xmlnode_copy(*packet);
+}
+
+static void
+mam_test_setup(void)
+{
+	memset(&mt, 0, sizeof(mt));
+
+	jabber_mam_init();
+
+	purple_signal_register(&mam_test_prpl, "jabber-sending-xmlnode",
+			purple_marshal_VOID__POINTER_POINTER, NULL, 2,
+			purple_value_new(PURPLE_TYPE_SUBTYPE, PURPLE_SUBTYPE_CONNECTION),
+			purple_value_new_outgoing(PURPLE_TYPE_SUBTYPE, PURPLE_SUBTYPE_XMLNODE));
+	purple_signal_connect(&mam_test_prpl, "jabber-sending-xmlnode",
+			&mt, PURPLE_CALLBACK(mam_test_sending_cb), NULL);
+
+	mt.account = purple_account_new("user@example.com", "prpl-jabber");
+	purple_account_set_bool(mt.account, "mam", TRUE);
+	mt.gc = g_new0(PurpleConnection, 1);
+	mt.gc->prpl = &mam_test_prpl;
+	mt.gc->account = mt.account;
+	mt.js = g_new0(JabberStream, 1);
+	mt.js->gc = mt.gc;
+	mt.js->fd = -1;
+	mt.js->user = jabber_id_new("user@example.com/test");
+	mt.js->iq_callbacks = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, (GDestroyNotify)jabber_iq_callbackdata_free);
+	mt.js->chats = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+	mt.js->mam = jabber_mam_new(mt.js);
+	mt.gc->proto_data = mt.js;
+
+	mt.chat = g_new0(JabberChat, 1);
+	mt.chat->js = mt.js;
+	mt.chat->room = g_strdup("room");
+	mt.chat->server = g_strdup("conference.example.com");
+	mt.chat->mam = TRUE;
+	mt.chat->mam_xmlns = NS_XMPP_MAM_2;
+	g_hash_table_insert(mt.js->chats, g_strdup(MAM_TEST_ROOM), mt.chat);
+
+	jabber_mam_room_discovered(mt.js, MAM_TEST_ROOM, TRUE);
+}
+
+static void
+mam_test_teardown(void)
+{
+	jabber_mam_free(mt.js->mam);
+	g_hash_table_destroy(mt.js->chats);
+	g_hash_table_destroy(mt.js->iq_callbacks);
+	jabber_id_free(mt.js->user);
+	g_free(mt.js);
+	g_free(mt.gc);
+	purple_account_destroy(mt.account);
+
+	g_free(mt.chat->room);
+	g_free(mt.chat->server);
+	g_free(mt.chat->mam_first);
+	g_free(mt.chat);
+
+	if (mt.sent)
+		xmlnode_free(mt.sent);
+
+	purple_signals_disconnect_by_handle(&mt);
+	purple_signals_unregister_by_instance(&mam_test_prpl);
+
+	/* Drop the cursors, so the next test starts afresh */
+	jabber_mam_uninit();
+}
+
+/* The RSM <set/> of the query that was sent last */
+static xmlnode *
+mam_test_sent_set(void)
+{
+	xmlnode *query;
+
+	fail_unless(mt.sent != NULL, "Nothing was sent");
+	assert_string_equal(MAM_TEST_ROOM, xmlnode_get_attrib(mt.sent, "to"));
+	query = xmlnode_get_child_with_namespace(mt.sent, "query", NS_XMPP_MAM_2);
+	fail_unless(query != NULL, NULL);
+
+	return xmlnode_get_child_with_namespace(query, "set", NS_RSM);
+}
+
+static const char *
+mam_test_sent_queryid(void)
+{
+	return xmlnode_get_attrib(xmlnode_get_child(mt.sent, "query"), "queryid");
+}
+
+/* Ends the query that was sent last */
+static void
+mam_test_fin(const char *first, const char *last)
+{
+	xmlnode *fin = xmlnode_new("fin");
+	xmlnode *set;
+
+	xmlnode_set_namespace(fin, NS_XMPP_MAM_2);
+	xmlnode_set_attrib(fin, "queryid", mam_test_sent_queryid());
+	xmlnode_set_attrib(fin, "complete", "true");
+	set = xmlnode_new_child(fin, "set");
+	xmlnode_set_namespace(set, NS_RSM);
+	if (first)
+		xmlnode_insert_data(xmlnode_new_child(set, "first"), first, -1);
+	if (last)
+		xmlnode_insert_data(xmlnode_new_child(set, "last"), last, -1);
+
+	jabber_mam_handle_fin(mt.js, fin);
+	xmlnode_free(fin);
+}
+
+static gboolean
+mam_test_result_is_backfill(void)
+{
+	xmlnode *result = xmlnode_new("result");
+	gboolean backfill;
+
+	xmlnode_set_attrib(result, "queryid", mam_test_sent_queryid());
+	backfill = jabber_mam_is_backfill(mt.js, result);
+	xmlnode_free(result);
+
+	return backfill;
+}
+
+START_TEST(test_mam_room_first_join)
+{
+	xmlnode *set, *before;
+
+	/* Never been here: the most recent page is all news */
+	fail_unless(jabber_mam_fetch_room(mt.js, mt.chat), NULL);
+	set = mam_test_sent_set();
+	fail_unless(set != NULL, NULL);
+	before = xmlnode_get_child(set, "before");
+	fail_unless(before != NULL, "Expected the last page");
+	fail_unless(xmlnode_get_data(before) == NULL, NULL);
+	fail_unless(xmlnode_get_child(set, "after") == NULL, NULL);
+	fail_if(mam_test_result_is_backfill(), NULL);
+
+	mam_test_fin("5", "9");
+	fail_unless(mt.chat->mam_synced, NULL);
+	assert_string_equal("5", mt.chat->mam_first);
+
+	/* Asking for more pages back from there, shown below the room */
+	fail_unless(jabber_mam_fetch_room(mt.js, mt.chat), NULL);
+	assert_string_equal_free("5",
+			xmlnode_get_data(xmlnode_get_child(mam_test_sent_set(), "before")));
+	fail_unless(mam_test_result_is_backfill(), NULL);
+}
+END_TEST
+
+START_TEST(test_mam_room_rejoin)
+{
+	xmlnode *packet, *sid, *set;
+
+	/* A message that was shown (and logged) live before we left */
+	packet = xmlnode_new("message");
+	xmlnode_set_attrib(packet, "type", "groupchat");
+	xmlnode_set_attrib(packet, "from", MAM_TEST_ROOM "/juliet");
+	sid = xmlnode_new_child(packet, "stanza-id");
+	xmlnode_set_namespace(sid, NS_STANZA_ID);
+	xmlnode_set_attrib(sid, "by", MAM_TEST_ROOM);
+	xmlnode_set_attrib(sid, "id", "live-1");
+	fail_unless(jabber_mam_handle_live(mt.js, packet, MAM_TEST_ROOM "/juliet",
+			time(NULL) - 60), NULL);
+	xmlnode_free(packet);
+
+	/* Coming back picks up after it, and what that brings is news */
+	fail_unless(jabber_mam_fetch_room(mt.js, mt.chat), NULL);
+	set = mam_test_sent_set();
+	fail_unless(set != NULL, NULL);
+	assert_string_equal_free("live-1",
+			xmlnode_get_data(xmlnode_get_child(set, "after")));
+	fail_unless(xmlnode_get_child(set, "before") == NULL,
+			"Asked for the last page instead of what came after the cursor");
+	fail_if(mam_test_result_is_backfill(), NULL);
+
+	mam_test_fin("live-2", "live-3");
+	fail_unless(mt.chat->mam_synced, NULL);
+	assert_string_equal("live-2", mt.chat->mam_first);
+
+	/* Anything further back was there before, so it goes below */
+	fail_unless(jabber_mam_fetch_room(mt.js, mt.chat), NULL);
+	assert_string_equal_free("live-2",
+			xmlnode_get_data(xmlnode_get_child(mam_test_sent_set(), "before")));
+	fail_unless(mam_test_result_is_backfill(), NULL);
+}
+END_TEST
+
+Suite *
+jabber_mam_suite(void)
+{
+	Suite *s = suite_create("Jabber Message Archive Management");
+
+	TCase *tc = tcase_create("Rooms");
+	tcase_add_checked_fixture(tc, mam_test_setup, mam_test_teardown);
+	tcase_add_test(tc, test_mam_room_first_join);
+	tcase_add_test(tc, test_mam_room_rejoin);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -0,0 +1,418 @@
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "tests.h"
+#include "../util.h"
+#include "../protocols/jabber/jabber.h"
+#include "../protocols/jabber/jutil.h"
+#include "../protocols/jabber/websocket.h"
+
+#define assert_frame_equal(buf, len, exp_fin, exp_opcode, exp_payload, exp_len) { \
+	const guchar *payload; \
+	gsize payload_len; \
+	gboolean fin; \
+	guint8 opcode; \
+	fail_unless(jabber_websocket_frame_parse((const guchar *)(buf), (len), \
+			&fin, &opcode, &payload, &payload_len) == (gssize)(len)); \
+	fail_unless(fin == (exp_fin)); \
+	fail_unless(opcode == (exp_opcode)); \
+	fail_unless(payload_len == (exp_len)); \
+	fail_unless(memcmp(payload, (exp_payload), (exp_len)) == 0); \
+}
+
+/*
+ * A WebSocket server on the loopback interface, and just enough of a
+ * JabberStream to connect to it.
+ */
+typedef struct {
+	GMainLoop *loop;
+	int listener;
+	int fd;
+	guint watch;
+	GString *buf;
+
+	PurpleAccount *account;
+	PurpleConnection *gc;
+	JabberStream *js;
+} WsTest;
+
+static WsTest wst;
+
+/* Any instance will do: nothing is connected to its signals */
+static PurplePlugin ws_test_prpl;
+
+static void
+ws_test_read_cb(gpointer data, gint fd, PurpleInputCondition cond)
+{
+	char buf[4096];
+	int len;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		g_string_append_len(wst.buf, buf, len);
+
+	g_main_loop_quit(wst.loop);
+}
+
+static void
+ws_test_accept_cb(gpointer data, gint fd, PurpleInputCondition cond)
+{
+	wst.fd = accept(wst.listener, NULL, NULL);
+	fail_if(wst.fd < 0, "Unable to accept the connection");
+	fcntl(wst.fd, F_SETFL, O_NONBLOCK);
+
+	purple_input_remove(wst.watch);
+	wst.watch = purple_input_add(wst.fd, PURPLE_INPUT_READ,
+			ws_test_read_cb, NULL);
+}
+
+/*
+ * Connects a JabberWebSocket to the test server.
+ *
+ * @return The Sec-WebSocket-Key of the handshake request.
+ */
+static char *
+ws_test_connect(void)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	char *url, *request, *key, *end;
+
+	memset(&wst, 0, sizeof(wst));
+	wst.loop = g_main_loop_new(NULL, FALSE);
+	wst.buf = g_string_new(NULL);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	wst.listener = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(wst.listener < 0, NULL);
+	fail_unless(bind(wst.listener, (struct sockaddr *)&addr, addrlen) == 0, NULL);
+	fail_unless(listen(wst.listener, 1) == 0, NULL);
+	fail_unless(getsockname(wst.listener, (struct sockaddr *)&addr, &addrlen) == 0, NULL);
+	wst.watch = purple_input_add(wst.listener, PURPLE_INPUT_READ,
+			ws_test_accept_cb, NULL);
+
+	wst.account = purple_account_new("user@example.com", "prpl-jabber");
+	wst.gc = g_new0(PurpleConnection, 1);
+	wst.gc->prpl = &ws_test_prpl;
+	wst.gc->account = wst.account;
+	wst.js = g_new0(JabberStream, 1);
+	wst.js->gc = wst.gc;
+	wst.js->fd = -1;
+	wst.js->user = jabber_id_new("user@example.com/test");
+	wst.gc->proto_data = wst.js;
+
+	url = g_strdup_printf("ws://127.0.0.1:%d/xmpp-websocket",
+			ntohs(addr.sin_port));
+	wst.js->websocket = jabber_websocket_new(wst.js, url);
+	g_free(url);
+	fail_unless(wst.js->websocket != NULL, NULL);
+	assert_string_equal("example.com", wst.js->serverFQDN);
+
+	jabber_websocket_connect(wst.js->websocket);
+
+	while ((end = strstr(wst.buf->str, "\r\n\r\n")) == NULL)
+		g_main_loop_run(wst.loop);
+
+	request = g_strndup(wst.buf->str, end - wst.buf->str + 4);
+	g_string_erase(wst.buf, 0, end - wst.buf->str + 4);
+
+	fail_unless(g_str_has_prefix(request, "GET /xmpp-websocket HTTP/1.1\r\n"),
+			"Unexpected request: %s", request);
+	fail_unless(strstr(request, "\r\nUpgrade: websocket\r\n") != NULL, NULL);
+	fail_unless(strstr(request, "\r\nConnection: Upgrade\r\n") != NULL, NULL);
+	fail_unless(strstr(request, "\r\nSec-WebSocket-Protocol: xmpp\r\n") != NULL, NULL);
+	fail_unless(strstr(request, "\r\nSec-WebSocket-Version: 13\r\n") != NULL, NULL);
+
+	key = strstr(request, "\r\nSec-WebSocket-Key: ");
+	fail_unless(key != NULL, "No Sec-WebSocket-Key in %s", request);
+	key += strlen("\r\nSec-WebSocket-Key: ");
+	key = g_strndup(key, strstr(key, "\r\n") - key);
+	g_free(request);
+
+	/* 16 random bytes, base64 encoded */
+	fail_unless(strlen(key) == 24, "Unexpected key %s", key);
+
+	return key;
+}
+
+static void
+ws_test_send(const char *data, gsize len)
+{
+	fail_unless(write(wst.fd, data, len) == (ssize_t)len, NULL);
+}
+
+static void
+ws_test_send_handshake(const char *accept)
+{
+	char *response = g_strdup_printf("HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n"
+			"Sec-WebSocket-Protocol: xmpp\r\n\r\n",
+			accept);
+	ws_test_send(response, strlen(response));
+	g_free(response);
+}
+
+/*
+ * Unmasks the next frame the client sent, waiting for it to arrive.
+ * Only short, unfragmented frames are expected.
+ */
+static char *
+ws_test_recv_frame(guint8 *opcode)
+{
+	const guchar *data;
+	char *payload;
+	gsize len, i;
+
+	while (wst.buf->len < 2 ||
+			wst.buf->len < 6 + (wst.buf->str[1] & 0x7f))
+		g_main_loop_run(wst.loop);
+
+	data = (const guchar *)wst.buf->str;
+	fail_unless(data[0] & 0x80, "Expected a final frame");
+	fail_unless(data[1] & 0x80, "Expected a masked frame");
+	len = data[1] & 0x7f;
+	fail_unless(len < 126, NULL);
+
+	*opcode = data[0] & 0x0f;
+	payload = g_malloc(len + 1);
+	for (i = 0; i < len; i++)
+		payload[i] = data[6 + i] ^ data[2 + i % 4];
+	payload[len] = '\0';
+	g_string_erase(wst.buf, 0, 6 + len);
+
+	return payload;
+}
+
+/*
+ * Waits for the WebSocket to give up on the connection.  There's no real
+ * account to disconnect, so that's left undone.
+ */
+static void
+ws_test_wait_for_error(void)
+{
+	while (wst.gc->disconnect_timeout == 0)
+		g_main_context_iteration(NULL, TRUE);
+
+	purple_timeout_remove(wst.gc->disconnect_timeout);
+	wst.gc->disconnect_timeout = 0;
+}
+
+static void
+ws_test_free(void)
+{
+	jabber_websocket_free(wst.js->websocket);
+
+	jabber_id_free(wst.js->user);
+	g_free(wst.js->serverFQDN);
+	g_free(wst.js->stream_id);
+	if (wst.js->send_buffer)
+		g_string_free(wst.js->send_buffer, TRUE);
+	g_free(wst.js);
+	g_free(wst.gc);
+	purple_account_destroy(wst.account);
+
+	purple_input_remove(wst.watch);
+	if (wst.fd >= 0)
+		close(wst.fd);
+	close(wst.listener);
+	g_string_free(wst.buf, TRUE);
+	g_main_loop_unref(wst.loop);
+}
+
+START_TEST(test_accept_key)
+{
+	/* The example from RFC 6455 */
+	assert_string_equal_free("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=",
+			jabber_websocket_accept_key("dGhlIHNhbXBsZSBub25jZQ=="));
+}
+END_TEST
+
+START_TEST(test_frames)
+{
+	const char *open = "<open xmlns='urn:ietf:params:xml:ns:xmpp-framing' "
+			"to='example.com' version='1.0'/>";
+	const guchar *payload;
+	gsize payload_len;
+	gboolean fin;
+	guint8 opcode;
+	GString *buf = g_string_new(NULL);
+	char *big;
+	gsize i;
+
+	/* What a server would send */
+	jabber_websocket_frame_append(buf, JABBER_WEBSOCKET_TEXT, open,
+			strlen(open), FALSE);
+	fail_unless(buf->len == strlen(open) + 2);
+	assert_frame_equal(buf->str, buf->len, TRUE, JABBER_WEBSOCKET_TEXT,
+			open, strlen(open));
+
+	/* Not all of it has arrived yet */
+	fail_unless(jabber_websocket_frame_parse((const guchar *)buf->str,
+			buf->len - 1, &fin, &opcode, &payload, &payload_len) == 0);
+	fail_unless(jabber_websocket_frame_parse((const guchar *)buf->str,
+			1, &fin, &opcode, &payload, &payload_len) == 0);
+
+	/* 16-bit and 64-bit lengths */
+	big = g_malloc(70000);
+	memset(big, 'x', 70000);
+	g_string_truncate(buf, 0);
+	jabber_websocket_frame_append(buf, JABBER_WEBSOCKET_TEXT, big, 300, FALSE);
+	fail_unless(buf->len == 300 + 4);
+	assert_frame_equal(buf->str, buf->len, TRUE, JABBER_WEBSOCKET_TEXT, big, 300);
+
+	g_string_truncate(buf, 0);
+	jabber_websocket_frame_append(buf, JABBER_WEBSOCKET_TEXT, big, 70000, FALSE);
+	fail_unless(buf->len == 70000 + 10);
+	assert_frame_equal(buf->str, buf->len, TRUE, JABBER_WEBSOCKET_TEXT, big, 70000);
+	g_free(big);
+
+	/* What we send is masked, which a server must never do */
+	g_string_truncate(buf, 0);
+	jabber_websocket_frame_append(buf, JABBER_WEBSOCKET_TEXT, open,
+			strlen(open), TRUE);
+	fail_unless(buf->len == strlen(open) + 6);
+	fail_unless((buf->str[1] & 0x80) != 0);
+	for (i = 0; i < strlen(open); i++)
+		fail_unless((buf->str[6 + i] ^ buf->str[2 + i % 4]) == open[i]);
+	fail_unless(jabber_websocket_frame_parse((const guchar *)buf->str,
+			buf->len, &fin, &opcode, &payload, &payload_len) == -1);
+
+	/* Control frames can't be fragmented */
+	assert_frame_equal("\x89\x02hi", 4, TRUE, JABBER_WEBSOCKET_PING, "hi", 2);
+	fail_unless(jabber_websocket_frame_parse((const guchar *)"\x09\x02hi",
+			4, &fin, &opcode, &payload, &payload_len) == -1);
+
+	/* A fragmented message */
+	assert_frame_equal("\x01\x03<a>", 5, FALSE, JABBER_WEBSOCKET_TEXT, "<a>", 3);
+	assert_frame_equal("\x80\x04</a>", 6, TRUE, JABBER_WEBSOCKET_CONTINUATION,
+			"</a>", 4);
+
+	g_string_free(buf, TRUE);
+}
+END_TEST
+
+START_TEST(test_handshake)
+{
+	char *key, *accept, *payload;
+	guint8 opcode;
+
+	key = ws_test_connect();
+	accept = jabber_websocket_accept_key(key);
+	ws_test_send_handshake(accept);
+	g_free(accept);
+	g_free(key);
+
+	/* Once upgraded, the stream is opened in a message of its own */
+	payload = ws_test_recv_frame(&opcode);
+	fail_unless(opcode == JABBER_WEBSOCKET_TEXT, NULL);
+	assert_string_equal("<open xmlns='urn:ietf:params:xml:ns:xmpp-framing' "
+			"to='example.com' xml:lang='en' version='1.0'/>", payload);
+	g_free(payload);
+	fail_unless(wst.js->state == JABBER_STREAM_INITIALIZING, NULL);
+	fail_unless(wst.gc->disconnect_timeout == 0, "The connection failed");
+
+	ws_test_free();
+}
+END_TEST
+
+START_TEST(test_handshake_bad_accept)
+{
+	char *key;
+
+	key = ws_test_connect();
+	ws_test_send_handshake(key);
+	g_free(key);
+	ws_test_wait_for_error();
+
+	/* Nothing is sent to a server that didn't prove it understood us */
+	fail_unless(wst.js->state != JABBER_STREAM_INITIALIZING, NULL);
+	fail_unless(wst.buf->len == 0, NULL);
+
+	ws_test_free();
+}
+END_TEST
+
+START_TEST(test_messages)
+{
+	const char *open = "<open xmlns='urn:ietf:params:xml:ns:xmpp-framing' "
+			"from='example.com' id='ws-test' version='1.0'/>";
+	char *key, *accept, *payload;
+	GString *frames = g_string_new(NULL);
+	gsize split = 20;
+	guint8 opcode;
+
+	key = ws_test_connect();
+	accept = jabber_websocket_accept_key(key);
+	ws_test_send_handshake(accept);
+	g_free(accept);
+	g_free(key);
+	g_free(ws_test_recv_frame(&opcode));
+
+	/* The first fragment of a message, with a ping on its heels */
+	jabber_websocket_frame_append(frames, JABBER_WEBSOCKET_TEXT, open, split,
+			FALSE);
+	frames->str[0] &= 0x7f;
+	jabber_websocket_frame_append(frames, JABBER_WEBSOCKET_PING, "1", 1, FALSE);
+	ws_test_send(frames->str, frames->len);
+
+	payload = ws_test_recv_frame(&opcode);
+	fail_unless(opcode == JABBER_WEBSOCKET_PONG, NULL);
+	assert_string_equal("1", payload);
+	g_free(payload);
+	fail_unless(wst.js->stream_id == NULL, NULL);
+
+	/* The rest of it */
+	g_string_truncate(frames, 0);
+	jabber_websocket_frame_append(frames, JABBER_WEBSOCKET_CONTINUATION,
+			open + split, strlen(open) - split, FALSE);
+	jabber_websocket_frame_append(frames, JABBER_WEBSOCKET_PING, "2", 1, FALSE);
+	ws_test_send(frames->str, frames->len);
+
+	payload = ws_test_recv_frame(&opcode);
+	fail_unless(opcode == JABBER_WEBSOCKET_PONG, NULL);
+	assert_string_equal("2", payload);
+	g_free(payload);
+	assert_string_equal("ws-test", wst.js->stream_id);
+
+	/* The server closes with 1000; the status is echoed back */
+	g_string_truncate(frames, 0);
+	jabber_websocket_frame_append(frames, JABBER_WEBSOCKET_CLOSE, "\x03\xe8", 2,
+			FALSE);
+	ws_test_send(frames->str, frames->len);
+	ws_test_wait_for_error();
+
+	payload = ws_test_recv_frame(&opcode);
+	fail_unless(opcode == JABBER_WEBSOCKET_CLOSE, NULL);
+	fail_unless(memcmp(payload, "\x03\xe8", 2) == 0, NULL);
+	g_free(payload);
+
+	g_string_free(frames, TRUE);
+	ws_test_free();
+}
+END_TEST
+
+Suite *
+jabber_websocket_suite(void)
+{
+	Suite *s = suite_create("Jabber WebSocket functions");
+
+	TCase *tc = tcase_create("Handshake");
+	tcase_add_test(tc, test_accept_key);
+	tcase_add_test(tc, test_handshake);
+	tcase_add_test(tc, test_handshake_bad_accept);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("Framing");
+	tcase_add_test(tc, test_frames);
+	tcase_add_test(tc, test_messages);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
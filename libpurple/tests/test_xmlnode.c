@@ -21,6 +21,139 @@ START_TEST(test_xmlnode_billion_laughs_attack)
 }
 END_TEST
 
+START_TEST(test_xmlnode_to_str_escaping)
+{
+	const char *text = "a<b>&'\"\x01\x7f\xc2\x80\xc2\x85\xc2\x9f\xc3\xa9";
+	xmlnode *node, *child;
+	GString *str;
+	char *escaped, *expected, *xml;
+	int len;
+
+	node = xmlnode_new("message");
+	xmlnode_set_namespace(node, "jabber:client");
+	xmlnode_set_attrib(node, "to", text);
+	child = xmlnode_new_child(node, "body");
+	xmlnode_insert_data(child, text, -1);
+	xmlnode_new_child(node, "active");
+
+	escaped = g_markup_escape_text(text, -1);
+	expected = g_strdup_printf("<message xmlns='jabber:client' to='%s'>"
+			"<body>%s</body><active/></message>", escaped, escaped);
+
+	xml = xmlnode_to_str(node, &len);
+	assert_string_equal(expected, xml);
+	fail_unless(len == (int)strlen(expected));
+	g_free(xml);
+
+	/* Appending must produce the same text, after what is already there */
+	str = g_string_new("<stream>");
+	xmlnode_append_to_gstring(node, str);
+	xmlnode_append_to_gstring(child, str);
+	xml = g_strdup_printf("<stream>%s<body>%s</body>", expected, escaped);
+	assert_string_equal(xml, str->str);
+	g_free(xml);
+	g_string_free(str, TRUE);
+	g_free(escaped);
+
+	g_free(expected);
+	xmlnode_free(node);
+}
+END_TEST
+
+START_TEST(test_xmlnode_arena)
+{
+	const char *text = "<iq type='get' id='1'><query xmlns='jabber:iq:version'/>"
+			"<x a='&amp;'>text</x></iq>";
+	xmlnode *node, *child, *copy, *other;
+	char *xml;
+
+	node = xmlnode_from_str(text, -1);
+	fail_unless(node != NULL);
+	assert_string_equal("&", xmlnode_get_attrib(xmlnode_get_child(node, "x"), "a"));
+
+	/* Attributes set after the children must still be found, and written */
+	xmlnode_set_attrib(node, "to", "juliet@example.com");
+	assert_string_equal("juliet@example.com", xmlnode_get_attrib(node, "to"));
+	xmlnode_set_attrib(node, "id", "2");
+	assert_string_equal("2", xmlnode_get_attrib(node, "id"));
+
+	/* Replacing or removing an attribute must not take the rest of the
+	 * tree with it, even once the memory has been handed out again */
+	xmlnode_set_attrib(node, "to", "romeo@example.com");
+	xmlnode_set_attrib_with_namespace(node, "lang", "urn:test", "en");
+	xmlnode_remove_attrib_with_namespace(node, "lang", "urn:test");
+	other = xmlnode_from_str(text, -1);
+	xmlnode_free(other);
+	other = xmlnode_from_str("<presence type='unavailable' id='3'><status>away"
+			"</status></presence>", -1);
+	assert_string_equal("romeo@example.com", xmlnode_get_attrib(node, "to"));
+	fail_unless(xmlnode_get_attrib(node, "lang") == NULL);
+	xml = xmlnode_get_data(xmlnode_get_child(node, "x"));
+	assert_string_equal("text", xml);
+	g_free(xml);
+	xmlnode_free(other);
+	xmlnode_set_attrib(node, "to", "juliet@example.com");
+	other = xmlnode_from_str("<presence type='unavailable' id='3'/>", -1);
+	assert_string_equal("set", xmlnode_get_attrib(node, "type"));
+	assert_string_equal("text", xmlnode_get_data(xmlnode_get_child(node, "x")));
+	xmlnode_set_attrib(node, "type", "get");
+	xmlnode_free(other);
+
+	xml = xmlnode_to_str(node, NULL);
+	assert_string_equal("<iq type='get' id='2' to='juliet@example.com'>"
+			"<query xmlns='jabber:iq:version'/><x a='&amp;'>text</x></iq>", xml);
+
+	copy = xmlnode_copy(node);
+	g_free(xml);
+	xml = xmlnode_to_str(copy, NULL);
+	assert_string_equal("<iq type='get' id='2' to='juliet@example.com'>"
+			"<query xmlns='jabber:iq:version'/><x a='&amp;'>text</x></iq>", xml);
+	g_free(xml);
+
+	/* Freeing part of the tree only takes it out */
+	child = xmlnode_get_child(copy, "query");
+	xmlnode_free(child);
+	fail_unless(xmlnode_get_child(copy, "query") == NULL);
+	xmlnode_insert_data(xmlnode_new_child(copy, "body"), "hi", -1);
+	xml = xmlnode_to_str(copy, NULL);
+	assert_string_equal("<iq type='get' id='2' to='juliet@example.com'>"
+			"<x a='&amp;'>text</x><body>hi</body></iq>", xml);
+	g_free(xml);
+
+	xmlnode_free(copy);
+	xmlnode_free(node);
+}
+END_TEST
+
+START_TEST(test_xmlnode_arena_move)
+{
+	xmlnode *node, *child, *parent;
+	char *xml;
+
+	node = xmlnode_from_str("<message><body>hi</body><x xmlns='jabber:x:data'/></message>", -1);
+	fail_unless(node != NULL);
+
+	/* A subtree taken out of a tree outlives the tree it came from */
+	child = xmlnode_get_child(node, "body");
+	node->child = child->next;
+	child->next = NULL;
+	parent = xmlnode_new("forwarded");
+	xmlnode_insert_child(parent, child);
+	xmlnode_free(node);
+
+	/* Nodes added to it afterwards are freed like any others */
+	xmlnode_set_attrib(child, "id", "1");
+	xmlnode_set_attrib(child, "id", "2");
+	xmlnode_free(xmlnode_new_child(child, "thread"));
+
+	xml = xmlnode_to_str(parent, NULL);
+	assert_string_equal("<forwarded><body id='2'>hi</body></forwarded>", xml);
+	g_free(xml);
+
+	xmlnode_free(parent);
+}
+END_TEST
+
 Suite *
 xmlnode_suite(void)
 {
@@ -28,6 +161,9 @@ xmlnode_suite(void)
 
 	TCase *tc = tcase_create("xmlnode");
 	tcase_add_test(tc, test_xmlnode_billion_laughs_attack);
+	tcase_add_test(tc, test_xmlnode_to_str_escaping);
+	tcase_add_test(tc, test_xmlnode_arena);
+	tcase_add_test(tc, test_xmlnode_arena_move);
 	suite_add_tcase(s, tc);
 
 	return s;
@@ -9,10 +9,14 @@
 /* remember to add the suite to the runner in check_libpurple.c */
 Suite * master_suite(void);
 Suite * cipher_suite(void);
+Suite * ft_suite(void);
+Suite * irc_parse_suite(void);
 Suite * jabber_caps_suite(void);
 Suite * jabber_digest_md5_suite(void);
 Suite * jabber_jutil_suite(void);
+Suite * jabber_mam_suite(void);
 Suite * jabber_scram_suite(void);
+Suite * jabber_websocket_suite(void);
 Suite * oscar_util_suite(void);
 Suite * yahoo_util_suite(void);
 Suite * util_suite(void);
@@ -46,6 +46,165 @@
 # define NEWLINE_S "\n"
 #endif
 
+/* Blocks of memory for nodes in an arena.  The first one is small because
+ * most stanzas are. */
+#define ARENA_BLOCK_MIN 2048
+#define ARENA_BLOCK_MAX (64 * 1024)
+
+/* Names longer than this, or arriving after the table is full, are just
+ * copied.  Interned strings are kept until _purple_xmlnode_uninit(), so
+ * there must be a limit on how many a peer can make us keep. */
+#define INTERN_MAX_LEN 64
+#define INTERN_MAX_COUNT 4096
+
+typedef struct _xmlnode_arena_block xmlnode_arena_block;
+
+struct _xmlnode_arena_block {
+	xmlnode_arena_block *next;
+	gsize size;
+	gsize used;
+};
+
+/*
+ * Every node, string and attribute of a tree created by
+ * xmlnode_new_arena() comes from here until the tree is sealed, and it is
+ * all freed together when the last reference goes.  The owner holds one,
+ * and so does every subtree that was moved out into another tree.
+ *
+ * Whatever is added to a sealed tree is allocated as usual and freed as
+ * usual, so a long-lived tree that keeps changing doesn't keep growing.
+ * What it replaces stays in the arena until the arena goes.
+ */
+struct _xmlnode_arena {
+	xmlnode_arena_block *blocks;
+	xmlnode *owner;
+	guint refs;
+	gboolean sealed;
+	GSList *strings; /* Names set after sealing that couldn't be interned */
+};
+
+static GHashTable *interned = NULL;
+
+#define ARENA_ALIGN (2 * sizeof(gpointer))
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~(gsize)(ARENA_ALIGN - 1))
+#define ARENA_BLOCK_HEADER ARENA_ROUND(sizeof(xmlnode_arena_block))
+
+static gpointer
+arena_alloc(struct _xmlnode_arena *arena, gsize size, gboolean align)
+{
+	xmlnode_arena_block *block = arena->blocks;
+	gsize offset;
+
+	offset = block->used;
+	if (align)
+		offset = ARENA_ROUND(offset);
+
+	if (offset + size > block->size) {
+		gsize block_size = MIN(block->size * 2, ARENA_BLOCK_MAX);
+
+		block_size = MAX(block_size, size);
+
+		block = g_malloc(ARENA_BLOCK_HEADER + block_size);
+		block->size = block_size;
+		block->next = arena->blocks;
+		arena->blocks = block;
+		offset = 0;
+	}
+
+	block->used = offset + size;
+
+	return (char *)block + ARENA_BLOCK_HEADER + offset;
+}
+
+static char *
+arena_strndup(struct _xmlnode_arena *arena, const char *str, gsize len)
+{
+	char *ret = arena_alloc(arena, len + 1, FALSE);
+
+	memcpy(ret, str, len);
+	ret[len] = '\0';
+
+	return ret;
+}
+
+static char *
+arena_strdup(struct _xmlnode_arena *arena, const char *str)
+{
+	if (str == NULL)
+		return NULL;
+
+	return arena_strndup(arena, str, strlen(str));
+}
+
+static struct _xmlnode_arena *
+arena_new(void)
+{
+	struct _xmlnode_arena *arena = g_new(struct _xmlnode_arena, 1);
+
+	arena->blocks = g_malloc(ARENA_BLOCK_HEADER + ARENA_BLOCK_MIN);
+	arena->blocks->next = NULL;
+	arena->blocks->size = ARENA_BLOCK_MIN;
+	arena->blocks->used = 0;
+	arena->owner = NULL;
+	arena->refs = 1;
+	arena->sealed = FALSE;
+	arena->strings = NULL;
+
+	return arena;
+}
+
+static void
+arena_unref(struct _xmlnode_arena *arena)
+{
+	if (--arena->refs > 0)
+		return;
+
+	while (arena->blocks) {
+		xmlnode_arena_block *next = arena->blocks->next;
+		g_free(arena->blocks);
+		arena->blocks = next;
+	}
+
+	g_slist_foreach(arena->strings, (GFunc)g_free, NULL);
+	g_slist_free(arena->strings);
+	g_free(arena);
+}
+
+/*
+ * Element and attribute names, namespaces and prefixes come from a small
+ * vocabulary, so nodes in an arena share a single copy of each.
+ */
+static char *
+intern(struct _xmlnode_arena *arena, const char *str)
+{
+	char *ret;
+	gsize len;
+
+	if (str == NULL)
+		return NULL;
+
+	if (interned == NULL)
+		interned = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	if ((ret = g_hash_table_lookup(interned, str)) != NULL)
+		return ret;
+
+	len = strlen(str);
+	if (len > INTERN_MAX_LEN || g_hash_table_size(interned) >= INTERN_MAX_COUNT) {
+		if (!arena->sealed)
+			return arena_strndup(arena, str, len);
+
+		ret = g_strndup(str, len);
+		arena->strings = g_slist_prepend(arena->strings, ret);
+		return ret;
+	}
+
+	ret = g_strndup(str, len);
+	g_hash_table_insert(interned, ret, ret);
+
+	return ret;
+}
+
 static xmlnode*
 new_node(const char *name, XMLNodeType type)
 {
@@ -59,6 +218,42 @@ new_node(const char *name, XMLNodeType type)
 	return node;
 }
 
+static xmlnode *
+new_arena_node(struct _xmlnode_arena *arena, const char *name, XMLNodeType type)
+{
+	xmlnode *node = arena_alloc(arena, sizeof(xmlnode), TRUE);
+
+	memset(node, 0, sizeof(xmlnode));
+	node->name = intern(arena, name);
+	node->type = type;
+	node->arena = arena;
+
+	PURPLE_DBUS_REGISTER_POINTER(node, xmlnode);
+
+	return node;
+}
+
+/* Makes a node to go under parent, from its arena if the tree is still
+ * being built. */
+static xmlnode *
+new_node_for(const xmlnode *parent, const char *name, XMLNodeType type)
+{
+	if (parent->arena && !parent->arena->sealed)
+		return new_arena_node(parent->arena, name, type);
+
+	return new_node(name, type);
+}
+
+void
+_purple_xmlnode_uninit(void)
+{
+	if (interned == NULL)
+		return;
+
+	g_hash_table_destroy(interned);
+	interned = NULL;
+}
+
 xmlnode*
 xmlnode_new(const char *name)
 {
@@ -67,6 +262,28 @@ xmlnode_new(const char *name)
 	return new_node(name, XMLNODE_TYPE_TAG);
 }
 
+xmlnode *
+xmlnode_new_arena(const char *name)
+{
+	struct _xmlnode_arena *arena;
+
+	g_return_val_if_fail(name != NULL && *name != '\0', NULL);
+
+	arena = arena_new();
+	arena->owner = new_arena_node(arena, name, XMLNODE_TYPE_TAG);
+
+	return arena->owner;
+}
+
+void
+xmlnode_seal_arena(xmlnode *node)
+{
+	g_return_if_fail(node != NULL);
+
+	if (node->arena)
+		node->arena->sealed = TRUE;
+}
+
 xmlnode *
 xmlnode_new_child(xmlnode *parent, const char *name)
 {
@@ -75,19 +292,55 @@ xmlnode_new_child(xmlnode *parent, const char *name)
 	g_return_val_if_fail(parent != NULL, NULL);
 	g_return_val_if_fail(name != NULL && *name != '\0', NULL);
 
-	node = new_node(name, XMLNODE_TYPE_TAG);
+	node = new_node_for(parent, name, XMLNODE_TYPE_TAG);
 
 	xmlnode_insert_child(parent, node);
 
 	return node;
 }
 
+/*
+ * Attributes are kept ahead of all other children, so looking one up
+ * never has to walk past the elements and text of a node.
+ */
+static void
+insert_attrib(xmlnode *node, xmlnode *attrib)
+{
+	xmlnode *prev = NULL, *x;
+
+	for (x = node->child; x && x->type == XMLNODE_TYPE_ATTRIB; x = x->next)
+		prev = x;
+
+	attrib->parent = node;
+
+	if (prev) {
+		attrib->next = prev->next;
+		prev->next = attrib;
+	} else {
+		attrib->next = node->child;
+		node->child = attrib;
+	}
+
+	if (attrib->next == NULL)
+		node->lastchild = attrib;
+}
+
 void
 xmlnode_insert_child(xmlnode *parent, xmlnode *child)
 {
 	g_return_if_fail(parent != NULL);
 	g_return_if_fail(child != NULL);
 
+	/* A subtree moved out of its arena's tree keeps the arena alive. */
+	if (child->arena && child != child->arena->owner &&
+			parent->arena != child->arena)
+		child->arena->refs++;
+
+	if (child->type == XMLNODE_TYPE_ATTRIB) {
+		insert_attrib(parent, child);
+		return;
+	}
+
 	child->parent = parent;
 
 	if(parent->lastchild) {
@@ -111,9 +364,12 @@ xmlnode_insert_data(xmlnode *node, const char *data, gssize size)
 
 	real_size = size == -1 ? strlen(data) : (gsize)size;
 
-	child = new_node(NULL, XMLNODE_TYPE_DATA);
+	child = new_node_for(node, NULL, XMLNODE_TYPE_DATA);
 
-	child->data = g_memdup(data, real_size);
+	if (child->arena)
+		child->data = arena_strndup(child->arena, data, real_size);
+	else
+		child->data = g_memdup(data, real_size);
 	child->data_sz = real_size;
 
 	xmlnode_insert_child(node, child);
@@ -128,29 +384,25 @@ xmlnode_remove_attrib(xmlnode *node, const char *attr)
 	g_return_if_fail(attr != NULL);
 
 	attr_node = node->child;
-	while (attr_node) {
-		if(attr_node->type == XMLNODE_TYPE_ATTRIB &&
-				purple_strequal(attr_node->name, attr))
+	while (attr_node && attr_node->type == XMLNODE_TYPE_ATTRIB) {
+		if (purple_strequal(attr_node->name, attr))
 		{
 			if (node->lastchild == attr_node) {
 				node->lastchild = sibling;
 			}
 			if (sibling == NULL) {
 				node->child = attr_node->next;
-				xmlnode_free(attr_node);
-				attr_node = node->child;
 			} else {
 				sibling->next = attr_node->next;
-				sibling = attr_node->next;
-				xmlnode_free(attr_node);
-				attr_node = sibling;
 			}
+			xmlnode_free(attr_node);
+			attr_node = sibling ? sibling->next : node->child;
 		}
 		else
 		{
+			sibling = attr_node;
 			attr_node = attr_node->next;
 		}
-		sibling = attr_node;
 	}
 }
 
@@ -162,10 +414,11 @@ xmlnode_remove_attrib_with_namespace(xmlnode *node, const char *attr, const char
 	g_return_if_fail(node != NULL);
 	g_return_if_fail(attr != NULL);
 
-	for(attr_node = node->child; attr_node; attr_node = attr_node->next)
+	for(attr_node = node->child;
+			attr_node && attr_node->type == XMLNODE_TYPE_ATTRIB;
+			attr_node = attr_node->next)
 	{
-		if(attr_node->type == XMLNODE_TYPE_ATTRIB &&
-		   purple_strequal(attr,  attr_node->name) &&
+		if(purple_strequal(attr,  attr_node->name) &&
 		   purple_strequal(xmlns, attr_node->xmlns))
 		{
 			if(sibling == NULL) {
@@ -212,13 +465,19 @@ xmlnode_set_attrib_full(xmlnode *node, const char *attr, const char *xmlns, cons
 	g_return_if_fail(value != NULL);
 
 	xmlnode_remove_attrib_with_namespace(node, attr, xmlns);
-	attrib_node = new_node(attr, XMLNODE_TYPE_ATTRIB);
+	attrib_node = new_node_for(node, attr, XMLNODE_TYPE_ATTRIB);
 
-	attrib_node->data = g_strdup(value);
-	attrib_node->xmlns = g_strdup(xmlns);
-	attrib_node->prefix = g_strdup(prefix);
+	if (attrib_node->arena) {
+		attrib_node->data = arena_strdup(attrib_node->arena, value);
+		attrib_node->xmlns = intern(attrib_node->arena, xmlns);
+		attrib_node->prefix = intern(attrib_node->arena, prefix);
+	} else {
+		attrib_node->data = g_strdup(value);
+		attrib_node->xmlns = g_strdup(xmlns);
+		attrib_node->prefix = g_strdup(prefix);
+	}
 
-	xmlnode_insert_child(node, attrib_node);
+	insert_attrib(node, attrib_node);
 }
 
 
@@ -230,8 +489,8 @@ xmlnode_get_attrib(const xmlnode *node, const char *attr)
 	g_return_val_if_fail(node != NULL, NULL);
 	g_return_val_if_fail(attr != NULL, NULL);
 
-	for(x = node->child; x; x = x->next) {
-		if(x->type == XMLNODE_TYPE_ATTRIB && purple_strequal(attr, x->name)) {
+	for(x = node->child; x && x->type == XMLNODE_TYPE_ATTRIB; x = x->next) {
+		if(purple_strequal(attr, x->name)) {
 			return x->data;
 		}
 	}
@@ -247,9 +506,8 @@ xmlnode_get_attrib_with_namespace(const xmlnode *node, const char *attr, const c
 	g_return_val_if_fail(node != NULL, NULL);
 	g_return_val_if_fail(attr != NULL, NULL);
 
-	for(x = node->child; x; x = x->next) {
-		if(x->type == XMLNODE_TYPE_ATTRIB &&
-		   purple_strequal(attr,  x->name) &&
+	for(x = node->child; x && x->type == XMLNODE_TYPE_ATTRIB; x = x->next) {
+		if(purple_strequal(attr,  x->name) &&
 		   purple_strequal(xmlns, x->xmlns)) {
 			return x->data;
 		}
@@ -263,6 +521,11 @@ void xmlnode_set_namespace(xmlnode *node, const char *xmlns)
 {
 	g_return_if_fail(node != NULL);
 
+	if (node->arena) {
+		node->xmlns = intern(node->arena, xmlns);
+		return;
+	}
+
 	g_free(node->xmlns);
 	node->xmlns = g_strdup(xmlns);
 }
@@ -278,6 +541,11 @@ void xmlnode_set_prefix(xmlnode *node, const char *prefix)
 {
 	g_return_if_fail(node != NULL);
 
+	if (node->arena) {
+		node->prefix = intern(node->arena, prefix);
+		return;
+	}
+
 	g_free(node->prefix);
 	node->prefix = g_strdup(prefix);
 }
@@ -294,11 +562,45 @@ xmlnode *xmlnode_get_parent(const xmlnode *child)
 	return child->parent;
 }
 
-void
-xmlnode_free(xmlnode *node)
+static void
+xmlnode_free_tree(xmlnode *node)
 {
 	xmlnode *x, *y;
 
+	/* free our children */
+	x = node->child;
+	while(x) {
+		y = x->next;
+		xmlnode_free_tree(x);
+		x = y;
+	}
+
+	if(node->namespace_map)
+		g_hash_table_destroy(node->namespace_map);
+
+	PURPLE_DBUS_UNREGISTER_POINTER(node);
+
+	if (node->arena) {
+		/* Nodes from an arena go with it, all at once.  The owner and
+		 * subtrees moved elsewhere each hold a reference to it; anything
+		 * else, even if it's been taken out of the tree, holds none. */
+		if (node == node->arena->owner ||
+				(node->parent && node->parent->arena != node->arena))
+			arena_unref(node->arena);
+		return;
+	}
+
+	/* now dispose of ourselves */
+	g_free(node->name);
+	g_free(node->data);
+	g_free(node->xmlns);
+	g_free(node->prefix);
+	g_free(node);
+}
+
+void
+xmlnode_free(xmlnode *node)
+{
 	g_return_if_fail(node != NULL);
 
 	/* if we're part of a tree, remove ourselves from the tree first */
@@ -320,25 +622,7 @@ xmlnode_free(xmlnode *node)
 		}
 	}
 
-	/* now free our children */
-	x = node->child;
-	while(x) {
-		y = x->next;
-		xmlnode_free(x);
-		x = y;
-	}
-
-	/* now dispose of ourselves */
-	g_free(node->name);
-	g_free(node->data);
-	g_free(node->xmlns);
-	g_free(node->prefix);
-
-	if(node->namespace_map)
-		g_hash_table_destroy(node->namespace_map);
-
-	PURPLE_DBUS_UNREGISTER_POINTER(node);
-	g_free(node);
+	xmlnode_free_tree(node);
 }
 
 xmlnode*
@@ -427,30 +711,83 @@ xmlnode_to_str_foreach_append_ns(const char *key, const char *value,
 	}
 }
 
-static char *
-xmlnode_to_str_helper(const xmlnode *node, int *len, gboolean formatting, int depth)
+/*
+ * Appends text to a string the way g_markup_escape_text() would escape
+ * it, without allocating a copy first.
+ */
+static void
+xmlnode_append_escaped(GString *text, const char *data, gssize length)
+{
+	const char *p, *end, *run;
+
+	if (length < 0)
+		length = strlen(data);
+
+	end = data + length;
+	for (p = run = data; p < end; ) {
+		const guchar c = *p;
+		const char *entity = NULL;
+		guint skip = 1;
+		gunichar escape = 0;
+
+		switch (c) {
+			case '&':  entity = "&amp;";  break;
+			case '<':  entity = "&lt;";   break;
+			case '>':  entity = "&gt;";   break;
+			case '\'': entity = "&apos;"; break;
+			case '"':  entity = "&quot;"; break;
+			default:
+				if ((c >= 0x1 && c <= 0x8) || c == 0xb || c == 0xc ||
+						(c >= 0xe && c <= 0x1f) || c == 0x7f)
+					escape = c;
+				else if (c == 0xc2 && p + 1 < end &&
+						(((guchar)p[1] >= 0x80 && (guchar)p[1] <= 0x84) ||
+						 ((guchar)p[1] >= 0x86 && (guchar)p[1] <= 0x9f))) {
+					/* U+0080 to U+009F, except U+0085 */
+					escape = (guchar)p[1];
+					skip = 2;
+				}
+				break;
+		}
+
+		if (entity == NULL && escape == 0) {
+			p++;
+			continue;
+		}
+
+		g_string_append_len(text, run, p - run);
+		if (entity)
+			g_string_append(text, entity);
+		else
+			g_string_append_printf(text, "&#x%x;", escape);
+		p += skip;
+		run = p;
+	}
+
+	g_string_append_len(text, run, p - run);
+}
+
+static void
+xmlnode_to_str_helper(const xmlnode *node, GString *text, gboolean formatting, int depth)
 {
-	GString *text = g_string_new("");
 	const char *prefix;
 	const xmlnode *c;
-	char *node_name, *esc, *esc2, *tab = NULL;
 	gboolean need_end = FALSE, pretty = formatting;
+	int i;
 
-	g_return_val_if_fail(node != NULL, NULL);
+	g_return_if_fail(node != NULL);
 
 	if(pretty && depth) {
-		tab = g_strnfill(depth, '\t');
-		text = g_string_append(text, tab);
+		for (i = 0; i < depth; i++)
+			g_string_append_c(text, '\t');
 	}
 
-	node_name = g_markup_escape_text(node->name, -1);
 	prefix = xmlnode_get_prefix(node);
 
-	if (prefix) {
-		g_string_append_printf(text, "<%s:%s", prefix, node_name);
-	} else {
-		g_string_append_printf(text, "<%s", node_name);
-	}
+	g_string_append_c(text, '<');
+	if (prefix)
+		g_string_append_printf(text, "%s:", prefix);
+	xmlnode_append_escaped(text, node->name, -1);
 
 	if (node->namespace_map) {
 		g_hash_table_foreach(node->namespace_map,
@@ -458,24 +795,21 @@ xmlnode_to_str_helper(const xmlnode *node, int *len, gboolean formatting, int de
 	} else if (node->xmlns) {
 		if(!node->parent || !purple_strequal(node->xmlns, node->parent->xmlns))
 		{
-			char *xmlns = g_markup_escape_text(node->xmlns, -1);
-			g_string_append_printf(text, " xmlns='%s'", xmlns);
-			g_free(xmlns);
+			g_string_append(text, " xmlns='");
+			xmlnode_append_escaped(text, node->xmlns, -1);
+			g_string_append_c(text, '\'');
 		}
 	}
 	for(c = node->child; c; c = c->next)
 	{
 		if(c->type == XMLNODE_TYPE_ATTRIB) {
-			const char *aprefix = xmlnode_get_prefix(c);
-			esc = g_markup_escape_text(c->name, -1);
-			esc2 = g_markup_escape_text(c->data, -1);
-			if (aprefix) {
-				g_string_append_printf(text, " %s:%s='%s'", aprefix, esc, esc2);
-			} else {
-				g_string_append_printf(text, " %s='%s'", esc, esc2);
-			}
-			g_free(esc);
-			g_free(esc2);
+			g_string_append_c(text, ' ');
+			if (xmlnode_get_prefix(c))
+				g_string_append_printf(text, "%s:", xmlnode_get_prefix(c));
+			xmlnode_append_escaped(text, c->name, -1);
+			g_string_append(text, "='");
+			xmlnode_append_escaped(text, c->data, -1);
+			g_string_append_c(text, '\'');
 		} else if(c->type == XMLNODE_TYPE_TAG || c->type == XMLNODE_TYPE_DATA) {
 			if(c->type == XMLNODE_TYPE_DATA)
 				pretty = FALSE;
@@ -484,65 +818,75 @@ xmlnode_to_str_helper(const xmlnode *node, int *len, gboolean formatting, int de
 	}
 
 	if(need_end) {
-		g_string_append_printf(text, ">%s", pretty ? NEWLINE_S : "");
+		g_string_append_c(text, '>');
+		if (pretty)
+			g_string_append(text, NEWLINE_S);
 
 		for(c = node->child; c; c = c->next)
 		{
 			if(c->type == XMLNODE_TYPE_TAG) {
-				int esc_len;
-				esc = xmlnode_to_str_helper(c, &esc_len, pretty, depth+1);
-				text = g_string_append_len(text, esc, esc_len);
-				g_free(esc);
+				xmlnode_to_str_helper(c, text, pretty, depth+1);
 			} else if(c->type == XMLNODE_TYPE_DATA && c->data_sz > 0) {
-				esc = g_markup_escape_text(c->data, c->data_sz);
-				text = g_string_append(text, esc);
-				g_free(esc);
+				xmlnode_append_escaped(text, c->data, c->data_sz);
 			}
 		}
 
-		if(tab && pretty)
-			text = g_string_append(text, tab);
-		if (prefix) {
-			g_string_append_printf(text, "</%s:%s>%s", prefix, node_name, formatting ? NEWLINE_S : "");
-		} else {
-			g_string_append_printf(text, "</%s>%s", node_name, formatting ? NEWLINE_S : "");
+		if(pretty && depth) {
+			for (i = 0; i < depth; i++)
+				g_string_append_c(text, '\t');
 		}
+		g_string_append(text, "</");
+		if (prefix)
+			g_string_append_printf(text, "%s:", prefix);
+		xmlnode_append_escaped(text, node->name, -1);
+		g_string_append_c(text, '>');
 	} else {
-		g_string_append_printf(text, "/>%s", formatting ? NEWLINE_S : "");
+		g_string_append(text, "/>");
 	}
 
-	g_free(node_name);
-
-	g_free(tab);
+	if (formatting)
+		g_string_append(text, NEWLINE_S);
+}
 
-	if(len)
-		*len = text->len;
+void
+xmlnode_append_to_gstring(const xmlnode *node, GString *str)
+{
+	g_return_if_fail(node != NULL);
+	g_return_if_fail(str != NULL);
 
-	return g_string_free(text, FALSE);
+	xmlnode_to_str_helper(node, str, FALSE, 0);
 }
 
 char *
 xmlnode_to_str(const xmlnode *node, int *len)
 {
-	return xmlnode_to_str_helper(node, len, FALSE, 0);
+	GString *text;
+
+	g_return_val_if_fail(node != NULL, NULL);
+
+	text = g_string_new(NULL);
+	xmlnode_to_str_helper(node, text, FALSE, 0);
+
+	if(len)
+		*len = text->len;
+
+	return g_string_free(text, FALSE);
 }
 
 char *
 xmlnode_to_formatted_str(const xmlnode *node, int *len)
 {
-	char *xml, *xml_with_declaration;
+	GString *text;
 
 	g_return_val_if_fail(node != NULL, NULL);
 
-	xml = xmlnode_to_str_helper(node, len, TRUE, 0);
-	xml_with_declaration =
-		g_strdup_printf("<?xml version='1.0' encoding='UTF-8' ?>" NEWLINE_S NEWLINE_S "%s", xml);
-	g_free(xml);
+	text = g_string_new("<?xml version='1.0' encoding='UTF-8' ?>" NEWLINE_S NEWLINE_S);
+	xmlnode_to_str_helper(node, text, TRUE, 0);
 
 	if (len)
-		*len += sizeof("<?xml version='1.0' encoding='UTF-8' ?>" NEWLINE_S NEWLINE_S) - 1;
+		*len = text->len;
 
-	return xml_with_declaration;
+	return g_string_free(text, FALSE);
 }
 
 struct _xmlnode_parser_data {
@@ -550,6 +894,35 @@ struct _xmlnode_parser_data {
 	gboolean error;
 };
 
+static void
+xmlnode_parser_add_attrib(xmlnode *node, const char *name, const char *prefix,
+                          const char *value, gsize len)
+{
+	xmlnode *attrib = new_node_for(node, name, XMLNODE_TYPE_ATTRIB);
+	char *unescaped = NULL;
+
+	/* libxml2 leaves entities in attribute values alone */
+	if (memchr(value, '&', len) != NULL) {
+		char *tmp = g_strndup(value, len);
+		unescaped = purple_unescape_text(tmp);
+		g_free(tmp);
+
+		value = unescaped;
+		len = strlen(unescaped);
+	}
+
+	if (attrib->arena) {
+		attrib->data = arena_strndup(attrib->arena, value, len);
+		attrib->prefix = intern(attrib->arena, prefix);
+		g_free(unescaped);
+	} else {
+		attrib->data = unescaped ? unescaped : g_strndup(value, len);
+		attrib->prefix = g_strdup(prefix);
+	}
+
+	insert_attrib(node, attrib);
+}
+
 static void
 xmlnode_parser_element_start_libxml(void *user_data,
 				   const xmlChar *element_name, const xmlChar *prefix, const xmlChar *xmlns,
@@ -566,7 +939,7 @@ xmlnode_parser_element_start_libxml(void *user_data,
 		if(xpd->current)
 			node = xmlnode_new_child(xpd->current, (const char*) element_name);
 		else
-			node = xmlnode_new((const char *) element_name);
+			node = xmlnode_new_arena((const char *) element_name);
 
 		xmlnode_set_namespace(node, (const char *) xmlns);
 		xmlnode_set_prefix(node, (const char *)prefix);
@@ -583,17 +956,12 @@ xmlnode_parser_element_start_libxml(void *user_data,
 			}
 		}
 
+		/* libxml2 has already rejected duplicate attributes */
 		for(i=0; i < nb_attributes * 5; i+=5) {
-			const char *name = (const char *)attributes[i];
-			const char *prefix = (const char *)attributes[i+1];
-			char *txt;
-			int attrib_len = attributes[i+4] - attributes[i+3];
-			char *attrib = g_strndup((const char *)attributes[i+3], attrib_len);
-			txt = attrib;
-			attrib = purple_unescape_text(txt);
-			g_free(txt);
-			xmlnode_set_attrib_full(node, name, NULL, prefix, attrib);
-			g_free(attrib);
+			xmlnode_parser_add_attrib(node, (const char *)attributes[i],
+					(const char *)attributes[i+1],
+					(const char *)attributes[i+3],
+					attributes[i+4] - attributes[i+3]);
 		}
 
 		xpd->current = node;
@@ -727,6 +1095,8 @@ xmlnode_from_str(const char *str, gssize size)
 		if (xpd->current)
 			xmlnode_free(xpd->current);
 	}
+	if (ret)
+		xmlnode_seal_arena(ret);
 
 	g_free(xpd);
 	return ret;
@@ -811,26 +1181,24 @@ xmlnode_copy_foreach_ns(gpointer key, gpointer value, gpointer user_data)
 	g_hash_table_insert(ret, g_strdup(key), g_strdup(value));
 }
 
-xmlnode *
-xmlnode_copy(const xmlnode *src)
+static xmlnode *
+xmlnode_copy_into(struct _xmlnode_arena *arena, const xmlnode *src)
 {
 	xmlnode *ret;
 	xmlnode *child;
 	xmlnode *sibling = NULL;
 
-	g_return_val_if_fail(src != NULL, NULL);
-
-	ret = new_node(src->name, src->type);
-	ret->xmlns = g_strdup(src->xmlns);
+	ret = new_arena_node(arena, src->name, src->type);
+	ret->xmlns = intern(arena, src->xmlns);
 	if (src->data) {
 		if (src->data_sz) {
-			ret->data = g_memdup(src->data, src->data_sz);
+			ret->data = arena_strndup(arena, src->data, src->data_sz);
 			ret->data_sz = src->data_sz;
 		} else {
-			ret->data = g_strdup(src->data);
+			ret->data = arena_strdup(arena, src->data);
 		}
 	}
-	ret->prefix = g_strdup(src->prefix);
+	ret->prefix = intern(arena, src->prefix);
 	if (src->namespace_map) {
 		ret->namespace_map = g_hash_table_new_full(g_str_hash, g_str_equal,
 		                                           g_free, g_free);
@@ -839,10 +1207,10 @@ xmlnode_copy(const xmlnode *src)
 
 	for (child = src->child; child; child = child->next) {
 		if (sibling) {
-			sibling->next = xmlnode_copy(child);
+			sibling->next = xmlnode_copy_into(arena, child);
 			sibling = sibling->next;
 		} else {
-			ret->child = sibling = xmlnode_copy(child);
+			ret->child = sibling = xmlnode_copy_into(arena, child);
 		}
 		sibling->parent = ret;
 	}
@@ -852,6 +1220,20 @@ xmlnode_copy(const xmlnode *src)
 	return ret;
 }
 
+xmlnode *
+xmlnode_copy(const xmlnode *src)
+{
+	struct _xmlnode_arena *arena;
+
+	g_return_val_if_fail(src != NULL, NULL);
+
+	arena = arena_new();
+	arena->owner = xmlnode_copy_into(arena, src);
+	arena->sealed = TRUE;
+
+	return arena->owner;
+}
+
 xmlnode *
 xmlnode_get_next_twin(xmlnode *node)
 {
@@ -44,6 +44,9 @@ typedef enum _XMLNodeType
 
 /**
  * An xmlnode.
+ *
+ * Attributes are children of type XMLNODE_TYPE_ATTRIB, and always come
+ * before any other children of a node.
  */
 typedef struct _xmlnode xmlnode;
 struct _xmlnode
@@ -59,6 +62,7 @@ struct _xmlnode
 	xmlnode *next;              /**< The next node or @c NULL. */
 	char *prefix;               /**< The namespace prefix if any. */
 	GHashTable *namespace_map;  /**< The namespace map. */
+	struct _xmlnode_arena *arena; /**< Private. @since 2.11.0 */
 };
 
 /**
@@ -70,6 +74,40 @@ struct _xmlnode
  */
 xmlnode *xmlnode_new(const char *name);
 
+/**
+ * Creates a new xmlnode to be the root of a tree that is allocated in one
+ * arena.  Until xmlnode_seal_arena() is called, children, attributes and
+ * data added to the tree come from the arena, and are all freed at once
+ * by xmlnode_free() on this node; freeing a node further down only takes
+ * it out of the tree.  Element and attribute names and namespaces are
+ * shared between nodes.
+ *
+ * A subtree may be moved into another tree, and keeps the arena around
+ * until it is freed as well.
+ *
+ * This is meant for trees which are built once and then thrown away,
+ * such as parsed stanzas.  xmlnode_from_str() and xmlnode_copy() return
+ * trees like this, already sealed.
+ *
+ * @param name The name of the node.
+ *
+ * @return The new node.
+ *
+ * @since 2.11.0
+ */
+xmlnode *xmlnode_new_arena(const char *name);
+
+/**
+ * Marks a tree created by xmlnode_new_arena() as built.  Anything added to
+ * it from then on is allocated and freed like the nodes of any other
+ * tree, so changing it for a long time doesn't make the arena grow.
+ *
+ * @param node A node of the tree.
+ *
+ * @since 2.11.0
+ */
+void xmlnode_seal_arena(xmlnode *node);
+
 /**
  * Creates a new xmlnode child.
  *
@@ -301,6 +339,17 @@ char *xmlnode_to_str(const xmlnode *node, int *len);
  */
 char *xmlnode_to_formatted_str(const xmlnode *node, int *len);
 
+/**
+ * Appends the node, serialized as by xmlnode_to_str(), to the end of
+ * a string.  This lets a caller reuse one buffer for many nodes.
+ *
+ * @param node The starting node to output.
+ * @param str  The string to append to.
+ *
+ * @since 2.11.0
+ */
+void xmlnode_append_to_gstring(const xmlnode *node, GString *str);
+
 /**
  * Creates a node from a string of XML.  Calling this on the
  * root node of an XML document will parse the entire document
@@ -319,7 +368,8 @@ xmlnode *xmlnode_from_str(const char *str, gssize size);
  *
  * @param src The node to copy.
  *
- * @return A new copy of the src node.
+ * @return A new copy of the src node, allocated as by xmlnode_new_arena()
+ *         and sealed.
  */
 xmlnode *xmlnode_copy(const xmlnode *src);
 
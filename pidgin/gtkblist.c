@@ -154,6 +154,9 @@ static const char *item_factory_translate_func (const char *path, gpointer func_
 static gboolean get_iter_from_node(PurpleBlistNode *node, GtkTreeIter *iter);
 static gboolean buddy_is_displayable(PurpleBuddy *buddy);
 static void redo_buddy_list(PurpleBuddyList *list, gboolean remove, gboolean rerender);
+static void sort_index_remove(PurpleBlistNode *node);
+static void sort_index_clear(PurpleBlistNode *group);
+static void sort_index_invalidate(PurpleBlistNode *node);
 static void pidgin_blist_collapse_contact_cb(GtkWidget *w, PurpleBlistNode *node);
 static char *pidgin_get_group_title(PurpleBlistNode *gnode, gboolean expanded);
 static void pidgin_blist_expand_contact_cb(GtkWidget *w, PurpleBlistNode *node);
@@ -174,6 +177,15 @@ typedef struct _pidgin_blist_node {
 		time_t last_message;          /* timestamp for last displayed message */
 		PidginBlistNodeFlags flags;
 	} conv;
+	struct {
+		char *name;                   /* name the collation key was made from */
+		char *key;                    /* collation key for the name */
+		int log_activity;             /* cached log activity score, or -1 */
+		int log_buddies;              /* number of buddies the score covers */
+		PurpleBlistNode *group;       /* group whose index has this node */
+		GArray *index;                /* groups: sorted children, in row order */
+		gboolean unsorted;            /* groups: some keys changed in place */
+	} sort;
 } PidginBlistNode;
 
 /***************************************************
@@ -4690,6 +4702,15 @@ written_msg_update_ui_cb(PurpleAccount *account, const char *who, const char *me
 		PurpleConversation *conv, PurpleMessageFlags flag, PurpleBlistNode *node)
 {
 	PidginBlistNode *ui = node->ui_data;
+
+	/* The message is in the log now, so the contact's activity score
+	 * changed.  Move the contact to match, so its group stays in order. */
+	if (PURPLE_BLIST_NODE_IS_BUDDY(node) && node->parent && node->parent->ui_data) {
+		((PidginBlistNode *)node->parent->ui_data)->sort.log_activity = -1;
+		if (current_sort_method && current_sort_method->func == sort_method_log_activity)
+			pidgin_blist_update(purple_get_blist(), node->parent);
+	}
+
 	if (ui->conv.conv != conv || !pidgin_conv_is_hidden(PIDGIN_CONVERSATION(conv)) ||
 			!(flag & (PURPLE_MESSAGE_SEND | PURPLE_MESSAGE_RECV)))
 		return;
@@ -4781,7 +4802,9 @@ static void pidgin_blist_new_list(PurpleBuddyList *blist)
 
 static void pidgin_blist_new_node(PurpleBlistNode *node)
 {
-	node->ui_data = g_new0(struct _pidgin_blist_node, 1);
+	struct _pidgin_blist_node *gtknode = g_new0(struct _pidgin_blist_node, 1);
+	gtknode->sort.log_activity = -1;
+	node->ui_data = gtknode;
 }
 
 gboolean pidgin_blist_node_is_contact_expanded(PurpleBlistNode *node)
@@ -6122,6 +6145,13 @@ static void redo_buddy_list(PurpleBuddyList *list, gboolean remove, gboolean rer
 	if(!gtkblist || !gtkblist->treeview)
 		return;
 
+	/* Groups which may be out of order are sorted again from scratch */
+	for (node = list->root; node; node = node->next) {
+		struct _pidgin_blist_node *gtknode = node->ui_data;
+		if (gtknode && gtknode->sort.unsorted)
+			sort_index_clear(node);
+	}
+
 	node = list->root;
 
 	while (node)
@@ -6213,6 +6243,13 @@ static void pidgin_blist_remove(PurpleBuddyList *list, PurpleBlistNode *node)
 			purple_timeout_remove(gtknode->recent_signonoff_timer);
 
 		purple_signals_disconnect_by_handle(node->ui_data);
+		sort_index_remove(node);
+		if (gtknode->sort.index) {
+			sort_index_clear(node);
+			g_array_free(gtknode->sort.index, TRUE);
+		}
+		g_free(gtknode->sort.name);
+		g_free(gtknode->sort.key);
 		g_free(node->ui_data);
 		node->ui_data = NULL;
 	}
@@ -6274,18 +6311,19 @@ static gboolean insert_node(PurpleBuddyList *list, PurpleBlistNode *node, GtkTre
 	if(get_iter_from_node(node, &cur))
 		curptr = &cur;
 
+	/* The sort methods cache their keys in the node's UI data */
+	if(gtknode == NULL) {
+		pidgin_blist_new_node(node);
+		gtknode = (struct _pidgin_blist_node *)node->ui_data;
+	}
+
 	if(PURPLE_BLIST_NODE_IS_CONTACT(node) || PURPLE_BLIST_NODE_IS_CHAT(node)) {
 		current_sort_method->func(node, list, parent_iter, curptr, iter);
 	} else {
 		sort_method_none(node, list, parent_iter, curptr, iter);
 	}
 
-	if(gtknode != NULL) {
-		gtk_tree_row_reference_free(gtknode->row);
-	} else {
-		pidgin_blist_new_node(node);
-		gtknode = (struct _pidgin_blist_node *)node->ui_data;
-	}
+	gtk_tree_row_reference_free(gtknode->row);
 
 	newpath = gtk_tree_model_get_path(GTK_TREE_MODEL(gtkblist->treemodel),
 			iter);
@@ -6606,14 +6644,17 @@ static void pidgin_blist_update_contact(PurpleBuddyList *list, PurpleBlistNode *
 	gboolean biglist = purple_prefs_get_bool(PIDGIN_PREFS_ROOT "/blist/show_buddy_icons");
 	struct _pidgin_blist_node *gtknode;
 
-	if (editing_blist)
-		return;
-
 	if (PURPLE_BLIST_NODE_IS_BUDDY(node))
 		cnode = node->parent;
 	else
 		cnode = node;
 
+	if (editing_blist) {
+		/* It's put in its place when the list is refreshed after editing */
+		sort_index_invalidate(cnode);
+		return;
+	}
+
 	g_return_if_fail(PURPLE_BLIST_NODE_IS_CONTACT(cnode));
 
 	/* First things first, update the group */
@@ -6732,8 +6773,10 @@ static void pidgin_blist_update_chat(PurpleBuddyList *list, PurpleBlistNode *nod
 
 	g_return_if_fail(PURPLE_BLIST_NODE_IS_CHAT(node));
 
-	if (editing_blist)
+	if (editing_blist) {
+		sort_index_invalidate(node);
 		return;
+	}
 
 	/* First things first, update the group */
 	pidgin_blist_update_group(list, node->parent);
@@ -7668,6 +7711,11 @@ void pidgin_blist_sort_method_set(const char *id){
 		l = l->next;
 
 	if (l) {
+		if (current_sort_method != l->data) {
+			PurpleBlistNode *gnode;
+			for (gnode = purple_blist_get_root(); gnode; gnode = gnode->next)
+				sort_index_clear(gnode);
+		}
 		current_sort_method = l->data;
 	} else if (!current_sort_method) {
 		pidgin_blist_sort_method_set("none");
@@ -7703,232 +7751,351 @@ static void sort_method_none(PurpleBlistNode *node, PurpleBuddyList *blist, GtkT
 			sibling ? &sibling_iter : NULL);
 }
 
-static void sort_method_alphabetical(PurpleBlistNode *node, PurpleBuddyList *blist, GtkTreeIter groupiter, GtkTreeIter *cur, GtkTreeIter *iter)
+/* Returns the collation key for the name a contact or chat is sorted by.
+ * It is only made again when the name (e.g. the alias) changes. */
+static const char *
+get_node_sort_key(PurpleBlistNode *node)
 {
-	GtkTreeIter more_z;
-
-	const char *my_name;
+	struct _pidgin_blist_node *gtknode = node->ui_data;
+	const char *name;
 
 	if(PURPLE_BLIST_NODE_IS_CONTACT(node)) {
-		my_name = purple_contact_get_alias((PurpleContact*)node);
+		name = purple_contact_get_alias((PurpleContact*)node);
 	} else if(PURPLE_BLIST_NODE_IS_CHAT(node)) {
-		my_name = purple_chat_get_name((PurpleChat*)node);
+		name = purple_chat_get_name((PurpleChat*)node);
 	} else {
-		sort_method_none(node, blist, groupiter, cur, iter);
-		return;
+		name = NULL;
 	}
 
-	if (!gtk_tree_model_iter_children(GTK_TREE_MODEL(gtkblist->treemodel), &more_z, &groupiter)) {
-		gtk_tree_store_insert(gtkblist->treemodel, iter, &groupiter, 0);
-		return;
+	if (name == NULL || gtknode == NULL)
+		return NULL;
+
+	if (gtknode->sort.name == NULL || strcmp(gtknode->sort.name, name) != 0) {
+		g_free(gtknode->sort.name);
+		g_free(gtknode->sort.key);
+		gtknode->sort.name = g_strdup(name);
+		if (g_utf8_validate(name, -1, NULL)) {
+			char *fold = g_utf8_casefold(name, -1);
+			gtknode->sort.key = g_utf8_collate_key(fold, -1);
+			g_free(fold);
+		} else {
+			gtknode->sort.key = g_strdup(name);
+		}
 	}
 
-	do {
-		PurpleBlistNode *n;
-		const char *this_name;
-		int cmp;
+	return gtknode->sort.key;
+}
 
-		gtk_tree_model_get(GTK_TREE_MODEL(gtkblist->treemodel), &more_z, NODE_COLUMN, &n, -1);
+/* Compares the names of two nodes like purple_utf8_strcasecmp() would */
+static int
+compare_sort_keys(PurpleBlistNode *a, PurpleBlistNode *b)
+{
+	const char *akey = get_node_sort_key(a);
+	const char *bkey = b ? get_node_sort_key(b) : NULL;
 
-		if(PURPLE_BLIST_NODE_IS_CONTACT(n)) {
-			this_name = purple_contact_get_alias((PurpleContact*)n);
-		} else if(PURPLE_BLIST_NODE_IS_CHAT(n)) {
-			this_name = purple_chat_get_name((PurpleChat*)n);
-		} else {
-			this_name = NULL;
-		}
+	if (!akey && bkey)
+		return -1;
+	else if (akey && !bkey)
+		return 1;
+	else if (!akey && !bkey)
+		return 0;
+	return strcmp(akey, bkey);
+}
+
+/* Returns the log activity score of a contact, which is only worked out
+ * again when a message was written or the contact's buddies changed. */
+static int
+get_contact_log_activity(PurpleBlistNode *node)
+{
+	struct _pidgin_blist_node *gtknode = node->ui_data;
+	PurpleBlistNode *n;
+	int buddies = 0, score = 0;
 
-		cmp = purple_utf8_strcasecmp(my_name, this_name);
+	for (n = node->child; n; n = n->next)
+		buddies++;
 
-		if(this_name && (cmp < 0 || (cmp == 0 && node < n))) {
-			if(cur) {
-				gtk_tree_store_move_before(gtkblist->treemodel, cur, &more_z);
-				*iter = *cur;
-				return;
-			} else {
-				gtk_tree_store_insert_before(gtkblist->treemodel, iter,
-						&groupiter, &more_z);
-				return;
-			}
-		}
-	} while (gtk_tree_model_iter_next (GTK_TREE_MODEL(gtkblist->treemodel), &more_z));
+	if (gtknode && gtknode->sort.log_activity >= 0 && gtknode->sort.log_buddies == buddies)
+		return gtknode->sort.log_activity;
 
-	if(cur) {
-		gtk_tree_store_move_before(gtkblist->treemodel, cur, NULL);
-		*iter = *cur;
-		return;
-	} else {
-		gtk_tree_store_append(gtkblist->treemodel, iter, &groupiter);
+	for (n = node->child; n; n = n->next) {
+		PurpleBuddy *buddy = (PurpleBuddy*)n;
+		score += purple_log_get_activity_score(PURPLE_LOG_IM, buddy->name, buddy->account);
+	}
+
+	if (gtknode) {
+		gtknode->sort.log_activity = score;
+		gtknode->sort.log_buddies = buddies;
+	}
+	return score;
+}
+
+static void
+sort_index_clear(PurpleBlistNode *group)
+{
+	struct _pidgin_blist_node *gtkgroup = group->ui_data;
+	guint i;
+
+	if (!gtkgroup || !gtkgroup->sort.index)
 		return;
+
+	for (i = 0; i < gtkgroup->sort.index->len; i++) {
+		PurpleBlistNode *n = g_array_index(gtkgroup->sort.index, PurpleBlistNode *, i);
+		((struct _pidgin_blist_node *)n->ui_data)->sort.group = NULL;
 	}
+	g_array_set_size(gtkgroup->sort.index, 0);
+	gtkgroup->sort.unsorted = FALSE;
 }
 
-static void sort_method_status(PurpleBlistNode *node, PurpleBuddyList *blist, GtkTreeIter groupiter, GtkTreeIter *cur, GtkTreeIter *iter)
+/* Notes that what node is sorted by changed without it being moved, so
+ * its group's index can't be searched until it's sorted again */
+static void
+sort_index_invalidate(PurpleBlistNode *node)
 {
-	GtkTreeIter more_z;
+	struct _pidgin_blist_node *gtknode = node->ui_data;
+	struct _pidgin_blist_node *gtkgroup;
 
-	PurpleBuddy *my_buddy, *this_buddy;
+	if (!gtknode || !gtknode->sort.group)
+		return;
 
-	if(PURPLE_BLIST_NODE_IS_CONTACT(node)) {
-		my_buddy = purple_contact_get_priority_buddy((PurpleContact*)node);
-	} else if(PURPLE_BLIST_NODE_IS_CHAT(node)) {
-		if (cur != NULL) {
-			*iter = *cur;
-			return;
-		}
+	gtkgroup = gtknode->sort.group->ui_data;
+	if (gtkgroup)
+		gtkgroup->sort.unsorted = TRUE;
+}
+
+/* Takes a node out of the sort index of the group it was sorted into */
+static void
+sort_index_remove(PurpleBlistNode *node)
+{
+	struct _pidgin_blist_node *gtknode = node->ui_data;
+	struct _pidgin_blist_node *gtkgroup;
+	GArray *index;
+	guint i;
 
-		gtk_tree_store_append(gtkblist->treemodel, iter, &groupiter);
+	if (!gtknode || !gtknode->sort.group)
 		return;
-	} else {
-		sort_method_alphabetical(node, blist, groupiter, cur, iter);
+
+	gtkgroup = gtknode->sort.group->ui_data;
+	gtknode->sort.group = NULL;
+	if (!gtkgroup || !(index = gtkgroup->sort.index))
 		return;
+
+	for (i = 0; i < index->len; i++) {
+		if (g_array_index(index, PurpleBlistNode *, i) == node) {
+			g_array_remove_index(index, i);
+			break;
+		}
 	}
+}
 
+/* Whether the row for node is still shown in the group at group_row */
+static gboolean
+sort_index_is_valid(PurpleBlistNode *node, int group_row)
+{
+	struct _pidgin_blist_node *gtknode = node->ui_data;
+	GtkTreePath *path;
+	gboolean ret;
 
-	if (!gtk_tree_model_iter_children(GTK_TREE_MODEL(gtkblist->treemodel), &more_z, &groupiter)) {
-		gtk_tree_store_insert(gtkblist->treemodel, iter, &groupiter, 0);
-		return;
-	}
+	if (!gtknode->row || !gtk_tree_row_reference_valid(gtknode->row))
+		return FALSE;
 
-	do {
-		PurpleBlistNode *n;
-		gint name_cmp;
-		gint presence_cmp;
+	path = gtk_tree_row_reference_get_path(gtknode->row);
+	ret = (gtk_tree_path_get_depth(path) == 2 &&
+			gtk_tree_path_get_indices(path)[0] == group_row);
+	gtk_tree_path_free(path);
+	return ret;
+}
 
-		gtk_tree_model_get(GTK_TREE_MODEL(gtkblist->treemodel), &more_z, NODE_COLUMN, &n, -1);
+/* Puts node in the group's rows before the first row it should go before,
+ * as decided by the before() function.  Instead of walking all the rows,
+ * the rows the sort methods added are kept in an index on the group, in
+ * the order they are shown, which is searched with a binary search.  If
+ * the index may be out of order, every row is looked at instead, until
+ * the next time the list is redone.  Entries for rows which have gone
+ * away are dropped when they are met. */
+static void
+sort_index_insert(PurpleBlistNode *node, GtkTreeIter *groupiter, GtkTreeIter *cur,
+		GtkTreeIter *iter, gboolean (*before)(PurpleBlistNode *node, PurpleBlistNode *n))
+{
+	PurpleBlistNode *group = node->parent;
+	struct _pidgin_blist_node *gtkgroup = group->ui_data;
+	GtkTreePath *path;
+	GtkTreeIter more_z;
+	GArray *index;
+	int group_row;
+	guint low = 0, high;
 
-		if(PURPLE_BLIST_NODE_IS_CONTACT(n)) {
-			this_buddy = purple_contact_get_priority_buddy((PurpleContact*)n);
-		} else {
-			this_buddy = NULL;
-		}
+	sort_index_remove(node);
 
-		name_cmp = purple_utf8_strcasecmp(
-			purple_contact_get_alias(purple_buddy_get_contact(my_buddy)),
-			(this_buddy
-			 ? purple_contact_get_alias(purple_buddy_get_contact(this_buddy))
-			 : NULL));
+	if (gtkgroup->sort.index == NULL)
+		gtkgroup->sort.index = g_array_new(FALSE, FALSE, sizeof(PurpleBlistNode *));
+	index = gtkgroup->sort.index;
 
-		presence_cmp = purple_presence_compare(
-			purple_buddy_get_presence(my_buddy),
-			this_buddy ? purple_buddy_get_presence(this_buddy) : NULL);
+	path = gtk_tree_model_get_path(GTK_TREE_MODEL(gtkblist->treemodel), groupiter);
+	group_row = gtk_tree_path_get_indices(path)[0];
+	gtk_tree_path_free(path);
 
-		if (this_buddy == NULL ||
-			(presence_cmp < 0 ||
-			 (presence_cmp == 0 &&
-			  (name_cmp < 0 || (name_cmp == 0 && node < n)))))
-		{
-			if (cur != NULL)
-			{
-				gtk_tree_store_move_before(gtkblist->treemodel, cur, &more_z);
-				*iter = *cur;
-				return;
+	if (gtkgroup->sort.unsorted) {
+		while (low < index->len) {
+			PurpleBlistNode *n = g_array_index(index, PurpleBlistNode *, low);
+
+			if (!sort_index_is_valid(n, group_row)) {
+				((struct _pidgin_blist_node *)n->ui_data)->sort.group = NULL;
+				g_array_remove_index(index, low);
+			} else if (before(node, n)) {
+				break;
+			} else {
+				low++;
 			}
-			else
-			{
-				gtk_tree_store_insert_before(gtkblist->treemodel, iter,
-											 &groupiter, &more_z);
-				return;
+		}
+	} else {
+		high = index->len;
+		while (low < high) {
+			guint mid = (low + high) / 2;
+			PurpleBlistNode *n = g_array_index(index, PurpleBlistNode *, mid);
+
+			if (!sort_index_is_valid(n, group_row)) {
+				((struct _pidgin_blist_node *)n->ui_data)->sort.group = NULL;
+				g_array_remove_index(index, mid);
+				high--;
+			} else if (before(node, n)) {
+				high = mid;
+			} else {
+				low = mid + 1;
 			}
 		}
 	}
-	while (gtk_tree_model_iter_next(GTK_TREE_MODEL(gtkblist->treemodel),
-									&more_z));
+
+	while (low < index->len) {
+		PurpleBlistNode *n = g_array_index(index, PurpleBlistNode *, low);
+		if (sort_index_is_valid(n, group_row) && get_iter_from_node(n, &more_z))
+			break;
+		((struct _pidgin_blist_node *)n->ui_data)->sort.group = NULL;
+		g_array_remove_index(index, low);
+	}
 
 	if (cur) {
-		gtk_tree_store_move_before(gtkblist->treemodel, cur, NULL);
+		gtk_tree_store_move_before(gtkblist->treemodel, cur,
+				low < index->len ? &more_z : NULL);
 		*iter = *cur;
-		return;
+	} else if (low < index->len) {
+		gtk_tree_store_insert_before(gtkblist->treemodel, iter, groupiter, &more_z);
 	} else {
-		gtk_tree_store_append(gtkblist->treemodel, iter, &groupiter);
-		return;
+		gtk_tree_store_append(gtkblist->treemodel, iter, groupiter);
 	}
+
+	g_array_insert_val(index, low, node);
+	((struct _pidgin_blist_node *)node->ui_data)->sort.group = group;
 }
 
-static void sort_method_log_activity(PurpleBlistNode *node, PurpleBuddyList *blist, GtkTreeIter groupiter, GtkTreeIter *cur, GtkTreeIter *iter)
+/* Adds a row the sort methods always put last to the end of the index */
+static void
+sort_index_append(PurpleBlistNode *node, GtkTreeIter *groupiter, GtkTreeIter *cur, GtkTreeIter *iter)
 {
-	GtkTreeIter more_z;
-
-	int activity_score = 0, this_log_activity_score = 0;
-	const char *buddy_name, *this_buddy_name;
+	PurpleBlistNode *group = node->parent;
+	struct _pidgin_blist_node *gtkgroup = group->ui_data;
+	struct _pidgin_blist_node *gtknode = node->ui_data;
 
-	if(cur && (gtk_tree_model_iter_n_children(GTK_TREE_MODEL(gtkblist->treemodel), &groupiter) == 1)) {
+	if (cur != NULL) {
 		*iter = *cur;
-		return;
+		if (gtknode->sort.group == group)
+			return;
+	} else {
+		gtk_tree_store_append(gtkblist->treemodel, iter, groupiter);
 	}
 
-	if(PURPLE_BLIST_NODE_IS_CONTACT(node)) {
-		PurpleBlistNode *n;
-		PurpleBuddy *buddy;
-		for (n = node->child; n; n = n->next) {
-			buddy = (PurpleBuddy*)n;
-			activity_score += purple_log_get_activity_score(PURPLE_LOG_IM, buddy->name, buddy->account);
-		}
-		buddy_name = purple_contact_get_alias((PurpleContact*)node);
-	} else if(PURPLE_BLIST_NODE_IS_CHAT(node)) {
-		/* we don't have a reliable way of getting the log filename
-		 * from the chat info in the blist, yet */
-		if (cur != NULL) {
-			*iter = *cur;
-			return;
-		}
+	sort_index_remove(node);
+	if (gtkgroup->sort.index == NULL)
+		gtkgroup->sort.index = g_array_new(FALSE, FALSE, sizeof(PurpleBlistNode *));
+	g_array_append_val(gtkgroup->sort.index, node);
+	gtknode->sort.group = group;
+}
 
-		gtk_tree_store_append(gtkblist->treemodel, iter, &groupiter);
-		return;
-	} else {
+static gboolean
+sort_alphabetical_before(PurpleBlistNode *node, PurpleBlistNode *n)
+{
+	int cmp;
+
+	if (get_node_sort_key(n) == NULL)
+		return FALSE;
+
+	cmp = compare_sort_keys(node, n);
+	return (cmp < 0 || (cmp == 0 && node < n));
+}
+
+static void sort_method_alphabetical(PurpleBlistNode *node, PurpleBuddyList *blist, GtkTreeIter groupiter, GtkTreeIter *cur, GtkTreeIter *iter)
+{
+	if(!PURPLE_BLIST_NODE_IS_CONTACT(node) && !PURPLE_BLIST_NODE_IS_CHAT(node)) {
 		sort_method_none(node, blist, groupiter, cur, iter);
 		return;
 	}
 
+	sort_index_insert(node, &groupiter, cur, iter, sort_alphabetical_before);
+}
 
-	if (!gtk_tree_model_iter_children(GTK_TREE_MODEL(gtkblist->treemodel), &more_z, &groupiter)) {
-		gtk_tree_store_insert(gtkblist->treemodel, iter, &groupiter, 0);
-		return;
-	}
+static gboolean
+sort_status_before(PurpleBlistNode *node, PurpleBlistNode *n)
+{
+	PurpleBuddy *my_buddy, *this_buddy;
+	gint name_cmp;
+	gint presence_cmp;
 
-	do {
-		PurpleBlistNode *n;
-		PurpleBlistNode *n2;
-		PurpleBuddy *buddy;
-		int cmp;
+	if(!PURPLE_BLIST_NODE_IS_CONTACT(n))
+		return TRUE;
 
-		gtk_tree_model_get(GTK_TREE_MODEL(gtkblist->treemodel), &more_z, NODE_COLUMN, &n, -1);
-		this_log_activity_score = 0;
+	my_buddy = purple_contact_get_priority_buddy((PurpleContact*)node);
+	this_buddy = purple_contact_get_priority_buddy((PurpleContact*)n);
+	if (this_buddy == NULL)
+		return TRUE;
 
-		if(PURPLE_BLIST_NODE_IS_CONTACT(n)) {
-			for (n2 = n->child; n2; n2 = n2->next) {
-                        	buddy = (PurpleBuddy*)n2;
-				this_log_activity_score += purple_log_get_activity_score(PURPLE_LOG_IM, buddy->name, buddy->account);
-			}
-			this_buddy_name = purple_contact_get_alias((PurpleContact*)n);
-		} else {
-			this_buddy_name = NULL;
-		}
+	presence_cmp = purple_presence_compare(
+		purple_buddy_get_presence(my_buddy),
+		purple_buddy_get_presence(this_buddy));
+	if (presence_cmp != 0)
+		return presence_cmp < 0;
 
-		cmp = purple_utf8_strcasecmp(buddy_name, this_buddy_name);
+	name_cmp = compare_sort_keys(node, n);
+	return (name_cmp < 0 || (name_cmp == 0 && node < n));
+}
 
-		if (!PURPLE_BLIST_NODE_IS_CONTACT(n) || activity_score > this_log_activity_score ||
-				((activity_score == this_log_activity_score) &&
-				 (cmp < 0 || (cmp == 0 && node < n)))) {
-			if (cur != NULL) {
-				gtk_tree_store_move_before(gtkblist->treemodel, cur, &more_z);
-				*iter = *cur;
-				return;
-			} else {
-				gtk_tree_store_insert_before(gtkblist->treemodel, iter,
-						&groupiter, &more_z);
-				return;
-			}
-		}
-	} while (gtk_tree_model_iter_next (GTK_TREE_MODEL(gtkblist->treemodel), &more_z));
+static void sort_method_status(PurpleBlistNode *node, PurpleBuddyList *blist, GtkTreeIter groupiter, GtkTreeIter *cur, GtkTreeIter *iter)
+{
+	if(PURPLE_BLIST_NODE_IS_CONTACT(node)) {
+		sort_index_insert(node, &groupiter, cur, iter, sort_status_before);
+	} else if(PURPLE_BLIST_NODE_IS_CHAT(node)) {
+		sort_index_append(node, &groupiter, cur, iter);
+	} else {
+		sort_method_alphabetical(node, blist, groupiter, cur, iter);
+	}
+}
 
-	if (cur != NULL) {
-		gtk_tree_store_move_before(gtkblist->treemodel, cur, NULL);
-		*iter = *cur;
-		return;
+static gboolean
+sort_log_activity_before(PurpleBlistNode *node, PurpleBlistNode *n)
+{
+	int activity_score, this_log_activity_score;
+	int cmp;
+
+	if (!PURPLE_BLIST_NODE_IS_CONTACT(n))
+		return TRUE;
+
+	activity_score = get_contact_log_activity(node);
+	this_log_activity_score = get_contact_log_activity(n);
+	if (activity_score != this_log_activity_score)
+		return activity_score > this_log_activity_score;
+
+	cmp = compare_sort_keys(node, n);
+	return (cmp < 0 || (cmp == 0 && node < n));
+}
+
+static void sort_method_log_activity(PurpleBlistNode *node, PurpleBuddyList *blist, GtkTreeIter groupiter, GtkTreeIter *cur, GtkTreeIter *iter)
+{
+	if(PURPLE_BLIST_NODE_IS_CONTACT(node)) {
+		sort_index_insert(node, &groupiter, cur, iter, sort_log_activity_before);
+	} else if(PURPLE_BLIST_NODE_IS_CHAT(node)) {
+		/* we don't have a reliable way of getting the log filename
+		 * from the chat info in the blist, yet */
+		sort_index_append(node, &groupiter, cur, iter);
 	} else {
-		gtk_tree_store_append(gtkblist->treemodel, iter, &groupiter);
-		return;
+		sort_method_none(node, blist, groupiter, cur, iter);
 	}
 }
 
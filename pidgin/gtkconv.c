@@ -132,6 +132,10 @@ static GtkWidget *warn_close_dialog = NULL;
 static PidginWindow *hidden_convwin = NULL;
 static GList *window_list = NULL;
 
+/* IDs of the signals emitted for every message displayed. */
+static gulong displaying_im_msg_signal = 0;
+static gulong displaying_chat_msg_signal = 0;
+
 /* Lists of status icons at all available sizes for use as window icons */
 static GList *available_list = NULL;
 static GList *away_list = NULL;
@@ -163,6 +167,7 @@ static void pidgin_conv_update_fields(PurpleConversation *conv, PidginConvFields
 static void focus_out_from_menubar(GtkWidget *wid, PidginWindow *win);
 static void pidgin_conv_tab_pack(PidginWindow *win, PidginConversation *gtkconv);
 static gboolean infopane_press_cb(GtkWidget *widget, GdkEventButton *e, PidginConversation *conv);
+static void free_attach_iters(PidginConversation *gtkconv);
 static void hide_conv(PidginConversation *gtkconv, gboolean closetimer);
 
 static void pidgin_conv_set_position_size(PidginWindow *win, int x, int y,
@@ -5564,6 +5569,7 @@ pidgin_conv_destroy(PurpleConversation *conv)
 	if (gtkconv->attach.timer) {
 		g_source_remove(gtkconv->attach.timer);
 	}
+	free_attach_iters(gtkconv);
 
 	g_free(gtkconv);
 }
@@ -5827,9 +5833,9 @@ pidgin_conv_write_conv(PurpleConversation *conv, const char *name, const char *a
 	else
 		displaying = purple_markup_linkify(message);
 
-	plugin_return = GPOINTER_TO_INT(purple_signal_emit_return_1(
-							pidgin_conversations_get_handle(), (type == PURPLE_CONV_TYPE_IM ?
-							"displaying-im-msg" : "displaying-chat-msg"),
+	plugin_return = GPOINTER_TO_INT(purple_signal_emit_by_id_return_1(
+							(type == PURPLE_CONV_TYPE_IM ?
+							displaying_im_msg_signal : displaying_chat_msg_signal),
 							account, name, &displaying, conv, flags));
 	if (plugin_return)
 	{
@@ -6264,6 +6270,7 @@ pidgin_conv_chat_remove_users(PurpleConversation *conv, GList *users)
 	GtkTreeIter iter;
 	GtkTreeModel *model;
 	GList *l;
+	GHashTable *names;
 	char tmp[BUF_LONG];
 	int num_users;
 	gboolean f;
@@ -6275,28 +6282,35 @@ pidgin_conv_chat_remove_users(PurpleConversation *conv, GList *users)
 
 	num_users = g_list_length(purple_conv_chat_get_users(chat));
 
-	for (l = users; l != NULL; l = l->next) {
-		model = gtk_tree_view_get_model(GTK_TREE_VIEW(gtkchat->list));
+	/* A netsplit can take thousands of users with it, so walk the list
+	 * once rather than once per user. */
+	names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	for (l = users; l != NULL; l = l->next)
+		g_hash_table_insert(names, g_utf8_casefold(l->data, -1), l->data);
 
-		if (!gtk_tree_model_get_iter_first(GTK_TREE_MODEL(model), &iter))
-			/* XXX: Break? */
-			continue;
+	model = gtk_tree_view_get_model(GTK_TREE_VIEW(gtkchat->list));
 
+	if (gtk_tree_model_get_iter_first(GTK_TREE_MODEL(model), &iter)) {
 		do {
-			char *val;
+			char *val, *key;
 
 			gtk_tree_model_get(GTK_TREE_MODEL(model), &iter,
 							   CHAT_USERS_NAME_COLUMN, &val, -1);
+			key = g_utf8_casefold(val, -1);
 
-			if (!purple_utf8_strcasecmp((char *)l->data, val)) {
+			if (g_hash_table_lookup(names, key) != NULL)
 				f = gtk_list_store_remove(GTK_LIST_STORE(model), &iter);
-			}
 			else
 				f = gtk_tree_model_iter_next(GTK_TREE_MODEL(model), &iter);
 
+			g_free(key);
 			g_free(val);
 		} while (f);
+	}
+
+	g_hash_table_destroy(names);
 
+	for (l = users; l != NULL; l = l->next) {
 		if ((tag = get_buddy_tag(conv, l->data, 0, FALSE)))
 			g_object_set(G_OBJECT(tag), "style", PANGO_STYLE_ITALIC, NULL);
 		if ((tag = get_buddy_tag(conv, l->data, PURPLE_MESSAGE_NICK, FALSE)))
@@ -7730,12 +7744,38 @@ update_chat_topic(PurpleConversation *conv, const char *old, const char *new)
 
 /* Message history stuff */
 
-/* Compare two PurpleConvMessage's, according to time in ascending order. */
-static int
-message_compare(gconstpointer p1, gconstpointer p2)
+/*
+ * Returns the oldest message not yet shown from any of the conversations
+ * being attached, and moves past it.
+ */
+static PurpleConvMessage *
+next_attach_message(PidginConversation *gtkconv)
+{
+	GList *l;
+	PurpleConvMessageIter *oldest = NULL;
+	PurpleConvMessage *msg = NULL;
+
+	for (l = gtkconv->attach.current; l; l = l->next) {
+		PurpleConvMessageIter peek = *(PurpleConvMessageIter *)l->data;
+		PurpleConvMessage *next = purple_conversation_message_iter_next(&peek);
+		if (next && (msg == NULL || next->when < msg->when)) {
+			msg = next;
+			oldest = l->data;
+		}
+	}
+
+	if (oldest)
+		purple_conversation_message_iter_next(oldest);
+
+	return msg;
+}
+
+static void
+free_attach_iters(PidginConversation *gtkconv)
 {
-	const PurpleConvMessage *m1 = p1, *m2 = p2;
-	return (m1->when > m2->when);
+	g_list_foreach(gtkconv->attach.current, (GFunc)g_free, NULL);
+	g_list_free(gtkconv->attach.current);
+	gtkconv->attach.current = NULL;
 }
 
 /* Adds some message history to the gtkconv. This happens in a idle-callback. */
@@ -7747,46 +7787,26 @@ add_message_history_to_gtkconv(gpointer data)
 	int timer = gtkconv->attach.timer;
 	time_t when = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(gtkconv->entry), "attach-start-time"));
 	gboolean im = (gtkconv->active_conv->type == PURPLE_CONV_TYPE_IM);
+	PurpleConvMessage *msg = NULL;
 
 	gtkconv->attach.timer = 0;
-	while (gtkconv->attach.current && count < 100) {  /* XXX: 100 is a random value here */
-		PurpleConvMessage *msg = gtkconv->attach.current->data;
+	/* Messages written while this runs are picked up along the way */
+	while (count < 100 && (msg = next_attach_message(gtkconv))) {  /* XXX: 100 is a random value here */
 		if (!im && when && when < msg->when) {
 			gtk_imhtml_append_text(GTK_IMHTML(gtkconv->imhtml), "<BR><HR>", 0);
 			g_object_set_data(G_OBJECT(gtkconv->entry), "attach-start-time", NULL);
 		}
 		pidgin_conv_write_conv(msg->conv, msg->who, msg->alias, msg->what, msg->flags, msg->when);
-		if (im) {
-			gtkconv->attach.current = g_list_delete_link(gtkconv->attach.current, gtkconv->attach.current);
-		} else {
-			gtkconv->attach.current = gtkconv->attach.current->prev;
-		}
 		count++;
 	}
 	gtkconv->attach.timer = timer;
-	if (gtkconv->attach.current)
+	if (msg)
 		return TRUE;
 
 	g_source_remove(gtkconv->attach.timer);
 	gtkconv->attach.timer = 0;
+	free_attach_iters(gtkconv);
 	if (im) {
-		/* Print any message that was sent while the old history was being added back. */
-		GList *msgs = NULL;
-		GList *iter = gtkconv->convs;
-		for (; iter; iter = iter->next) {
-			PurpleConversation *conv = iter->data;
-			GList *history = purple_conversation_get_message_history(conv);
-			for (; history; history = history->next) {
-				PurpleConvMessage *msg = history->data;
-				if (msg->when > when)
-					msgs = g_list_prepend(msgs, msg);
-			}
-		}
-		msgs = g_list_sort(msgs, message_compare);
-		for (; msgs; msgs = g_list_delete_link(msgs, msgs)) {
-			PurpleConvMessage *msg = msgs->data;
-			pidgin_conv_write_conv(msg->conv, msg->who, msg->alias, msg->what, msg->flags, msg->when);
-		}
 		gtk_imhtml_append_text(GTK_IMHTML(gtkconv->imhtml), "<BR><HR>", 0);
 		g_object_set_data(G_OBJECT(gtkconv->entry), "attach-start-time", NULL);
 	}
@@ -7838,32 +7858,43 @@ gboolean pidgin_conv_attach_to_conversation(PurpleConversation *conv)
 	pidgin_conv_attach(conv);
 	gtkconv = PIDGIN_CONVERSATION(conv);
 
-	list = purple_conversation_get_message_history(conv);
-	if (list) {
+	if (purple_conversation_get_message_count(conv) > 0) {
+		time_t newest = 0;
+
+		list = g_list_prepend(NULL, conv);
 		switch (purple_conversation_get_type(conv)) {
 			case PURPLE_CONV_TYPE_IM:
 			{
 				GList *convs;
-				list = g_list_copy(list);
 				for (convs = purple_get_ims(); convs; convs = convs->next)
 					if (convs->data != conv &&
 							pidgin_conv_find_gtkconv(convs->data) == gtkconv) {
 						pidgin_conv_attach(convs->data);
-						list = g_list_concat(list, g_list_copy(purple_conversation_get_message_history(convs->data)));
+						list = g_list_prepend(list, convs->data);
 					}
-				list = g_list_sort(list, message_compare);
-				gtkconv->attach.current = list;
-				list = g_list_last(list);
 				break;
 			}
 			case PURPLE_CONV_TYPE_CHAT:
-				gtkconv->attach.current = g_list_last(list);
 				break;
 			default:
+				g_list_free(list);
 				g_return_val_if_reached(TRUE);
 		}
+
+		for (; list; list = g_list_delete_link(list, list)) {
+			PurpleConvMessageIter *iter = g_new(PurpleConvMessageIter, 1);
+			PurpleConvMessage *msg;
+
+			purple_conversation_message_iter_init(iter, list->data, TRUE);
+			if ((msg = purple_conversation_message_iter_next(iter)) && msg->when > newest)
+				newest = msg->when;
+
+			purple_conversation_message_iter_init(iter, list->data, FALSE);
+			gtkconv->attach.current = g_list_prepend(gtkconv->attach.current, iter);
+		}
+
 		g_object_set_data(G_OBJECT(gtkconv->entry), "attach-start-time",
-				GINT_TO_POINTER(((PurpleConvMessage*)(list->data))->when));
+				GINT_TO_POINTER(newest));
 		gtkconv->attach.timer = g_idle_add(add_message_history_to_gtkconv, gtkconv);
 	} else {
 		purple_signal_emit(pidgin_conversations_get_handle(),
@@ -8015,7 +8046,8 @@ pidgin_conversations_init(void)
 #endif
 	                     purple_value_new(PURPLE_TYPE_BOOLEAN));
 
-	purple_signal_register(handle, "displaying-im-msg",
+	displaying_im_msg_signal =
+		purple_signal_register(handle, "displaying-im-msg",
 						 purple_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER_POINTER,
 						 purple_value_new(PURPLE_TYPE_BOOLEAN), 5,
 						 purple_value_new(PURPLE_TYPE_SUBTYPE,
@@ -8037,7 +8069,8 @@ pidgin_conversations_init(void)
 										PURPLE_SUBTYPE_CONVERSATION),
 						 purple_value_new(PURPLE_TYPE_INT));
 
-	purple_signal_register(handle, "displaying-chat-msg",
+	displaying_chat_msg_signal =
+		purple_signal_register(handle, "displaying-chat-msg",
 						 purple_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER_POINTER,
 						 purple_value_new(PURPLE_TYPE_BOOLEAN), 5,
 						 purple_value_new(PURPLE_TYPE_SUBTYPE,
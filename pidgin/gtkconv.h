@@ -175,7 +175,7 @@ struct _PidginConversation
 	 * with message history */
 	struct {
 		int timer;
-		GList *current;
+		GList *current;  /* PurpleConvMessageIter's, one per conversation */
 	} attach;
 
 	/**
@@ -29,6 +29,7 @@
 #include "account.h"
 #include "debug.h"
 #include "log.h"
+#include "logsearch.h"
 #include "notify.h"
 #include "request.h"
 #include "util.h"
@@ -119,12 +120,34 @@ static const char *log_get_date(PurpleLog *log)
 		return purple_date_format_full(localtime(&log->time));
 }
 
+static void search_done_cb(GList *results, guint total, gpointer data)
+{
+	PidginLogViewer *lv = data;
+	GList *l;
+
+	for (l = results; l != NULL; l = l->next) {
+		PurpleLogSearchResult *result = l->data;
+		GtkTreeIter iter;
+
+		gtk_tree_store_append (lv->treestore, &iter, NULL);
+		gtk_tree_store_set(lv->treestore, &iter,
+				   0, log_get_date(result->log),
+				   1, result->log, -1);
+	}
+	purple_log_search_results_free(results);
+
+	select_first_log(lv);
+	pidgin_clear_cursor(lv->window);
+}
+
 static void search_cb(GtkWidget *button, PidginLogViewer *lv)
 {
 	const char *search_term = gtk_entry_get_text(GTK_ENTRY(lv->entry));
-	GList *logs;
 
 	if (!(*search_term)) {
+		purple_log_search_cancel_with_handle(lv);
+		pidgin_clear_cursor(lv->window);
+
 		/* reset the tree */
 		gtk_tree_store_clear(lv->treestore);
 		populate_log_tree(lv);
@@ -142,6 +165,7 @@ static void search_cb(GtkWidget *button, PidginLogViewer *lv)
 		return;
 	}
 
+	purple_log_search_cancel_with_handle(lv);
 	pidgin_set_cursor(lv->window, GDK_WATCH);
 
 	g_free(lv->search);
@@ -150,22 +174,7 @@ static void search_cb(GtkWidget *button, PidginLogViewer *lv)
 	gtk_tree_store_clear(lv->treestore);
 	gtk_imhtml_clear(GTK_IMHTML(lv->imhtml));
 
-	for (logs = lv->logs; logs != NULL; logs = logs->next) {
-		char *read = purple_log_read((PurpleLog*)logs->data, NULL);
-		if (read && *read && purple_strcasestr(read, search_term)) {
-			GtkTreeIter iter;
-			PurpleLog *log = logs->data;
-
-			gtk_tree_store_append (lv->treestore, &iter, NULL);
-			gtk_tree_store_set(lv->treestore, &iter,
-					   0, log_get_date(log),
-					   1, log, -1);
-		}
-		g_free(read);
-	}
-
-	select_first_log(lv);
-	pidgin_clear_cursor(lv->window);
+	purple_log_search_async(lv, lv->logs, search_term, 0, 0, search_done_cb, lv);
 }
 
 static void destroy_cb(GtkWidget *w, gint resp, struct log_viewer_hash_t *ht) {
@@ -215,6 +224,7 @@ static void destroy_cb(GtkWidget *w, gint resp, struct log_viewer_hash_t *ht) {
 		syslog_viewer = NULL;
 
 	purple_request_close_with_handle(lv);
+	purple_log_search_cancel_with_handle(lv);
 
 	g_list_foreach(lv->logs, (GFunc)purple_log_free, NULL);
 	g_list_free(lv->logs);